@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Hot standby takeover: the standby must keep forwarding once the primary exits and its poll set shrinks.
+#
+# Usage: tests/takeover.sh <udp-redirect binary> <poll|epoll>
+#
+
+BINARY=${1:-./udp-redirect}
+BACKEND=${2:-epoll}
+PORT=${PORT:-15400}
+LOG=$(mktemp)
+
+sleep 60 &
+PRIMARY=$!
+
+"$BINARY" --debug --listen-address 127.0.0.1 --listen-port $PORT --connect-address 127.0.0.1 --connect-port $((PORT + 1)) \
+    --subscribe-port $((PORT + 2)) --hot-standby $PRIMARY --io-backend $BACKEND > "$LOG" 2>&1 &
+STANDBY=$!
+
+sleep 0.5
+kill $PRIMARY
+wait $PRIMARY 2> /dev/null
+sleep 0.5
+
+for i in 1 2 3 4 5; do
+    echo -n "packet$i" > /dev/udp/127.0.0.1/$PORT
+    sleep 0.1
+done
+
+RESULT=0
+if ! kill -0 $STANDBY 2> /dev/null; then
+    echo "takeover ($BACKEND): standby exited" >&2
+    RESULT=1
+elif ! grep -q "now forwarding" "$LOG"; then
+    echo "takeover ($BACKEND): standby did not take over" >&2
+    RESULT=1
+elif [ "$(grep -c '(SEND PORT): 7 bytes' "$LOG")" != 5 ]; then
+    echo "takeover ($BACKEND): standby did not forward the packets" >&2
+    RESULT=1
+fi
+
+if [ $RESULT -ne 0 ]; then
+    tail -5 "$LOG" >&2
+fi
+
+kill $STANDBY 2> /dev/null
+wait $STANDBY 2> /dev/null
+rm -f "$LOG"
+
+echo "takeover ($BACKEND): $([ $RESULT -eq 0 ] && echo PASS || echo FAIL)" >&2
+
+exit $RESULT
@@ -0,0 +1,90 @@
+/**
+ * @file test-admission.c
+ * @brief Admission tag tests: SipHash-2-4 known answers, tags bound to the epoch and the source.
+ */
+
+#include "test.h"
+
+/**
+ * SipHash-2-4 reference vectors, key 00 01 .. 0f, messages 00 01 .. (length - 1).
+ */
+void test_siphash(void) {
+    const uint64_t key[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+    unsigned char message[64];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        message[i] = i;
+    }
+
+    CHECK(siphash24(key, message, 0) == 0x726fdb47dd0e0e31ULL);
+    CHECK(siphash24(key, message, 1) == 0x74f839c593dc67fdULL);
+    CHECK(siphash24(key, message, 7) == 0xab0200f58b01d137ULL);
+    CHECK(siphash24(key, message, 8) == 0x93f5f5799a932462ULL);
+    CHECK(siphash24(key, message, 15) == 0xa129ca6149be45e5ULL);
+    CHECK(siphash24(key, message, 63) == 0x958a324ceb064572ULL);
+}
+
+/**
+ * Tags verify from the source they were made for, in the neighbouring epochs only.
+ */
+void test_admission_tag(void) {
+    const unsigned char key[ADMISSION_KEY_SIZE] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    struct admission sender, verifier;
+    struct sockaddr_in source, other;
+    unsigned char packet[64];
+    unsigned char copy[64];
+    size_t length;
+
+    admission_initialize(&sender, key, 30);
+    admission_initialize(&verifier, key, 30);
+
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(0xc0000201);
+    source.sin_port = htons(51820);
+
+    memcpy(packet, "payload", 7);
+    length = admission_tag_append(&sender, packet, 7, &source, 3000);
+    CHECK(length == 7 + ADMISSION_TAG_SIZE);
+
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, length, &source, 3000) == 7);
+    CHECK(memcmp(copy, "payload", 7) == 0);
+
+    /* The previous and next epochs are accepted, the ones beyond are not */
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, length, &source, 3030) == 7);
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, length, &source, 2970) == 7);
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, length, &source, 3060) == -1);
+
+    /* Replayed from another port or address */
+    other = source;
+    other.sin_port = htons(51821);
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, length, &other, 3000) == -1);
+    other = source;
+    other.sin_addr.s_addr = htonl(0xc0000202);
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, length, &other, 3000) == -1);
+
+    /* Modified payload, truncated packet */
+    memcpy(copy, packet, length);
+    copy[0] ^= 1;
+    CHECK(admission_tag_verify(&verifier, copy, length, &source, 3000) == -1);
+    memcpy(copy, packet, length);
+    CHECK(admission_tag_verify(&verifier, copy, ADMISSION_TAG_SIZE - 1, &source, 3000) == -1);
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    test_siphash();
+    test_admission_tag();
+
+    return TEST_RESULT("admission");
+}
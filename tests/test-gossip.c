@@ -0,0 +1,141 @@
+/**
+ * @file test-gossip.c
+ * @brief Rate limit gossip tests: authenticated counts are added once, replays and forgeries are dropped.
+ */
+
+#include "test.h"
+
+/**
+ * Open a nonblocking gossip socket on a loopback port.
+ * @param[out] name The socket name
+ * @return The socket.
+ */
+int test_gossip_socket(struct sockaddr_in *name) {
+    socklen_t name_len = sizeof(*name);
+    int xsock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(name, 0, sizeof(*name));
+    name->sin_family = AF_INET;
+    name->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(xsock, (struct sockaddr *)name, sizeof(*name)) == 0);
+    CHECK(getsockname(xsock, (struct sockaddr *)name, &name_len) == 0);
+    CHECK(fcntl(xsock, F_SETFL, O_NONBLOCK) == 0);
+
+    return xsock;
+}
+
+/**
+ * Set up a gossiping node.
+ * @param[out] r The forwarding state
+ * @param[out] s The settings
+ * @param[out] st The statistics
+ * @param[out] peer The peer, <address>:<port>
+ * @param[in] xsock The gossip socket
+ * @param[in] peer_name The peer socket name
+ */
+void test_gossip_node(struct redirector *r, struct settings *s, struct statistics *st, char *peer, int xsock,
+        const struct sockaddr_in *peer_name) {
+    memset(r, 0, sizeof(*r));
+    settings_initialize(s);
+    statistics_initialize(st);
+
+    sprintf(peer, "127.0.0.1:%d", ntohs(peer_name->sin_port));
+    s->rate_limit = 100;
+    s->rate_limit_prefix = 32;
+    s->gossip_peers[0] = peer;
+    s->gossip_peer_count = 1;
+    s->gossip_key = "00112233445566778899aabbccddeeff";
+
+    r->s = s;
+    r->st = st;
+    CHECK(rate_limit_initialize(&(r->rate), s) == 0);
+    r->rate.sock = xsock;
+}
+
+/**
+ * The packets counted for a source by a node, from its peers.
+ * @param[in,out] r The forwarding state
+ * @param[in] source The source
+ * @return The packets counted in the sliding window.
+ */
+uint32_t test_gossip_remote(struct redirector *r, const struct sockaddr_in *source) {
+    struct timespec now;
+    struct rate_entry *e;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((e = rate_limit_find(&(r->rate), source->sin_addr.s_addr, (uint32_t)now.tv_sec)) == NULL) {
+        return 0;
+    }
+
+    return e->remote[0] + e->remote[1];
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    struct redirector a, b;
+    struct settings sa, sb;
+    struct statistics sta, stb;
+    struct sockaddr_in name_a, name_b, source;
+    char peer_a[32], peer_b[32];
+    unsigned char message[2048];
+    int sock_a = test_gossip_socket(&name_a);
+    int sock_b = test_gossip_socket(&name_b);
+    ssize_t length;
+    int i;
+
+    test_gossip_node(&a, &sa, &sta, peer_b, sock_a, &name_b);
+    test_gossip_node(&b, &sb, &stb, peer_a, sock_b, &name_a);
+
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(0x0a000001);
+
+    /* Node a allows 10 packets and gossips them, the message is captured and sent 3 times */
+    for (i = 0; i < 10; i++) {
+        CHECK(rate_limit_allow(&a, &source) == 1);
+    }
+    rate_gossip_send(&a);
+    CHECK(sta.count_gossip_send == 1);
+    CHECK((length = recv(sock_b, message, sizeof(message), 0)) == GOSSIP_HEADER_SIZE + GOSSIP_ENTRY_SIZE + GOSSIP_TAG_SIZE);
+    for (i = 0; i < 3; i++) {
+        CHECK(sendto(sock_a, message, length, 0, (struct sockaddr *)&name_b, sizeof(name_b)) == length);
+    }
+    rate_gossip_receive(&b);
+    CHECK(stb.count_gossip_receive == 1);
+    CHECK(stb.count_gossip_invalid == 2);
+    CHECK(test_gossip_remote(&b, &source) == 10);
+
+    /* A newer message with a forged sequence number fails the tag */
+    for (i = 0; i < 5; i++) {
+        CHECK(rate_limit_allow(&a, &source) == 1);
+    }
+    rate_gossip_send(&a);
+    CHECK((length = recv(sock_b, message, sizeof(message), 0)) > 0);
+    message[15] ^= 0x80;
+    CHECK(sendto(sock_a, message, length, 0, (struct sockaddr *)&name_b, sizeof(name_b)) == length);
+    rate_gossip_receive(&b);
+    CHECK(stb.count_gossip_invalid == 3);
+
+    /* The genuine one is added */
+    message[15] ^= 0x80;
+    CHECK(sendto(sock_a, message, length, 0, (struct sockaddr *)&name_b, sizeof(name_b)) == length);
+    rate_gossip_receive(&b);
+    CHECK(stb.count_gossip_receive == 2);
+    CHECK(test_gossip_remote(&b, &source) == 15);
+
+    /* From another address than the peer, dropped */
+    rate_limit_allow(&a, &source);
+    rate_gossip_send(&a);
+    CHECK((length = recv(sock_b, message, sizeof(message), 0)) > 0);
+    CHECK(sendto(sock_b, message, length, 0, (struct sockaddr *)&name_b, sizeof(name_b)) == length);
+    rate_gossip_receive(&b);
+    CHECK(stb.count_gossip_invalid == 4);
+
+    close(sock_a);
+    close(sock_b);
+
+    return TEST_RESULT("gossip");
+}
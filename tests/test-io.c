@@ -0,0 +1,87 @@
+/**
+ * @file test-io.c
+ * @brief I/O backend tests: the poll set of a hot standby shrinks when the primary exits.
+ */
+
+#include "test.h"
+
+/**
+ * Wait on the descriptors, check that exactly the expected index is readable.
+ * @param[in,out] io The I/O backend state
+ * @param[in,out] ufds The file descriptors
+ * @param[in] nfds The number of file descriptors
+ * @param[in] readable The index expected readable
+ */
+void test_io_readable(struct io *io, struct pollfd *ufds, int nfds, int readable) {
+    int i;
+
+    CHECK(io_wait(io, ufds, nfds, 1000) == 1);
+    for (i = 0; i < nfds; i++) {
+        CHECK(((ufds[i].revents & POLLIN) != 0) == (i == readable));
+    }
+}
+
+/**
+ * Run the standby takeover sequence with a backend.
+ * @param[in] backend The backend, see IO_BACKEND
+ */
+void test_io_takeover(int backend) {
+    struct io io;
+    struct pollfd ufds[IO_MAX_FDS];
+    int pipes[4][2];
+    char byte = 0;
+    int i;
+
+    io_initialize(DEBUG_LEVEL_ERROR, &io, backend);
+
+    for (i = 0; i < 4; i++) {
+        CHECK(pipe(pipes[i]) == 0);
+        ufds[i].fd = pipes[i][0];
+        ufds[i].events = POLLIN;
+    }
+
+    /* Listen, send, standby pidfd, subscribe port: the subscribe port is readable */
+    CHECK(write(pipes[3][1], &byte, 1) == 1);
+    test_io_readable(&io, ufds, 4, 3);
+    CHECK(read(pipes[3][0], &byte, 1) == 1);
+
+    /* The primary exited, the standby descriptor is closed and the subscribe port moves down */
+    close(pipes[2][0]);
+    close(pipes[2][1]);
+    ufds[2] = ufds[3];
+    CHECK(write(pipes[3][1], &byte, 1) == 1);
+    test_io_readable(&io, ufds, 3, 2);
+    CHECK(read(pipes[3][0], &byte, 1) == 1);
+
+    /* The set shrinks again, the dropped descriptor must not report */
+    CHECK(write(pipes[3][1], &byte, 1) == 1);
+    CHECK(write(pipes[0][1], &byte, 1) == 1);
+    test_io_readable(&io, ufds, 2, 0);
+    CHECK(read(pipes[0][0], &byte, 1) == 1);
+
+    /* A new descriptor may reuse the closed number */
+    CHECK(pipe(pipes[2]) == 0);
+    ufds[2].fd = pipes[2][0];
+    CHECK(write(pipes[2][1], &byte, 1) == 1);
+    CHECK(read(pipes[3][0], &byte, 1) == 1);
+    test_io_readable(&io, ufds, 3, 2);
+
+    for (i = 0; i < 4; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    io_close(&io);
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    test_io_takeover(IO_BACKEND_POLL);
+#ifdef __linux__
+    test_io_takeover(IO_BACKEND_EPOLL);
+#endif
+
+    return TEST_RESULT("io");
+}
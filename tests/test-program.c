@@ -0,0 +1,174 @@
+/**
+ * @file test-program.c
+ * @brief Packet program tests: the verifier, memory bounds and the addresses a program sees.
+ */
+
+#include "test.h"
+
+/**
+ * Encode an eBPF instruction.
+ */
+#define INSN(OPCODE, DST, SRC, OFFSET, IMM) \
+        (OPCODE), ((SRC) << 4) | (DST), (OFFSET) & 0xff, ((OFFSET) >> 8) & 0xff, \
+        (IMM) & 0xff, ((IMM) >> 8) & 0xff, ((IMM) >> 16) & 0xff, ((uint32_t)(IMM) >> 24) & 0xff
+
+#define MOV64_IMM(DST, IMM)    INSN(EBPF_CLASS_ALU64 | EBPF_OP_MOV, DST, 0, 0, IMM)
+#define MOV64_REG(DST, SRC)    INSN(EBPF_CLASS_ALU64 | EBPF_OP_MOV | EBPF_SRC_X, DST, SRC, 0, 0)
+#define ADD64_IMM(DST, IMM)    INSN(EBPF_CLASS_ALU64 | EBPF_OP_ADD, DST, 0, 0, IMM)
+#define LDX(SIZE, DST, SRC, OFFSET)    INSN(EBPF_CLASS_LDX | EBPF_MODE_MEM | (SIZE), DST, SRC, OFFSET, 0)
+#define STX(SIZE, DST, SRC, OFFSET)    INSN(EBPF_CLASS_STX | EBPF_MODE_MEM | (SIZE), DST, SRC, OFFSET, 0)
+#define LDDW(DST, LOW, HIGH)   INSN(EBPF_OPCODE_LDDW, DST, 0, 0, LOW), INSN(0, 0, 0, 0, HIGH)
+#define JA(OFFSET)             INSN(EBPF_OPCODE_JA, 0, 0, OFFSET, 0)
+#define JEQ_IMM(DST, IMM, OFFSET)    INSN(EBPF_CLASS_JMP | EBPF_OP_JEQ, DST, 0, OFFSET, IMM)
+#define EXIT()                 INSN(EBPF_OPCODE_EXIT, 0, 0, 0, 0)
+
+#define SIZE_B     0x10
+#define SIZE_DW    0x18
+
+/**
+ * Load a program, quietly.
+ * @param[out] p The program
+ * @param[in] code The bytecode
+ * @param[in] len The bytecode length
+ * @return The program_load() return value.
+ */
+int test_program_load(struct program *p, const unsigned char *code, size_t len) {
+    memset(p, 0, sizeof(*p));
+
+    return program_load(-1, p, code, len);
+}
+
+/**
+ * Run a program on a packet.
+ * @param[in] code The bytecode
+ * @param[in] len The bytecode length
+ * @param[in,out] packet The packet
+ * @param[in] length The packet length
+ * @param[out] error Set if the program was aborted
+ * @return The program return value.
+ */
+uint64_t test_program_run(const unsigned char *code, size_t len, unsigned char *packet, size_t length, int *error) {
+    struct sockaddr_in source, original_destination;
+    struct program_context ctx;
+    struct program p;
+    uint64_t retval;
+
+    CHECK(test_program_load(&p, code, len) == 0);
+
+    memset(&source, 0, sizeof(source));
+    memset(&original_destination, 0, sizeof(original_destination));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.program = &p;
+    ctx.data = packet;
+    ctx.length = length;
+    ctx.capacity = length;
+    ctx.source = &source;
+    ctx.original_destination = &original_destination;
+
+    retval = program_run(&ctx);
+    *error = ctx.error;
+    free(p.instructions);
+
+    return retval;
+}
+
+/**
+ * The verifier rejects backward and out of range jumps, jumps into a 64 bit load, broken 64 bit
+ * loads and programs that can run off the end.
+ */
+void test_program_verifier(void) {
+    const unsigned char valid[] = { MOV64_IMM(0, 1), JEQ_IMM(1, 0, 2), LDDW(0, 2, 0), EXIT() };
+    const unsigned char backward[] = { MOV64_IMM(0, 1), JA(-2), EXIT() };
+    const unsigned char beyond[] = { MOV64_IMM(0, 1), JEQ_IMM(0, 1, 1), EXIT() };
+    const unsigned char into_lddw[] = { JEQ_IMM(0, 0, 1), LDDW(0, 1, 0), EXIT() };
+    const unsigned char lddw_last[] = { MOV64_IMM(0, 1), EXIT(), INSN(EBPF_OPCODE_LDDW, 0, 0, 0, 1) };
+    const unsigned char lddw_second[] = { INSN(EBPF_OPCODE_LDDW, 0, 0, 0, 1), MOV64_IMM(0, 1), EXIT() };
+    const unsigned char ja_last[] = { MOV64_IMM(0, 1), JA(0) };
+    const unsigned char no_exit[] = { MOV64_IMM(0, 1) };
+    const unsigned char write_r10[] = { MOV64_IMM(10, 1), EXIT() };
+    const unsigned char bad_register[] = { MOV64_IMM(11, 1), EXIT() };
+    const unsigned char bad_helper[] = { INSN(EBPF_OPCODE_CALL, 0, 0, 0, PROGRAM_HELPER_MAX + 1), EXIT() };
+    const unsigned char div_zero[] = { INSN(EBPF_CLASS_ALU64 | EBPF_OP_DIV, 0, 0, 0, 0), EXIT() };
+    struct program p;
+
+    CHECK(test_program_load(&p, valid, sizeof(valid)) == 0);
+    free(p.instructions);
+
+    CHECK(test_program_load(&p, backward, sizeof(backward)) == -1);
+    CHECK(test_program_load(&p, beyond, sizeof(beyond)) == -1);
+    CHECK(test_program_load(&p, into_lddw, sizeof(into_lddw)) == -1);
+    CHECK(test_program_load(&p, lddw_last, sizeof(lddw_last)) == -1);
+    CHECK(test_program_load(&p, lddw_second, sizeof(lddw_second)) == -1);
+    CHECK(test_program_load(&p, ja_last, sizeof(ja_last)) == -1);
+    CHECK(test_program_load(&p, no_exit, sizeof(no_exit)) == -1);
+    CHECK(test_program_load(&p, write_r10, sizeof(write_r10)) == -1);
+    CHECK(test_program_load(&p, bad_register, sizeof(bad_register)) == -1);
+    CHECK(test_program_load(&p, bad_helper, sizeof(bad_helper)) == -1);
+    CHECK(test_program_load(&p, div_zero, sizeof(div_zero)) == -1);
+    CHECK(test_program_load(&p, valid, sizeof(valid) - 1) == -1);
+}
+
+/**
+ * Accesses are bounded by the packet and the stack, including near the end of the address space.
+ */
+void test_program_memory(void) {
+    /* Copy the last byte of the packet to the first one */
+    const unsigned char last[] = { LDX(SIZE_B, 2, 1, 7), STX(SIZE_B, 1, 2, 0), MOV64_IMM(0, 1), EXIT() };
+    const unsigned char over[] = { LDX(SIZE_B, 2, 1, 8), MOV64_IMM(0, 1), EXIT() };
+    const unsigned char under[] = { LDX(SIZE_B, 2, 1, -1), MOV64_IMM(0, 1), EXIT() };
+    const unsigned char stack_top[] = { STX(SIZE_DW, 10, 1, -8), LDX(SIZE_DW, 0, 10, -8), EXIT() };
+    const unsigned char stack_over[] = { STX(SIZE_B, 10, 1, 0), MOV64_IMM(0, 1), EXIT() };
+    const unsigned char stack_under[] = { STX(SIZE_B, 10, 1, -PROGRAM_STACK_SIZE - 1), MOV64_IMM(0, 1), EXIT() };
+    const unsigned char wrap[] = { LDDW(2, -4, -1), LDX(SIZE_DW, 0, 2, 0), EXIT() };
+    const unsigned char wrap_packet[] = { LDDW(2, -2, -1), MOV64_REG(3, 1), INSN(EBPF_CLASS_ALU64 | EBPF_OP_ADD | EBPF_SRC_X, 3, 2, 0, 0),
+        LDX(SIZE_DW, 0, 3, 0), EXIT() };
+    unsigned char packet[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    int error;
+
+    CHECK(test_program_run(last, sizeof(last), packet, sizeof(packet), &error) == 1 && !error);
+    CHECK(packet[0] == 8);
+    CHECK(test_program_run(over, sizeof(over), packet, sizeof(packet), &error) == 0 && error);
+    CHECK(test_program_run(under, sizeof(under), packet, sizeof(packet), &error) == 0 && error);
+    CHECK(test_program_run(stack_top, sizeof(stack_top), packet, sizeof(packet), &error) == PROGRAM_PACKET_BASE && !error);
+    CHECK(test_program_run(stack_over, sizeof(stack_over), packet, sizeof(packet), &error) == 0 && error);
+    CHECK(test_program_run(stack_under, sizeof(stack_under), packet, sizeof(packet), &error) == 0 && error);
+    CHECK(test_program_run(wrap, sizeof(wrap), packet, sizeof(packet), &error) == 0 && error);
+    CHECK(test_program_run(wrap_packet, sizeof(wrap_packet), packet, sizeof(packet), &error) == 0 && error);
+}
+
+/**
+ * A program only sees its own addresses and a zeroed stack, nothing of the host.
+ */
+void test_program_isolation(void) {
+    /* Write r1 and r10 into the packet, then a stack word never written */
+    const unsigned char leak[] = { STX(SIZE_DW, 1, 1, 0), STX(SIZE_DW, 1, 10, 8), LDX(SIZE_DW, 2, 10, -PROGRAM_STACK_SIZE),
+        STX(SIZE_DW, 1, 2, 16), MOV64_IMM(0, 1), EXIT() };
+    /* Dirty the stack, the next run must not see it */
+    const unsigned char dirty[] = { LDDW(2, 0x55555555, 0x55555555), STX(SIZE_DW, 10, 2, -PROGRAM_STACK_SIZE), MOV64_IMM(0, 1), EXIT() };
+    unsigned char packet[24];
+    uint64_t value;
+    int error;
+
+    memset(packet, 0xff, sizeof(packet));
+    CHECK(test_program_run(dirty, sizeof(dirty), packet, sizeof(packet), &error) == 1 && !error);
+    CHECK(test_program_run(leak, sizeof(leak), packet, sizeof(packet), &error) == 1 && !error);
+
+    memcpy(&value, packet, 8);
+    CHECK(value == PROGRAM_PACKET_BASE);
+    memcpy(&value, packet + 8, 8);
+    CHECK(value == PROGRAM_STACK_BASE + PROGRAM_STACK_SIZE);
+    memcpy(&value, packet + 16, 8);
+    CHECK(value == 0);
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    test_program_verifier();
+    test_program_memory();
+    test_program_isolation();
+
+    return TEST_RESULT("program");
+}
@@ -0,0 +1,116 @@
+/**
+ * @file test-proxy.c
+ * @brief PROXY protocol v2 tests: prepend and parse round trip, LOCAL and other families, malformed headers.
+ */
+
+#include "test.h"
+
+/**
+ * A prepended header parses back to the original source.
+ */
+void test_proxy_round_trip(void) {
+    struct sockaddr_in source, destination, parsed;
+    char buffer[PROXY_V2_HEADER_SIZE + 16];
+    char *packet;
+
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(0xc0000201);
+    source.sin_port = htons(51820);
+    memset(&destination, 0, sizeof(destination));
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = htonl(0xc6336401);
+    destination.sin_port = htons(53);
+
+    memcpy(buffer + PROXY_V2_HEADER_SIZE, "payload", 7);
+    packet = proxy_header_prepend(buffer + PROXY_V2_HEADER_SIZE, &source, &destination);
+    CHECK(packet == buffer);
+    CHECK(memcmp(packet, PROXY_V2_SIGNATURE, PROXY_V2_SIGNATURE_SIZE) == 0);
+    CHECK((unsigned char)packet[12] == 0x21 && (unsigned char)packet[13] == 0x12);
+    CHECK(memcmp(packet + 20, &(destination.sin_addr.s_addr), 4) == 0);
+    CHECK(memcmp(packet + 26, &(destination.sin_port), 2) == 0);
+
+    CHECK(proxy_header_parse(packet, PROXY_V2_HEADER_SIZE + 7, &parsed) == PROXY_V2_HEADER_SIZE);
+    CHECK(parsed.sin_family == AF_INET);
+    CHECK(parsed.sin_addr.s_addr == source.sin_addr.s_addr);
+    CHECK(parsed.sin_port == source.sin_port);
+    CHECK(memcmp(packet + PROXY_V2_HEADER_SIZE, "payload", 7) == 0);
+
+    /* The header alone is enough */
+    CHECK(proxy_header_parse(packet, PROXY_V2_HEADER_SIZE, &parsed) == PROXY_V2_HEADER_SIZE);
+}
+
+/**
+ * LOCAL commands and other address families are stripped without a source.
+ */
+void test_proxy_local(void) {
+    struct sockaddr_in parsed;
+    unsigned char header[PROXY_V2_FIXED_SIZE + 36];
+
+    /* LOCAL, no addresses */
+    memset(header, 0, sizeof(header));
+    memcpy(header, PROXY_V2_SIGNATURE, PROXY_V2_SIGNATURE_SIZE);
+    header[12] = 0x20;
+    header[13] = 0x00;
+    CHECK(proxy_header_parse((char *)header, PROXY_V2_FIXED_SIZE + 4, &parsed) == PROXY_V2_FIXED_SIZE);
+    CHECK(parsed.sin_family == AF_INET && parsed.sin_addr.s_addr == INADDR_ANY && parsed.sin_port == 0);
+
+    /* PROXY over UDP and IPv6: the header is skipped, the source is unknown */
+    header[12] = 0x21;
+    header[13] = 0x22;
+    header[15] = 36;
+    memset(header + PROXY_V2_FIXED_SIZE, 0xff, 36);
+    CHECK(proxy_header_parse((char *)header, sizeof(header), &parsed) == PROXY_V2_FIXED_SIZE + 36);
+    CHECK(parsed.sin_addr.s_addr == INADDR_ANY && parsed.sin_port == 0);
+
+    /* PROXY over TCP and IPv4 */
+    header[13] = 0x11;
+    header[15] = 12;
+    CHECK(proxy_header_parse((char *)header, PROXY_V2_HEADER_SIZE, &parsed) == PROXY_V2_HEADER_SIZE);
+    CHECK(parsed.sin_addr.s_addr == INADDR_ANY && parsed.sin_port == 0);
+}
+
+/**
+ * Packets without a header pass, malformed headers are refused.
+ */
+void test_proxy_invalid(void) {
+    struct sockaddr_in source, parsed;
+    char buffer[PROXY_V2_HEADER_SIZE + 16];
+    char *packet;
+
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(0xc0000201);
+    source.sin_port = htons(51820);
+
+    /* No signature, or too short to hold one */
+    memset(buffer, 'x', sizeof(buffer));
+    CHECK(proxy_header_parse(buffer, sizeof(buffer), &parsed) == 0);
+    packet = proxy_header_prepend(buffer + PROXY_V2_HEADER_SIZE, &source, &source);
+    CHECK(proxy_header_parse(packet, PROXY_V2_FIXED_SIZE - 1, &parsed) == 0);
+
+    /* Header longer than the packet */
+    CHECK(proxy_header_parse(packet, PROXY_V2_HEADER_SIZE - 1, &parsed) == -1);
+
+    /* Bad version */
+    packet[12] = 0x11;
+    CHECK(proxy_header_parse(packet, sizeof(buffer), &parsed) == -1);
+
+    /* UDP over IPv4 without room for the addresses */
+    packet[12] = 0x21;
+    packet[15] = 4;
+    CHECK(proxy_header_parse(packet, sizeof(buffer), &parsed) == -1);
+    CHECK(parsed.sin_addr.s_addr == INADDR_ANY);
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    test_proxy_round_trip();
+    test_proxy_local();
+    test_proxy_invalid();
+
+    return TEST_RESULT("proxy");
+}
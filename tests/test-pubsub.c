@@ -0,0 +1,161 @@
+/**
+ * @file test-pubsub.c
+ * @brief Subscriber table tests: lookups after backward shift deletion, with colliding and wrapping probes.
+ */
+
+#include "test.h"
+
+/**
+ * Build a subscriber address.
+ * @param[out] address The address
+ * @param[in] n The address number
+ */
+void test_pubsub_address(struct sockaddr_in *address, unsigned int n) {
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(((n & 0xff) << 24) | ((n >> 8) << 8) | 1);
+    address->sin_port = htons(4000);
+}
+
+/**
+ * Check the table against the subscribers: every subscriber is found, and only through its own slot.
+ * @param[in] ps The subscribers
+ * @param[in] subscribed Whether each address number is subscribed
+ * @param[in] n The number of address numbers
+ */
+void test_pubsub_consistent(const struct pubsub *ps, const char *subscribed, unsigned int n) {
+    struct sockaddr_in address;
+    unsigned int i;
+    int used = 0;
+
+    for (i = 0; i <= ps->mask; i++) {
+        if (ps->table[i] != -1) {
+            CHECK(ps->table[i] < ps->count);
+            CHECK(ps->subscribers[ps->table[i]].slot == (int)i);
+            used++;
+        }
+    }
+    CHECK(used == ps->count);
+
+    for (i = 0; i < n; i++) {
+        test_pubsub_address(&address, i);
+        CHECK((ps->table[pubsub_slot(ps, &address)] != -1) == subscribed[i]);
+    }
+}
+
+/**
+ * Colliding subscribers stay reachable after any of them is removed, also when the probes wrap.
+ */
+void test_pubsub_collisions(void) {
+    struct settings s;
+    struct pubsub ps;
+    struct sockaddr_in address;
+    unsigned int home[2] = { 0, 0 };
+    unsigned int colliding[2][3];
+    unsigned int found[2] = { 0, 0 };
+    char subscribed[4096];
+    unsigned int i, j, k;
+
+    memset(&s, 0, sizeof(s));
+    s.subscribe_max = 8;
+    s.subscribe_timeout = 10;
+    CHECK(pubsub_initialize(&ps, &s) == 0);
+    CHECK(ps.mask == 15);
+
+    /* Three addresses sharing the last slot, and three sharing the first, so the probes wrap and interleave */
+    home[0] = ps.mask;
+    for (i = 0; i < sizeof(subscribed) && (found[0] < 3 || found[1] < 3); i++) {
+        test_pubsub_address(&address, i);
+        for (j = 0; j < 2; j++) {
+            if ((pubsub_hash(&address) & ps.mask) == home[j] && found[j] < 3) {
+                colliding[j][found[j]++] = i;
+            }
+        }
+    }
+    CHECK(found[0] == 3 && found[1] == 3);
+
+    /* Remove each one in turn, from the full cluster */
+    for (k = 0; k < 6; k++) {
+        memset(subscribed, 0, sizeof(subscribed));
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 2; j++) {
+                test_pubsub_address(&address, colliding[j][i]);
+                CHECK(pubsub_subscribe(&ps, &address, 0) == 1);
+                subscribed[colliding[j][i]] = 1;
+            }
+        }
+        test_pubsub_consistent(&ps, subscribed, sizeof(subscribed));
+
+        test_pubsub_address(&address, colliding[k % 2][k / 2]);
+        CHECK(pubsub_unsubscribe(&ps, &address) == 1);
+        CHECK(pubsub_unsubscribe(&ps, &address) == 0);
+        subscribed[colliding[k % 2][k / 2]] = 0;
+        test_pubsub_consistent(&ps, subscribed, sizeof(subscribed));
+
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 2; j++) {
+                if (subscribed[colliding[j][i]]) {
+                    test_pubsub_address(&address, colliding[j][i]);
+                    CHECK(pubsub_subscribe(&ps, &address, 0) == 0);
+                    CHECK(pubsub_unsubscribe(&ps, &address) == 1);
+                    subscribed[colliding[j][i]] = 0;
+                    test_pubsub_consistent(&ps, subscribed, sizeof(subscribed));
+                }
+            }
+        }
+        CHECK(ps.count == 0);
+    }
+}
+
+/**
+ * Random subscriptions and removals keep the table consistent, up to the subscriber limit.
+ */
+void test_pubsub_random(void) {
+    struct settings s;
+    struct pubsub ps;
+    struct sockaddr_in address;
+    char subscribed[256];
+    unsigned int state = 1;
+    int count = 0;
+    int i;
+
+    memset(&s, 0, sizeof(s));
+    s.subscribe_max = 64;
+    s.subscribe_timeout = 10;
+    CHECK(pubsub_initialize(&ps, &s) == 0);
+    memset(subscribed, 0, sizeof(subscribed));
+
+    for (i = 0; i < 4000; i++) {
+        unsigned int n;
+
+        state = state * 1103515245U + 12345U;
+        n = (state >> 16) % sizeof(subscribed);
+        test_pubsub_address(&address, n);
+
+        if (subscribed[n]) {
+            CHECK(pubsub_unsubscribe(&ps, &address) == 1);
+            subscribed[n] = 0;
+            count--;
+        } else if (count == s.subscribe_max) {
+            CHECK(pubsub_subscribe(&ps, &address, 0) == -1);
+        } else {
+            CHECK(pubsub_subscribe(&ps, &address, 0) == 1);
+            subscribed[n] = 1;
+            count++;
+        }
+
+        CHECK(ps.count == count);
+        test_pubsub_consistent(&ps, subscribed, sizeof(subscribed));
+    }
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    test_pubsub_collisions();
+    test_pubsub_random();
+
+    return TEST_RESULT("pubsub");
+}
@@ -0,0 +1,193 @@
+/**
+ * @file test-tunnel.c
+ * @brief Tunnel tests: ChaCha20 and ChaCha20-Poly1305 known answers (RFC 8439), seal, open and replay.
+ */
+
+#include "test.h"
+
+/**
+ * The RFC 8439 sample plaintext.
+ */
+#define TEST_SUNSCREEN "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, " \
+    "sunscreen would be it."
+
+/**
+ * Decode a hexadecimal string.
+ * @param[out] out The output buffer
+ * @param[in] hex The hexadecimal string, spaces are skipped
+ * @return The number of bytes decoded.
+ */
+size_t test_hex(unsigned char *out, const char *hex) {
+    size_t len = 0;
+    unsigned int byte;
+
+    while (*hex != '\0') {
+        if (*hex == ' ') {
+            hex++;
+            continue;
+        }
+        sscanf(hex, "%2x", &byte);
+        out[len++] = byte;
+        hex += 2;
+    }
+
+    return len;
+}
+
+/**
+ * RFC 8439 section 2.3.2, ChaCha20 block function.
+ */
+void test_chacha20_block(void) {
+    unsigned char key[32], nonce[12], block[64], expected[64];
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        key[i] = i;
+    }
+    test_hex(nonce, "000000090000004a00000000");
+    test_hex(expected,
+            "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+            "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e");
+
+    chacha20_block(key, 1, nonce, block);
+    CHECK(memcmp(block, expected, sizeof(block)) == 0);
+}
+
+/**
+ * RFC 8439 section 2.4.2, ChaCha20 encryption starting at block counter 1.
+ */
+void test_chacha20_xor(void) {
+    unsigned char key[32], nonce[12], data[128], expected[128];
+    size_t len = strlen(TEST_SUNSCREEN);
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        key[i] = i;
+    }
+    test_hex(nonce, "000000000000004a00000000");
+    CHECK(test_hex(expected,
+            "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+            "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+            "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+            "5af90bbf74a35be6b40b8eedf2785e42874d") == len);
+
+    memcpy(data, TEST_SUNSCREEN, len);
+    chacha20_xor(key, nonce, data, len);
+    CHECK(memcmp(data, expected, len) == 0);
+
+    chacha20_xor(key, nonce, data, len);
+    CHECK(memcmp(data, TEST_SUNSCREEN, len) == 0);
+}
+
+/**
+ * RFC 8439 section 2.8.2, ChaCha20-Poly1305 AEAD encryption.
+ */
+void test_chacha20_poly1305(void) {
+    unsigned char key[32], nonce[12], aad[12], data[128], expected[128], tag[16], expected_tag[16];
+    size_t len = strlen(TEST_SUNSCREEN);
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        key[i] = 0x80 + i;
+    }
+    test_hex(nonce, "070000004041424344454647");
+    test_hex(aad, "50515253c0c1c2c3c4c5c6c7");
+    test_hex(expected,
+            "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+            "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+            "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+            "3ff4def08e4b7a9de576d26586cec64b6116");
+    test_hex(expected_tag, "1ae10b594f09e26a7e902ecbd0600691");
+
+    memcpy(data, TEST_SUNSCREEN, len);
+    chacha20_xor(key, nonce, data, len);
+    CHECK(memcmp(data, expected, len) == 0);
+
+    chacha20_poly1305_tag(key, nonce, aad, sizeof(aad), data, len, tag);
+    CHECK(memcmp(tag, expected_tag, sizeof(tag)) == 0);
+
+    /* Any modified ciphertext or additional data byte changes the tag */
+    data[len - 1] ^= 1;
+    chacha20_poly1305_tag(key, nonce, aad, sizeof(aad), data, len, tag);
+    CHECK(memcmp(tag, expected_tag, sizeof(tag)) != 0);
+    data[len - 1] ^= 1;
+    aad[0] ^= 1;
+    chacha20_poly1305_tag(key, nonce, aad, sizeof(aad), data, len, tag);
+    CHECK(memcmp(tag, expected_tag, sizeof(tag)) != 0);
+}
+
+/**
+ * Packets sealed by one end open at the other end only, once, and only unmodified.
+ */
+void test_tunnel(void) {
+    unsigned char key[TUNNEL_KEY_SIZE];
+    struct tunnel connect, listen;
+    char buffer[TUNNEL_HEADER_SIZE + 64 + TUNNEL_TAG_SIZE];
+    char copy[sizeof(buffer)];
+    char *sealed, *opened;
+    uint64_t counter, replayed;
+    int length, copy_length;
+    int i;
+
+    for (i = 0; i < TUNNEL_KEY_SIZE; i++) {
+        key[i] = i;
+    }
+    tunnel_initialize(&connect, key, TUNNEL_DIRECTION_CONNECT, TUNNEL_DIRECTION_LISTEN);
+    tunnel_initialize(&listen, key, TUNNEL_DIRECTION_LISTEN, TUNNEL_DIRECTION_CONNECT);
+
+    length = 7;
+    memcpy(buffer + TUNNEL_HEADER_SIZE, "payload", length);
+    sealed = tunnel_seal(&connect, buffer + TUNNEL_HEADER_SIZE, &length);
+    CHECK(sealed == buffer);
+    CHECK(length == TUNNEL_HEADER_SIZE + 7 + TUNNEL_TAG_SIZE);
+    CHECK(memcmp(buffer + TUNNEL_HEADER_SIZE, "payload", 7) != 0);
+    memcpy(copy, buffer, length);
+    copy_length = length;
+
+    /* The sender cannot open its own packets, the directions differ */
+    CHECK(tunnel_open(&connect, copy, &copy_length, &counter) == NULL);
+
+    opened = tunnel_open(&listen, buffer, &length, &counter);
+    CHECK(opened == buffer + TUNNEL_HEADER_SIZE);
+    CHECK(length == 7);
+    CHECK(opened != NULL && memcmp(opened, "payload", 7) == 0);
+    CHECK(tunnel_replay_check(&listen, counter) == 0);
+
+    /* The same packet again is authentic, but a replay */
+    copy_length = TUNNEL_HEADER_SIZE + 7 + TUNNEL_TAG_SIZE;
+    memcpy(buffer, copy, copy_length);
+    CHECK(tunnel_open(&listen, buffer, &copy_length, &replayed) != NULL);
+    CHECK(replayed == counter);
+    CHECK(tunnel_replay_check(&listen, replayed) == -1);
+
+    /* Modified header, payload or tag, truncated packet */
+    for (i = 0; i < TUNNEL_HEADER_SIZE + 7 + TUNNEL_TAG_SIZE; i += 5) {
+        copy_length = TUNNEL_HEADER_SIZE + 7 + TUNNEL_TAG_SIZE;
+        memcpy(buffer, copy, copy_length);
+        buffer[i] ^= 1;
+        CHECK(tunnel_open(&listen, buffer, &copy_length, &replayed) == NULL);
+    }
+    copy_length = TUNNEL_HEADER_SIZE + TUNNEL_TAG_SIZE - 1;
+    memcpy(buffer, copy, sizeof(buffer));
+    CHECK(tunnel_open(&listen, buffer, &copy_length, &replayed) == NULL);
+
+    /* Reordered packets inside the window are accepted once, those behind it are not */
+    CHECK(tunnel_replay_check(&listen, counter + 10) == 0);
+    CHECK(tunnel_replay_check(&listen, counter + 5) == 0);
+    CHECK(tunnel_replay_check(&listen, counter + 5) == -1);
+    CHECK(tunnel_replay_check(&listen, counter + 10 + TUNNEL_REPLAY_WINDOW) == 0);
+    CHECK(tunnel_replay_check(&listen, counter + 10) == -1);
+}
+
+/**
+ * Test program function.
+ * @return The test program return code.
+ */
+int main(void) {
+    test_chacha20_block();
+    test_chacha20_xor();
+    test_chacha20_poly1305();
+    test_tunnel();
+
+    return TEST_RESULT("tunnel");
+}
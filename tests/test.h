@@ -0,0 +1,34 @@
+/**
+ * @file test.h
+ * @brief Minimal test helpers, the tests include udp-redirect.c to reach its helper functions.
+ */
+
+#ifndef UDP_REDIRECT_TEST_H
+#define UDP_REDIRECT_TEST_H
+
+#define main udp_redirect_main
+#include "../udp-redirect.c"
+#undef main
+
+static int test_failures = 0;   ///< The number of failed checks
+
+/**
+ * Check a condition, report it when false.
+ * @param[in] X The condition
+ */
+#define CHECK(X) do { \
+    if (!(X)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); \
+        test_failures++; \
+    } \
+} while (0)
+
+/**
+ * Report the test result.
+ * @param[in] X The test name
+ * @return The test program return code.
+ */
+#define TEST_RESULT(X) (fprintf(stderr, "%s: %s\n", (X), (test_failures == 0)?"PASS":"FAIL"), \
+        (test_failures == 0)?EXIT_SUCCESS:EXIT_FAILURE)
+
+#endif
@@ -15,6 +15,10 @@
  * A simple and high performance UDP redirector.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU affinity */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -30,6 +34,30 @@
 #include <math.h>
 #include <netdb.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <netinet/ip.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/utsname.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <linux/bpf.h>
+#endif
 
 /**
  * The udp-redirect version
@@ -47,753 +75,9070 @@
 #define NETWORK_BUFFER_SIZE    65535
 
 /**
- * @brief Readability: errno value for OK.
+ * Space reserved in front of a received packet, used to prepend headers before forwarding
  */
-#define EOK 0
+#define NETWORK_BUFFER_HEADROOM    64
 
 /**
-  * Maximum known errno, used to ignore harmless sendto / recvfrom errors
-  */
-#define MAX_ERRNO 256
+ * Space reserved after a received packet, used to append trailers before forwarding
+ */
+#define NETWORK_BUFFER_TAILROOM    64
 
 /**
-  * Initialize errno ignore set
-  */
-#define ERRNO_IGNORE_INIT(X)   memset((X), 0, MAX_ERRNO * sizeof(unsigned char))
+ * The largest UDP payload that can be sent over IPv4
+ */
+#define UDP_PAYLOAD_MAX    65507
 
 /**
-  * Set errno ignore boolean for a specific errno
-  */
-#define ERRNO_IGNORE_SET(X, Y) if ((Y) >= 0 && (Y) < MAX_ERRNO) (X)[(Y)] = 1
+ * The size in bytes of the admission tag appended to packets
+ */
+#define ADMISSION_TAG_SIZE    8
 
 /**
-  * Check if errno is in declared set
-  */
-#define ERRNO_IGNORE_CHECK(X, Y) ((Y) >= 0 && (Y) < MAX_ERRNO && (X)[(Y)] == 1)
+ * The size in bytes of the source address and port the admission tag is bound to
+ */
+#define ADMISSION_SOURCE_SIZE    6
 
 /**
- * @brief The available debug levels.
+ * The size in bytes of the admission key (SipHash-2-4 key)
  */
-enum DEBUG_LEVEL {
-    DEBUG_LEVEL_ERROR = 0,      ///< Error messages
-    DEBUG_LEVEL_INFO = 1,       ///< Informational messages
-    DEBUG_LEVEL_VERBOSE = 2,    ///< Verbose messages
-    DEBUG_LEVEL_DEBUG = 3       ///< Debug messages
-};
+#define ADMISSION_KEY_SIZE    16
 
 /**
- * Standard debug macro requiring a locally defined debug level.
- * Adapted from the excellent https://github.com/jleffler/soq/blob/master/src/libsoq/debug.h
- *
- * Note that __VA_ARGS__ is a GCC extension; used for convenience to support DEBUG without format arguments.
+ * The default admission epoch length in seconds
  */
-#define DEBUG(debug_level_local, debug_level_message, fmt, ...) \
-        do { \
-            if ((debug_level_local) >= (debug_level_message)) { \
-                fprintf(stderr, "%s:%d:%d:%s(): " fmt "\n", __FILE__, \
-                    __LINE__, (int)(time(NULL)), __func__, ##__VA_ARGS__); \
-            } \
-        } while (0)
+#define ADMISSION_EPOCH_SECONDS    30
 
 /**
- * Command line options.
+ * The size in bytes of the tunnel key (ChaCha20-Poly1305 key)
  */
-static struct option longopts[] = {
-    { "verbose",               no_argument,            NULL,           'v' }, ///< Verbose mode, can be specified multiple times (optional)
-    { "debug",                 no_argument,            NULL,           'd' }, ///< Debug mode (optional)
+#define TUNNEL_KEY_SIZE    32
 
-    { "listen-address",        required_argument,      NULL,           'a' }, ///< Listen address (optional)
-    { "listen-port",           required_argument,      NULL,           'b' }, ///< Listen port (required)
-    { "listen-interface",      required_argument,      NULL,           'c' }, ///< Listen interface (optional)
+/**
+ * The size in bytes of the tunnel nonce
+ */
+#define TUNNEL_NONCE_SIZE    12
 
-    { "connect-address",       required_argument,      NULL,           'g' }, ///< Connect address (required)
-    { "connect-host",          required_argument,      NULL,           'h' }, ///< Connect host (required)
-    { "connect-port",          required_argument,      NULL,           'i' }, ///< Connect port (required)
+/**
+ * The size in bytes of the tunnel header, the packet counter
+ */
+#define TUNNEL_HEADER_SIZE    8
 
-    { "send-address",          required_argument,      NULL,           'm' }, ///< Send packets address (optional)
-    { "send-port",             required_argument,      NULL,           'n' }, ///< Send packets port (optional)
-    { "send-interface",        required_argument,      NULL,           'o' }, ///< Send packets interface (optional)
+/**
+ * The size in bytes of the tunnel authentication tag
+ */
+#define TUNNEL_TAG_SIZE    16
 
-    { "listen-address-strict", no_argument,            NULL,           'x' }, ///< Listener only receives packets from the same endpoint
-    { "connect-address-strict",no_argument,            NULL,           'y' }, ///< Sender only receives packets from the connect address
+/**
+ * The number of 64 bit words in the tunnel replay bitmap
+ */
+#define TUNNEL_REPLAY_WORDS    16
 
-    { "listen-sender-address", required_argument,      NULL,           'k' }, ///< Connect expects packets from this source address
-    { "listen-sender-port",    required_argument,      NULL,           'l' }, ///< Connect expects packets from this source port
+/**
+ * The tunnel replay window in packets; one bitmap word is kept spare while the window moves
+ */
+#define TUNNEL_REPLAY_WINDOW    ((TUNNEL_REPLAY_WORDS - 1) * 64)
 
-    { "ignore-errors",         no_argument,            NULL,           'r' }, ///< Ignore harmless recvfrom / sendto errors (default)
-    { "stop-errors",           no_argument,            NULL,           's' }, ///< Do NOT ignore harmless recvfrom / sendto errors
+/**
+ * Tunnel packet counters are wall clock nanoseconds: a receiver refuses counters further than this
+ * behind its clock when it starts, and senders keep their counters within half of it of their clock
+ */
+#define TUNNEL_CLOCK_SKEW_NS    (60 * 1000000000ULL)
 
-    { "stats",                 no_argument,            NULL,           'q' }, ///< Display stats every 60 seconds
+/**
+ * Tunnel nonce prefix for packets sent toward the connect address
+ */
+#define TUNNEL_DIRECTION_CONNECT    1
 
-    { "version",               no_argument,            NULL,           'z' }, ///< Display the version
+/**
+ * Tunnel nonce prefix for packets sent toward the listener endpoint
+ */
+#define TUNNEL_DIRECTION_LISTEN    2
 
-    { NULL,                    0,                      NULL,            0 }
-};
+/**
+ * The PROXY protocol v2 signature
+ */
+#define PROXY_V2_SIGNATURE    "\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A"
 
 /**
- * Store command line option values in one place.
+ * The PROXY protocol v2 signature length
  */
-struct settings {
-    char *laddr;        ///< Listen address
-    int lport;          ///< Listen port
-    char *lif;          ///< Listen interface
+#define PROXY_V2_SIGNATURE_SIZE    12
 
-    char *caddr;        ///< Connect address
-    char *chost;        ///< Connect host
-    int cport;          ///< Connect port
+/**
+ * The PROXY protocol v2 fixed header size: signature, version / command, family, length
+ */
+#define PROXY_V2_FIXED_SIZE    16
 
-    char *saddr;        ///< Send packets from address
-    int sport;          ///< Send packets from port
-    char *sif;          ///< Send packets from interface
+/**
+ * The PROXY protocol v2 header size for UDP over IPv4: fixed header and addresses
+ */
+#define PROXY_V2_HEADER_SIZE    (PROXY_V2_FIXED_SIZE + 12)
 
-    int lstrict;        ///< Strict mode for listener (set endpoint on first packet arrival)
-    int cstrict;        ///< Strict mode for sender (only accept from caddr / cport)
+/**
+ * The size in bytes of an eBPF instruction
+ */
+#define PROGRAM_INSTRUCTION_SIZE    8
 
-    char *lsaddr;       ///< Listen port expects packets from this address
-    int lsport;         ///< Listen port only expects packets from this port
+/**
+ * The maximum number of instructions in a packet program
+ */
+#define PROGRAM_MAX_INSTRUCTIONS    4096
 
-    int eignore;        ///< Ignore most recvfrom / sendto errors
+/**
+ * The packet program stack size in bytes
+ */
+#define PROGRAM_STACK_SIZE    512
 
-    int stats;          ///< Display stats every 60 seconds
-};
+/**
+ * The packet address seen by a packet program, host addresses are never exposed
+ */
+#define PROGRAM_PACKET_BASE    0x100000000ULL
 
 /**
- * Store and display statistics
+ * The stack start address seen by a packet program
  */
-struct statistics {
-    time_t time_display_last;
-    time_t time_display_first;
+#define PROGRAM_STACK_BASE    0x200000000ULL
 
-    unsigned long count_listen_packet_receive;
-    unsigned long count_listen_byte_receive;
+/**
+ * The number of counters available to a packet program
+ */
+#define PROGRAM_COUNTERS    16
 
-    unsigned long count_listen_packet_send;
-    unsigned long count_listen_byte_send;
+/**
+ * The number of packets queued between the main thread and the workers
+ */
+#define WORKER_QUEUE_SIZE    128
 
-    unsigned long count_connect_packet_receive;
-    unsigned long count_connect_byte_receive;
+/**
+ * Flow buckets the worker queue keeps ordered, packets of flows sharing a bucket are sent in receive order
+ */
+#define WORKER_FLOW_BUCKETS    256
 
-    unsigned long count_connect_packet_send;
-    unsigned long count_connect_byte_send;
+/**
+ * The CPU budget accounting window in nanoseconds
+ */
+#define BUDGET_WINDOW_NS    100000000ULL
 
-    unsigned long count_listen_packet_receive_total;
-    unsigned long count_listen_byte_receive_total;
+/**
+ * The maximum number of query cache rules
+ */
+#define QUERY_CACHE_RULES    8
 
-    unsigned long count_listen_packet_send_total;
-    unsigned long count_listen_byte_send_total;
+/**
+ * The maximum length in bytes of a query cache prefix
+ */
+#define QUERY_PREFIX_MAX    32
 
-    unsigned long count_connect_packet_receive_total;
-    unsigned long count_connect_byte_receive_total;
+/**
+ * The number of clients whose last challenge is remembered, a power of 2
+ */
+#define QUERY_CHALLENGES    4096
 
-    unsigned long count_connect_packet_send_total;
-    unsigned long count_connect_byte_send_total;
-};
+/**
+ * Seconds a challenge issued to a client is remembered
+ */
+#define QUERY_CHALLENGE_SECONDS    30
 
-/* Function prototypes */
+/**
+ * The default query cache time to live in milliseconds
+ */
+#define QUERY_CACHE_TTL_MS    1000
 
-int socket_setup(const int debug_level, const char *desc, const char *xaddr, const int xport, const char *xif, struct sockaddr_in *xsock_name);
-char *resolve_host(int debug_level, const char *host);
+/**
+ * The maximum number of replay buffer streams
+ */
+#define REPLAY_STREAMS    16
 
-void settings_initialize(struct settings *s);
-void usage(const char *argv0, const char *message);
+/**
+ * The default number of packets kept per replay buffer stream
+ */
+#define REPLAY_SLOTS    4096
 
-void statistics_initialize(struct statistics *st);
-double int_to_human_value(double value);
-char int_to_human_char(double value);
-void statistics_display(int debug_level, struct statistics *st, time_t now);
+/**
+ * The largest packet kept in the replay buffer
+ */
+#define REPLAY_SLOT_SIZE    2048
 
 /**
- * Main program function.
- *
- * @param[in] argc The count of arguments, including the program name.
- * @param[in] argv The program arguments
- * @return The program return code.
- *
+ * Retransmit request: magic, stream, first sequence number and count, then the cookie
  */
-int main(int argc, char *argv[]) {
-    /* Store debug level and program name */
-    int debug_level = DEBUG_LEVEL_ERROR;
-    char *argv0 = argv[0];
+#define REPLAY_REQUEST_MAGIC    "URRQ"
+#define REPLAY_REQUEST_SIZE     14
 
-    int ch; /* Used by getopt_long */
+/**
+ * Retransmit cookie: magic and cookie, the reply to a request without a valid cookie
+ */
+#define REPLAY_COOKIE_MAGIC    "URCK"
+#define REPLAY_COOKIE_SIZE     8
 
-    /* Command line arguments */
-    struct settings s;
+/**
+ * Seconds a retransmit cookie is valid for, and up to as long again
+ */
+#define REPLAY_COOKIE_SECONDS    60
 
-    struct statistics st;
+/**
+ * The maximum bytes sent again for one retransmit request, as a multiple of the request size
+ */
+#define REPLAY_AMPLIFICATION    4
 
-    time_t now;
+/**
+ * The maximum number of packets sent again for one retransmit request
+ */
+#define REPLAY_REQUEST_MAX    1024
 
-    int lsock; /* Listen socket */
-    int ssock; /* Send socket */
+/**
+ * The number of requests tracked for hedging
+ */
+#define HEDGE_REQUESTS    1024
 
-    struct sockaddr_in lsock_name; /* Listen socket name */
-    struct sockaddr_in ssock_name; /* Send socket name */
+/**
+ * The largest request kept to be sent again to the hedge address
+ */
+#define HEDGE_REQUEST_SIZE    2048
 
-    struct sockaddr_in caddr; /* Connect address */
+/**
+ * The largest request identifier, in bytes
+ */
+#define HEDGE_ID_MAX    8
 
-    /* Simplify inet_ntop usage in DEBUG() by reserving buffers to write output */
-    char print_buffer1[INET_ADDRSTRLEN];
-    char print_buffer2[INET_ADDRSTRLEN];
+/**
+ * The default request identifier, offset and length in bytes (the DNS message ID)
+ */
+#define HEDGE_ID    "0:2"
 
-    char network_buffer[NETWORK_BUFFER_SIZE]; /* The network buffer. All reads and writes happen here */
+/**
+ * The default reply latency percentile requests are hedged at
+ */
+#define HEDGE_PERCENTILE    95
 
-    struct pollfd ufds[2]; /* Poll file descriptors */
+/**
+ * The default share of requests that can be hedged, in percent
+ */
+#define HEDGE_BUDGET    5
 
-    struct sockaddr_in endpoint; /* Address where the current packet was received from */
-    struct sockaddr_in previous_endpoint; /* Address where the previous packet was received from */
+/**
+ * The number of hedges that can be sent back to back once the budget has built up
+ */
+#define HEDGE_BURST    10
 
-    unsigned char errno_ignore[MAX_ERRNO];
+/**
+ * Reply latency histogram buckets, 4 per power of 2 microseconds
+ */
+#define HEDGE_HISTOGRAM_BUCKETS    128
 
-    settings_initialize(&s);
-    statistics_initialize(&st);
+/**
+ * Reply latencies measured before the percentile is used, and between delay updates
+ */
+#define HEDGE_SAMPLES_MIN    32
 
-    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
-        switch (ch) {
-            case 'v': /* --verbose */
-                if (debug_level < DEBUG_LEVEL_VERBOSE) {
-                    debug_level = DEBUG_LEVEL_VERBOSE;
-                } else {
-                    debug_level = debug_level + 1;
-                }
+/**
+ * The histogram is halved once it holds this many latencies, so the delay follows recent replies
+ */
+#define HEDGE_SAMPLES_DECAY    4096
 
-                break;
-            case 'd': /* --debug */
-                debug_level = DEBUG_LEVEL_DEBUG;
+/**
+ * The hedging delay until enough reply latencies were measured, in microseconds
+ */
+#define HEDGE_DELAY_INITIAL_US    10000
 
-                break;
-            case 'a': /* --listen-address */
-                s.laddr = optarg;
+/**
+ * The shortest hedging delay, in microseconds
+ */
+#define HEDGE_DELAY_MIN_US    100
 
-                break;
-            case 'b': /* --listen-port */
-                s.lport = atoi(optarg);
-                if (errno != EOK) {
-                    perror("atoi");
-                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid listen port: %s (%d)", optarg, errno);
+/**
+ * The default seconds a subscriber stays subscribed without a keepalive
+ */
+#define PUBSUB_TIMEOUT    30
 
-                    exit(EXIT_FAILURE);
-                }
+/**
+ * The default maximum number of subscribers
+ */
+#define PUBSUB_MAX    65536
 
-                break;
-            case 'c': /* --listeninterface */
-                s.lif = optarg;
+/**
+ * Subscribers sent a feed packet per sendmmsg() call
+ */
+#define PUBSUB_BATCH    64
 
-                break;
-            case 'g': /* --connect-address */
-                s.caddr = optarg;
+/**
+ * The longest subscription token
+ */
+#define PUBSUB_TOKEN_MAX    64
 
-                break;
-            case 'h': /* --connect-host */
-                s.chost = optarg;
+/**
+ * The longest control datagram
+ */
+#define PUBSUB_CONTROL_SIZE    256
 
-                break;
+/**
+ * Control datagrams handled per main loop iteration
+ */
+#define PUBSUB_CONTROL_BUDGET    64
+
+/**
+ * The number of sources or prefixes the rate limiter counts, a power of 2
+ */
+#define RATE_LIMIT_ENTRIES    65536
+
+/**
+ * Slots probed for a source before it is left uncounted
+ */
+#define RATE_LIMIT_PROBES    16
+
+/**
+ * The maximum number of gossip peers
+ */
+#define GOSSIP_PEERS    16
+
+/**
+ * The default milliseconds between gossip messages
+ */
+#define GOSSIP_INTERVAL_MS    100
+
+/**
+ * Sources or prefixes per gossip message, the ones with the most new packets are sent first
+ */
+#define GOSSIP_ENTRIES    100
+
+/**
+ * Gossip message header size: magic, entry count, prefix length, padding and sequence number
+ */
+#define GOSSIP_HEADER_SIZE    16
+
+/**
+ * Gossip message entry size: source or prefix, second and packets
+ */
+#define GOSSIP_ENTRY_SIZE    12
+
+/**
+ * Gossip message authentication tag size, with --gossip-key
+ */
+#define GOSSIP_TAG_SIZE    8
+
+/**
+ * Gossip message magic
+ */
+#define GOSSIP_MAGIC    "URG2"
+
+/**
+ * The maximum number of --sk-lookup address and port ranges
+ */
+#define SK_LOOKUP_RANGES    64
+
+/**
+ * The maximum number of original destinations counted separately, the others are counted together
+ */
+#define DESTINATIONS_MAX    1024
+
+/**
+ * The size of the original destination table, a power of 2 at least twice DESTINATIONS_MAX
+ */
+#define DESTINATION_SLOTS    2048
+
+/**
+ * The number of busiest original destinations displayed with the statistics
+ */
+#define DESTINATION_DISPLAY    16
+
+/**
+ * The maximum number of file descriptors waited on by the main loop
+ */
+#define IO_MAX_FDS    8
+
+/**
+ * The name of an I/O backend, see IO_BACKEND
+ */
+#define IO_BACKEND_NAME(X)    (((X) == IO_BACKEND_EPOLL)?"epoll":"poll")
+
+/**
+ * The highest I/O backend available on this platform
+ */
+#ifdef __linux__
+#define IO_BACKEND_MAX    IO_BACKEND_EPOLL
+#else
+#define IO_BACKEND_MAX    IO_BACKEND_POLL
+#endif
+
+/**
+ * Calibration: how long each strategy is measured, the packets in flight and their size
+ */
+#define CALIBRATE_DURATION_MS    100
+#define CALIBRATE_WINDOW         32
+#define CALIBRATE_PACKET_SIZE    64
+
+/**
+ * Calibration: throughput differences below this fraction are considered noise
+ */
+#define CALIBRATE_NOISE    0.05
+
+/**
+ * The default calibration cache file, in a directory only root can write to
+ */
+#define CALIBRATE_CACHE    "/var/cache/udp-redirect.calibrate"
+
+/**
+ * The number of flow queues of the FQ-CoDel egress queue
+ */
+#define EGRESS_FLOWS    64
+
+/**
+ * The bytes a flow sends per round of the FQ-CoDel egress queue, and the backlog below which CoDel does not drop
+ */
+#define EGRESS_QUANTUM    1514
+
+/**
+ * The default number of packets an egress queue holds
+ */
+#define EGRESS_LIMIT    1024
+
+/**
+ * The default CoDel target sojourn time, in microseconds
+ */
+#define CODEL_TARGET_US    5000
+
+/**
+ * The default CoDel interval, in microseconds
+ */
+#define CODEL_INTERVAL_US    100000
+
+/**
+ * Egress queue sojourn time histogram buckets, the first below 125us, doubling up to 128ms and above
+ */
+#define EGRESS_SOJOURN_BUCKETS    12
+
+/**
+ * ECN codepoints, the low two bits of the IPv4 TOS byte
+ */
+#define ECN_MASK        0x03
+#define ECN_NOT_ECT     0x00
+#define ECN_ECT1        0x01
+#define ECN_ECT0        0x02
+#define ECN_CE          0x03
+
+/**
+ * The maximum number of CPUs considered for automatic thread placement
+ */
+#define AFFINITY_MAX_CPUS    1024
+
+/**
+ * eBPF instruction classes, operations and modes used by the packet program interpreter
+ */
+#define EBPF_CLASS_LD       0x00
+#define EBPF_CLASS_LDX      0x01
+#define EBPF_CLASS_ST       0x02
+#define EBPF_CLASS_STX      0x03
+#define EBPF_CLASS_ALU      0x04
+#define EBPF_CLASS_JMP      0x05
+#define EBPF_CLASS_JMP32    0x06
+#define EBPF_CLASS_ALU64    0x07
+
+#define EBPF_SRC_X          0x08
+#define EBPF_MODE_MEM       0x60
+
+#define EBPF_OP_ADD         0x00
+#define EBPF_OP_SUB         0x10
+#define EBPF_OP_MUL         0x20
+#define EBPF_OP_DIV         0x30
+#define EBPF_OP_OR          0x40
+#define EBPF_OP_AND         0x50
+#define EBPF_OP_LSH         0x60
+#define EBPF_OP_RSH         0x70
+#define EBPF_OP_NEG         0x80
+#define EBPF_OP_MOD         0x90
+#define EBPF_OP_XOR         0xa0
+#define EBPF_OP_MOV         0xb0
+#define EBPF_OP_ARSH        0xc0
+#define EBPF_OP_END         0xd0
+
+#define EBPF_OP_JA          0x00
+#define EBPF_OP_JEQ         0x10
+#define EBPF_OP_JGT         0x20
+#define EBPF_OP_JGE         0x30
+#define EBPF_OP_JSET        0x40
+#define EBPF_OP_JNE         0x50
+#define EBPF_OP_JSGT        0x60
+#define EBPF_OP_JSGE        0x70
+#define EBPF_OP_JLT         0xa0
+#define EBPF_OP_JLE         0xb0
+#define EBPF_OP_JSLT        0xc0
+#define EBPF_OP_JSLE        0xd0
+
+#define EBPF_OPCODE_LDDW    0x18
+#define EBPF_OPCODE_JA      0x05
+#define EBPF_OPCODE_CALL    0x85
+#define EBPF_OPCODE_EXIT    0x95
+
+/**
+ * @brief Readability: errno value for OK.
+ */
+#define EOK 0
+
+/**
+  * Maximum known errno, used to ignore harmless sendto / recvfrom errors
+  */
+#define MAX_ERRNO 256
+
+/**
+  * Initialize errno ignore set
+  */
+#define ERRNO_IGNORE_INIT(X)   memset((X), 0, MAX_ERRNO * sizeof(unsigned char))
+
+/**
+  * Set errno ignore boolean for a specific errno
+  */
+#define ERRNO_IGNORE_SET(X, Y) if ((Y) >= 0 && (Y) < MAX_ERRNO) (X)[(Y)] = 1
+
+/**
+  * Check if errno is in declared set
+  */
+#define ERRNO_IGNORE_CHECK(X, Y) ((Y) >= 0 && (Y) < MAX_ERRNO && (X)[(Y)] == 1)
+
+/**
+ * @brief The available debug levels.
+ */
+enum DEBUG_LEVEL {
+    DEBUG_LEVEL_ERROR = 0,      ///< Error messages
+    DEBUG_LEVEL_INFO = 1,       ///< Informational messages
+    DEBUG_LEVEL_VERBOSE = 2,    ///< Verbose messages
+    DEBUG_LEVEL_DEBUG = 3       ///< Debug messages
+};
+
+/**
+ * @brief The helpers available to packet programs, called with the eBPF call instruction.
+ */
+enum PROGRAM_HELPER {
+    PROGRAM_HELPER_COUNTER_ADD = 1,     ///< counter_add(index, value): add to a counter, return the new value
+    PROGRAM_HELPER_COUNTER_GET = 2,     ///< counter_get(index): return a counter value
+    PROGRAM_HELPER_SET_LENGTH = 3,      ///< set_length(length): truncate or extend the packet, return 0 or -1
+    PROGRAM_HELPER_SET_DESTINATION = 4, ///< set_destination(address, port): send the packet to address (network order), port
+    PROGRAM_HELPER_SOURCE = 5,          ///< source(): return the packet source as address (network order) << 16 | port
+    PROGRAM_HELPER_DESTINATION = 6,     ///< destination(): return the original destination as address (network order) << 16 | port, 0 if unknown
+    PROGRAM_HELPER_MAX = 6              ///< The highest helper number
+};
+
+/**
+ * @brief The packet direction, also passed to packet programs.
+ */
+enum PACKET_DIRECTION {
+    PACKET_DIRECTION_LISTEN = 0,        ///< Received by the listener, sent to the connect address
+    PACKET_DIRECTION_CONNECT = 1        ///< Received from the connect address, sent to the listener endpoint
+};
+
+/**
+ * @brief What to do with a packet once transformed.
+ */
+enum PACKET_VERDICT {
+    PACKET_VERDICT_FORWARD = 0,         ///< Check the source and send the packet
+    PACKET_VERDICT_DROP_ADMISSION = 1,  ///< Invalid admission tag
+    PACKET_VERDICT_DROP_TUNNEL = 2,     ///< Tunnel authentication failed
+    PACKET_VERDICT_DROP_PROXY = 3,      ///< Invalid PROXY header
+    PACKET_VERDICT_DROP_PROGRAM = 4,    ///< Dropped by the packet program
+    PACKET_VERDICT_DROP_SIZE = 5        ///< No room left for the headers to add
+};
+
+/**
+ * @brief Queues for packets waiting for room in the socket send buffer.
+ */
+enum EGRESS_QUEUE {
+    EGRESS_QUEUE_NONE = 0,              ///< Packets are dropped when the send buffer is full
+    EGRESS_QUEUE_CODEL = 1,             ///< One CoDel queue
+    EGRESS_QUEUE_FQ_CODEL = 2           ///< CoDel queues per flow, served round robin
+};
+
+/**
+ * @brief The FQ-CoDel list a flow queue is on.
+ */
+enum EGRESS_LIST {
+    EGRESS_LIST_NEW = 0,                ///< Flows that just became active, served first
+    EGRESS_LIST_OLD = 1,                ///< Flows that used their quantum
+    EGRESS_LIST_NONE = 2                ///< Flows without packets
+};
+
+/**
+ * @brief How the main loop waits for readable sockets.
+ */
+enum IO_BACKEND {
+    IO_BACKEND_POLL = 0,                ///< poll()
+    IO_BACKEND_EPOLL = 1                ///< epoll, Linux only
+};
+
+/**
+ * @brief Command line options without a short option character.
+ */
+enum OPTION {
+    OPTION_IO_BACKEND = 256,            ///< --io-backend
+    OPTION_BUSY_POLL,                   ///< --busy-poll
+    OPTION_CALIBRATE,                   ///< --calibrate
+    OPTION_CALIBRATE_CACHE,             ///< --calibrate-cache
+    OPTION_HEDGE_ADDRESS,               ///< --hedge-address
+    OPTION_HEDGE_PORT,                  ///< --hedge-port
+    OPTION_HEDGE_PERCENTILE,            ///< --hedge-percentile
+    OPTION_HEDGE_BUDGET,                ///< --hedge-budget
+    OPTION_HEDGE_ID,                    ///< --hedge-id
+    OPTION_EGRESS_QUEUE,                ///< --egress-queue
+    OPTION_EGRESS_QUEUE_LIMIT,          ///< --egress-queue-limit
+    OPTION_CODEL_TARGET,                ///< --codel-target
+    OPTION_CODEL_INTERVAL,              ///< --codel-interval
+    OPTION_SUBSCRIBE_PORT,              ///< --subscribe-port
+    OPTION_SUBSCRIBE_TOKEN,             ///< --subscribe-token
+    OPTION_SUBSCRIBE_TIMEOUT,           ///< --subscribe-timeout
+    OPTION_SUBSCRIBE_MAX,               ///< --subscribe-max
+    OPTION_SK_LOOKUP,                   ///< --sk-lookup
+    OPTION_RATE_LIMIT,                  ///< --rate-limit
+    OPTION_RATE_LIMIT_PREFIX,           ///< --rate-limit-prefix
+    OPTION_GOSSIP_PORT,                 ///< --gossip-port
+    OPTION_GOSSIP_PEER,                 ///< --gossip-peer
+    OPTION_GOSSIP_INTERVAL,             ///< --gossip-interval
+    OPTION_GOSSIP_KEY                   ///< --gossip-key
+};
+
+/**
+ * Standard debug macro requiring a locally defined debug level.
+ * Adapted from the excellent https://github.com/jleffler/soq/blob/master/src/libsoq/debug.h
+ *
+ * Note that __VA_ARGS__ is a GCC extension; used for convenience to support DEBUG without format arguments.
+ */
+#define DEBUG(debug_level_local, debug_level_message, fmt, ...) \
+        do { \
+            if ((debug_level_local) >= (debug_level_message)) { \
+                fprintf(stderr, "%s:%d:%d:%s(): " fmt "\n", __FILE__, \
+                    __LINE__, (int)(time(NULL)), __func__, ##__VA_ARGS__); \
+            } \
+        } while (0)
+
+/**
+ * Command line options.
+ */
+static struct option longopts[] = {
+    { "verbose",               no_argument,            NULL,           'v' }, ///< Verbose mode, can be specified multiple times (optional)
+    { "debug",                 no_argument,            NULL,           'd' }, ///< Debug mode (optional)
+
+    { "listen-address",        required_argument,      NULL,           'a' }, ///< Listen address (optional)
+    { "listen-port",           required_argument,      NULL,           'b' }, ///< Listen port (required)
+    { "listen-interface",      required_argument,      NULL,           'c' }, ///< Listen interface (optional)
+
+    { "connect-address",       required_argument,      NULL,           'g' }, ///< Connect address (required)
+    { "connect-host",          required_argument,      NULL,           'h' }, ///< Connect host (required)
+    { "connect-port",          required_argument,      NULL,           'i' }, ///< Connect port (required)
+
+    { "send-address",          required_argument,      NULL,           'm' }, ///< Send packets address (optional)
+    { "send-port",             required_argument,      NULL,           'n' }, ///< Send packets port (optional)
+    { "send-interface",        required_argument,      NULL,           'o' }, ///< Send packets interface (optional)
+    { "send-interface-failover",required_argument,     NULL,           'L' }, ///< Send packets interface when the send interface is down or has no route
+
+    { "listen-address-strict", no_argument,            NULL,           'x' }, ///< Listener only receives packets from the same endpoint
+    { "connect-address-strict",no_argument,            NULL,           'y' }, ///< Sender only receives packets from the connect address
+
+    { "listen-sender-address", required_argument,      NULL,           'k' }, ///< Connect expects packets from this source address
+    { "listen-sender-port",    required_argument,      NULL,           'l' }, ///< Connect expects packets from this source port
+
+    { "listen-admission-key",  required_argument,      NULL,           'A' }, ///< Verify and strip admission tags on packets received by the listener
+    { "connect-admission-key", required_argument,      NULL,           'B' }, ///< Append admission tags on packets sent to the connect address
+    { "admission-epoch",       required_argument,      NULL,           'C' }, ///< Admission key rotation epoch in seconds
+
+    { "connect-proxy-protocol",no_argument,            NULL,           'E' }, ///< Prepend a PROXY v2 header to packets sent to the connect address
+
+    { "listen-tunnel-key",     required_argument,      NULL,           'F' }, ///< Decrypt packets received by the listener, encrypt packets sent to it
+    { "connect-tunnel-key",    required_argument,      NULL,           'G' }, ///< Encrypt packets sent to the connect address, decrypt packets received from it
+
+    { "packet-program",        required_argument,      NULL,           'D' }, ///< Run an eBPF packet program on every forwarded packet
+
+    { "query-cache",           required_argument,      NULL,           'S' }, ///< Answer queries matching a prefix from a cache of upstream responses
+    { "query-cache-ttl",       required_argument,      NULL,           'T' }, ///< Query cache time to live in milliseconds
+    { "query-challenge",       required_argument,      NULL,           'U' }, ///< Upstream responses with this prefix are challenges, never cached
+
+    { "replay-buffer",         required_argument,      NULL,           'V' }, ///< Keep packets from the connect address for retransmit requests (seconds)
+    { "replay-slots",          required_argument,      NULL,           'W' }, ///< Packets kept per replay stream
+    { "replay-sequence-offset",required_argument,      NULL,           'X' }, ///< Offset of the 32 bit sequence number in the payload
+    { "replay-stream-offset",  required_argument,      NULL,           'Y' }, ///< Offset of the 32 bit stream identifier in the payload
+
+    { "hedge-address",         required_argument,      NULL,           OPTION_HEDGE_ADDRESS }, ///< Send requests not answered in time to this address too
+    { "hedge-port",            required_argument,      NULL,           OPTION_HEDGE_PORT }, ///< Hedge port
+    { "hedge-percentile",      required_argument,      NULL,           OPTION_HEDGE_PERCENTILE }, ///< Reply latency percentile requests are hedged at
+    { "hedge-budget",          required_argument,      NULL,           OPTION_HEDGE_BUDGET }, ///< Share of requests that can be hedged, in percent
+    { "hedge-id",              required_argument,      NULL,           OPTION_HEDGE_ID }, ///< Request identifier, <offset>:<length> in bytes
+
+    { "egress-queue",          required_argument,      NULL,           OPTION_EGRESS_QUEUE }, ///< Queue packets while the send buffer is full, codel or fq-codel
+    { "egress-queue-limit",    required_argument,      NULL,           OPTION_EGRESS_QUEUE_LIMIT }, ///< Packets held per egress queue
+    { "codel-target",          required_argument,      NULL,           OPTION_CODEL_TARGET }, ///< CoDel target sojourn time (microseconds)
+    { "codel-interval",        required_argument,      NULL,           OPTION_CODEL_INTERVAL }, ///< CoDel interval (microseconds)
+
+    { "rate-limit",            required_argument,      NULL,           OPTION_RATE_LIMIT }, ///< Packets per second each source or prefix may send, across the cluster
+    { "rate-limit-prefix",     required_argument,      NULL,           OPTION_RATE_LIMIT_PREFIX }, ///< Count sources by prefix of this length
+    { "gossip-port",           required_argument,      NULL,           OPTION_GOSSIP_PORT }, ///< Exchange rate limit counts with the peers on this port
+    { "gossip-peer",           required_argument,      NULL,           OPTION_GOSSIP_PEER }, ///< A peer, <address>:<port>, repeatable
+    { "gossip-interval",       required_argument,      NULL,           OPTION_GOSSIP_INTERVAL }, ///< Milliseconds between gossip messages
+    { "gossip-key",            required_argument,      NULL,           OPTION_GOSSIP_KEY }, ///< Authenticate gossip messages
+
+    { "subscribe-port",        required_argument,      NULL,           OPTION_SUBSCRIBE_PORT }, ///< Replicate packets from the connect address to the subscribers of this control port
+    { "subscribe-token",       required_argument,      NULL,           OPTION_SUBSCRIBE_TOKEN }, ///< Token required to subscribe
+    { "subscribe-timeout",     required_argument,      NULL,           OPTION_SUBSCRIBE_TIMEOUT }, ///< Subscribers expire without a keepalive (seconds)
+    { "subscribe-max",         required_argument,      NULL,           OPTION_SUBSCRIBE_MAX }, ///< Subscribers at most
+
+    { "ecn",                   no_argument,            NULL,           'M' }, ///< Forward the TOS (DSCP and ECN codepoint) of received packets
+    { "ecn-ce-threshold",      required_argument,      NULL,           'N' }, ///< Mark CE when a packet was held longer than this (microseconds)
+
+    { "budget-packets",        required_argument,      NULL,           'O' }, ///< Packets received per socket per loop iteration
+    { "budget-cpu",            required_argument,      NULL,           'P' }, ///< CPU share per direction, in percent of one CPU
+    { "budget-buffer",         required_argument,      NULL,           'Q' }, ///< Buffered bytes per direction
+    { "cpu-accounting",        no_argument,            NULL,           'R' }, ///< Measure the CPU time used per direction
+
+    { "io-backend",            required_argument,      NULL,           OPTION_IO_BACKEND }, ///< Wait for readable sockets with poll or epoll
+    { "busy-poll",             required_argument,      NULL,           OPTION_BUSY_POLL }, ///< Busy poll the sockets for this many microseconds
+    { "calibrate",             no_argument,            NULL,           OPTION_CALIBRATE }, ///< Measure and pick the fastest I/O strategy at startup
+    { "calibrate-cache",       required_argument,      NULL,           OPTION_CALIBRATE_CACHE }, ///< Calibration cache file
+
+    { "workers",               required_argument,      NULL,           'H' }, ///< Transform packets on worker threads
+
+    { "auto-affinity",         no_argument,            NULL,           'K' }, ///< Pin threads next to the interface queue interrupts
+
+    { "conntrack-bypass",      no_argument,            NULL,           'Z' }, ///< Install nftables notrack rules for the redirector traffic
+
+    { "sk-lookup",             required_argument,      NULL,           OPTION_SK_LOOKUP }, ///< Steer packets to these addresses and ports to the listen socket with BPF sk_lookup
+
+    { "reuseport",             no_argument,            NULL,           'I' }, ///< Join a SO_REUSEPORT group steered to its first socket
+    { "hot-standby",           required_argument,      NULL,           'J' }, ///< Take over from the primary process when it exits
+
+    { "ignore-errors",         no_argument,            NULL,           'r' }, ///< Ignore harmless recvfrom / sendto errors (default)
+    { "stop-errors",           no_argument,            NULL,           's' }, ///< Do NOT ignore harmless recvfrom / sendto errors
+
+    { "stats",                 no_argument,            NULL,           'q' }, ///< Display stats every 60 seconds
+
+    { "version",               no_argument,            NULL,           'z' }, ///< Display the version
+
+    { NULL,                    0,                      NULL,            0 }
+};
+
+#ifdef __linux__
+/**
+ * The nftables table installed by --conntrack-bypass and removed at exit, empty if none.
+ */
+static char conntrack_table[64];
+
+/**
+ * The signal that asked the redirector to exit, 0 if none.
+ */
+static volatile sig_atomic_t terminate_signal;
+#endif
+
+/**
+ * Store command line option values in one place.
+ */
+struct settings {
+    char *laddr;        ///< Listen address
+    int lport;          ///< Listen port
+    char *lif;          ///< Listen interface
+
+    char *caddr;        ///< Connect address
+    char *chost;        ///< Connect host
+    int cport;          ///< Connect port
+
+    char *saddr;        ///< Send packets from address
+    int sport;          ///< Send packets from port
+    char *sif;          ///< Send packets from interface
+    char *sif_failover; ///< Send packets from this interface when sif is down or has no route
+
+    int cproxy;         ///< Prepend PROXY v2 headers to packets sent to the connect address, route replies by header
+
+    int lstrict;        ///< Strict mode for listener (set endpoint on first packet arrival)
+    int cstrict;        ///< Strict mode for sender (only accept from caddr / cport)
+
+    char *lsaddr;       ///< Listen port expects packets from this address
+    int lsport;         ///< Listen port only expects packets from this port
+
+    char *lakey;        ///< Listen admission key (hex), verify and strip tags
+    char *cakey;        ///< Connect admission key (hex), append tags
+    int aepoch;         ///< Admission epoch in seconds
+
+    char *ltkey;        ///< Listen tunnel key (hex)
+    char *ctkey;        ///< Connect tunnel key (hex)
+
+    char *program;      ///< eBPF packet program file
+
+    char *query_cache[QUERY_CACHE_RULES]; ///< Query cache rules, <query prefix hex>:<response prefix hex>
+    int query_cache_count; ///< Number of query cache rules
+    int query_cache_ttl; ///< Query cache time to live in milliseconds
+    char *query_challenge; ///< Challenge response prefix (hex)
+
+    int replay_seconds; ///< Keep packets from the connect address this many seconds for retransmit requests, 0 to disable
+    int replay_slots;   ///< Packets kept per replay stream
+    int replay_sequence_offset; ///< Offset of the 32 bit big endian sequence number in the payload
+    int replay_stream_offset; ///< Offset of the 32 bit big endian stream identifier in the payload, -1 for a single stream
+
+    char *hedge_address; ///< Hedge address, requests not answered within the hedging delay are sent there too
+    int hedge_port;     ///< Hedge port, 0 for the connect port
+    int hedge_percentile; ///< Reply latency percentile requests are hedged at
+    int hedge_budget;   ///< Share of requests that can be hedged, in percent
+    char *hedge_id;     ///< Request identifier in requests and replies, <offset>:<length> in bytes
+
+    int rate_limit;     ///< Packets per second each source or prefix may send to the listener across the cluster, 0 to disable
+    int rate_limit_prefix; ///< Sources are counted by prefix of this length
+    int gossip_port;    ///< Port rate limit counts are exchanged with the peers on, 0 to count locally only
+    char *gossip_peers[GOSSIP_PEERS]; ///< The peers, <address>:<port>
+    int gossip_peer_count; ///< The number of peers
+    int gossip_interval; ///< Milliseconds between gossip messages
+    char *gossip_key;   ///< Gossip message authentication key, 32 hexadecimal characters, or NULL
+
+    int subscribe_port; ///< Control port subscribers subscribe to packets from the connect address on, 0 to disable
+    char *subscribe_token; ///< Token required to subscribe, or NULL
+    int subscribe_timeout; ///< Seconds a subscriber stays subscribed without a keepalive
+    int subscribe_max;  ///< Subscribers at most
+
+    int egress_queue;   ///< Queue packets while the socket send buffer is full, see EGRESS_QUEUE
+    int egress_limit;   ///< Packets held per egress queue
+    int codel_target;   ///< CoDel target sojourn time in microseconds
+    int codel_interval; ///< CoDel interval in microseconds
+
+    int ecn;            ///< Forward the TOS (DSCP and ECN codepoint) of received packets
+    int ecn_threshold;  ///< Mark CE on ECN capable packets held longer than this many microseconds, 0 to disable
+
+    int budget_packets; ///< Packets received per socket per loop iteration
+    int budget_cpu;     ///< CPU share per direction in percent of one CPU, 0 for no limit
+    int budget_buffer;  ///< Buffered bytes per direction (socket receive buffer, worker queue), 0 for no limit
+    int cpu_accounting; ///< Measure the CPU time used per direction
+
+    int io_backend;     ///< How the main loop waits for readable sockets, see IO_BACKEND
+    int busy_poll;      ///< Busy poll the sockets for this many microseconds, 0 to disable
+    int calibrate;      ///< Pick the I/O backend, packet budget and busy polling with a loopback self-test
+    char *calibrate_cache; ///< Calibration cache file
+
+    int workers;        ///< Number of worker threads, 0 to transform packets on the main thread
+
+    int affinity;       ///< Pin threads next to the listen / send interface queue interrupts
+
+    int conntrack_bypass; ///< Exempt the listen port and the connect address tuple from connection tracking
+
+    char *sk_lookup[SK_LOOKUP_RANGES]; ///< Address and port ranges steered to the listen socket, <address>/<prefix>:<port>[-<port>]
+    int sk_lookup_count; ///< The number of --sk-lookup ranges
+
+    int reuseport;      ///< Bind with SO_REUSEPORT, steering all packets to the first socket of the group
+    int standby;        ///< Primary process ID when running as hot standby, 0 otherwise
+
+    int eignore;        ///< Ignore most recvfrom / sendto errors
+
+    int stats;          ///< Display stats every 60 seconds
+};
+
+/**
+ * Store and display statistics
+ */
+struct statistics {
+    time_t time_display_last;
+    time_t time_display_first;
+
+    unsigned long count_listen_packet_receive;
+    unsigned long count_listen_byte_receive;
+
+    unsigned long count_listen_packet_send;
+    unsigned long count_listen_byte_send;
+
+    unsigned long count_connect_packet_receive;
+    unsigned long count_connect_byte_receive;
+
+    unsigned long count_connect_packet_send;
+    unsigned long count_connect_byte_send;
+
+    unsigned long count_listen_admission_drop;
+
+    unsigned long count_listen_tunnel_drop;
+    unsigned long count_connect_tunnel_drop;
+
+    unsigned long count_listen_program_drop;
+    unsigned long count_connect_program_drop;
+
+    unsigned long count_listen_ecn_ect0;
+    unsigned long count_listen_ecn_ect1;
+    unsigned long count_listen_ecn_ce;
+    unsigned long count_listen_ecn_ce_mark;
+    unsigned long count_connect_ecn_ect0;
+    unsigned long count_connect_ecn_ect1;
+    unsigned long count_connect_ecn_ce;
+    unsigned long count_connect_ecn_ce_mark;
+
+    unsigned long count_query_hit;
+    unsigned long count_query_miss;
+    unsigned long count_query_store;
+    unsigned long count_query_challenge;
+
+    unsigned long count_hedge_request;
+    unsigned long count_hedge_sent;
+    unsigned long count_hedge_won;
+    unsigned long count_hedge_budget;
+    unsigned long count_hedge_suppress;
+    uint64_t time_hedge_delay;      ///< The current hedging delay in nanoseconds
+
+    unsigned long count_listen_rate_drop;
+    unsigned long count_rate_untracked;
+    unsigned long count_gossip_send;
+    unsigned long count_gossip_receive;
+    unsigned long count_gossip_invalid;
+
+    unsigned long count_pubsub_subscribe;
+    unsigned long count_pubsub_unsubscribe;
+    unsigned long count_pubsub_expire;
+    unsigned long count_pubsub_deny;
+    unsigned long count_pubsub_full;
+    unsigned long count_pubsub_publish;
+    unsigned long count_pubsub_send;
+    unsigned long count_pubsub_drop;
+    unsigned long count_pubsub_subscribers; ///< The current number of subscribers
+
+    unsigned long count_listen_egress_queue;
+    unsigned long count_listen_egress_drop;
+    unsigned long count_listen_egress_mark;
+    unsigned long count_listen_egress_overflow;
+    unsigned long count_connect_egress_queue;
+    unsigned long count_connect_egress_drop;
+    unsigned long count_connect_egress_mark;
+    unsigned long count_connect_egress_overflow;
+
+    uint64_t time_listen_cpu;   ///< CPU nanoseconds spent on packets received by the listener
+    uint64_t time_connect_cpu;  ///< CPU nanoseconds spent on packets received from the connect address
+    unsigned long count_listen_budget_defer;
+    unsigned long count_connect_budget_defer;
+
+    unsigned long count_send_link_event;
+    unsigned long count_send_address_event;
+    unsigned long count_send_route_event;
+    unsigned long count_send_interface_switch;
+    uint64_t time_send_interface_switch; ///< Nanoseconds between the last route event and the send socket moving
+
+    unsigned long count_worker_packet;
+    unsigned long count_worker_depth_sum;
+    unsigned long count_worker_depth_samples;
+    unsigned long count_worker_depth_max;
+    uint64_t time_worker_queue;     ///< Nanoseconds between receive and a worker starting on the packet
+    uint64_t time_worker_process;   ///< Nanoseconds spent transforming the packet
+    uint64_t time_worker_reorder;   ///< Nanoseconds between the transform finishing and the packet being sent
+
+    unsigned long count_listen_packet_receive_total;
+    unsigned long count_listen_byte_receive_total;
+
+    unsigned long count_listen_packet_send_total;
+    unsigned long count_listen_byte_send_total;
+
+    unsigned long count_connect_packet_receive_total;
+    unsigned long count_connect_byte_receive_total;
+
+    unsigned long count_connect_packet_send_total;
+    unsigned long count_connect_byte_send_total;
+
+    unsigned long count_listen_admission_drop_total;
+
+    unsigned long count_listen_tunnel_drop_total;
+    unsigned long count_connect_tunnel_drop_total;
+
+    unsigned long count_listen_program_drop_total;
+    unsigned long count_connect_program_drop_total;
+
+    unsigned long count_listen_ecn_ect0_total;
+    unsigned long count_listen_ecn_ect1_total;
+    unsigned long count_listen_ecn_ce_total;
+    unsigned long count_listen_ecn_ce_mark_total;
+    unsigned long count_connect_ecn_ect0_total;
+    unsigned long count_connect_ecn_ect1_total;
+    unsigned long count_connect_ecn_ce_total;
+    unsigned long count_connect_ecn_ce_mark_total;
+
+    unsigned long count_query_hit_total;
+    unsigned long count_query_miss_total;
+    unsigned long count_query_store_total;
+    unsigned long count_query_challenge_total;
+
+    unsigned long count_hedge_request_total;
+    unsigned long count_hedge_sent_total;
+    unsigned long count_hedge_won_total;
+    unsigned long count_hedge_budget_total;
+    unsigned long count_hedge_suppress_total;
+
+    unsigned long count_listen_rate_drop_total;
+    unsigned long count_rate_untracked_total;
+    unsigned long count_gossip_send_total;
+    unsigned long count_gossip_receive_total;
+    unsigned long count_gossip_invalid_total;
+
+    unsigned long count_pubsub_subscribe_total;
+    unsigned long count_pubsub_unsubscribe_total;
+    unsigned long count_pubsub_expire_total;
+    unsigned long count_pubsub_deny_total;
+    unsigned long count_pubsub_full_total;
+    unsigned long count_pubsub_publish_total;
+    unsigned long count_pubsub_send_total;
+    unsigned long count_pubsub_drop_total;
+
+    unsigned long count_listen_egress_queue_total;
+    unsigned long count_listen_egress_drop_total;
+    unsigned long count_listen_egress_mark_total;
+    unsigned long count_listen_egress_overflow_total;
+    unsigned long count_connect_egress_queue_total;
+    unsigned long count_connect_egress_drop_total;
+    unsigned long count_connect_egress_mark_total;
+    unsigned long count_connect_egress_overflow_total;
+
+    uint64_t time_listen_cpu_total;
+    uint64_t time_connect_cpu_total;
+    unsigned long count_listen_budget_defer_total;
+    unsigned long count_connect_budget_defer_total;
+
+    unsigned long count_send_link_event_total;
+    unsigned long count_send_address_event_total;
+    unsigned long count_send_route_event_total;
+    unsigned long count_send_interface_switch_total;
+};
+
+/**
+ * Stateless admission tags: a truncated SipHash-2-4 of the payload, keyed by a key derived
+ * from the pre-shared key and the current time epoch.
+ */
+struct admission {
+    uint64_t key[2];            ///< The pre-shared key
+    int epoch_seconds;          ///< The epoch length in seconds
+    time_t epoch;               ///< The epoch the derived keys belong to
+    uint64_t epoch_key[3][2];   ///< Derived keys for the previous, current and next epoch
+};
+
+/**
+ * ChaCha20-Poly1305 tunnel between paired redirectors, with a replay window.
+ */
+struct tunnel {
+    unsigned char key[TUNNEL_KEY_SIZE]; ///< The pre-shared key
+    uint32_t send_direction;    ///< Nonce prefix for packets sent
+    uint32_t receive_direction; ///< Nonce prefix expected on packets received
+    uint64_t send_counter;      ///< The next packet counter
+    uint64_t replay_top;        ///< The highest packet counter received
+    uint64_t replay_bitmap[TUNNEL_REPLAY_WORDS]; ///< The packet counters received within the window
+};
+
+/**
+ * A decoded eBPF instruction.
+ */
+struct program_instruction {
+    uint8_t opcode;             ///< The operation code
+    uint8_t dst;                ///< The destination register
+    uint8_t src;                ///< The source register
+    int16_t offset;             ///< The jump or memory offset
+    int32_t imm;                ///< The immediate value
+};
+
+/**
+ * A verified packet program and its counters.
+ */
+struct program {
+    struct program_instruction *instructions; ///< The instructions
+    int count;                  ///< The number of instructions
+    uint64_t counters[PROGRAM_COUNTERS]; ///< Counters updated by the program, displayed with --stats
+};
+
+/**
+ * The state a packet program can access while it runs.
+ */
+struct program_context {
+    struct program *program;    ///< The program
+    unsigned char *data;        ///< The packet
+    size_t length;              ///< The packet length, updated by set_length()
+    size_t capacity;            ///< The maximum packet length
+    int direction;              ///< The packet direction, see PACKET_DIRECTION
+    const struct sockaddr_in *source; ///< The packet source
+    const struct sockaddr_in *original_destination; ///< The address and port the packet was sent to, port 0 if unknown
+    struct sockaddr_in destination; ///< The destination set by set_destination()
+    int destination_set;        ///< Set if set_destination() was called
+    int error;                  ///< Set if the program was aborted
+};
+
+/**
+ * A query cache rule: queries starting with a prefix, answered by responses starting with a prefix.
+ */
+struct query_rule {
+    unsigned char query[QUERY_PREFIX_MAX]; ///< The query prefix
+    int query_length;           ///< The query prefix length
+    unsigned char response[QUERY_PREFIX_MAX]; ///< The response prefix
+    int response_length;        ///< The response prefix length
+    char *cached;               ///< The cached response
+    int cached_length;          ///< The cached response length, 0 if none
+    struct timespec cached_time; ///< When the response was cached
+    int query_min;              ///< The length of the query the cached response answered
+    int pending;                ///< Set while a query is forwarded upstream and not yet answered
+    int pending_length;         ///< The length of the forwarded query
+};
+
+/**
+ * The last challenge the upstream issued to a client.
+ */
+struct query_challenge {
+    struct sockaddr_in client;  ///< The client
+    unsigned char value[QUERY_PREFIX_MAX]; ///< The challenge, after the challenge prefix
+    int length;                 ///< The challenge length, 0 if the slot was never used
+    struct timespec time;       ///< When the challenge was issued
+};
+
+/**
+ * Responses to repeated queries (e.g., game server browser queries), answered without waking the
+ * upstream. Only the main thread updates the cache; the workers only match the prefixes.
+ */
+struct query_cache {
+    struct query_rule rules[QUERY_CACHE_RULES]; ///< The rules
+    int count;                  ///< The number of rules
+    int ttl_ms;                 ///< How long responses are served, in milliseconds
+    unsigned char challenge[QUERY_PREFIX_MAX]; ///< The challenge response prefix
+    int challenge_length;       ///< The challenge response prefix length, 0 if none
+    struct query_challenge *challenges; ///< The last challenge issued to each client, by hash
+};
+
+/**
+ * A packet kept in the replay buffer.
+ */
+struct replay_slot {
+    uint32_t sequence;          ///< The packet sequence number
+    int length;                 ///< The packet length, 0 if the slot was never used
+    struct timespec time;       ///< When the packet was sent
+};
+
+/**
+ * A sequenced stream of packets from the connect address, with its ring of recent packets.
+ */
+struct replay_stream {
+    uint32_t id;                ///< The stream identifier
+    struct replay_slot *slots;  ///< The ring, indexed by sequence number
+    char *data;                 ///< The packets, REPLAY_SLOT_SIZE bytes per slot
+    uint32_t next_sequence;     ///< The next sequence number expected
+    int started;                ///< Set once the first packet was received
+    unsigned long count_packet; ///< Packets received
+    unsigned long count_gap;    ///< Jumps forward in the sequence
+    unsigned long count_gap_missing; ///< Sequence numbers skipped by the jumps
+    unsigned long count_late;   ///< Packets older than the next sequence number expected
+    unsigned long count_oversize; ///< Packets too large to keep
+    unsigned long count_request; ///< Retransmit requests received
+    unsigned long count_challenge; ///< Retransmit requests answered with a cookie
+    unsigned long count_limited; ///< Packets requested but over the bytes allowed for the request
+    unsigned long count_resend; ///< Packets sent again
+    unsigned long count_unavailable; ///< Packets requested but no longer (or never) kept
+};
+
+/**
+ * Recent packets from the connect address, sent again on retransmit requests from the listener
+ * endpoint. Only the main thread updates it; the workers only read the offsets.
+ */
+struct replay {
+    struct replay_stream streams[REPLAY_STREAMS]; ///< The streams
+    int count;                  ///< The number of streams seen
+    int seconds;                ///< How long packets are kept
+    int slots;                  ///< Packets kept per stream
+    int sequence_offset;        ///< Offset of the sequence number in the payload
+    int stream_offset;          ///< Offset of the stream identifier in the payload, -1 for a single stream
+    uint64_t cookie_key[2];     ///< The key of the cookies requesters echo to prove they own their address
+};
+
+/**
+ * A request sent to the connect address, kept until it is answered or hedged and answered.
+ */
+struct hedge_request {
+    unsigned char id[HEDGE_ID_MAX]; ///< The request identifier
+    int length;                 ///< The request length, 0 if the slot is free
+    struct timespec sent;       ///< When the request was sent to the connect address
+    int hedged;                 ///< Set once the request was sent to the hedge address
+    int answered;               ///< Set once a reply to the hedged request was delivered
+    unsigned long sequence;     ///< Tells the slot users apart
+};
+
+/**
+ * A request waiting for its hedging deadline, in send order.
+ */
+struct hedge_pending {
+    int slot;                   ///< The request slot
+    unsigned long sequence;     ///< The request sequence, the entry is stale if the slot was reused
+};
+
+/**
+ * Hedged requests: requests not answered within a percentile of the recent reply latencies are
+ * sent to the hedge address too, the first reply is delivered. Only the main thread updates it;
+ * the workers only read the identifier offset and length.
+ */
+struct hedge {
+    struct sockaddr_in address; ///< The hedge address
+    int id_offset;              ///< The request identifier offset
+    int id_length;              ///< The request identifier length
+    int percentile;             ///< The reply latency percentile requests are hedged at
+    int budget;                 ///< Hedges earned per request, in hundredths
+    int tokens;                 ///< Hedges available, in hundredths
+    struct hedge_request *requests; ///< The requests, by identifier hash
+    char *data;                 ///< The requests as sent, HEDGE_REQUEST_SIZE bytes per slot
+    struct hedge_pending *pending; ///< The ring of requests waiting for their deadline
+    unsigned long head;         ///< The oldest pending request
+    unsigned long tail;         ///< The next pending request
+    unsigned long sequence;     ///< The last request sequence
+    unsigned long histogram[HEDGE_HISTOGRAM_BUCKETS]; ///< Reply latencies from the connect address
+    unsigned long samples;      ///< The number of latencies in the histogram
+    unsigned long samples_update; ///< Latencies measured since the delay was updated
+    uint64_t delay_ns;          ///< The hedging delay
+};
+
+/**
+ * The packets a source or prefix sent in the current and previous second, allowed by this node and by the peers.
+ */
+struct rate_entry {
+    uint32_t key;               ///< The source address masked to the prefix, network byte order
+    uint32_t window;            ///< The second the current counts are for, 0 if the entry is free
+    uint32_t local[2];          ///< Packets allowed by this node in the current and previous second
+    uint32_t remote[2];         ///< Packets allowed by the peers in the current and previous second
+    uint32_t reported[2];       ///< Packets of the current and previous second already gossiped
+    int dirty;                  ///< Set while on the list of entries with packets to gossip
+};
+
+/**
+ * Rate limiting shared by the nodes of a cluster: every node counts the packets it allows per
+ * source or prefix, gossips the new counts to its peers and enforces the limit on the sum, with
+ * a sliding window over the current and previous second. Only used by the main thread.
+ */
+struct rate_limit {
+    uint32_t limit;             ///< Packets per second per source or prefix
+    uint32_t mask;              ///< The prefix mask, network byte order
+    int prefix;                 ///< The prefix length
+    struct rate_entry *entries; ///< The sources or prefixes, by hash
+    int *dirty;                 ///< The entries with packets to gossip
+    int dirty_count;            ///< The number of entries with packets to gossip
+    int sock;                   ///< The gossip socket, -1 without gossip
+    struct sockaddr_in peers[GOSSIP_PEERS]; ///< The peers
+    uint64_t peer_sequence[GOSSIP_PEERS]; ///< The sequence number of the last message accepted from each peer
+    int peer_count;             ///< The number of peers
+    uint64_t sequence;          ///< The sequence number of the last message sent
+    int interval_ms;            ///< Milliseconds between gossip messages
+    struct timespec gossip_next; ///< When the next gossip message is due
+    int keyed;                  ///< Set if gossip messages are authenticated
+    uint64_t key[2];            ///< The gossip message authentication key
+};
+
+/**
+ * An original destination of packets received by the listener.
+ */
+struct destination {
+    struct sockaddr_in address; ///< The address and port the packets were sent to
+    int sock;                   ///< The socket replies are sent from, bound to the address, -1 until needed, -2 if it cannot be opened
+    unsigned long packets;      ///< Packets received since the statistics were displayed
+    unsigned long bytes;        ///< Bytes received since the statistics were displayed
+    unsigned long packets_total; ///< Packets received
+    unsigned long bytes_total;  ///< Bytes received
+};
+
+/**
+ * The original destinations of packets received by the listener, with --sk-lookup. Only used by the main thread.
+ */
+struct destination_table {
+    struct destination *entries; ///< The destinations, the first count are used
+    int count;                  ///< The number of destinations
+    int *slots;                 ///< Destination index by address hash, -1 if the slot is free
+    unsigned long other_packets; ///< Packets to destinations beyond DESTINATIONS_MAX since the statistics were displayed
+    unsigned long other_packets_total; ///< Packets to destinations beyond DESTINATIONS_MAX
+};
+
+/**
+ * A subscriber of the packets from the connect address.
+ */
+struct pubsub_subscriber {
+    struct sockaddr_in address; ///< Where to send the packets
+    time_t expires;             ///< When the subscription ends without a keepalive
+    int slot;                   ///< The subscriber slot in the address table
+};
+
+/**
+ * Subscribers of the packets from the connect address. The subscribers are kept in a dense array,
+ * to replicate packets without gaps, and indexed by address in an open addressing table.
+ * Only used by the main thread.
+ */
+struct pubsub {
+    int sock;                   ///< The control socket, packets are also sent from it
+    struct sockaddr_in name;    ///< The control socket name
+    const char *token;          ///< The token required to subscribe, or NULL
+    size_t token_length;        ///< The token length
+    int timeout;                ///< Seconds a subscriber stays subscribed without a keepalive
+    int max;                    ///< Subscribers at most
+    uint64_t cookie_key[2];     ///< The key of the cookies subscribers echo to prove they own their address
+    struct pubsub_subscriber *subscribers; ///< The subscribers, the first count are used
+    int count;                  ///< The number of subscribers
+    int *table;                 ///< Subscriber index by address hash, -1 if the slot is free
+    unsigned int mask;          ///< The table size minus one, the table size is a power of 2
+    time_t sweep;               ///< When expired subscribers were last removed
+#ifdef __linux__
+    struct mmsghdr messages[PUBSUB_BATCH]; ///< The sendmmsg() batch
+#endif
+};
+
+/**
+ * A packet waiting in an egress queue.
+ */
+struct egress_packet {
+    struct egress_packet *next; ///< The next packet of the flow
+    struct sockaddr_in destination; ///< Where to send the packet
+    uint64_t enqueued;          ///< When the packet was queued, monotonic nanoseconds
+    int tos;                    ///< The TOS to send the packet with: the DSCP received and the ECN codepoint
+    int length;                 ///< The packet length
+    char data[];                ///< The packet
+};
+
+/**
+ * A flow queue and its CoDel state.
+ */
+struct egress_flow {
+    struct egress_packet *head; ///< The oldest packet
+    struct egress_packet *tail; ///< The newest packet
+    int packets;                ///< Packets queued
+    int bytes;                  ///< Bytes queued
+    int deficit;                ///< Bytes left in the current round, FQ-CoDel only
+    int list;                   ///< The list the flow is on, see EGRESS_LIST
+    int next;                   ///< The next flow on the list, -1 if last
+    uint64_t first_above;       ///< When the sojourn time will have been above target for an interval, 0 if below target
+    uint64_t drop_next;         ///< When the next packet is dropped while dropping
+    unsigned int count;         ///< Packets dropped since entering the dropping state
+    unsigned int lastcount;     ///< The drop count when the dropping state was last entered
+    int dropping;               ///< Set while in the dropping state
+};
+
+/**
+ * Packets waiting for room in the send buffer of the socket sending one direction, dropped
+ * (or marked CE) by CoDel once their sojourn time stays above target for an interval.
+ * Only used by the main thread.
+ */
+struct egress {
+    int mode;                   ///< The queue, see EGRESS_QUEUE
+    int limit;                  ///< Packets held at most
+    uint64_t target_ns;         ///< The CoDel target sojourn time
+    uint64_t interval_ns;       ///< The CoDel interval
+    struct egress_flow flows[EGRESS_FLOWS]; ///< The flow queues, only the first one without FQ
+    int head[2];                ///< The first flow of the new and old lists, -1 if empty
+    int tail[2];                ///< The last flow of the new and old lists
+    int packets;                ///< Packets queued in all flows
+    struct egress_packet *held; ///< A packet taken from the queue that did not fit the send buffer, sent first
+    unsigned long sojourn[EGRESS_SOJOURN_BUCKETS]; ///< Sojourn times of the packets sent
+};
+
+/**
+ * A packet being forwarded, and what was decided about it along the way.
+ */
+struct packet {
+    char buffer[NETWORK_BUFFER_HEADROOM + NETWORK_BUFFER_SIZE + NETWORK_BUFFER_TAILROOM]; ///< Packets are received after the headroom
+    char *payload;              ///< Start of the forwarded data, moves into the headroom when headers are prepended
+    int length;                 ///< The forwarded data length
+    int received_length;        ///< The length as received
+    int direction;              ///< The packet direction, see PACKET_DIRECTION
+    time_t now;                 ///< The receive time
+    struct sockaddr_in source;  ///< Where the packet was received from
+    struct sockaddr_in original_destination; ///< The address and port the packet was sent to, with --sk-lookup, port 0 if unknown
+    struct sockaddr_in destination; ///< The destination set by the packet program
+    int destination_set;        ///< Set if the packet program set the destination
+    struct sockaddr_in proxy_client; ///< The client named in the PROXY header of a reply
+    int proxy_client_set;       ///< Set if the reply had a PROXY header with an address
+    int tunnel_opened;          ///< Set if the packet was decrypted, the counter still needs the replay check
+    uint64_t tunnel_counter;    ///< The tunnel packet counter
+    int verdict;                ///< What to do with the packet, see PACKET_VERDICT
+    int query_rule;             ///< The query cache rule the packet matches, -1 if none
+    int replay_set;             ///< Set if the packet has a replay stream and sequence number
+    uint32_t replay_stream;     ///< The replay stream identifier
+    uint32_t replay_sequence;   ///< The replay sequence number
+    int replay_request;         ///< Set if the packet is a retransmit request
+    int hedge_set;              ///< Set if the packet has a hedging request identifier
+    unsigned char hedge_id[HEDGE_ID_MAX]; ///< The hedging request identifier
+    int ecn;                    ///< The ECN codepoint received, if ECN is enabled
+    int dscp;                   ///< The TOS received without the ECN codepoint, if ECN is enabled
+    struct timespec time_kernel; ///< When the kernel received the packet, monotonic, if CE marking is enabled
+    int time_kernel_set;        ///< Set if time_kernel is available
+    int done;                   ///< Set by the worker once the packet is transformed
+    int committed;              ///< Set once sent ahead of an earlier packet of another flow still being transformed
+    struct timespec time_receive; ///< When the packet was queued
+    struct timespec time_start; ///< When a worker started on the packet
+    struct timespec time_done;  ///< When the worker finished the packet
+    uint64_t time_cpu;          ///< CPU nanoseconds the worker spent on the packet
+};
+
+/**
+ * The forwarding state shared by the main thread and the workers. Workers only read it, except
+ * for the tunnel send counters and program counters which are updated atomically.
+ */
+struct redirector {
+    int debug_level;            ///< The debug level to be used for the DEBUG() macro
+    const struct settings *s;   ///< The settings
+    struct statistics *st;      ///< The statistics, only updated by the main thread
+
+    int lsock;                  ///< Listen socket
+    int ssock;                  ///< Send socket
+
+    struct sockaddr_in lsock_name; ///< Listen socket name
+    struct sockaddr_in ssock_name; ///< Send socket name
+
+    struct sockaddr_in caddr;   ///< Connect address
+    struct sockaddr_in previous_endpoint; ///< Address where the previous packet was received from
+    struct sockaddr_in previous_destination; ///< Address the previous endpoint sent its last packet to, with --sk-lookup
+
+    unsigned char errno_ignore[MAX_ERRNO]; ///< Receive and send errors to ignore
+
+    struct timespec budget_window; ///< When the current CPU budget window started
+    uint64_t budget_cpu_used[2]; ///< CPU nanoseconds used by each direction in the current window
+
+    int ecn_tos[2];             ///< The TOS last set on the socket sending each direction, where per packet TOS is not available
+
+    struct egress egress[2];    ///< The egress queue of the socket sending each direction
+
+    struct admission ladmission; ///< Listen admission tag verification
+    struct admission cadmission; ///< Connect admission tag generation
+    uint64_t cadmission_source; ///< The source the connect address sees, bound into the admission tags: address << 16 | port, network byte order
+
+    struct tunnel ltunnel;      ///< Listen tunnel
+    struct tunnel ctunnel;      ///< Connect tunnel
+
+    struct program program;     ///< Packet program
+
+    struct query_cache query;   ///< Query cache
+
+    struct replay replay;       ///< Replay buffer
+
+    struct hedge hedge;         ///< Hedged requests
+
+    struct pubsub pubsub;       ///< Subscribers of the packets from the connect address
+
+    struct destination_table destinations; ///< Original destinations of packets received by the listener
+
+    struct rate_limit rate;     ///< Cluster wide rate limiting of packets received by the listener
+};
+
+/**
+ * CPUs chosen for the forwarding threads.
+ */
+struct affinity {
+    int count;                  ///< The number of CPUs chosen, 0 if none were found
+    int cpus[AFFINITY_MAX_CPUS]; ///< The main thread CPU, then the worker CPUs (used round robin)
+};
+
+/**
+ * Keeps the send socket on a usable interface as links, addresses and routes change.
+ */
+struct route_monitor {
+    int sock;                   ///< The rtnetlink socket, -1 if not monitoring
+    const char *interfaces[2];  ///< The send interface, then the failover interface (or NULL)
+    int active;                 ///< The interface the send socket is bound to
+};
+
+/**
+ * Connection tracking table size and drop counters.
+ */
+struct conntrack_statistics {
+    unsigned long entries;      ///< Connections tracked
+    unsigned long max;          ///< Connections tracked at most
+    unsigned long drop;         ///< Packets dropped, the table was full
+    unsigned long early_drop;   ///< Connections evicted to make room
+    unsigned long insert_failed; ///< Connections not inserted
+    unsigned long invalid;      ///< Packets not tracked, invalid
+};
+
+/**
+ * The I/O backend state. With epoll, the file descriptors and events last handed to the kernel.
+ */
+struct io {
+    int backend;                ///< The backend, see IO_BACKEND
+    int epfd;                   ///< The epoll instance, -1 if not used
+    int fds[IO_MAX_FDS];        ///< The registered file descriptors, by last poll index
+    short events[IO_MAX_FDS];   ///< The registered events, by last poll index
+    int count;                  ///< The number of registered file descriptors
+};
+
+/**
+ * A calibration load generator, sending packets through the strategy under test.
+ */
+struct calibrate_generator {
+    int sock;                   ///< The socket packets are sent from and return to
+    struct sockaddr_in target;  ///< Where packets are sent to
+    int stop;                   ///< Set when the measurement is over
+    unsigned long received;     ///< Packets returned
+    uint64_t latency;           ///< Nanoseconds packets took to return, summed
+};
+
+/**
+ * An I/O strategy and how it performed.
+ */
+struct calibrate_result {
+    int backend;                ///< The backend, see IO_BACKEND
+    int batch;                  ///< Packets received per loop iteration
+    int busy_poll;              ///< Busy poll time in microseconds
+    double pps;                 ///< Packets per second
+    double latency;             ///< Average latency in nanoseconds
+};
+
+struct worker_pool;
+
+/**
+ * A worker thread.
+ */
+struct worker {
+    pthread_t thread;           ///< The thread
+    int id;                     ///< The worker number
+    struct worker_pool *pool;   ///< The pool the worker belongs to
+    struct redirector *r;       ///< The forwarding state
+    struct admission ladmission; ///< Listen admission state, the per epoch key cache is per worker
+    struct admission cadmission; ///< Connect admission state, the per epoch key cache is per worker
+};
+
+/**
+ * Workers transforming packets out of a ring, the main thread sending them in ring order.
+ * Slots between commit and submit are owned by the workers, from claim onwards not yet started.
+ */
+struct worker_pool {
+    struct packet *packets;     ///< The ring of WORKER_QUEUE_SIZE packets
+    unsigned long submit;       ///< The next slot to receive into, written by the main thread
+    unsigned long claim;        ///< The next slot a worker takes
+    unsigned long commit;       ///< The next slot to send, written by the main thread
+    int sleeping;               ///< The number of workers waiting for packets
+    int notify;                 ///< Set once a worker wrote to the notification pipe
+    int notify_pipe[2];         ///< Wakes up the main thread when packets are transformed
+    unsigned long inflight_bytes[2]; ///< Bytes queued per direction, written by the main thread
+    pthread_mutex_t mutex;      ///< Protects the condition variable
+    pthread_cond_t cond;        ///< Signalled when packets are queued
+    struct worker *workers;     ///< The workers
+    int count;                  ///< The number of workers
+};
+
+/* Function prototypes */
+
+int socket_setup(const int debug_level, const char *desc, const char *xaddr, const int xport, const char *xif, const int reuseport, struct sockaddr_in *xsock_name);
+char *resolve_host(int debug_level, const char *host);
+int standby_pidfd_open(int debug_level, int pid);
+
+int hex_decode(const char *hex, unsigned char *out, size_t out_len);
+
+uint64_t siphash24(const uint64_t key[2], const unsigned char *data, size_t len);
+void admission_initialize(struct admission *a, const unsigned char *key, int epoch_seconds);
+void admission_epoch_update(struct admission *a, time_t now);
+size_t admission_tag_append(struct admission *a, unsigned char *data, size_t len, const struct sockaddr_in *source, time_t now);
+int admission_tag_verify(struct admission *a, unsigned char *data, size_t len, const struct sockaddr_in *source, time_t now);
+void admission_source_update(int debug_level, struct redirector *r, const char *ifname);
+
+void chacha20_block(const unsigned char *key, uint32_t counter, const unsigned char *nonce, unsigned char *out);
+void chacha20_xor(const unsigned char *key, const unsigned char *nonce, unsigned char *data, size_t len);
+void chacha20_poly1305_tag(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+        const unsigned char *data, size_t len, unsigned char *tag);
+void tunnel_initialize(struct tunnel *t, const unsigned char *key, uint32_t send_direction, uint32_t receive_direction);
+char *tunnel_seal(struct tunnel *t, char *packet, int *length);
+char *tunnel_open(struct tunnel *t, char *packet, int *length, uint64_t *counter);
+int tunnel_replay_check(struct tunnel *t, uint64_t counter);
+
+char *proxy_header_prepend(char *packet, const struct sockaddr_in *source, const struct sockaddr_in *destination);
+int proxy_header_parse(const char *packet, int length, struct sockaddr_in *source);
+
+int program_load(int debug_level, struct program *p, const unsigned char *code, size_t len);
+void program_load_file(int debug_level, struct program *p, const char *filename);
+uint64_t program_run(struct program_context *ctx);
+int program_packet(int debug_level, struct program *p, int direction, char *packet, int length,
+        const struct sockaddr_in *source, const struct sockaddr_in *original_destination, struct sockaddr_in *destination, int *destination_set);
+void program_statistics_display(int debug_level, const struct program *p);
+
+int redirector_receive(struct redirector *r, struct worker_pool *pool, struct packet *inline_packet, int direction, time_t now);
+void packet_transform(struct redirector *r, struct admission *ladmission, struct admission *cadmission, struct packet *p);
+void packet_commit(struct redirector *r, struct packet *p);
+
+int query_cache_initialize(struct query_cache *q, const struct settings *s);
+int query_cache_match(const struct query_cache *q, int direction, const char *payload, int length);
+int query_cache_lookup(struct query_cache *q, struct packet *p, const struct timespec *now);
+int query_cache_store(struct query_cache *q, const struct packet *p, const struct timespec *now);
+int query_cache_challenge(const struct query_cache *q, const struct packet *p);
+struct query_challenge *query_challenge_slot(const struct query_cache *q, const struct sockaddr_in *client);
+void query_challenge_record(struct query_cache *q, const struct packet *p, const struct sockaddr_in *client, const struct timespec *now);
+int query_challenge_check(const struct query_cache *q, const struct packet *p, const struct timespec *now);
+
+void replay_initialize(struct replay *rp, const struct settings *s);
+uint32_t replay_read32(const char *data);
+uint64_t replay_cookie(const struct replay *rp, const struct sockaddr_in *address, time_t epoch);
+void replay_classify(const struct replay *rp, struct packet *p);
+struct replay_stream *replay_stream_find(struct replay *rp, uint32_t id, int create);
+void replay_store(struct replay *rp, const struct packet *p, const struct timespec *now);
+int replay_serve(struct redirector *r, const struct packet *p, const struct timespec *now);
+void replay_statistics_display(int debug_level, const struct replay *rp);
+
+int hedge_initialize(struct hedge *h, const struct settings *s);
+void hedge_classify(const struct hedge *h, struct packet *p);
+int hedge_slot(const struct hedge *h, const unsigned char *id);
+void hedge_track(struct hedge *h, const struct packet *p, const struct timespec *now);
+int hedge_reply(struct hedge *h, struct statistics *st, const struct packet *p, const struct timespec *now);
+int hedge_bucket(uint64_t us);
+uint64_t hedge_bucket_limit(int bucket);
+void hedge_latency(struct hedge *h, struct statistics *st, uint64_t ns);
+int hedge_expire(struct redirector *r);
+
+int pubsub_initialize(struct pubsub *ps, const struct settings *s);
+unsigned int pubsub_hash(const struct sockaddr_in *address);
+unsigned int pubsub_slot(const struct pubsub *ps, const struct sockaddr_in *address);
+uint64_t pubsub_cookie(const struct pubsub *ps, const struct sockaddr_in *address, time_t epoch);
+int pubsub_token_check(const struct pubsub *ps, const char *token);
+int pubsub_subscribe(struct pubsub *ps, const struct sockaddr_in *address, time_t now);
+void pubsub_remove(struct pubsub *ps, int index);
+int pubsub_unsubscribe(struct pubsub *ps, const struct sockaddr_in *address);
+void pubsub_expire(struct pubsub *ps, struct statistics *st, time_t now);
+void pubsub_control(struct redirector *r, time_t now);
+void pubsub_publish(struct redirector *r, const struct packet *p);
+
+int rate_limit_initialize(struct rate_limit *rl, const struct settings *s);
+struct rate_entry *rate_limit_find(struct rate_limit *rl, uint32_t key, uint32_t window);
+void rate_limit_roll(struct rate_entry *e, uint32_t window);
+int rate_limit_allow(struct redirector *r, const struct sockaddr_in *source);
+int rate_gossip_compare(const void *a, const void *b);
+void rate_gossip_send(struct redirector *r);
+int rate_gossip_timer(struct redirector *r);
+void rate_gossip_receive(struct redirector *r);
+
+uint64_t thread_cpu_ns(void);
+uint64_t budget_window_update(struct redirector *r);
+int budget_exceeded(const struct redirector *r, const struct worker_pool *pool, int direction);
+void budget_account(struct redirector *r, int direction, uint64_t cpu);
+void redirector_drain(struct redirector *r, struct worker_pool *pool, struct packet *inline_packet, const int *readable, time_t now);
+
+void ecn_socket_setup(int debug_level, const char *desc, int xsock, int timestamp);
+int packet_receive(int xsock, struct packet *p);
+int packet_send(struct redirector *r, int xsock, int direction, const struct packet *p, const struct sockaddr_in *destination);
+int packet_transmit(struct redirector *r, int xsock, int direction, const char *payload, int length, int tos, const struct sockaddr_in *destination);
+
+void egress_initialize(struct egress *q, const struct settings *s);
+uint64_t egress_clock(void);
+int egress_pending(const struct egress *q);
+int egress_send(struct redirector *r, int xsock, int direction, const struct packet *p, int tos, const struct sockaddr_in *destination);
+void egress_enqueue(struct redirector *r, struct egress *q, int direction, const struct packet *p, int tos, const struct sockaddr_in *destination);
+struct egress_packet *egress_flow_pop(struct egress *q, struct egress_flow *f);
+void egress_list_push(struct egress *q, int list, int index);
+void egress_list_pop(struct egress *q, int list);
+int egress_drop(struct redirector *r, int direction, struct egress_packet *e);
+uint64_t codel_control_law(const struct egress *q, uint64_t t, unsigned int count);
+int codel_should_drop(struct egress *q, struct egress_flow *f, const struct egress_packet *e, uint64_t now);
+struct egress_packet *codel_dequeue(struct redirector *r, int direction, struct egress_flow *f, uint64_t now);
+struct egress_packet *egress_dequeue(struct redirector *r, int direction, uint64_t now);
+void egress_flush(struct redirector *r, int direction);
+void egress_statistics_display(int debug_level, const struct redirector *r);
+
+void worker_pool_initialize(struct worker_pool *pool, struct redirector *r, int count, const struct affinity *a);
+void *worker_main(void *arg);
+void worker_pool_submit(struct worker_pool *pool, struct redirector *r);
+void worker_pool_wake(struct worker_pool *pool);
+unsigned int worker_flow_bucket(const struct packet *p);
+void worker_pool_commit(struct worker_pool *pool, struct redirector *r);
+
+#ifdef __linux__
+int affinity_read(const char *path, char *buffer, size_t size);
+int affinity_parse_list(const char *list, cpu_set_t *set);
+int affinity_irq(int irq, cpu_set_t *set);
+void affinity_interface(int debug_level, const char *ifname, cpu_set_t *irq_cpus, cpu_set_t *node_cpus);
+void affinity_plan(int debug_level, const struct settings *s, struct affinity *a);
+void affinity_apply(int debug_level, pthread_t thread, int cpu);
+#endif
+
+#ifdef __linux__
+int conntrack_active(void);
+int conntrack_nft(int debug_level, const char *commands);
+void conntrack_bypass_install(int debug_level, const struct redirector *r);
+void conntrack_bypass_remove(void);
+void conntrack_signal(int signal);
+int conntrack_statistics_read(struct conntrack_statistics *c);
+void conntrack_statistics_display(int debug_level, const struct conntrack_statistics *start);
+#endif
+
+#ifdef __linux__
+void route_monitor_initialize(int debug_level, struct route_monitor *rm, const struct settings *s);
+int route_interface_usable(const char *ifname, const struct sockaddr_in *caddr);
+void route_monitor_update(int debug_level, struct route_monitor *rm, struct redirector *r, const struct timespec *event);
+void route_monitor_receive(int debug_level, struct route_monitor *rm, struct redirector *r);
+#endif
+
+int sk_lookup_parse(const char *range, uint32_t *address, int *prefix, int *port_min, int *port_max);
+#ifdef __linux__
+int sk_lookup_bpf(int cmd, union bpf_attr *attr);
+int sk_lookup_attach(int debug_level, const struct settings *s, int xsock);
+#endif
+void destination_table_initialize(struct destination_table *t);
+struct destination *destination_find(struct destination_table *t, const struct sockaddr_in *address);
+void destination_account(struct destination_table *t, const struct sockaddr_in *address, int length);
+int destination_reply_socket(struct redirector *r, const struct sockaddr_in *address);
+void destination_statistics_display(int debug_level, struct destination_table *t);
+
+void io_initialize(int debug_level, struct io *io, int backend);
+void io_close(struct io *io);
+int io_wait(struct io *io, struct pollfd *ufds, int nfds, int timeout);
+int io_busy_poll(int xsock, int busy_poll);
+
+void *calibrate_generator_main(void *arg);
+int calibrate_run(int debug_level, struct calibrate_result *c);
+void calibrate_key(char *key, size_t size);
+FILE *calibrate_cache_open(int debug_level, const char *path, int flags);
+void calibrate(int debug_level, struct settings *s);
+
+void settings_initialize(struct settings *s);
+void usage(const char *argv0, const char *message);
+
+void statistics_initialize(struct statistics *st);
+double int_to_human_value(double value);
+char int_to_human_char(double value);
+void statistics_display(int debug_level, const struct settings *s, struct statistics *st, time_t now);
+
+/**
+ * Main program function.
+ *
+ * @param[in] argc The count of arguments, including the program name.
+ * @param[in] argv The program arguments
+ * @return The program return code.
+ *
+ */
+int main(int argc, char *argv[]) {
+    /* Store debug level and program name */
+    int debug_level = DEBUG_LEVEL_ERROR;
+    char *argv0 = argv[0];
+
+    int ch; /* Used by getopt_long */
+
+    /* Command line arguments */
+    struct settings s;
+
+    struct statistics st;
+
+    time_t now;
+
+    struct redirector r; /* Forwarding state */
+
+    struct packet packet; /* The packet buffer when transforming packets on the main thread */
+
+    struct worker_pool pool; /* Workers transforming packets, if enabled */
+
+    struct affinity affinity; /* CPUs chosen for the forwarding threads */
+
+    struct pollfd ufds[7]; /* Poll file descriptors */
+    struct sockaddr_in gossip_name; /* Gossip socket name */
+
+    struct route_monitor route; /* Send interface link and route monitor */
+
+    struct io io; /* How the main loop waits for readable sockets */
+
+#ifdef __linux__
+    struct conntrack_statistics conntrack_start; /* Conntrack counters at startup */
+#endif
+
+    int standby_pidfd = -1; /* Becomes readable when the primary process exits */
+    struct timespec standby_promoted; /* When the primary process exited */
+    unsigned long standby_receive = 0; /* Listen packets received when promoted, to time the first one after */
+
+    settings_initialize(&s);
+    statistics_initialize(&st);
+
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'v': /* --verbose */
+                if (debug_level < DEBUG_LEVEL_VERBOSE) {
+                    debug_level = DEBUG_LEVEL_VERBOSE;
+                } else {
+                    debug_level = debug_level + 1;
+                }
+
+                break;
+            case 'd': /* --debug */
+                debug_level = DEBUG_LEVEL_DEBUG;
+
+                break;
+            case 'a': /* --listen-address */
+                s.laddr = optarg;
+
+                break;
+            case 'b': /* --listen-port */
+                s.lport = atoi(optarg);
+                if (errno != EOK) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid listen port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'c': /* --listeninterface */
+                s.lif = optarg;
+
+                break;
+            case 'g': /* --connect-address */
+                s.caddr = optarg;
+
+                break;
+            case 'h': /* --connect-host */
+                s.chost = optarg;
+
+                break;
             case 'i': /* --connect-port */
                 s.cport = atoi(optarg);
                 if (errno != EOK) {
                     perror("atoi");
-                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid connect port: %s (%d)", optarg, errno);
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid connect port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'm': /* --send-address */
+                s.saddr = optarg;
+
+                break;
+            case 'n': /* --send-port */
+                s.sport = atoi(optarg);
+                if (errno != EOK) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid send port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'o': /* --send-interface */
+                s.sif = optarg;
+
+                break;
+            case 'L': /* --send-interface-failover */
+                s.sif_failover = optarg;
+
+                break;
+            case 'x': /* --listen-address-strict */
+                s.lstrict = 1;
+
+                break;
+            case 'y': /* --connect-address-strict */
+                s.cstrict = 1;
+
+                break;
+            case 'k': /* --listen-sender-address */
+                s.lsaddr = optarg;
+
+                break;
+            case 'l': /* --listen-sender-port */
+                s.lsport = atoi(optarg);
+                if (errno != EOK) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid send port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'A': /* --listen-admission-key */
+                s.lakey = optarg;
+
+                break;
+            case 'B': /* --connect-admission-key */
+                s.cakey = optarg;
+
+                break;
+            case 'C': /* --admission-epoch */
+                s.aepoch = atoi(optarg);
+                if (errno != EOK || s.aepoch <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid admission epoch: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'E': /* --connect-proxy-protocol */
+                s.cproxy = 1;
+
+                break;
+            case 'F': /* --listen-tunnel-key */
+                s.ltkey = optarg;
+
+                break;
+            case 'G': /* --connect-tunnel-key */
+                s.ctkey = optarg;
+
+                break;
+            case 'D': /* --packet-program */
+                s.program = optarg;
+
+                break;
+            case 'K': /* --auto-affinity */
+                s.affinity = 1;
+
+                break;
+            case 'Z': /* --conntrack-bypass */
+                s.conntrack_bypass = 1;
+
+                break;
+            case 'I': /* --reuseport */
+                s.reuseport = 1;
+
+                break;
+            case 'J': /* --hot-standby */
+                s.standby = atoi(optarg);
+                if (errno != EOK || s.standby <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid primary process ID: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+                s.reuseport = 1;
+
+                break;
+            case 'M': /* --ecn */
+                s.ecn = 1;
+
+                break;
+            case 'N': /* --ecn-ce-threshold */
+                s.ecn_threshold = atoi(optarg);
+                if (errno != EOK || s.ecn_threshold <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid ECN CE threshold: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+                s.ecn = 1;
+
+                break;
+            case 'O': /* --budget-packets */
+                s.budget_packets = atoi(optarg);
+                if (errno != EOK || s.budget_packets <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid packet budget: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'P': /* --budget-cpu */
+                s.budget_cpu = atoi(optarg);
+                if (errno != EOK || s.budget_cpu <= 0 || s.budget_cpu > 100) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid CPU budget: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+                s.cpu_accounting = 1;
+
+                break;
+            case 'Q': /* --budget-buffer */
+                s.budget_buffer = atoi(optarg);
+                if (errno != EOK || s.budget_buffer <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid buffer budget: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'R': /* --cpu-accounting */
+                s.cpu_accounting = 1;
+
+                break;
+            case 'S': /* --query-cache */
+                if (s.query_cache_count == QUERY_CACHE_RULES) {
+                    usage(argv0, "Too many --query-cache rules");
+                }
+                s.query_cache[s.query_cache_count++] = optarg;
+
+                break;
+            case 'T': /* --query-cache-ttl */
+                s.query_cache_ttl = atoi(optarg);
+                if (errno != EOK || s.query_cache_ttl <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid query cache TTL: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'U': /* --query-challenge */
+                s.query_challenge = optarg;
+
+                break;
+            case 'V': /* --replay-buffer */
+                s.replay_seconds = atoi(optarg);
+                if (errno != EOK || s.replay_seconds <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid replay buffer: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'W': /* --replay-slots */
+                s.replay_slots = atoi(optarg);
+                if (errno != EOK || s.replay_slots <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid replay slots: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'X': /* --replay-sequence-offset */
+                s.replay_sequence_offset = atoi(optarg);
+                if (errno != EOK || s.replay_sequence_offset < 0 || s.replay_sequence_offset > UDP_PAYLOAD_MAX - 4) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid replay sequence offset: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'Y': /* --replay-stream-offset */
+                s.replay_stream_offset = atoi(optarg);
+                if (errno != EOK || s.replay_stream_offset < 0 || s.replay_stream_offset > UDP_PAYLOAD_MAX - 4) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid replay stream offset: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_IO_BACKEND: /* --io-backend */
+                if (strcmp(optarg, "poll") == 0) {
+                    s.io_backend = IO_BACKEND_POLL;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    s.io_backend = IO_BACKEND_EPOLL;
+                } else {
+                    usage(argv0, "Option --io-backend must be poll or epoll");
+                }
+
+                break;
+            case OPTION_BUSY_POLL: /* --busy-poll */
+                s.busy_poll = atoi(optarg);
+                if (errno != EOK || s.busy_poll <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid busy poll: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_CALIBRATE: /* --calibrate */
+                s.calibrate = 1;
+
+                break;
+            case OPTION_CALIBRATE_CACHE: /* --calibrate-cache */
+                s.calibrate_cache = optarg;
+
+                break;
+            case OPTION_HEDGE_ADDRESS: /* --hedge-address */
+                s.hedge_address = optarg;
+
+                break;
+            case OPTION_HEDGE_PORT: /* --hedge-port */
+                s.hedge_port = atoi(optarg);
+                if (errno != EOK || s.hedge_port <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid hedge port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_HEDGE_PERCENTILE: /* --hedge-percentile */
+                s.hedge_percentile = atoi(optarg);
+                if (errno != EOK || s.hedge_percentile <= 0 || s.hedge_percentile >= 100) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid hedge percentile: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_HEDGE_BUDGET: /* --hedge-budget */
+                s.hedge_budget = atoi(optarg);
+                if (errno != EOK || s.hedge_budget <= 0 || s.hedge_budget > 100) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid hedge budget: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_HEDGE_ID: /* --hedge-id */
+                s.hedge_id = optarg;
+
+                break;
+            case OPTION_EGRESS_QUEUE: /* --egress-queue */
+                if (strcmp(optarg, "codel") == 0) {
+                    s.egress_queue = EGRESS_QUEUE_CODEL;
+                } else if (strcmp(optarg, "fq-codel") == 0) {
+                    s.egress_queue = EGRESS_QUEUE_FQ_CODEL;
+                } else {
+                    usage(argv0, "Option --egress-queue must be codel or fq-codel");
+                }
+
+                break;
+            case OPTION_EGRESS_QUEUE_LIMIT: /* --egress-queue-limit */
+                s.egress_limit = atoi(optarg);
+                if (errno != EOK || s.egress_limit <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid egress queue limit: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_CODEL_TARGET: /* --codel-target */
+                s.codel_target = atoi(optarg);
+                if (errno != EOK || s.codel_target <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid CoDel target: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_CODEL_INTERVAL: /* --codel-interval */
+                s.codel_interval = atoi(optarg);
+                if (errno != EOK || s.codel_interval <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid CoDel interval: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_SUBSCRIBE_PORT: /* --subscribe-port */
+                s.subscribe_port = atoi(optarg);
+                if (errno != EOK || s.subscribe_port <= 0 || s.subscribe_port > 65535) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid subscribe port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_RATE_LIMIT: /* --rate-limit */
+                s.rate_limit = atoi(optarg);
+                if (errno != EOK || s.rate_limit <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid rate limit: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_RATE_LIMIT_PREFIX: /* --rate-limit-prefix */
+                s.rate_limit_prefix = atoi(optarg);
+                if (errno != EOK || s.rate_limit_prefix <= 0 || s.rate_limit_prefix > 32) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid rate limit prefix: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_GOSSIP_PORT: /* --gossip-port */
+                s.gossip_port = atoi(optarg);
+                if (errno != EOK || s.gossip_port <= 0 || s.gossip_port > 65535) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid gossip port: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_GOSSIP_PEER: /* --gossip-peer */
+                if (s.gossip_peer_count == GOSSIP_PEERS) {
+                    usage(argv0, "Too many --gossip-peer peers");
+                }
+                s.gossip_peers[s.gossip_peer_count++] = optarg;
+
+                break;
+            case OPTION_GOSSIP_INTERVAL: /* --gossip-interval */
+                s.gossip_interval = atoi(optarg);
+                if (errno != EOK || s.gossip_interval <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid gossip interval: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_GOSSIP_KEY: /* --gossip-key */
+                s.gossip_key = optarg;
+
+                break;
+            case OPTION_SK_LOOKUP: /* --sk-lookup */
+                if (s.sk_lookup_count == SK_LOOKUP_RANGES) {
+                    usage(argv0, "Too many --sk-lookup ranges");
+                }
+                s.sk_lookup[s.sk_lookup_count++] = optarg;
+
+                break;
+            case OPTION_SUBSCRIBE_TOKEN: /* --subscribe-token */
+                s.subscribe_token = optarg;
+
+                break;
+            case OPTION_SUBSCRIBE_TIMEOUT: /* --subscribe-timeout */
+                s.subscribe_timeout = atoi(optarg);
+                if (errno != EOK || s.subscribe_timeout <= 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid subscribe timeout: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case OPTION_SUBSCRIBE_MAX: /* --subscribe-max */
+                s.subscribe_max = atoi(optarg);
+                if (errno != EOK || s.subscribe_max <= 0 || s.subscribe_max > 16777216) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid subscribe max: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'H': /* --workers */
+                s.workers = atoi(optarg);
+                if (errno != EOK || s.workers < 0) {
+                    perror("atoi");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid workers: %s (%d)", optarg, errno);
+
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+            case 'r': /* --ignore-errors */
+                s.eignore = 1;
+
+                break;
+            case 's': /* --stop-errors */
+                s.eignore = 0;
+
+                break;
+            case 'q': /* --stats */
+                s.stats = 1;
+
+                break;
+            case 'z': /* --version */
+                fprintf(stderr, "udp-redirect v%s\n", UDP_REDIRECT_VERSION);
+                exit(EXIT_SUCCESS);
+
+                break;
+            default:
+                usage(argv0, NULL);
+                break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 0) {
+        usage(argv0, "Unknown argument");
+    }
+
+    if (s.lport == 0) {
+        usage(argv0, "Listen port not specified");
+    }
+
+    if (s.caddr == NULL && s.chost == NULL) {
+        usage(argv0, "Connect host or address not specified");
+    }
+
+    if (s.cport == 0) {
+        usage(argv0, "Connect port not specified");
+    }
+
+    if ((s.lsaddr != NULL && s.lsport == 0) ||
+            (s.lsaddr == NULL && s.lsport != 0)) {
+        usage(argv0, "Options --listen-sender-port and --list-sender-address must either both be specified or none");
+    }
+
+    /* Set strict mode if using lsport and csport */
+    if (s.lsaddr != NULL && s.lsport != 0) {
+        s.lstrict = 1;
+    }
+
+    if (s.lakey != NULL) {
+        unsigned char key[ADMISSION_KEY_SIZE];
+
+        if (hex_decode(s.lakey, key, sizeof(key)) != ADMISSION_KEY_SIZE) {
+            usage(argv0, "Option --listen-admission-key must be 32 hexadecimal characters");
+        }
+        admission_initialize(&r.ladmission, key, s.aepoch);
+    }
+
+    if (s.cakey != NULL) {
+        unsigned char key[ADMISSION_KEY_SIZE];
+
+        if (hex_decode(s.cakey, key, sizeof(key)) != ADMISSION_KEY_SIZE) {
+            usage(argv0, "Option --connect-admission-key must be 32 hexadecimal characters");
+        }
+        admission_initialize(&r.cadmission, key, s.aepoch);
+    }
+
+    if (s.ltkey != NULL) {
+        unsigned char key[TUNNEL_KEY_SIZE];
+
+        if (hex_decode(s.ltkey, key, sizeof(key)) != TUNNEL_KEY_SIZE) {
+            usage(argv0, "Option --listen-tunnel-key must be 64 hexadecimal characters");
+        }
+        tunnel_initialize(&r.ltunnel, key, TUNNEL_DIRECTION_LISTEN, TUNNEL_DIRECTION_CONNECT);
+    }
+
+    if (s.ctkey != NULL) {
+        unsigned char key[TUNNEL_KEY_SIZE];
+
+        if (hex_decode(s.ctkey, key, sizeof(key)) != TUNNEL_KEY_SIZE) {
+            usage(argv0, "Option --connect-tunnel-key must be 64 hexadecimal characters");
+        }
+        tunnel_initialize(&r.ctunnel, key, TUNNEL_DIRECTION_CONNECT, TUNNEL_DIRECTION_LISTEN);
+    }
+
+    if (s.program != NULL) {
+        program_load_file(debug_level, &r.program, s.program);
+    }
+
+    if (query_cache_initialize(&r.query, &s) == -1) {
+        usage(argv0, "Option --query-cache must be <query prefix>:<response prefix>, --query-challenge <prefix>, up to 32 bytes in hexadecimal");
+    }
+    if (s.query_cache_count > 0 && s.ltkey != NULL) {
+        usage(argv0, "Option --query-cache cannot be used with --listen-tunnel-key");
+    }
+
+    if (s.replay_seconds > 0 && s.ltkey != NULL) {
+        usage(argv0, "Option --replay-buffer cannot be used with --listen-tunnel-key");
+    }
+    replay_initialize(&r.replay, &s);
+
+    if (s.hedge_address != NULL && hedge_initialize(&r.hedge, &s) == -1) {
+        usage(argv0, "Option --hedge-address must be an IPv4 address, --hedge-id <offset>:<length> with a length of 1 to 8 bytes");
+    }
+
+    if ((s.rate_limit_prefix != 32 || s.gossip_port != 0 || s.gossip_peer_count > 0 || s.gossip_key != NULL ||
+                s.gossip_interval != GOSSIP_INTERVAL_MS) && s.rate_limit == 0) {
+        usage(argv0, "Options --rate-limit-prefix, --gossip-port, --gossip-peer, --gossip-interval and --gossip-key require --rate-limit");
+    }
+
+    if (s.gossip_peer_count > 0 && s.gossip_port == 0) {
+        usage(argv0, "Option --gossip-peer requires --gossip-port");
+    }
+
+    /* Peer addresses are easily spoofed, unauthenticated counts could blackhole any source */
+    if (s.gossip_peer_count > 0 && s.gossip_key == NULL) {
+        usage(argv0, "Option --gossip-peer requires --gossip-key");
+    }
+
+    if (s.rate_limit > 0 && rate_limit_initialize(&r.rate, &s) == -1) {
+        usage(argv0, "Option --gossip-peer must be <address>:<port>, --gossip-key 32 hexadecimal characters");
+    }
+
+    if (s.subscribe_port != 0 && pubsub_initialize(&r.pubsub, &s) == -1) {
+        usage(argv0, "Option --subscribe-token must be 1 to 64 printable characters without spaces");
+    }
+
+    if (s.sk_lookup_count > 0) {
+        uint32_t address;
+        int prefix, port_min, port_max;
+        int i;
+
+        for (i = 0; i < s.sk_lookup_count; i++) {
+            if (sk_lookup_parse(s.sk_lookup[i], &address, &prefix, &port_min, &port_max) == -1) {
+                usage(argv0, "Option --sk-lookup must be <address>[/<prefix>]:<port>[-<port>]");
+            }
+        }
+    }
+
+    if (s.subscribe_port == 0 && (s.subscribe_token != NULL || s.subscribe_timeout != PUBSUB_TIMEOUT || s.subscribe_max != PUBSUB_MAX)) {
+        usage(argv0, "Options --subscribe-token, --subscribe-timeout and --subscribe-max require --subscribe-port");
+    }
+
+#ifndef __linux__
+    if (s.standby != 0) {
+        usage(argv0, "Option --hot-standby is only supported on Linux");
+    }
+    if (s.affinity) {
+        usage(argv0, "Option --auto-affinity is only supported on Linux");
+    }
+    if (s.sif_failover != NULL) {
+        usage(argv0, "Option --send-interface-failover is only supported on Linux");
+    }
+    if (s.conntrack_bypass) {
+        usage(argv0, "Option --conntrack-bypass is only supported on Linux");
+    }
+    if (s.io_backend == IO_BACKEND_EPOLL) {
+        usage(argv0, "Option --io-backend epoll is only supported on Linux");
+    }
+    if (s.busy_poll > 0) {
+        usage(argv0, "Option --busy-poll is only supported on Linux");
+    }
+    if (s.sk_lookup_count > 0) {
+        usage(argv0, "Option --sk-lookup is only supported on Linux");
+    }
+#endif
+
+    /* Replaces --io-backend, --budget-packets and --busy-poll */
+    if (s.calibrate) {
+        calibrate(debug_level, &s);
+    }
+
+    if (s.sif_failover != NULL && s.sif == NULL) {
+        usage(argv0, "Option --send-interface-failover requires --send-interface");
+    }
+
+    if (s.affinity && s.lif == NULL && s.sif == NULL) {
+        usage(argv0, "Option --auto-affinity requires --listen-interface or --send-interface");
+    }
+
+    /* Resolve connect host if available */
+    if (s.chost != NULL) {
+        s.caddr = resolve_host(debug_level, s.chost);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "---- INFO ----");
+
+//    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Debug level: %d", debug_level);
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen address: %s", (s.laddr != NULL)?s.laddr:"ANY");
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen port: %d", s.lport);
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen interface: %s", (s.lif != NULL)?s.lif:"ANY");
+
+    if (s.chost != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect host: %s", s.chost);
+    }
+
+    if (s.caddr != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect address: %s", s.caddr);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect port: %d", s.cport);
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send address: %s", (s.saddr != NULL)?s.saddr:"ANY");
+    if (s.sport != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send port: %d", s.sport);
+    } else {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send port: %s", "ANY");
+    }
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send interface: %s", (s.sif != NULL)?s.sif:"ANY");
+    if (s.sif_failover != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send interface failover: %s", s.sif_failover);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect PROXY protocol: %s", s.cproxy?"ENABLED":"DISABLED");
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen strict: %s", s.cstrict?"ENABLED":"DISABLED");
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect strict: %s", s.lstrict?"ENABLED":"DISABLED");
+
+    if (s.lsaddr != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen only accepts packets from address: %s", s.lsaddr);
+    }
+    if (s.lsport != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen only accepts packets from port: %d", s.lsport);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen admission tags: %s", (s.lakey != NULL)?"ENABLED":"DISABLED");
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect admission tags: %s", (s.cakey != NULL)?"ENABLED":"DISABLED");
+    if (s.lakey != NULL || s.cakey != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Admission epoch: %d seconds", s.aepoch);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen tunnel: %s", (s.ltkey != NULL)?"ENABLED":"DISABLED");
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect tunnel: %s", (s.ctkey != NULL)?"ENABLED":"DISABLED");
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Packet program: %s", (s.program != NULL)?s.program:"DISABLED");
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Conntrack bypass: %s", s.conntrack_bypass?"ENABLED":"DISABLED");
+
+    if (s.sk_lookup_count > 0) {
+        int i;
+
+        for (i = 0; i < s.sk_lookup_count; i++) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Socket lookup range: %s", s.sk_lookup[i]);
+        }
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Reuse port: %s", s.reuseport?"ENABLED":"DISABLED");
+    if (s.standby != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Hot standby for process: %d", s.standby);
+    }
+
+    if (s.query_cache_count > 0) {
+        int i;
+
+        for (i = 0; i < s.query_cache_count; i++) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Query cache rule: %s", s.query_cache[i]);
+        }
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Query cache TTL: %dms", s.query_cache_ttl);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Query challenge: %s", (s.query_challenge != NULL)?s.query_challenge:"DISABLED");
+    }
+
+    if (s.replay_seconds > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Replay buffer: %d seconds, %d packets per stream", s.replay_seconds, s.replay_slots);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Replay sequence offset: %d", s.replay_sequence_offset);
+        if (s.replay_stream_offset >= 0) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Replay stream offset: %d", s.replay_stream_offset);
+        }
+    }
+
+    if (s.hedge_address != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Hedge address: %s", s.hedge_address);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Hedge port: %d", (s.hedge_port != 0)?s.hedge_port:s.cport);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Hedge delay: reply latency p%d, budget %d%% of requests", s.hedge_percentile, s.hedge_budget);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Hedge request identifier: %s", s.hedge_id);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "I/O backend: %s", IO_BACKEND_NAME(s.io_backend));
+    if (s.busy_poll > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Busy poll: %dus", s.busy_poll);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Packet budget: %d per socket per iteration", s.budget_packets);
+    if (s.budget_cpu > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "CPU budget: %d%% per direction", s.budget_cpu);
+    }
+    if (s.budget_buffer > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Buffer budget: %d bytes per direction", s.budget_buffer);
+    }
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "CPU accounting: %s", s.cpu_accounting?"ENABLED":"DISABLED");
+
+    if (s.rate_limit > 0) {
+        int i;
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Rate limit: %d packets per second per /%d", s.rate_limit, s.rate_limit_prefix);
+        if (s.gossip_port != 0) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Gossip port: %d, every %dms, %s", s.gossip_port, s.gossip_interval,
+                    (s.gossip_key != NULL)?"authenticated":"unauthenticated");
+        }
+        for (i = 0; i < s.gossip_peer_count; i++) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Gossip peer: %s", s.gossip_peers[i]);
+        }
+    } else {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Rate limit: %s", "DISABLED");
+    }
+
+    if (s.subscribe_port != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Subscribe port: %d", s.subscribe_port);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Subscribe token: %s", (s.subscribe_token != NULL)?"REQUIRED":"NONE");
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Subscribers: %d at most, expire after %d seconds", s.subscribe_max, s.subscribe_timeout);
+    }
+
+    if (s.egress_queue != EGRESS_QUEUE_NONE) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Egress queue: %s, %d packets", (s.egress_queue == EGRESS_QUEUE_FQ_CODEL)?"fq-codel":"codel", s.egress_limit);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "CoDel target: %dus, interval: %dus", s.codel_target, s.codel_interval);
+    } else {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Egress queue: %s", "DISABLED");
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "ECN: %s", s.ecn?"ENABLED":"DISABLED");
+    if (s.ecn_threshold > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "ECN CE threshold: %dus", s.ecn_threshold);
+    }
+
+    if (s.workers > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Workers: %d", s.workers);
+    } else {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Workers: %s", "DISABLED");
+    }
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Auto affinity: %s", s.affinity?"ENABLED":"DISABLED");
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Ignore errors: %s", s.eignore?"ENABLED":"DISABLED");
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Display stats: %s", s.stats?"ENABLED":"DISABLED");
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "---- START ----");
+
+    r.debug_level = debug_level;
+    r.s = &s;
+    r.st = &st;
+
+    /* Pin the main thread first, so the buffers allocated from now on are on its NUMA node */
+    affinity.count = 0;
+#ifdef __linux__
+    if (s.affinity) {
+        affinity_plan(debug_level, &s, &affinity);
+
+        if (affinity.count > 0) {
+            affinity_apply(debug_level, pthread_self(), affinity.cpus[0]);
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Auto affinity: main thread on CPU %d", affinity.cpus[0]);
+        } else {
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Auto affinity: no CPU found for the interfaces, threads are not pinned");
+        }
+    }
+#endif
+
+    /* Watch the primary before joining its group, so an exit in between is not missed */
+    if (s.standby != 0) {
+        standby_pidfd = standby_pidfd_open(debug_level, s.standby);
+    }
+
+    r.lsock = socket_setup(debug_level, "Listen", s.laddr, s.lport, s.lif, s.reuseport, &r.lsock_name); /* Set up listening socket */
+    r.ssock = socket_setup(debug_level, "Send", s.saddr, s.sport, s.sif, s.reuseport, &r.ssock_name); /* Set up send socket */
+#ifdef __linux__
+    /* Report the address and port each packet was sent to, then steer the ranges to the listen socket */
+    if (s.sk_lookup_count > 0) {
+        int enable = 1;
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen socket: receive original destination");
+        if (setsockopt(r.lsock, IPPROTO_IP, IP_RECVORIGDSTADDR, &enable, sizeof(enable)) == -1) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket IP_RECVORIGDSTADDR (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+
+        destination_table_initialize(&r.destinations);
+        sk_lookup_attach(debug_level, &s, r.lsock);
+    }
+#endif
+    memset(&r.previous_destination, 0, sizeof(r.previous_destination));
+    if (s.gossip_port != 0) {
+        r.rate.sock = socket_setup(debug_level, "Gossip", NULL, s.gossip_port, NULL, 0, &gossip_name); /* Set up gossip socket */
+    }
+    if (s.subscribe_port != 0) {
+        r.pubsub.sock = socket_setup(debug_level, "Subscribe", s.laddr, s.subscribe_port, s.lif, s.reuseport, &r.pubsub.name); /* Set up control socket */
+    }
+
+    if (s.ecn) {
+        ecn_socket_setup(debug_level, "Listen", r.lsock, s.ecn_threshold > 0);
+        ecn_socket_setup(debug_level, "Send", r.ssock, s.ecn_threshold > 0);
+    }
+    r.ecn_tos[PACKET_DIRECTION_LISTEN] = r.ecn_tos[PACKET_DIRECTION_CONNECT] = 0;
+
+    egress_initialize(&(r.egress[PACKET_DIRECTION_LISTEN]), &s);
+    egress_initialize(&(r.egress[PACKET_DIRECTION_CONNECT]), &s);
+
+    /* The kernel buffers packets for each direction in its socket receive buffer, cap it to the buffer budget */
+    if (s.budget_buffer > 0) {
+        if (setsockopt(r.lsock, SOL_SOCKET, SO_RCVBUF, &s.budget_buffer, sizeof(s.budget_buffer)) == -1 ||
+                setsockopt(r.ssock, SOL_SOCKET, SO_RCVBUF, &s.budget_buffer, sizeof(s.budget_buffer)) == -1) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_RCVBUF (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (s.busy_poll > 0) {
+        if (io_busy_poll(r.lsock, s.busy_poll) == -1 || io_busy_poll(r.ssock, s.busy_poll) == -1) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_BUSY_POLL (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &r.budget_window);
+    r.budget_cpu_used[PACKET_DIRECTION_LISTEN] = r.budget_cpu_used[PACKET_DIRECTION_CONNECT] = 0;
+
+    /* Set up connect address */
+    memset(&r.caddr, 0, sizeof(r.caddr));
+    r.caddr.sin_family = AF_INET;
+    if ((r.caddr.sin_addr.s_addr = inet_addr(s.caddr)) == INADDR_NONE) {
+        perror("inet_addr");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid connect address %s (%d)", s.caddr, errno);
+
+        exit(EXIT_FAILURE);
+    }
+    r.caddr.sin_port = htons(s.cport);
+
+    r.previous_endpoint.sin_family = AF_INET;
+    if (s.lsaddr == NULL && s.lsport == 0) {
+        r.previous_endpoint.sin_addr.s_addr = 0; /* No packet received, no previous endpoint */
+    } else {
+        if ((r.previous_endpoint.sin_addr.s_addr = inet_addr(s.lsaddr)) == INADDR_NONE) {
+            perror("inet_addr");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid listen packet address %s (%d)", s.lsaddr, errno);
+
+            exit(EXIT_FAILURE);
+        }
+        r.previous_endpoint.sin_port = htons(s.lsport);
+    }
+
+    /* Follow link and route changes so a bound send interface is not used while it cannot reach the connect address */
+    route.sock = -1;
+#ifdef __linux__
+    if (s.sif != NULL) {
+        struct timespec start;
+
+        route_monitor_initialize(debug_level, &route, &s);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        route_monitor_update(debug_level, &route, &r, &start);
+    }
+#endif
+
+    /* The peer verifies the admission tags against the source it receives the packets from */
+    if (s.cakey != NULL) {
+        admission_source_update(debug_level, &r, (route.sock != -1)?route.interfaces[route.active]:s.sif);
+    }
+
+#ifdef __linux__
+    /* Exit cleanly on SIGINT / SIGTERM so the notrack rules are removed */
+    if (s.conntrack_bypass) {
+        struct sigaction sa;
+
+        conntrack_statistics_read(&conntrack_start);
+        conntrack_bypass_install(debug_level, &r);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = conntrack_signal;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1) {
+            perror("sigaction");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set signal handlers (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
+    ERRNO_IGNORE_INIT(r.errno_ignore);
+    ERRNO_IGNORE_SET(r.errno_ignore, EINTR); /* Always ignore EINTR */
+
+    if (s.eignore == 1) { /* List of harmless recvfrom / sendto errors. Possibly incorrect. */
+        ERRNO_IGNORE_SET(r.errno_ignore, EAGAIN);
+        ERRNO_IGNORE_SET(r.errno_ignore, EHOSTUNREACH);
+        ERRNO_IGNORE_SET(r.errno_ignore, ENETDOWN);
+        ERRNO_IGNORE_SET(r.errno_ignore, ENETUNREACH);
+        ERRNO_IGNORE_SET(r.errno_ignore, ENOBUFS);
+        ERRNO_IGNORE_SET(r.errno_ignore, EPIPE);
+        ERRNO_IGNORE_SET(r.errno_ignore, EADDRNOTAVAIL);
+    }
+
+    if (s.workers > 0) {
+        worker_pool_initialize(&pool, &r, s.workers, &affinity);
+    }
+
+    io_initialize(debug_level, &io, s.io_backend);
+
+    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "entering infinite loop");
+
+    st.time_display_first = time(NULL);
+
+    /* Main loop */
+    while (1) {
+        int poll_retval;
+        int poll_timeout = 1000;
+        int nfds = 2;
+        int standby_index = -1;
+        int route_index = -1;
+        int pubsub_index = -1;
+        int gossip_index = -1;
+        int readable[2];
+        int direction;
+
+        /* With workers, only receive while the queue has room for a packet from each socket */
+        short events = (s.workers == 0 || pool.submit - pool.commit <= WORKER_QUEUE_SIZE - 2)?(POLLIN | POLLPRI):0;
+        uint64_t budget_window_left = budget_window_update(&r);
+
+#ifdef __linux__
+        if (terminate_signal != 0) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Signal %d received, exiting", (int)terminate_signal);
+
+            exit(EXIT_SUCCESS);
+        }
+#endif
+
+        now = time(NULL);
+
+        ufds[0].fd = r.lsock; ufds[0].events = events; ufds[0].revents = 0;
+        ufds[1].fd = r.ssock; ufds[1].events = events; ufds[1].revents = 0;
+
+        /* A direction over budget waits, its packets stay in its socket buffer */
+        for (direction = PACKET_DIRECTION_LISTEN; direction <= PACKET_DIRECTION_CONNECT; direction++) {
+            if (events != 0 && budget_exceeded(&r, (s.workers > 0)?&pool:NULL, direction)) {
+                ufds[direction].events = 0;
+                poll_timeout = budget_window_left / 1000000 + 1;
+
+                if (direction == PACKET_DIRECTION_LISTEN) {
+                    st.count_listen_budget_defer++;
+                } else {
+                    st.count_connect_budget_defer++;
+                }
+            }
+        }
+        /* Wait for room in the socket send buffers while packets are queued */
+        if (egress_pending(&(r.egress[PACKET_DIRECTION_CONNECT]))) {
+            ufds[0].events |= POLLOUT;
+        }
+        if (egress_pending(&(r.egress[PACKET_DIRECTION_LISTEN]))) {
+            ufds[1].events |= POLLOUT;
+        }
+
+        /* Hedge the requests left unanswered for too long, wake up for the next deadline */
+        if (s.hedge_address != NULL) {
+            int hedge_timeout = hedge_expire(&r);
+
+            if (hedge_timeout >= 0 && hedge_timeout < poll_timeout) {
+                poll_timeout = hedge_timeout;
+            }
+        }
+        /* Send the new counts to the peers when due, wake up for the next message */
+        if (s.gossip_port != 0 && s.gossip_peer_count > 0) {
+            int gossip_timeout = rate_gossip_timer(&r);
+
+            if (gossip_timeout < poll_timeout) {
+                poll_timeout = gossip_timeout;
+            }
+        }
+        if (s.workers > 0) {
+            ufds[2].fd = pool.notify_pipe[0]; ufds[2].events = POLLIN; ufds[2].revents = 0;
+            nfds = 3;
+        }
+        if (standby_pidfd != -1) {
+            ufds[nfds].fd = standby_pidfd; ufds[nfds].events = POLLIN; ufds[nfds].revents = 0;
+            standby_index = nfds++;
+        }
+        if (route.sock != -1) {
+            ufds[nfds].fd = route.sock; ufds[nfds].events = POLLIN; ufds[nfds].revents = 0;
+            route_index = nfds++;
+        }
+        if (s.subscribe_port != 0) {
+            ufds[nfds].fd = r.pubsub.sock; ufds[nfds].events = POLLIN; ufds[nfds].revents = 0;
+            pubsub_index = nfds++;
+
+            pubsub_expire(&r.pubsub, &st, now);
+        }
+        if (s.gossip_port != 0) {
+            ufds[nfds].fd = r.rate.sock; ufds[nfds].events = POLLIN; ufds[nfds].revents = 0;
+            gossip_index = nfds++;
+        }
+
+        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "waiting for readable sockets");
+
+        if (s.stats && (now - st.time_display_last) > STATISTICS_DELAY_SECONDS) {
+            statistics_display(debug_level, &s, &st, now);
+            if (s.program != NULL) {
+                program_statistics_display(debug_level, &r.program);
+            }
+            if (s.replay_seconds > 0) {
+                replay_statistics_display(debug_level, &r.replay);
+            }
+            if (s.egress_queue != EGRESS_QUEUE_NONE) {
+                egress_statistics_display(debug_level, &r);
+            }
+            if (s.sk_lookup_count > 0) {
+                destination_statistics_display(debug_level, &r.destinations);
+            }
+#ifdef __linux__
+            if (s.conntrack_bypass) {
+                conntrack_statistics_display(debug_level, &conntrack_start);
+            }
+#endif
+            st.time_display_last = now;
+        }
+
+        if ((poll_retval = io_wait(&io, ufds, nfds, poll_timeout)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Could not check readable sockets (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+        if (poll_retval == 0) {
+            DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "poll timeout");
+            continue;
+        }
+
+        /* The primary exited: its sockets left the group, ours moved to the first slot and receive everything */
+        if (standby_index != -1 && ufds[standby_index].revents & POLLIN) {
+            clock_gettime(CLOCK_MONOTONIC, &standby_promoted);
+            standby_receive = st.count_listen_packet_receive + 1;
+
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Primary process %d exited, now forwarding", s.standby);
+
+            close(standby_pidfd);
+            standby_pidfd = -1;
+        }
+
+#ifdef __linux__
+        /* Link, address or route change, move the send socket before sending more packets */
+        if (route_index != -1 && ufds[route_index].revents & POLLIN) {
+            route_monitor_receive(debug_level, &route, &r);
+        }
+#endif
+
+        /* Counts from the peers, before the limit is enforced on new packets */
+        if (gossip_index != -1 && ufds[gossip_index].revents & POLLIN) {
+            rate_gossip_receive(&r);
+        }
+
+        /* Subscribe, keepalive and unsubscribe requests, before the packets replicated to the subscribers */
+        if (pubsub_index != -1 && ufds[pubsub_index].revents & POLLIN) {
+            pubsub_control(&r, now);
+        }
+
+        /* Room in the socket send buffers, send the queued packets before the new ones */
+        if (ufds[0].revents & POLLOUT) {
+            egress_flush(&r, PACKET_DIRECTION_CONNECT);
+        }
+        if (ufds[1].revents & POLLOUT) {
+            egress_flush(&r, PACKET_DIRECTION_LISTEN);
+        }
+
+        /* New data on the LISTEN and / or SEND sockets */
+        readable[PACKET_DIRECTION_LISTEN] = (ufds[0].revents & POLLIN || ufds[0].revents & POLLPRI);
+        readable[PACKET_DIRECTION_CONNECT] = (ufds[1].revents & POLLIN || ufds[1].revents & POLLPRI);
+
+        redirector_drain(&r, (s.workers > 0)?&pool:NULL, &packet, readable, now);
+
+        if (readable[PACKET_DIRECTION_LISTEN]) {
+            if (standby_receive != 0 && st.count_listen_packet_receive >= standby_receive) {
+                struct timespec standby_first;
+
+                clock_gettime(CLOCK_MONOTONIC, &standby_first);
+                DEBUG(debug_level, DEBUG_LEVEL_INFO, "First packet received %.1lfus after the primary exited",
+                        (double)((standby_first.tv_sec - standby_promoted.tv_sec) * 1000000000LL +
+                            (standby_first.tv_nsec - standby_promoted.tv_nsec)) / 1000);
+
+                standby_receive = 0;
+            }
+        }
+
+        /* Hand new packets to the workers, send the transformed ones in receive order */
+        if (s.workers > 0) {
+            worker_pool_wake(&pool);
+            worker_pool_commit(&pool, &r);
+        }
+    }
+
+    /* Never reached. */
+    return 0;
+}
+
+/* Forwarding helper functions below */
+
+/**
+ * Receive a packet on the listen or send socket, then transform and send it inline, or queue it
+ * for the workers.
+ * @param[in,out] r The forwarding state
+ * @param[in,out] pool The worker pool, or NULL to process the packet inline
+ * @param[in,out] inline_packet The packet buffer used when processing inline
+ * @param[in] direction The socket to receive from, see PACKET_DIRECTION
+ * @param[in] now The current time
+ * @return 1 if a packet was received, 0 if the socket had no packet.
+ */
+int redirector_receive(struct redirector *r, struct worker_pool *pool, struct packet *inline_packet, int direction, time_t now) {
+    int debug_level = r->debug_level;
+    struct statistics *st = r->st;
+    struct packet *p = (pool != NULL)?&(pool->packets[pool->submit % WORKER_QUEUE_SIZE]):inline_packet;
+    int xsock = (direction == PACKET_DIRECTION_LISTEN)?r->lsock:r->ssock;
+    socklen_t source_len = sizeof(p->source);
+    int recvfrom_retval;
+
+    /* Simplify inet_ntop usage in DEBUG() by reserving buffers to write output */
+    char print_buffer1[INET_ADDRSTRLEN];
+    char print_buffer2[INET_ADDRSTRLEN];
+
+    memset(&(p->original_destination), 0, sizeof(p->original_destination));
+
+    if (r->s->ecn || (direction == PACKET_DIRECTION_LISTEN && r->s->sk_lookup_count > 0)) {
+        recvfrom_retval = packet_receive(xsock, p);
+    } else {
+        recvfrom_retval = recvfrom(xsock, p->buffer + NETWORK_BUFFER_HEADROOM, NETWORK_BUFFER_SIZE, 0,
+                (struct sockaddr *)&(p->source), &source_len);
+    }
+    if (recvfrom_retval == -1) {
+        if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+            perror("recvfrom");
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s cannot receive packet (%d)", (direction == PACKET_DIRECTION_LISTEN)?"Listen":"Send", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (recvfrom_retval <= 0) {
+        return 0;
+    }
+
+    if (direction == PACKET_DIRECTION_LISTEN) {
+        st->count_listen_packet_receive++;
+        st->count_listen_byte_receive += recvfrom_retval;
+
+        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "RECEIVE (%s, %d) -> (%s, %d) (LISTEN PORT): %d bytes",
+                inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port),
+                inet_ntop(AF_INET, &(r->lsock_name.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(r->lsock_name.sin_port),
+                recvfrom_retval);
+
+        if (r->s->sk_lookup_count > 0 && p->original_destination.sin_port != 0) {
+            destination_account(&(r->destinations), &(p->original_destination), recvfrom_retval);
+        }
+
+        if (r->s->ecn) {
+            st->count_listen_ecn_ect0 += (p->ecn == ECN_ECT0);
+            st->count_listen_ecn_ect1 += (p->ecn == ECN_ECT1);
+            st->count_listen_ecn_ce += (p->ecn == ECN_CE);
+        }
+    } else {
+        st->count_connect_packet_receive++;
+        st->count_connect_byte_receive += recvfrom_retval;
+
+        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "RECEIVE (%s, %d) -> (%s, %d) (SEND PORT): %d bytes",
+                inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port),
+                inet_ntop(AF_INET, &(r->ssock_name.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(r->ssock_name.sin_port),
+                recvfrom_retval);
+
+        if (r->s->ecn) {
+            st->count_connect_ecn_ect0 += (p->ecn == ECN_ECT0);
+            st->count_connect_ecn_ect1 += (p->ecn == ECN_ECT1);
+            st->count_connect_ecn_ce += (p->ecn == ECN_CE);
+        }
+    }
+
+    p->payload = p->buffer + NETWORK_BUFFER_HEADROOM;
+    p->length = p->received_length = recvfrom_retval;
+    p->direction = direction;
+    p->now = now;
+    p->destination_set = 0;
+    p->proxy_client_set = 0;
+    p->tunnel_opened = 0;
+    p->verdict = PACKET_VERDICT_FORWARD;
+    p->query_rule = -1;
+    p->replay_set = 0;
+    p->replay_request = 0;
+    p->hedge_set = 0;
+
+    if (pool == NULL) {
+        packet_transform(r, &(r->ladmission), &(r->cadmission), p);
+        packet_commit(r, p);
+    } else {
+        worker_pool_submit(pool, r);
+    }
+
+    return 1;
+}
+
+/**
+ * Apply the per packet transforms: admission tags, tunnel, PROXY header and packet program.
+ * Only touches state that is safe to share between workers; anything that depends on previous
+ * packets (replay window, endpoint learning, source checks) is left to packet_commit().
+ * @param[in,out] r The forwarding state
+ * @param[in,out] ladmission The listen admission state owned by the caller
+ * @param[in,out] cadmission The connect admission state owned by the caller
+ * @param[in,out] p The packet
+ */
+void packet_transform(struct redirector *r, struct admission *ladmission, struct admission *cadmission, struct packet *p) {
+    const struct settings *s = r->s;
+
+    if (p->direction == PACKET_DIRECTION_LISTEN) {
+        /* Drop packets without a valid admission tag before any further work */
+        if (s->lakey != NULL) {
+            if ((p->length = admission_tag_verify(ladmission, (unsigned char *)p->payload, p->length, &(p->source), p->now)) == -1) {
+                p->verdict = PACKET_VERDICT_DROP_ADMISSION;
+
+                return;
+            }
+        }
+
+        if (s->ltkey != NULL) {
+            if ((p->payload = tunnel_open(&(r->ltunnel), p->payload, &(p->length), &(p->tunnel_counter))) == NULL) {
+                p->verdict = PACKET_VERDICT_DROP_TUNNEL;
+
+                return;
+            }
+            p->tunnel_opened = 1;
+        }
+
+        if (s->program != NULL) {
+            if ((p->length = program_packet(r->debug_level, &(r->program), PACKET_DIRECTION_LISTEN,
+                            p->payload, p->length, &(p->source), &(p->original_destination), &(p->destination), &(p->destination_set))) == -1) {
+                p->verdict = PACKET_VERDICT_DROP_PROGRAM;
+
+                return;
+            }
+        }
+
+        if (r->query.count > 0) {
+            p->query_rule = query_cache_match(&(r->query), PACKET_DIRECTION_LISTEN, p->payload, p->length);
+        }
+
+        /* Retransmit requests are answered, not forwarded */
+        if (s->replay_seconds > 0) {
+            replay_classify(&(r->replay), p);
+            if (p->replay_request) {
+                return;
+            }
+        }
+
+        if (s->hedge_address != NULL) {
+            hedge_classify(&(r->hedge), p);
+        }
+
+        if (s->cproxy) {
+            if (p->length + PROXY_V2_HEADER_SIZE > UDP_PAYLOAD_MAX) {
+                p->verdict = PACKET_VERDICT_DROP_SIZE;
+
+                return;
+            }
+
+            p->payload = proxy_header_prepend(p->payload, &(p->source), &(r->lsock_name));
+            p->length += PROXY_V2_HEADER_SIZE;
+        }
+
+        if (s->ctkey != NULL) {
+            if (p->length + TUNNEL_HEADER_SIZE + TUNNEL_TAG_SIZE > UDP_PAYLOAD_MAX) {
+                p->verdict = PACKET_VERDICT_DROP_SIZE;
+
+                return;
+            }
+
+            p->payload = tunnel_seal(&(r->ctunnel), p->payload, &(p->length));
+        }
+
+        if (s->cakey != NULL) {
+            if (p->length + ADMISSION_TAG_SIZE > UDP_PAYLOAD_MAX) {
+                p->verdict = PACKET_VERDICT_DROP_SIZE;
+
+                return;
+            }
+
+            uint64_t source = __atomic_load_n(&(r->cadmission_source), __ATOMIC_RELAXED);
+            struct sockaddr_in tagged;
+
+            memset(&tagged, 0, sizeof(tagged));
+            tagged.sin_family = AF_INET;
+            tagged.sin_addr.s_addr = (uint32_t)(source >> 16);
+            tagged.sin_port = (uint16_t)(source & 0xffff);
+
+            p->length = admission_tag_append(cadmission, (unsigned char *)p->payload, p->length, &tagged, p->now);
+        }
+    } else {
+        if (s->ctkey != NULL) {
+            if ((p->payload = tunnel_open(&(r->ctunnel), p->payload, &(p->length), &(p->tunnel_counter))) == NULL) {
+                p->verdict = PACKET_VERDICT_DROP_TUNNEL;
+
+                return;
+            }
+            p->tunnel_opened = 1;
+        }
+
+        /* Route replies to the client named in the PROXY header, if any */
+        if (s->cproxy) {
+            int proxy_retval;
+
+            if ((proxy_retval = proxy_header_parse(p->payload, p->length, &(p->proxy_client))) == -1) {
+                p->verdict = PACKET_VERDICT_DROP_PROXY;
+
+                return;
+            }
+
+            if (proxy_retval > 0) {
+                p->payload += proxy_retval;
+                p->length -= proxy_retval;
+                p->proxy_client_set = (p->proxy_client.sin_addr.s_addr != 0);
+            }
+        }
+
+        if (s->program != NULL) {
+            if ((p->length = program_packet(r->debug_level, &(r->program), PACKET_DIRECTION_CONNECT,
+                            p->payload, p->length, &(p->source), &(p->original_destination), &(p->destination), &(p->destination_set))) == -1) {
+                p->verdict = PACKET_VERDICT_DROP_PROGRAM;
+
+                return;
+            }
+        }
+
+        if (r->query.count > 0) {
+            p->query_rule = query_cache_match(&(r->query), PACKET_DIRECTION_CONNECT, p->payload, p->length);
+        }
+
+        if (s->replay_seconds > 0) {
+            replay_classify(&(r->replay), p);
+        }
+
+        if (s->hedge_address != NULL) {
+            hedge_classify(&(r->hedge), p);
+        }
+
+        if (s->ltkey != NULL) {
+            if (p->length + TUNNEL_HEADER_SIZE + TUNNEL_TAG_SIZE > UDP_PAYLOAD_MAX) {
+                p->verdict = PACKET_VERDICT_DROP_SIZE;
+
+                return;
+            }
+
+            p->payload = tunnel_seal(&(r->ltunnel), p->payload, &(p->length));
+        }
+    }
+}
+
+/**
+ * Finish forwarding a transformed packet, in receive order: account for drops, check the replay
+ * window and the packet source, learn the listen endpoint and send the packet.
+ * @param[in,out] r The forwarding state
+ * @param[in] p The transformed packet
+ */
+void packet_commit(struct redirector *r, struct packet *p) {
+    int debug_level = r->debug_level;
+    const struct settings *s = r->s;
+    struct statistics *st = r->st;
+    struct sockaddr_in destination; /* Where the packet is sent to */
+    int sendto_retval;
+
+    /* Simplify inet_ntop usage in DEBUG() by reserving buffers to write output */
+    char print_buffer1[INET_ADDRSTRLEN];
+    char print_buffer2[INET_ADDRSTRLEN];
+
+    switch (p->verdict) {
+        case PACKET_VERDICT_DROP_ADMISSION:
+            st->count_listen_admission_drop++;
+
+            DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "LISTEN PORT invalid admission tag from (%s, %d)",
+                    inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+            return;
+        case PACKET_VERDICT_DROP_TUNNEL:
+            if (p->direction == PACKET_DIRECTION_LISTEN) {
+                st->count_listen_tunnel_drop++;
+            } else {
+                st->count_connect_tunnel_drop++;
+            }
+
+            DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "%s invalid tunnel packet from (%s, %d)",
+                    (p->direction == PACKET_DIRECTION_LISTEN)?"LISTEN PORT":"SEND PORT",
+                    inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+            return;
+        case PACKET_VERDICT_DROP_PROXY:
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "SEND PORT invalid PROXY header from (%s, %d)",
+                    inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+            return;
+        case PACKET_VERDICT_DROP_PROGRAM:
+            if (p->direction == PACKET_DIRECTION_LISTEN) {
+                st->count_listen_program_drop++;
+            } else {
+                st->count_connect_program_drop++;
+            }
+
+            return;
+        case PACKET_VERDICT_DROP_SIZE:
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Packet too large to add headers: %d bytes", p->received_length);
+
+            return;
+    }
+
+    if (p->tunnel_opened &&
+            tunnel_replay_check((p->direction == PACKET_DIRECTION_LISTEN)?&(r->ltunnel):&(r->ctunnel), p->tunnel_counter) == -1) {
+        if (p->direction == PACKET_DIRECTION_LISTEN) {
+            st->count_listen_tunnel_drop++;
+        } else {
+            st->count_connect_tunnel_drop++;
+        }
+
+        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "%s replayed tunnel packet from (%s, %d)",
+                (p->direction == PACKET_DIRECTION_LISTEN)?"LISTEN PORT":"SEND PORT",
+                inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+        return;
+    }
+
+    if (p->direction == PACKET_DIRECTION_LISTEN) {
+        /** Accept the packet IF:
+          * - There's no previous endpoint, OR
+          * - There is a previous endpoint, but we are not in strict mode, OR
+          * - The previous endpoint matches the current endpoint
+        */
+        if ((r->previous_endpoint.sin_addr.s_addr == 0 || !s->lstrict) ||
+                (r->previous_endpoint.sin_addr.s_addr == p->source.sin_addr.s_addr &&
+                 r->previous_endpoint.sin_port == p->source.sin_port)) {
+
+            /* Over the cluster wide limit, counted after the admission, tunnel and source checks so spoofed packets do not count */
+            if (s->rate_limit > 0 && !rate_limit_allow(r, &(p->source))) {
+                st->count_listen_rate_drop++;
+
+                DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "LISTEN PORT rate limit exceeded by (%s, %d)",
+                        inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+                return;
+            }
+
+            if (p->replay_request) {
+                struct timespec time_now;
+                int resent;
+
+                clock_gettime(CLOCK_MONOTONIC, &time_now);
+                resent = replay_serve(r, p, &time_now);
+
+                st->count_listen_packet_send += resent;
+
+                DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "LISTEN PORT retransmit request from (%s, %d): %d packets sent again",
+                        inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port), resent);
+
+                return;
+            }
+
+            /* Answer repeated queries from the cache, without learning the endpoint or waking the upstream */
+            if (p->query_rule >= 0) {
+                struct timespec time_now;
+
+                clock_gettime(CLOCK_MONOTONIC, &time_now);
+
+                if (query_cache_lookup(&(r->query), p, &time_now)) {
+                    st->count_query_hit++;
+
+                    /* The packet is now a reply, sent like packets received from the connect address */
+                    if ((sendto_retval = packet_send(r, destination_reply_socket(r, &(p->original_destination)), PACKET_DIRECTION_CONNECT,
+                                    p, &(p->source))) == -1) {
+                        if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                            perror("sendto");
+                            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Cannot send packet to listen port (%d)", errno);
+
+                            exit(EXIT_FAILURE);
+                        }
+                    } else { // At least one byte was sent, record it
+                        st->count_listen_packet_send++;
+                        st->count_listen_byte_send += sendto_retval;
+                    }
+
+                    DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "SEND (%s, %d) -> (%s, %d) (LISTEN PORT): %d bytes (QUERY CACHE)",
+                            inet_ntop(AF_INET, &(r->lsock_name.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(r->lsock_name.sin_port),
+                            inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(p->source.sin_port),
+                            sendto_retval);
+
+                    return;
+                }
+
+                st->count_query_miss++;
+            }
+
+            if (r->previous_endpoint.sin_addr.s_addr == 0 || !s->lstrict) {
+                if (r->previous_endpoint.sin_addr.s_addr != p->source.sin_addr.s_addr ||
+                        r->previous_endpoint.sin_port != p->source.sin_port) {
+                    DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "LISTEN remote endpoint set to (%s, %d)", inet_ntoa(p->source.sin_addr), ntohs(p->source.sin_port));
+                }
+
+                r->previous_endpoint.sin_addr.s_addr = p->source.sin_addr.s_addr;
+                r->previous_endpoint.sin_port = p->source.sin_port;
+            }
+
+            /* Replies to the endpoint are sent from where it sent its last packet */
+            if (p->original_destination.sin_port != 0) {
+                r->previous_destination = p->original_destination;
+            }
+
+            destination = p->destination_set?p->destination:r->caddr;
+
+            if ((sendto_retval = packet_send(r, r->ssock, p->direction, p, &destination)) == -1) {
+                if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                    perror("sendto");
+                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to send port (%d)", errno);
+
+                    exit(EXIT_FAILURE);
+                }
+            } else { // At least one byte was sent, record it
+                st->count_connect_packet_send++;
+                st->count_connect_byte_send += sendto_retval;
+
+                /* Keep the request as sent, to hedge it if no reply arrives in time */
+                if (p->hedge_set && !p->destination_set) {
+                    struct timespec time_now;
+
+                    clock_gettime(CLOCK_MONOTONIC, &time_now);
+                    hedge_track(&(r->hedge), p, &time_now);
+                    st->count_hedge_request++;
+                }
+            }
+
+            DEBUG(debug_level, (sendto_retval == p->length || s->eignore == 1)?DEBUG_LEVEL_DEBUG:DEBUG_LEVEL_ERROR,
+                    "SEND (%s, %d) -> (%s, %d) (SEND PORT): %d bytes (%s WRITE %d bytes)",
+                    inet_ntop(AF_INET, &(r->ssock_name.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(r->ssock_name.sin_port),
+                    inet_ntop(AF_INET, &(destination.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(destination.sin_port),
+                    sendto_retval,
+                    (sendto_retval == p->length)?"FULL":"PARTIAL", p->length);
+        } else {
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "LISTEN PORT invalid source (%s, %d), was expecting (%s, %d)",
+                    inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port),
+                    inet_ntop(AF_INET, &(r->previous_endpoint.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(r->previous_endpoint.sin_port));
+        }
+    } else {
+        int upstream = (r->caddr.sin_addr.s_addr == p->source.sin_addr.s_addr && r->caddr.sin_port == p->source.sin_port) ||
+                (s->hedge_address != NULL && r->hedge.address.sin_addr.s_addr == p->source.sin_addr.s_addr &&
+                 r->hedge.address.sin_port == p->source.sin_port);
+
+        /** Accept the packet IF:
+          * - The listen socket has received a packet, so we know the endpoint, OR there are subscribers, AND
+          * - The packet was received from the connect endpoint (or the hedge endpoint), OR
+          * - We are not in strict mode
+          */
+        if ((r->previous_endpoint.sin_addr.s_addr != 0 || s->subscribe_port != 0) && (!s->cstrict || upstream)) {
+
+            /* Only the connect (or hedge) endpoint may name the client, anyone else could send anywhere from the listen socket */
+            if (p->proxy_client_set && !upstream) {
+                DEBUG(debug_level, DEBUG_LEVEL_ERROR, "SEND PORT PROXY header from (%s, %d), not the connect endpoint",
+                        inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+                return;
+            }
+
+            if (p->proxy_client_set && s->lstrict && (p->proxy_client.sin_addr.s_addr != r->previous_endpoint.sin_addr.s_addr ||
+                        p->proxy_client.sin_port != r->previous_endpoint.sin_port)) {
+                DEBUG(debug_level, DEBUG_LEVEL_ERROR, "SEND PORT PROXY header client (%s, %d) is not the listen endpoint",
+                        inet_ntop(AF_INET, &(p->proxy_client.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->proxy_client.sin_port));
+
+                return;
+            }
+
+            /* Deliver the first reply to a hedged request, drop the other one, others must not touch the hedge state */
+            if (p->hedge_set && upstream) {
+                struct timespec time_now;
+
+                clock_gettime(CLOCK_MONOTONIC, &time_now);
+
+                if (!hedge_reply(&(r->hedge), st, p, &time_now)) {
+                    DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "SEND PORT reply from (%s, %d) already answered, suppressed",
+                            inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port));
+
+                    return;
+                }
+            }
+
+            /* The packet program takes precedence over the PROXY header */
+            destination = p->destination_set?p->destination:p->proxy_client_set?p->proxy_client:r->previous_endpoint;
+
+            /* Only the connect (or hedge) endpoint's replies are cached, anyone else could poison every client */
+            if (r->query.count > 0 && upstream) {
+                struct timespec time_now;
+
+                clock_gettime(CLOCK_MONOTONIC, &time_now);
+
+                if (query_cache_challenge(&(r->query), p)) {
+                    st->count_query_challenge++;
+
+                    /* Cached responses are served to this client only once it answers the challenge */
+                    if (r->query.challenges != NULL) {
+                        query_challenge_record(&(r->query), p, &destination, &time_now);
+                    }
+                } else if (p->query_rule >= 0) {
+                    st->count_query_store += query_cache_store(&(r->query), p, &time_now);
+                }
+            }
+
+            /* Keep the packet as sent, for retransmit requests, only from the connect (or hedge) endpoint */
+            if (p->replay_set && upstream) {
+                struct timespec time_now;
+
+                clock_gettime(CLOCK_MONOTONIC, &time_now);
+                replay_store(&(r->replay), p, &time_now);
+            }
+
+            /* Replicate the packet to the subscribers, unless the packet program or the PROXY header chose a destination */
+            if (s->subscribe_port != 0 && !p->destination_set && !p->proxy_client_set) {
+                pubsub_publish(r, p);
+
+                return;
+            }
+
+            if ((sendto_retval = packet_send(r, (p->destination_set || p->proxy_client_set)?r->lsock:
+                            destination_reply_socket(r, &(r->previous_destination)), p->direction, p, &destination)) == -1) {
+                if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                    perror("sendto");
+                    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Cannot send packet to listen port (%d)", errno);
+
+                    exit(EXIT_FAILURE);
+                }
+            } else { // At least one byte was sent, record it
+                st->count_listen_packet_send++;
+                st->count_listen_byte_send += sendto_retval;
+            }
+
+            DEBUG(debug_level, (sendto_retval == p->length || s->eignore == 1)?DEBUG_LEVEL_DEBUG:DEBUG_LEVEL_ERROR,
+                    "SEND (%s, %d) -> (%s, %d) (LISTEN PORT): %d bytes (%s WRITE %d bytes)",
+                    inet_ntop(AF_INET, &(r->lsock_name.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(r->lsock_name.sin_port),
+                    inet_ntop(AF_INET, &(destination.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(destination.sin_port),
+                    sendto_retval,
+                    (sendto_retval == p->length)?"FULL":"PARTIAL", p->length);
+        } else {
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "SEND PORT invalid source (%s, %d), was expecting (%s, %d)",
+                    inet_ntop(AF_INET, &(p->source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(p->source.sin_port),
+                    inet_ntop(AF_INET, &(r->caddr.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(r->caddr.sin_port));
+        }
+    }
+}
+
+/* Budget helper functions below */
+
+/**
+ * The CPU time used by the calling thread.
+ * @return The thread CPU time in nanoseconds.
+ */
+uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Start a new CPU budget window once the current one is over.
+ * @param[in,out] r The forwarding state
+ * @return The nanoseconds left in the current window.
+ */
+uint64_t budget_window_update(struct redirector *r) {
+    struct timespec now;
+    uint64_t elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (uint64_t)((now.tv_sec - r->budget_window.tv_sec) * 1000000000LL + (now.tv_nsec - r->budget_window.tv_nsec));
+
+    if (elapsed >= BUDGET_WINDOW_NS) {
+        r->budget_window = now;
+        r->budget_cpu_used[PACKET_DIRECTION_LISTEN] = r->budget_cpu_used[PACKET_DIRECTION_CONNECT] = 0;
+
+        return BUDGET_WINDOW_NS;
+    }
+
+    return BUDGET_WINDOW_NS - elapsed;
+}
+
+/**
+ * Check whether a direction used up its CPU share for the window or its buffer quota.
+ * @param[in] r The forwarding state
+ * @param[in] pool The worker pool, or NULL
+ * @param[in] direction The direction, see PACKET_DIRECTION
+ * @return 1 if the direction must wait, 0 otherwise.
+ */
+int budget_exceeded(const struct redirector *r, const struct worker_pool *pool, int direction) {
+    const struct settings *s = r->s;
+
+    if (s->budget_cpu > 0 && r->budget_cpu_used[direction] >= (uint64_t)s->budget_cpu * (BUDGET_WINDOW_NS / 100)) {
+        return 1;
+    }
+
+    if (s->budget_buffer > 0 && pool != NULL && pool->inflight_bytes[direction] >= (unsigned long)s->budget_buffer) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Charge CPU time to a direction.
+ * @param[in,out] r The forwarding state
+ * @param[in] direction The direction, see PACKET_DIRECTION
+ * @param[in] cpu The CPU time in nanoseconds
+ */
+void budget_account(struct redirector *r, int direction, uint64_t cpu) {
+    r->budget_cpu_used[direction] += cpu;
+
+    if (direction == PACKET_DIRECTION_LISTEN) {
+        r->st->time_listen_cpu += cpu;
+    } else {
+        r->st->time_connect_cpu += cpu;
+    }
+}
+
+/**
+ * Receive up to --budget-packets packets from each readable socket, alternating between them
+ * so a busy direction cannot starve the other, and stopping early for directions over budget.
+ * @param[in,out] r The forwarding state
+ * @param[in,out] pool The worker pool, or NULL to process packets inline
+ * @param[in,out] inline_packet The packet buffer used when processing inline
+ * @param[in] readable Whether the listen and send sockets are readable
+ * @param[in] now The current time
+ */
+void redirector_drain(struct redirector *r, struct worker_pool *pool, struct packet *inline_packet, const int *readable, time_t now) {
+    const struct settings *s = r->s;
+    int more[2];
+    int i, d;
+
+    more[PACKET_DIRECTION_LISTEN] = readable[PACKET_DIRECTION_LISTEN];
+    more[PACKET_DIRECTION_CONNECT] = readable[PACKET_DIRECTION_CONNECT];
+
+    for (i = 0; i < s->budget_packets && (more[PACKET_DIRECTION_LISTEN] || more[PACKET_DIRECTION_CONNECT]); i++) {
+        for (d = PACKET_DIRECTION_LISTEN; d <= PACKET_DIRECTION_CONNECT; d++) {
+            uint64_t cpu_start = 0;
+
+            if (!more[d]) {
+                continue;
+            }
+            if ((pool != NULL && pool->submit - pool->commit >= WORKER_QUEUE_SIZE) || budget_exceeded(r, pool, d)) {
+                more[d] = 0;
+                continue;
+            }
+
+            if (s->cpu_accounting) {
+                cpu_start = thread_cpu_ns();
+            }
+
+            more[d] = redirector_receive(r, pool, inline_packet, d, now);
+
+            if (s->cpu_accounting) {
+                budget_account(r, d, thread_cpu_ns() - cpu_start);
+            }
+        }
+    }
+}
+
+/* ECN helper functions below */
+
+/**
+ * Enable reading the TOS byte (and the kernel receive time, to measure queue delay) of received packets.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] desc The caller description, added to debug messages
+ * @param[in] xsock The socket
+ * @param[in] timestamp Also enable kernel receive timestamps
+ */
+void ecn_socket_setup(int debug_level, const char *desc, int xsock, int timestamp) {
+    const int enable = 1;
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: receive TOS", desc);
+    if (setsockopt(xsock, IPPROTO_IP, IP_RECVTOS, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket IP_RECVTOS (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if (timestamp) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: receive timestamps", desc);
+        if (setsockopt(xsock, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable)) == -1) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_TIMESTAMP (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Receive a packet along with its TOS, kernel receive time and original destination. The kernel
+ * receive time is a wall clock time, it is moved to the monotonic clock so that clock steps
+ * while the packet is held do not count as queue delay.
+ * @param[in] xsock The socket
+ * @param[in,out] p The packet, source, ecn, dscp, time_kernel and original_destination are set
+ * @return The recvmsg() return value.
+ */
+int packet_receive(int xsock, struct packet *p) {
+    char control[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(struct sockaddr_in))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int retval;
+
+    iov.iov_base = p->buffer + NETWORK_BUFFER_HEADROOM;
+    iov.iov_len = NETWORK_BUFFER_SIZE;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &(p->source);
+    msg.msg_namelen = sizeof(p->source);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    p->ecn = ECN_NOT_ECT;
+    p->dscp = 0;
+    p->time_kernel_set = 0;
+
+    if ((retval = recvmsg(xsock, &msg, 0)) <= 0) {
+        return retval;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        /* Linux reports the TOS as IP_TOS, BSDs as IP_RECVTOS */
+        if (cmsg->cmsg_level == IPPROTO_IP && (cmsg->cmsg_type == IP_TOS || cmsg->cmsg_type == IP_RECVTOS)) {
+            p->ecn = *(unsigned char *)CMSG_DATA(cmsg) & ECN_MASK;
+            p->dscp = *(unsigned char *)CMSG_DATA(cmsg) & ~ECN_MASK;
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+            struct timeval kernel, wall;
+            long long waited;
+
+            /* Only the time spent in the socket buffer is measured on the wall clock, a step then can only make it 0 */
+            memcpy(&kernel, CMSG_DATA(cmsg), sizeof(kernel));
+            gettimeofday(&wall, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &(p->time_kernel));
+
+            waited = (wall.tv_sec - kernel.tv_sec) * 1000000LL + (wall.tv_usec - kernel.tv_usec);
+            if (waited < 0) {
+                waited = 0;
+            }
+            p->time_kernel.tv_sec -= waited / 1000000;
+            p->time_kernel.tv_nsec -= (waited % 1000000) * 1000;
+            if (p->time_kernel.tv_nsec < 0) {
+                p->time_kernel.tv_nsec += 1000000000;
+                p->time_kernel.tv_sec--;
+            }
+            p->time_kernel_set = 1;
+#ifdef __linux__
+        } else if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_ORIGDSTADDR) {
+            memcpy(&(p->original_destination), CMSG_DATA(cmsg), sizeof(p->original_destination));
+#endif
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * Send a packet, reproducing its TOS when ECN is enabled. Marks CE on ECN capable packets that
+ * spent longer than the threshold between the kernel receiving them and now.
+ * With an egress queue, packets that do not fit the socket send buffer are queued.
+ * @param[in,out] r The forwarding state
+ * @param[in] xsock The socket to send from
+ * @param[in] direction The direction the packet is sent in, see PACKET_DIRECTION
+ * @param[in] p The packet
+ * @param[in] destination Where to send the packet
+ * @return The sendto() / sendmsg() return value, the packet length if queued.
+ */
+int packet_send(struct redirector *r, int xsock, int direction, const struct packet *p, const struct sockaddr_in *destination) {
+    const struct settings *s = r->s;
+    int ecn = p->ecn;
+
+    if (s->ecn_threshold > 0 && (ecn == ECN_ECT0 || ecn == ECN_ECT1) && p->time_kernel_set) {
+        struct timespec now;
+        int64_t delay;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        delay = (now.tv_sec - p->time_kernel.tv_sec) * 1000000LL + (now.tv_nsec - p->time_kernel.tv_nsec) / 1000;
+
+        if (delay > s->ecn_threshold) {
+            ecn = ECN_CE;
+
+            if (direction == PACKET_DIRECTION_LISTEN) {
+                r->st->count_listen_ecn_ce_mark++;
+            } else {
+                r->st->count_connect_ecn_ce_mark++;
+            }
+        }
+    }
+
+    /* The DSCP is kept, only the ECN codepoint is replaced */
+    if (s->egress_queue != EGRESS_QUEUE_NONE) {
+        return egress_send(r, xsock, direction, p, p->dscp | ecn, destination);
+    }
+
+    return packet_transmit(r, xsock, direction, p->payload, p->length, p->dscp | ecn, destination);
+}
+
+/**
+ * Send a packet with a TOS (DSCP and ECN codepoint), when ECN is enabled.
+ * @param[in,out] r The forwarding state
+ * @param[in] xsock The socket to send from
+ * @param[in] direction The packet direction, see PACKET_DIRECTION, the socket TOS is tracked per direction
+ * where per packet TOS is not available
+ * @param[in] payload The packet
+ * @param[in] length The packet length
+ * @param[in] tos The TOS
+ * @param[in] destination Where to send the packet
+ * @return The sendto() / sendmsg() return value.
+ */
+int packet_transmit(struct redirector *r, int xsock, int direction, const char *payload, int length, int tos, const struct sockaddr_in *destination) {
+    if (!r->s->ecn) {
+        return sendto(xsock, payload, length, 0, (const struct sockaddr *)destination, sizeof(*destination));
+    }
+
+#ifdef __linux__
+    (void)direction;
+
+    {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        iov.iov_base = (void *)payload;
+        iov.iov_len = length;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_name = (void *)destination;
+        msg.msg_namelen = sizeof(*destination);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TOS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+
+        return sendmsg(xsock, &msg, 0);
+    }
+#else
+    /* No per packet TOS, change the socket TOS when it changes */
+    if (r->ecn_tos[direction] != tos) {
+        if (setsockopt(xsock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) == -1) {
+            return -1;
+        }
+        r->ecn_tos[direction] = tos;
+    }
+
+    return sendto(xsock, payload, length, 0, (const struct sockaddr *)destination, sizeof(*destination));
+#endif
+}
+
+/* Egress queue helper functions below */
+
+/**
+ * Initialize an egress queue.
+ * @param[out] q The egress queue
+ * @param[in] s The settings
+ */
+void egress_initialize(struct egress *q, const struct settings *s) {
+    int i;
+
+    memset(q, 0, sizeof(*q));
+    q->mode = s->egress_queue;
+    q->limit = s->egress_limit;
+    q->target_ns = (uint64_t)s->codel_target * 1000;
+    q->interval_ns = (uint64_t)s->codel_interval * 1000;
+    q->head[EGRESS_LIST_NEW] = q->head[EGRESS_LIST_OLD] = -1;
+    q->tail[EGRESS_LIST_NEW] = q->tail[EGRESS_LIST_OLD] = -1;
+
+    for (i = 0; i < EGRESS_FLOWS; i++) {
+        q->flows[i].list = EGRESS_LIST_NONE;
+        q->flows[i].next = -1;
+    }
+}
+
+/**
+ * The monotonic clock, in nanoseconds.
+ * @return The current monotonic time.
+ */
+uint64_t egress_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Check whether an egress queue has packets waiting.
+ * @param[in] q The egress queue
+ * @return 1 if packets are waiting, 0 otherwise.
+ */
+int egress_pending(const struct egress *q) {
+    return q->packets > 0 || q->held != NULL;
+}
+
+/**
+ * Send a packet, or queue it if the socket send buffer is full or packets are already waiting.
+ * @param[in,out] r The forwarding state
+ * @param[in] xsock The socket to send from
+ * @param[in] direction The direction the packet is sent in, see PACKET_DIRECTION
+ * @param[in] p The packet
+ * @param[in] tos The TOS, DSCP and ECN codepoint
+ * @param[in] destination Where to send the packet
+ * @return The packet_transmit() return value, the packet length if queued.
+ */
+int egress_send(struct redirector *r, int xsock, int direction, const struct packet *p, int tos, const struct sockaddr_in *destination) {
+    struct egress *q = &(r->egress[direction]);
+    int retval;
+
+    /* Replies sent from an original destination socket are not queued, only the listen and send sockets are polled for room */
+    if (xsock != ((direction == PACKET_DIRECTION_LISTEN)?r->ssock:r->lsock)) {
+        return packet_transmit(r, xsock, direction, p->payload, p->length, tos, destination);
+    }
+
+    if (!egress_pending(q)) {
+        if ((retval = packet_transmit(r, xsock, direction, p->payload, p->length, tos, destination)) != -1 ||
+                (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)) {
+            return retval;
+        }
+    }
+
+    egress_enqueue(r, q, direction, p, tos, destination);
+
+    return p->length;
+}
+
+/**
+ * Queue a packet on its flow. A full queue drops the oldest packet of the longest flow.
+ * @param[in,out] r The forwarding state
+ * @param[in,out] q The egress queue
+ * @param[in] direction The direction the packet is sent in, see PACKET_DIRECTION
+ * @param[in] p The packet
+ * @param[in] tos The TOS, DSCP and ECN codepoint
+ * @param[in] destination Where to send the packet
+ */
+void egress_enqueue(struct redirector *r, struct egress *q, int direction, const struct packet *p, int tos, const struct sockaddr_in *destination) {
+    struct statistics *st = r->st;
+    struct egress_packet *e;
+    struct egress_flow *f;
+    int index = 0;
+
+    if ((e = malloc(sizeof(struct egress_packet) + p->length)) == NULL) {
+        perror("malloc");
+
+        exit(EXIT_FAILURE);
+    }
+
+    e->next = NULL;
+    e->destination = *destination;
+    e->enqueued = egress_clock();
+    e->tos = tos;
+    e->length = p->length;
+    memcpy(e->data, p->payload, p->length);
+
+    /* Flows are the packet source and destination pairs, a client or a backend */
+    if (q->mode == EGRESS_QUEUE_FQ_CODEL) {
+        uint32_t hash = 2166136261U;
+
+        hash = (hash ^ p->source.sin_addr.s_addr) * 16777619U;
+        hash = (hash ^ p->source.sin_port) * 16777619U;
+        hash = (hash ^ destination->sin_addr.s_addr) * 16777619U;
+        hash = (hash ^ destination->sin_port) * 16777619U;
+        index = hash % EGRESS_FLOWS;
+    }
+    f = &(q->flows[index]);
+
+    if (f->tail == NULL) {
+        f->head = e;
+    } else {
+        f->tail->next = e;
+    }
+    f->tail = e;
+    f->packets++;
+    f->bytes += e->length;
+    q->packets++;
+
+    if (q->mode == EGRESS_QUEUE_FQ_CODEL && f->list == EGRESS_LIST_NONE) {
+        f->deficit = EGRESS_QUANTUM;
+        egress_list_push(q, EGRESS_LIST_NEW, index);
+    }
+
+    if (direction == PACKET_DIRECTION_LISTEN) {
+        st->count_connect_egress_queue++;
+    } else {
+        st->count_listen_egress_queue++;
+    }
+
+    if (q->packets > q->limit) {
+        struct egress_flow *longest = &(q->flows[0]);
+        int i;
+
+        for (i = 1; i < EGRESS_FLOWS; i++) {
+            if (q->flows[i].bytes > longest->bytes) {
+                longest = &(q->flows[i]);
+            }
+        }
+
+        free(egress_flow_pop(q, longest));
+
+        if (direction == PACKET_DIRECTION_LISTEN) {
+            st->count_connect_egress_overflow++;
+        } else {
+            st->count_listen_egress_overflow++;
+        }
+    }
+}
+
+/**
+ * Take the oldest packet of a flow.
+ * @param[in,out] q The egress queue
+ * @param[in,out] f The flow
+ * @return The packet, or NULL if the flow is empty.
+ */
+struct egress_packet *egress_flow_pop(struct egress *q, struct egress_flow *f) {
+    struct egress_packet *e = f->head;
+
+    if (e == NULL) {
+        return NULL;
+    }
+
+    if ((f->head = e->next) == NULL) {
+        f->tail = NULL;
+    }
+    f->packets--;
+    f->bytes -= e->length;
+    q->packets--;
+
+    return e;
+}
+
+/**
+ * Append a flow to the new or old list.
+ * @param[in,out] q The egress queue
+ * @param[in] list The list, see EGRESS_LIST
+ * @param[in] index The flow
+ */
+void egress_list_push(struct egress *q, int list, int index) {
+    q->flows[index].list = list;
+    q->flows[index].next = -1;
+
+    if (q->head[list] == -1) {
+        q->head[list] = index;
+    } else {
+        q->flows[q->tail[list]].next = index;
+    }
+    q->tail[list] = index;
+}
+
+/**
+ * Remove the first flow of the new or old list.
+ * @param[in,out] q The egress queue
+ * @param[in] list The list, see EGRESS_LIST
+ */
+void egress_list_pop(struct egress *q, int list) {
+    struct egress_flow *f = &(q->flows[q->head[list]]);
+
+    q->head[list] = f->next;
+    f->list = EGRESS_LIST_NONE;
+    f->next = -1;
+}
+
+/**
+ * Drop a packet chosen by CoDel, or mark it CE if ECN is enabled and the packet is ECN capable.
+ * @param[in,out] r The forwarding state
+ * @param[in] direction The packet direction, see PACKET_DIRECTION
+ * @param[in,out] e The packet, freed if dropped
+ * @return 1 if the packet was marked and is still to be sent, 0 if it was dropped.
+ */
+int egress_drop(struct redirector *r, int direction, struct egress_packet *e) {
+    struct statistics *st = r->st;
+
+    if (r->s->ecn && ((e->tos & ECN_MASK) == ECN_ECT0 || (e->tos & ECN_MASK) == ECN_ECT1)) {
+        e->tos = (e->tos & ~ECN_MASK) | ECN_CE;
+
+        if (direction == PACKET_DIRECTION_LISTEN) {
+            st->count_connect_egress_mark++;
+        } else {
+            st->count_listen_egress_mark++;
+        }
+
+        return 1;
+    }
+
+    free(e);
+
+    if (direction == PACKET_DIRECTION_LISTEN) {
+        st->count_connect_egress_drop++;
+    } else {
+        st->count_listen_egress_drop++;
+    }
+
+    return 0;
+}
+
+/**
+ * The CoDel control law: the next drop comes interval / sqrt(count) after t.
+ * @param[in] q The egress queue
+ * @param[in] t The time to schedule from
+ * @param[in] count The number of drops so far
+ * @return The time of the next drop.
+ */
+uint64_t codel_control_law(const struct egress *q, uint64_t t, unsigned int count) {
+    uint64_t square = (uint64_t)count << 32;
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    /* Integer square root of count << 32, that is sqrt(count) << 16 */
+    while (bit > square) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (square >= root + bit) {
+            square -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return t + (q->interval_ns << 16) / root;
+}
+
+/**
+ * Decide whether a packet taken from a flow is dropped: its sojourn time, and the one of every
+ * packet before it, was above target for at least an interval, and more than a packet is left.
+ * @param[in] q The egress queue
+ * @param[in,out] f The flow
+ * @param[in] e The packet, or NULL
+ * @param[in] now The current monotonic time
+ * @return 1 if the packet can be dropped, 0 otherwise.
+ */
+int codel_should_drop(struct egress *q, struct egress_flow *f, const struct egress_packet *e, uint64_t now) {
+    if (e == NULL) {
+        f->first_above = 0;
+
+        return 0;
+    }
+
+    if (now - e->enqueued < q->target_ns || f->bytes <= EGRESS_QUANTUM) {
+        f->first_above = 0;
+
+        return 0;
+    }
+
+    if (f->first_above == 0) {
+        f->first_above = now + q->interval_ns;
+
+        return 0;
+    }
+
+    return now >= f->first_above;
+}
+
+/**
+ * Take the next packet to send from a flow, following RFC 8289: once dropping, packets are
+ * dropped at an increasing rate until the sojourn time goes back below target.
+ * @param[in,out] r The forwarding state
+ * @param[in] direction The direction of the egress queue, see PACKET_DIRECTION
+ * @param[in,out] f The flow
+ * @param[in] now The current monotonic time
+ * @return The packet, or NULL if the flow is empty.
+ */
+struct egress_packet *codel_dequeue(struct redirector *r, int direction, struct egress_flow *f, uint64_t now) {
+    struct egress *q = &(r->egress[direction]);
+    struct egress_packet *e = egress_flow_pop(q, f);
+    int drop = codel_should_drop(q, f, e, now);
+
+    if (f->dropping) {
+        if (!drop) {
+            f->dropping = 0;
+        }
+
+        while (f->dropping && now >= f->drop_next) {
+            f->count++;
+
+            if (egress_drop(r, direction, e)) {
+                f->drop_next = codel_control_law(q, f->drop_next, f->count);
+
+                return e;
+            }
+
+            e = egress_flow_pop(q, f);
+            if (!codel_should_drop(q, f, e, now)) {
+                f->dropping = 0;
+            } else {
+                f->drop_next = codel_control_law(q, f->drop_next, f->count);
+            }
+        }
+    } else if (drop) {
+        unsigned int delta;
+
+        if (!egress_drop(r, direction, e)) {
+            e = egress_flow_pop(q, f);
+            codel_should_drop(q, f, e, now);
+        }
+
+        /* Start from the previous drop rate if the last dropping state ended recently */
+        f->dropping = 1;
+        delta = f->count - f->lastcount;
+        f->count = (delta > 1 && now - f->drop_next < 16 * q->interval_ns)?delta:1;
+        f->drop_next = codel_control_law(q, now, f->count);
+        f->lastcount = f->count;
+    }
+
+    return e;
+}
+
+/**
+ * Take the next packet to send from an egress queue. With FQ-CoDel, flows that just became
+ * active are served first, then each flow sends a quantum of bytes per round.
+ * @param[in,out] r The forwarding state
+ * @param[in] direction The direction of the egress queue, see PACKET_DIRECTION
+ * @param[in] now The current monotonic time
+ * @return The packet, or NULL if the queue is empty.
+ */
+struct egress_packet *egress_dequeue(struct redirector *r, int direction, uint64_t now) {
+    struct egress *q = &(r->egress[direction]);
+
+    if (q->mode != EGRESS_QUEUE_FQ_CODEL) {
+        return codel_dequeue(r, direction, &(q->flows[0]), now);
+    }
+
+    while (1) {
+        int list = (q->head[EGRESS_LIST_NEW] != -1)?EGRESS_LIST_NEW:EGRESS_LIST_OLD;
+        int index = q->head[list];
+        struct egress_flow *f;
+        struct egress_packet *e;
+
+        if (index == -1) {
+            return NULL;
+        }
+        f = &(q->flows[index]);
+
+        if (f->deficit <= 0) {
+            f->deficit += EGRESS_QUANTUM;
+            egress_list_pop(q, list);
+            egress_list_push(q, EGRESS_LIST_OLD, index);
+
+            continue;
+        }
+
+        if ((e = codel_dequeue(r, direction, f, now)) == NULL) {
+            egress_list_pop(q, list);
+
+            /* An emptied new flow goes through the old list once, so it cannot stay ahead */
+            if (list == EGRESS_LIST_NEW && q->head[EGRESS_LIST_OLD] != -1) {
+                egress_list_push(q, EGRESS_LIST_OLD, index);
+            }
+
+            continue;
+        }
+
+        f->deficit -= e->length;
+
+        return e;
+    }
+}
+
+/**
+ * Send the queued packets until the socket send buffer is full again.
+ * @param[in,out] r The forwarding state
+ * @param[in] direction The direction of the egress queue, see PACKET_DIRECTION
+ */
+void egress_flush(struct redirector *r, int direction) {
+    struct egress *q = &(r->egress[direction]);
+    int xsock = (direction == PACKET_DIRECTION_LISTEN)?r->ssock:r->lsock;
+    uint64_t now = egress_clock();
+
+    while (1) {
+        struct egress_packet *e = q->held;
+        uint64_t sojourn;
+        int bucket = 0;
+
+        if (e == NULL && (e = egress_dequeue(r, direction, now)) == NULL) {
+            return;
+        }
+        q->held = NULL;
+
+        if (packet_transmit(r, xsock, direction, e->data, e->length, e->tos, &(e->destination)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                q->held = e;
+
+                return;
+            }
+
+            if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("sendto");
+                DEBUG(r->debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to %s port (%d)",
+                        (direction == PACKET_DIRECTION_LISTEN)?"send":"listen", errno);
+
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            for (sojourn = (now - e->enqueued) / 125000; sojourn > 0 && bucket < EGRESS_SOJOURN_BUCKETS - 1; sojourn >>= 1) {
+                bucket++;
+            }
+            q->sojourn[bucket]++;
+        }
+
+        free(e);
+    }
+}
+
+/**
+ * Display the sojourn time histogram of the egress queues, the buckets that are not empty.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] r The forwarding state
+ */
+void egress_statistics_display(int debug_level, const struct redirector *r) {
+    int direction;
+
+    for (direction = PACKET_DIRECTION_LISTEN; direction <= PACKET_DIRECTION_CONNECT; direction++) {
+        const struct egress *q = &(r->egress[direction]);
+        char histogram[EGRESS_SOJOURN_BUCKETS * 32] = "";
+        size_t used = 0;
+        int i;
+
+        for (i = 0; i < EGRESS_SOJOURN_BUCKETS; i++) {
+            if (q->sojourn[i] == 0) {
+                continue;
+            }
+
+            if (i < EGRESS_SOJOURN_BUCKETS - 1) {
+                used += snprintf(histogram + used, sizeof(histogram) - used, "%s<%gms %lu",
+                        (used > 0)?", ":"", 0.125 * (1 << i), q->sojourn[i]);
+            } else {
+                used += snprintf(histogram + used, sizeof(histogram) - used, "%s>=%gms %lu",
+                        (used > 0)?", ":"", 0.125 * (1 << (i - 1)), q->sojourn[i]);
+            }
+        }
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s:egress:sojourn: %s (%d queued)",
+                (direction == PACKET_DIRECTION_LISTEN)?"connect":"listen", (used > 0)?histogram:"none", q->packets);
+    }
+}
+
+/* Worker pool helper functions below */
+
+/**
+ * Nanoseconds elapsed between two monotonic clock readings.
+ */
+#define TIMESPEC_DELTA_NS(A, B) ((uint64_t)(((B).tv_sec - (A).tv_sec) * 1000000000LL + ((B).tv_nsec - (A).tv_nsec)))
+
+/**
+ * Start the worker threads.
+ * @param[out] pool The worker pool to initialize
+ * @param[in] r The forwarding state, shared with the workers
+ * @param[in] count The number of workers
+ * @param[in] a The CPUs to pin the workers to, round robin, if any
+ */
+void worker_pool_initialize(struct worker_pool *pool, struct redirector *r, int count, const struct affinity *a) {
+    int debug_level = r->debug_level;
+    int i;
+
+    pool->submit = pool->claim = pool->commit = 0;
+    pool->sleeping = 0;
+    pool->notify = 0;
+    pool->count = count;
+    pool->inflight_bytes[PACKET_DIRECTION_LISTEN] = pool->inflight_bytes[PACKET_DIRECTION_CONNECT] = 0;
+
+    if ((pool->packets = calloc(WORKER_QUEUE_SIZE, sizeof(struct packet))) == NULL ||
+            (pool->workers = calloc(count, sizeof(struct worker))) == NULL) {
+        perror("calloc");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot allocate worker pool (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if (pipe(pool->notify_pipe) == -1 ||
+            fcntl(pool->notify_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(pool->notify_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+        perror("pipe");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create worker notification pipe (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->cond), NULL);
+
+    for (i = 0; i < count; i++) {
+        struct worker *w = &(pool->workers[i]);
+
+        w->id = i;
+        w->pool = pool;
+        w->r = r;
+
+        /* Admission tags cache the per epoch keys, each worker keeps its own copy */
+        w->ladmission = r->ladmission;
+        w->cadmission = r->cadmission;
+
+        if ((errno = pthread_create(&(w->thread), NULL, worker_main, w)) != 0) {
+            perror("pthread_create");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot start worker %d (%d)", i, errno);
+
+            exit(EXIT_FAILURE);
+        }
+
+#ifdef __linux__
+        if (a->count > 0) {
+            int cpu = (a->count > 1)?a->cpus[1 + i % (a->count - 1)]:a->cpus[0];
+
+            affinity_apply(debug_level, w->thread, cpu);
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Auto affinity: worker %d on CPU %d", i, cpu);
+        }
+#endif
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "Started %d workers", count);
+}
+
+/**
+ * Worker thread: claim queued packets in order, transform them and mark them done.
+ * @param[in] arg The worker
+ * @return Never returns.
+ */
+void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct worker_pool *pool = w->pool;
+
+    while (1) {
+        unsigned long claim = __atomic_load_n(&(pool->claim), __ATOMIC_SEQ_CST);
+        struct packet *p;
+
+        if (claim == __atomic_load_n(&(pool->submit), __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&(pool->mutex));
+            __atomic_add_fetch(&(pool->sleeping), 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&(pool->claim), __ATOMIC_SEQ_CST) == __atomic_load_n(&(pool->submit), __ATOMIC_SEQ_CST)) {
+                pthread_cond_wait(&(pool->cond), &(pool->mutex));
+            }
+            __atomic_sub_fetch(&(pool->sleeping), 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&(pool->mutex));
+
+            continue;
+        }
+
+        /* Idle workers take the oldest queued packet, whoever it was meant for */
+        if (!__atomic_compare_exchange_n(&(pool->claim), &claim, claim + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+
+        p = &(pool->packets[claim % WORKER_QUEUE_SIZE]);
+
+        clock_gettime(CLOCK_MONOTONIC, &(p->time_start));
+        if (w->r->s->cpu_accounting) {
+            uint64_t cpu_start = thread_cpu_ns();
+
+            packet_transform(w->r, &(w->ladmission), &(w->cadmission), p);
+            p->time_cpu = thread_cpu_ns() - cpu_start;
+        } else {
+            packet_transform(w->r, &(w->ladmission), &(w->cadmission), p);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &(p->time_done));
+
+        __atomic_store_n(&(p->done), 1, __ATOMIC_RELEASE);
+
+        /* Wake up the main thread, once until it catches up */
+        if (__atomic_exchange_n(&(pool->notify), 1, __ATOMIC_SEQ_CST) == 0) {
+            if (write(pool->notify_pipe[1], "", 1) == -1 && errno != EAGAIN) {
+                perror("write");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Queue the packet received in the next free slot for the workers.
+ * @param[in,out] pool The worker pool
+ * @param[in,out] r The forwarding state, for statistics
+ */
+void worker_pool_submit(struct worker_pool *pool, struct redirector *r) {
+    struct packet *p = &(pool->packets[pool->submit % WORKER_QUEUE_SIZE]);
+    unsigned long depth = pool->submit - pool->commit + 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &(p->time_receive));
+    p->done = 0;
+    p->committed = 0;
+    p->time_cpu = 0;
+
+    pool->inflight_bytes[p->direction] += p->received_length;
+
+    r->st->count_worker_depth_sum += depth;
+    r->st->count_worker_depth_samples++;
+    if (depth > r->st->count_worker_depth_max) {
+        r->st->count_worker_depth_max = depth;
+    }
+
+    __atomic_store_n(&(pool->submit), pool->submit + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wake up sleeping workers if packets are queued.
+ * @param[in,out] pool The worker pool
+ */
+void worker_pool_wake(struct worker_pool *pool) {
+    if (__atomic_load_n(&(pool->sleeping), __ATOMIC_SEQ_CST) > 0 &&
+            __atomic_load_n(&(pool->claim), __ATOMIC_SEQ_CST) != pool->submit) {
+        pthread_mutex_lock(&(pool->mutex));
+        pthread_cond_broadcast(&(pool->cond));
+        pthread_mutex_unlock(&(pool->mutex));
+    }
+}
+
+/**
+ * The flow bucket of a packet: its direction and source address and port.
+ * @param[in] p The packet
+ * @return The bucket, below WORKER_FLOW_BUCKETS.
+ */
+unsigned int worker_flow_bucket(const struct packet *p) {
+    uint32_t hash = 2166136261U;
+
+    hash = (hash ^ (uint32_t)p->direction) * 16777619U;
+    hash = (hash ^ p->source.sin_addr.s_addr) * 16777619U;
+    hash = (hash ^ p->source.sin_port) * 16777619U;
+
+    return hash % WORKER_FLOW_BUCKETS;
+}
+
+/**
+ * Send the packets transformed by the workers, in receive order per flow. A packet still being
+ * transformed only holds back the later packets of its flow bucket; the packets of other flows
+ * are sent ahead of it, and its slot is freed once it and the packets before it are sent.
+ * @param[in,out] pool The worker pool
+ * @param[in,out] r The forwarding state
+ */
+void worker_pool_commit(struct worker_pool *pool, struct redirector *r) {
+    uint64_t blocked[WORKER_FLOW_BUCKETS / 64];
+    char drain[64];
+    unsigned long i;
+
+    /* Reset the notification before checking, packets finished from now on notify again */
+    __atomic_store_n(&(pool->notify), 0, __ATOMIC_SEQ_CST);
+    while (read(pool->notify_pipe[0], drain, sizeof(drain)) > 0);
+
+    memset(blocked, 0, sizeof(blocked));
+
+    for (i = pool->commit; i != pool->submit; i++) {
+        struct packet *p = &(pool->packets[i % WORKER_QUEUE_SIZE]);
+        struct timespec time_commit;
+        unsigned int bucket;
+
+        if (p->committed) {
+            continue;
+        }
+
+        /* The direction and source are set before the packet is queued, workers do not change them */
+        bucket = worker_flow_bucket(p);
+        if ((blocked[bucket / 64] & (1ULL << (bucket % 64))) || !__atomic_load_n(&(p->done), __ATOMIC_ACQUIRE)) {
+            blocked[bucket / 64] |= 1ULL << (bucket % 64);
+
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &time_commit);
+
+        r->st->count_worker_packet++;
+        r->st->time_worker_queue += TIMESPEC_DELTA_NS(p->time_receive, p->time_start);
+        r->st->time_worker_process += TIMESPEC_DELTA_NS(p->time_start, p->time_done);
+        r->st->time_worker_reorder += TIMESPEC_DELTA_NS(p->time_done, time_commit);
+
+        pool->inflight_bytes[p->direction] -= p->received_length;
+
+        if (r->s->cpu_accounting) {
+            uint64_t cpu_start = thread_cpu_ns();
+
+            packet_commit(r, p);
+            budget_account(r, p->direction, p->time_cpu + thread_cpu_ns() - cpu_start);
+        } else {
+            packet_commit(r, p);
+        }
+
+        p->committed = 1;
+    }
+
+    /* Free the slots up to the first packet not sent yet */
+    while (pool->commit != pool->submit && pool->packets[pool->commit % WORKER_QUEUE_SIZE].committed) {
+        pool->commit++;
+    }
+}
+
+/* Socket lookup helper functions below */
+
+/**
+ * Parse an address and port range steered to the listen socket.
+ * @param[in] range The range, <address>[/<prefix>]:<port>[-<port>]
+ * @param[out] address The address, network byte order, masked to the prefix
+ * @param[out] prefix The prefix length
+ * @param[out] port_min The first port
+ * @param[out] port_max The last port
+ * @return 0 on success, -1 if the range is invalid.
+ */
+int sk_lookup_parse(const char *range, uint32_t *address, int *prefix, int *port_min, int *port_max) {
+    char text[INET_ADDRSTRLEN];
+    const char *colon = strrchr(range, ':');
+    const char *slash = strchr(range, '/');
+    size_t length;
+    char end;
+
+    if (colon == NULL || (slash != NULL && slash > colon)) {
+        return -1;
+    }
+
+    length = ((slash != NULL)?slash:colon) - range;
+    if (length == 0 || length >= sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, range, length);
+    text[length] = '\0';
+
+    if (inet_pton(AF_INET, text, address) != 1) {
+        return -1;
+    }
+
+    *prefix = 32;
+    if (slash != NULL && (sscanf(slash + 1, "%d%c", prefix, &end) != 2 || end != ':' || *prefix < 0 || *prefix > 32)) {
+        return -1;
+    }
+    if (*prefix < 32) {
+        *address &= htonl(~(0xffffffffU >> *prefix));
+    }
+
+    switch (sscanf(colon + 1, "%d-%d%c", port_min, port_max, &end)) {
+        case 1:
+            *port_max = *port_min;
+            break;
+        case 2:
+            break;
+        default:
+            return -1;
+    }
+
+    return (*port_min > 0 && *port_max >= *port_min && *port_max <= 65535)?0:-1;
+}
+
+#ifdef __linux__
+/**
+ * Call the bpf() system call.
+ * @param[in] cmd The command
+ * @param[in,out] attr The command attributes
+ * @return The bpf() return value.
+ */
+int sk_lookup_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Attach a BPF sk_lookup program to the network namespace, steering UDP packets to the --sk-lookup
+ * ranges to a socket before the kernel looks up the socket bound to their address and port. The
+ * ranges are kept in a longest prefix match map of the address, with the port range as value.
+ * The program stays attached while the process runs.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] s The settings
+ * @param[in] xsock The socket packets are steered to
+ * @return The BPF link file descriptor.
+ */
+int sk_lookup_attach(int debug_level, const struct settings *s, int xsock) {
+    union bpf_attr attr;
+    int ranges_fd, socket_fd, program_fd, netns_fd, link_fd;
+    uint32_t key_zero = 0;
+    uint64_t value_socket = xsock;
+    char log[4096] = "";
+    int i;
+
+    /* The packet is UDP, its destination in the ranges map and its port in range: assign the socket */
+#define SK_LOOKUP_INSN(CODE, DST, SRC, OFF, IMM) { .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) }
+    struct bpf_insn program[] = {
+        /*  0 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        /*  1 */ SK_LOOKUP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sk_lookup, protocol), 0),
+        /*  2 */ SK_LOOKUP_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 28, IPPROTO_UDP),
+        /*  3 */ SK_LOOKUP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sk_lookup, local_ip4), 0),
+        /*  4 */ SK_LOOKUP_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0),
+        /*  5 */ SK_LOOKUP_INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -8, 32),
+        /*  6 */ SK_LOOKUP_INSN(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0),
+        /*  7 */ SK_LOOKUP_INSN(0, 0, 0, 0, 0),
+        /*  8 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        /*  9 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        /* 10 */ SK_LOOKUP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /* 11 */ SK_LOOKUP_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 19, 0),
+        /* 12 */ SK_LOOKUP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sk_lookup, local_port), 0),
+        /* 13 */ SK_LOOKUP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_0, 0, 0),
+        /* 14 */ SK_LOOKUP_INSN(BPF_JMP | BPF_JLT | BPF_X, BPF_REG_2, BPF_REG_3, 16, 0),
+        /* 15 */ SK_LOOKUP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_0, 4, 0),
+        /* 16 */ SK_LOOKUP_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_3, 14, 0),
+        /* 17 */ SK_LOOKUP_INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -12, 0),
+        /* 18 */ SK_LOOKUP_INSN(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0),
+        /* 19 */ SK_LOOKUP_INSN(0, 0, 0, 0, 0),
+        /* 20 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        /* 21 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -12),
+        /* 22 */ SK_LOOKUP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /* 23 */ SK_LOOKUP_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 7, 0),
+        /* 24 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+        /* 25 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        /* 26 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0),
+        /* 27 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0),
+        /* 28 */ SK_LOOKUP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_assign),
+        /* 29 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0),
+        /* 30 */ SK_LOOKUP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_release),
+        /* 31 */ SK_LOOKUP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        /* 32 */ SK_LOOKUP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+#undef SK_LOOKUP_INSN
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_LPM_TRIE;
+    attr.key_size = 8;
+    attr.value_size = 8;
+    attr.max_entries = SK_LOOKUP_RANGES;
+    attr.map_flags = BPF_F_NO_PREALLOC;
+    if ((ranges_fd = sk_lookup_bpf(BPF_MAP_CREATE, &attr)) == -1) {
+        perror("bpf");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create the sk_lookup ranges map, needs Linux 5.9 and CAP_BPF / CAP_NET_ADMIN (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < s->sk_lookup_count; i++) {
+        uint32_t key[2], value[2];
+        uint32_t address;
+        int prefix, port_min, port_max;
+
+        sk_lookup_parse(s->sk_lookup[i], &address, &prefix, &port_min, &port_max);
+        key[0] = prefix;
+        key[1] = address;
+        value[0] = port_min;
+        value[1] = port_max;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = ranges_fd;
+        attr.key = (uint64_t)(uintptr_t)key;
+        attr.value = (uint64_t)(uintptr_t)value;
+        if (sk_lookup_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+            perror("bpf");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot add sk_lookup range %s (%d)", s->sk_lookup[i], errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_SOCKMAP;
+    attr.key_size = sizeof(key_zero);
+    attr.value_size = sizeof(value_socket);
+    attr.max_entries = 1;
+    if ((socket_fd = sk_lookup_bpf(BPF_MAP_CREATE, &attr)) == -1) {
+        perror("bpf");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create the sk_lookup socket map (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = socket_fd;
+    attr.key = (uint64_t)(uintptr_t)&key_zero;
+    attr.value = (uint64_t)(uintptr_t)&value_socket;
+    if (sk_lookup_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        perror("bpf");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot add the listen socket to the sk_lookup socket map (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    program[6].imm = ranges_fd;
+    program[18].imm = socket_fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_LOOKUP;
+    attr.expected_attach_type = BPF_SK_LOOKUP;
+    attr.insns = (uint64_t)(uintptr_t)program;
+    attr.insn_cnt = sizeof(program) / sizeof(program[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    if ((program_fd = sk_lookup_bpf(BPF_PROG_LOAD, &attr)) == -1) {
+        perror("bpf");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot load the sk_lookup program (%d)\n%s", errno, log);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if ((netns_fd = open("/proc/self/ns/net", O_RDONLY)) == -1) {
+        perror("open");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot open the network namespace (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = program_fd;
+    attr.link_create.target_fd = netns_fd;
+    attr.link_create.attach_type = BPF_SK_LOOKUP;
+    if ((link_fd = sk_lookup_bpf(BPF_LINK_CREATE, &attr)) == -1) {
+        perror("bpf");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot attach the sk_lookup program (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    /* The link holds the program, the program holds the maps */
+    close(netns_fd);
+    close(program_fd);
+    close(socket_fd);
+    close(ranges_fd);
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen socket: sk_lookup attached, %d ranges", s->sk_lookup_count);
+
+    return link_fd;
+}
+#endif
+
+/**
+ * Initialize the original destination table, without any destination.
+ * @param[out] t The destination table
+ */
+void destination_table_initialize(struct destination_table *t) {
+    memset(t, 0, sizeof(*t));
+
+    if ((t->entries = calloc(DESTINATIONS_MAX, sizeof(struct destination))) == NULL ||
+            (t->slots = malloc(DESTINATION_SLOTS * sizeof(int))) == NULL) {
+        perror("malloc");
+
+        exit(EXIT_FAILURE);
+    }
+    memset(t->slots, 0xff, DESTINATION_SLOTS * sizeof(int));
+}
+
+/**
+ * Find an original destination, adding it if there is room.
+ * @param[in,out] t The destination table
+ * @param[in] address The address and port
+ * @return The destination, or NULL if the table is full.
+ */
+struct destination *destination_find(struct destination_table *t, const struct sockaddr_in *address) {
+    uint32_t hash = 2166136261U;
+    unsigned int slot;
+    struct destination *d;
+
+    hash = (hash ^ address->sin_addr.s_addr) * 16777619U;
+    hash = (hash ^ address->sin_port) * 16777619U;
+
+    for (slot = hash & (DESTINATION_SLOTS - 1); t->slots[slot] != -1; slot = (slot + 1) & (DESTINATION_SLOTS - 1)) {
+        d = &(t->entries[t->slots[slot]]);
+
+        if (d->address.sin_addr.s_addr == address->sin_addr.s_addr && d->address.sin_port == address->sin_port) {
+            return d;
+        }
+    }
+
+    if (t->count == DESTINATIONS_MAX) {
+        return NULL;
+    }
+
+    d = &(t->entries[t->count]);
+    memset(d, 0, sizeof(*d));
+    d->address.sin_family = AF_INET;
+    d->address.sin_addr.s_addr = address->sin_addr.s_addr;
+    d->address.sin_port = address->sin_port;
+    d->sock = -1;
+    t->slots[slot] = t->count++;
+
+    return d;
+}
+
+/**
+ * Count a packet received for an original destination.
+ * @param[in,out] t The destination table
+ * @param[in] address The address and port the packet was sent to
+ * @param[in] length The packet length
+ */
+void destination_account(struct destination_table *t, const struct sockaddr_in *address, int length) {
+    struct destination *d = destination_find(t, address);
+
+    if (d == NULL) {
+        t->other_packets++;
+        t->other_packets_total++;
+
+        return;
+    }
+
+    d->packets++;
+    d->bytes += length;
+    d->packets_total++;
+    d->bytes_total += length;
+}
+
+/**
+ * The socket to send replies from, so they come from the address and port the client sent to.
+ * Destinations on the listen port are answered from the listen socket, binding them would take
+ * packets from it; the others from a transparent socket bound to the destination, opened on first use.
+ * @param[in,out] r The forwarding state
+ * @param[in] address The original destination, port 0 if unknown
+ * @return The socket.
+ */
+int destination_reply_socket(struct redirector *r, const struct sockaddr_in *address) {
+    struct destination *d;
+
+    if (r->s->sk_lookup_count == 0 || address->sin_port == 0 || address->sin_port == r->lsock_name.sin_port ||
+            (d = destination_find(&(r->destinations), address)) == NULL) {
+        return r->lsock;
+    }
+
+#ifdef __linux__
+    if (d->sock == -1) {
+        int enable = 1;
+
+        /* Simplify inet_ntop usage in DEBUG() by reserving buffers to write output */
+        char print_buffer1[INET_ADDRSTRLEN];
+
+        if ((d->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1 ||
+                setsockopt(d->sock, IPPROTO_IP, IP_TRANSPARENT, &enable, sizeof(enable)) == -1 ||
+                setsockopt(d->sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1 ||
+                fcntl(d->sock, F_SETFL, O_NONBLOCK) == -1 ||
+                bind(d->sock, (const struct sockaddr *)&(d->address), sizeof(d->address)) == -1) {
+            DEBUG(r->debug_level, DEBUG_LEVEL_ERROR, "Cannot open reply socket for (%s, %d), replying from the listen socket (%d)",
+                    inet_ntop(AF_INET, &(d->address.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(d->address.sin_port), errno);
+
+            if (d->sock != -1) {
+                close(d->sock);
+            }
+            d->sock = -2;
+        }
+    }
+#endif
+
+    return (d->sock >= 0)?d->sock:r->lsock;
+}
+
+/**
+ * Display the busiest original destinations since the last display, then start a new interval.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] t The destination table
+ */
+void destination_statistics_display(int debug_level, struct destination_table *t) {
+    int shown[DESTINATION_DISPLAY];
+    int count = 0;
+    int i, j;
+
+    /* Simplify inet_ntop usage in DEBUG() by reserving buffers to write output */
+    char print_buffer1[INET_ADDRSTRLEN];
+
+    for (count = 0; count < DESTINATION_DISPLAY; count++) {
+        int busiest = -1;
+
+        for (i = 0; i < t->count; i++) {
+            for (j = 0; j < count && shown[j] != i; j++);
+
+            if (j == count && t->entries[i].packets > 0 && (busiest == -1 || t->entries[i].packets > t->entries[busiest].packets)) {
+                busiest = i;
+            }
+        }
+        if (busiest == -1) {
+            break;
+        }
+        shown[count] = busiest;
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "destination:%s:%d: packets %lu, bytes %lu (total packets %lu, bytes %lu)",
+                inet_ntop(AF_INET, &(t->entries[busiest].address.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(t->entries[busiest].address.sin_port),
+                t->entries[busiest].packets, t->entries[busiest].bytes, t->entries[busiest].packets_total, t->entries[busiest].bytes_total);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "destination: %d destinations, %lu packets to others (total %lu)",
+            t->count, t->other_packets, t->other_packets_total);
+
+    for (i = 0; i < t->count; i++) {
+        t->entries[i].packets = t->entries[i].bytes = 0;
+    }
+    t->other_packets = 0;
+}
+
+/* I/O backend helper functions below */
+
+/**
+ * Prepare waiting for readable sockets.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[out] io The I/O backend state
+ * @param[in] backend The backend, see IO_BACKEND
+ */
+void io_initialize(int debug_level, struct io *io, int backend) {
+    memset(io, 0, sizeof(*io));
+    io->backend = backend;
+    io->epfd = -1;
+    io->count = 0;
+
+#ifdef __linux__
+    if (backend == IO_BACKEND_EPOLL) {
+        if ((io->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            perror("epoll_create1");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create epoll instance (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+}
+
+/**
+ * Release the I/O backend state.
+ * @param[in,out] io The I/O backend state
+ */
+void io_close(struct io *io) {
+    if (io->epfd != -1) {
+        close(io->epfd);
+        io->epfd = -1;
+    }
+}
+
+/**
+ * Wait for readable (or writable) file descriptors, with the same interface as poll(). With epoll, the
+ * descriptors and events are only handed to the kernel when they change between calls.
+ * @param[in,out] io The I/O backend state
+ * @param[in,out] ufds The file descriptors and events, revents is set
+ * @param[in] nfds The number of file descriptors, at most IO_MAX_FDS
+ * @param[in] timeout The timeout in milliseconds
+ * @return The poll() / epoll_wait() return value.
+ */
+int io_wait(struct io *io, struct pollfd *ufds, int nfds, int timeout) {
+#ifdef __linux__
+    if (io->backend == IO_BACKEND_EPOLL) {
+        struct epoll_event events[IO_MAX_FDS];
+        int retval;
+        int i;
+        int j;
+
+        /*
+         * Registrations are keyed by descriptor: one leaving the set shifts the later ones to a new
+         * index, so drop the departed descriptors first (a closed one already left the epoll set,
+         * ignore errors) and only then add or re-index the rest.
+         */
+        for (j = 0; j < io->count; j++) {
+            for (i = 0; i < nfds && ufds[i].fd != io->fds[j]; i++);
+            if (i == nfds) {
+                epoll_ctl(io->epfd, EPOLL_CTL_DEL, io->fds[j], NULL);
+            }
+        }
+
+        for (i = 0; i < nfds; i++) {
+            struct epoll_event ev;
+
+            memset(&ev, 0, sizeof(ev));
+            ev.events = ((ufds[i].events & POLLIN)?EPOLLIN:0) | ((ufds[i].events & POLLPRI)?EPOLLPRI:0) |
+                ((ufds[i].events & POLLOUT)?EPOLLOUT:0);
+            ev.data.u32 = i;
+
+            for (j = 0; j < io->count && io->fds[j] != ufds[i].fd; j++);
+            if (j == io->count) {
+                if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, ufds[i].fd, &ev) == -1) {
+                    return -1;
+                }
+            } else if (j != i || io->events[j] != ufds[i].events) {
+                /* The descriptor number may have been closed and reused, re-add it then */
+                if (epoll_ctl(io->epfd, EPOLL_CTL_MOD, ufds[i].fd, &ev) == -1 &&
+                    (errno != ENOENT || epoll_ctl(io->epfd, EPOLL_CTL_ADD, ufds[i].fd, &ev) == -1)) {
+                    return -1;
+                }
+            }
+
+            ufds[i].revents = 0;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            io->fds[i] = ufds[i].fd;
+            io->events[i] = ufds[i].events;
+        }
+        io->count = nfds;
+
+        if ((retval = epoll_wait(io->epfd, events, IO_MAX_FDS, timeout)) <= 0) {
+            return retval;
+        }
+
+        for (i = 0; i < retval; i++) {
+            ufds[events[i].data.u32].revents =
+                ((events[i].events & EPOLLIN)?POLLIN:0) | ((events[i].events & EPOLLPRI)?POLLPRI:0) |
+                ((events[i].events & EPOLLOUT)?POLLOUT:0) | ((events[i].events & EPOLLERR)?POLLERR:0) | ((events[i].events & EPOLLHUP)?POLLHUP:0);
+        }
+
+        return retval;
+    }
+#endif
+
+    return poll(ufds, nfds, timeout);
+}
+
+/**
+ * Set the busy poll time of a socket.
+ * @param[in] xsock The socket
+ * @param[in] busy_poll The busy poll time in microseconds
+ * @return The setsockopt() return value, -1 where busy polling is not supported.
+ */
+int io_busy_poll(int xsock, int busy_poll) {
+#ifdef __linux__
+    return setsockopt(xsock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+#else
+    (void)xsock;
+    (void)busy_poll;
+    errno = ENOPROTOOPT;
+
+    return -1;
+#endif
+}
+
+/* Calibration helper functions below */
+
+/**
+ * Send timestamped packets through the strategy under test and time their return, keeping a
+ * window of packets in flight.
+ * @param[in,out] arg The generator state
+ * @return NULL
+ */
+void *calibrate_generator_main(void *arg) {
+    struct calibrate_generator *g = (struct calibrate_generator *)arg;
+    char buffer[CALIBRATE_PACKET_SIZE];
+    int inflight = 0;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    while (!__atomic_load_n(&(g->stop), __ATOMIC_ACQUIRE)) {
+        struct timespec sent, received;
+
+        while (inflight < CALIBRATE_WINDOW) {
+            clock_gettime(CLOCK_MONOTONIC, &sent);
+            memcpy(buffer, &sent, sizeof(sent));
+
+            if (sendto(g->sock, buffer, sizeof(buffer), 0, (const struct sockaddr *)&(g->target), sizeof(g->target)) == -1) {
+                break;
+            }
+            inflight++;
+        }
+
+        /* The receive timeout expiring means the packets in flight were lost */
+        if (recv(g->sock, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+            inflight = 0;
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &received);
+        memcpy(&sent, buffer, sizeof(sent));
+
+        g->received++;
+        g->latency += TIMESPEC_DELTA_NS(sent, received);
+        inflight--;
+    }
+
+    return NULL;
+}
+
+/**
+ * Forward packets over loopback with one strategy for a short while.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] c The strategy, pps and latency are set
+ * @return 0 on success, -1 if the strategy is not available.
+ */
+int calibrate_run(int debug_level, struct calibrate_result *c) {
+    struct calibrate_generator g;
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 10000 };
+    struct timespec start, now;
+    pthread_t thread;
+    struct io io;
+    char buffer[CALIBRATE_PACKET_SIZE];
+    int in, out;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(&g, 0, sizeof(g));
+
+    if ((in = socket(AF_INET, SOCK_DGRAM, 0)) == -1 || (out = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+            (g.sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        perror("socket");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create calibration socket (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(in, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+            getsockname(in, (struct sockaddr *)&(g.target), &address_len) == -1 ||
+            bind(g.sock, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+            getsockname(g.sock, (struct sockaddr *)&address, &address_len) == -1 ||
+            fcntl(in, F_SETFL, O_NONBLOCK) == -1 ||
+            setsockopt(g.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("bind");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set up calibration socket (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if (c->busy_poll > 0 && (io_busy_poll(in, c->busy_poll) == -1 || io_busy_poll(g.sock, c->busy_poll) == -1)) {
+        close(in);
+        close(out);
+        close(g.sock);
+
+        return -1;
+    }
+
+    io_initialize(debug_level, &io, c->backend);
+
+    if (pthread_create(&thread, NULL, calibrate_generator_main, &g) != 0) {
+        perror("pthread_create");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot start calibration thread");
+
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        struct pollfd ufds[1];
+
+        ufds[0].fd = in; ufds[0].events = POLLIN; ufds[0].revents = 0;
+
+        if (io_wait(&io, ufds, 1, 10) > 0 && (ufds[0].revents & POLLIN)) {
+            int i;
+
+            for (i = 0; i < c->batch; i++) {
+                ssize_t length = recv(in, buffer, sizeof(buffer), 0);
+
+                if (length <= 0) {
+                    break;
+                }
+                sendto(out, buffer, length, 0, (const struct sockaddr *)&address, sizeof(address));
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (TIMESPEC_DELTA_NS(start, now) < CALIBRATE_DURATION_MS * 1000000ULL);
+
+    __atomic_store_n(&(g.stop), 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    io_close(&io);
+    close(in);
+    close(out);
+    close(g.sock);
+
+    c->pps = (double)g.received * 1000000000.0 / TIMESPEC_DELTA_NS(start, now);
+    c->latency = (g.received > 0)?(double)g.latency / g.received:0;
+
+    return 0;
+}
+
+/**
+ * The calibration cache key: the kernel version and the CPU model.
+ * @param[out] key The key, without tabs or newlines
+ * @param[in] size The key buffer size
+ */
+void calibrate_key(char *key, size_t size) {
+    struct utsname u;
+    char model[256] = "unknown";
+    char *c;
+
+#ifdef __linux__
+    FILE *f;
+
+    if ((f = fopen("/proc/cpuinfo", "r")) != NULL) {
+        char line[512];
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char *value;
+
+            if (strncmp(line, "model name", 10) == 0 && (value = strchr(line, ':')) != NULL) {
+                snprintf(model, sizeof(model), "%s", value + 2);
+                model[strcspn(model, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(f);
+    }
+#endif
+
+    if (uname(&u) == -1) {
+        memset(&u, 0, sizeof(u));
+    }
+
+    snprintf(key, size, "%s %s %s|%s", u.sysname, u.release, u.machine, model);
+
+    for (c = key; *c != '\0'; c++) {
+        if (*c == '\t' || *c == '\n') {
+            *c = ' ';
+        }
+    }
+}
+
+/**
+ * Open the calibration cache, refusing symbolic links and files another user could have written:
+ * the file must be a regular file owned by root or the effective user, and not writable by others.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] path The calibration cache file
+ * @param[in] flags O_RDONLY to read, O_WRONLY | O_APPEND | O_CREAT to append
+ * @return The file, or NULL if it cannot be opened or is not trusted.
+ */
+FILE *calibrate_cache_open(int debug_level, const char *path, int flags) {
+    struct stat st;
+    FILE *f;
+    int fd;
+
+    if ((fd = open(path, flags | O_NOFOLLOW, 0644)) == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid()) ||
+            (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Calibration cache %s is not a regular file owned by root or the current user, "
+                "writable only by its owner, ignored", path);
+        close(fd);
+
+        return NULL;
+    }
+
+    if ((f = fdopen(fd, (flags & O_WRONLY)?"a":"r")) == NULL) {
+        close(fd);
+    }
+
+    return f;
+}
+
+/**
+ * Pick the fastest I/O strategy: the event backend, the packets received per socket per loop
+ * iteration and busy polling. The choice is cached per kernel version and CPU model; cached
+ * values are only used if they are among the strategies calibration measures.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] s The settings, io_backend, budget_packets and busy_poll are set
+ */
+void calibrate(int debug_level, struct settings *s) {
+    static const int batches[] = { 1, 8, 32 };
+    static const int busy_polls[] = { 0, 50 };
+    struct calibrate_result best, c;
+    char key[512];
+    char line[1024];
+    FILE *f;
+    int backend, b, p;
+
+    calibrate_key(key, sizeof(key));
+
+    if ((f = calibrate_cache_open(debug_level, s->calibrate_cache, O_RDONLY)) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char *values = strchr(line, '\t');
+            char name[16];
+            int batch, busy_poll;
+            int batch_valid = 0, busy_poll_valid = 0;
+
+            if (values == NULL || (size_t)(values - line) != strlen(key) || strncmp(line, key, values - line) != 0) {
+                continue;
+            }
+
+            if (sscanf(values + 1, "%15s %d %d", name, &batch, &busy_poll) != 3) {
+                continue;
+            }
+
+            for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+                batch_valid |= (batch == batches[b]);
+            }
+            for (p = 0; p < (int)(sizeof(busy_polls) / sizeof(busy_polls[0])); p++) {
+                busy_poll_valid |= (busy_poll == busy_polls[p]);
+            }
+
+            if (batch_valid && busy_poll_valid &&
+                    (strcmp(name, "poll") == 0 || (IO_BACKEND_MAX == IO_BACKEND_EPOLL && strcmp(name, "epoll") == 0))) {
+                s->io_backend = (strcmp(name, "epoll") == 0)?IO_BACKEND_EPOLL:IO_BACKEND_POLL;
+                s->budget_packets = batch;
+                s->busy_poll = busy_poll;
+                fclose(f);
+
+                DEBUG(debug_level, DEBUG_LEVEL_INFO, "Calibration: %s, %d packets per iteration, busy poll %dus (cached in %s)",
+                        IO_BACKEND_NAME(s->io_backend), s->budget_packets, s->busy_poll, s->calibrate_cache);
+
+                return;
+            }
+        }
+        fclose(f);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Calibrating for %s", key);
+
+    /* Keep the current settings if no strategy can be measured */
+    best.backend = s->io_backend;
+    best.batch = s->budget_packets;
+    best.busy_poll = s->busy_poll;
+    best.pps = -1;
+    best.latency = 0;
+
+    for (backend = IO_BACKEND_POLL; backend <= IO_BACKEND_MAX; backend++) {
+        for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+            for (p = 0; p < (int)(sizeof(busy_polls) / sizeof(busy_polls[0])); p++) {
+                c.backend = backend;
+                c.batch = batches[b];
+                c.busy_poll = busy_polls[p];
+
+                if (calibrate_run(debug_level, &c) == -1) {
+                    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "Calibration: %s, %d packets per iteration, busy poll %dus: not available",
+                            IO_BACKEND_NAME(c.backend), c.batch, c.busy_poll);
+                    continue;
+                }
+
+                DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "Calibration: %s, %d packets per iteration, busy poll %dus: %.0lf pps, %.1lfus",
+                        IO_BACKEND_NAME(c.backend), c.batch, c.busy_poll, c.pps, c.latency / 1000);
+
+                /* Throughput first; within the measurement noise, the lower latency wins */
+                if (best.pps < 0 || c.pps > best.pps * (1 + CALIBRATE_NOISE) ||
+                        (c.pps > best.pps * (1 - CALIBRATE_NOISE) && c.latency < best.latency)) {
+                    best = c;
+                }
+            }
+        }
+    }
+
+    s->io_backend = best.backend;
+    s->budget_packets = best.batch;
+    s->busy_poll = best.busy_poll;
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Calibration: %s, %d packets per iteration, busy poll %dus (%.0lf pps, %.1lfus)",
+            IO_BACKEND_NAME(s->io_backend), s->budget_packets, s->busy_poll, best.pps, best.latency / 1000);
+
+    if ((f = calibrate_cache_open(debug_level, s->calibrate_cache, O_WRONLY | O_APPEND | O_CREAT)) == NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Cannot write calibration cache %s (%d)", s->calibrate_cache, errno);
+
+        return;
+    }
+    fprintf(f, "%s\t%s %d %d\n", key, IO_BACKEND_NAME(s->io_backend), s->budget_packets, s->busy_poll);
+    fclose(f);
+}
+
+/* Network helper functions below */
+
+/**
+ * Creates a UDP socket on the specified address, port and interface, returning the socket and
+ * the socket name (if either arguments were NULL or 0).
+ *
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] desc The caller description, added to debug messages
+ * @param[in] xaddr The IPV4 address for the socket to be created, or NULL for INADDR_ANY
+ * @param[in] xport The IPV4 port for the socket to be created, or 0 for random (decided by bind())
+ * @param[in] xif The OS interface name to bind to, or NULL for all interfaces.
+ * @param[in] reuseport Bind with SO_REUSEPORT and steer the group's packets to its first socket
+ * @param[out] xsock_name The name of the socket created.
+ * @return The socket file descriptor as integer.
+ *
+ */
+int socket_setup(const int debug_level, const char *desc, const char *xaddr, const int xport, const char *xif, const int reuseport, struct sockaddr_in *xsock_name) {
+    int xsock;
+    const int enable = 1;
+    struct sockaddr_in addr;
+
+    /* Set up listening socket */
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: create", desc);
+    if ((xsock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP)) == -1) {
+        perror("socket");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create DGRAM socket (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    /* Address specified or any */
+    if (xaddr != NULL) {
+        if ((addr.sin_addr.s_addr = inet_addr(xaddr)) == INADDR_NONE) {
+            perror("inet_addr");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "%s address invalid %s (%d)", desc, xaddr, errno);
+
+            exit(EXIT_FAILURE);
+        }
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to address %s", desc, xaddr);
+    } else {
+        addr.sin_addr.s_addr = INADDR_ANY;
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to address %s", desc, "ANY");
+    }
+
+    /* Port specified or any */
+    if (xport != 0) {
+        addr.sin_port = htons(xport);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to port %d", desc, xport);
+    } else {
+        addr.sin_port = 0;
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to port %s", desc, "ANY");
+    }
+
+    if (xif != NULL) {
+#ifdef __MACH__
+        unsigned int xif_idx;
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to interface %s", desc, xif);
+
+        if ((xif_idx = if_nametoindex(xif)) == 0) {
+            perror("if_nametoindex");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot get the interface ID (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+
+        if (setsockopt(xsock, IPPROTO_IP, IP_BOUND_IF, &xif_idx, sizeof(xif_idx)) == -1) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket interface (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+#elif __unix__
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to interface %s", desc, xif);
+
+        if (setsockopt(xsock, SOL_SOCKET, SO_BINDTODEVICE, xif, strlen(xif)) == -1) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket interface (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+#endif
+    } else {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to interface %s", desc, "ANY");
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: reuse local address", desc);
+
+    if (setsockopt(xsock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+        perror("setsockopt");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_REUSEADDR (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if (reuseport) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: reuse local port", desc);
+
+        if (setsockopt(xsock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_REUSEPORT (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: set nonblocking", desc);
+    if (fcntl(xsock, F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket O_NONBLOCK (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind", desc);
+    if (bind(xsock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot bind socket (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef __linux__
+    /**
+     * Steer every packet to the first socket of the group instead of hashing flows across it.
+     * When that socket closes the kernel moves the last socket into its slot, so a standby
+     * process (joined second) starts receiving without any further action.
+     */
+    if (reuseport) {
+        struct sock_filter steer_code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+        struct sock_fprog steer = { .len = 1, .filter = steer_code };
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: steer reuse port group to the first socket", desc);
+
+        if (setsockopt(xsock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &steer, sizeof(steer)) < 0) {
+            perror("setsockopt");
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_ATTACH_REUSEPORT_CBPF (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
+    socklen_t xsock_name_len = sizeof(*xsock_name);
+    if (getsockname(xsock, (struct sockaddr *)xsock_name, &xsock_name_len) == -1) {
+        perror("getsockname");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot get socket name (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    return xsock;
+}
+
+/**
+ * Resolve a host to an IP address.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] host The host to resolve
+ * @return A newly allocated buffer containing the IP.
+ */
+char *resolve_host(int debug_level, const char *host) {
+    struct hostent *host_info;
+    struct in_addr *address;
+    char *retval;
+
+    if ((host_info = gethostbyname(host)) == NULL) {
+        perror("gethostbyname");
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Could not resolve host %s (%d)", host, errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    address = (struct in_addr *)(host_info->h_addr);
+    if ((retval = strdup(inet_ntoa(*address))) == NULL) {
+        perror("strdup");
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Could not duplicate string (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "Resolved %s to %s", host, strdup(inet_ntoa(*address)));
+
+    return retval;
+}
+
+/**
+ * Open a file descriptor that becomes readable when a process exits.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] pid The process ID
+ * @return The process file descriptor.
+ */
+int standby_pidfd_open(int debug_level, int pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    int pidfd;
+
+    if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1) {
+        perror("pidfd_open");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot watch primary process %d (%d)", pid, errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    return pidfd;
+#else
+    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot watch primary process %d, pidfd_open is not supported", pid);
+
+    exit(EXIT_FAILURE);
+#endif
+}
+
+/* Route monitor helper functions below */
+
+#ifdef __linux__
+/**
+ * Subscribe to link, IPv4 address and IPv4 route changes.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[out] rm The route monitor to initialize
+ * @param[in] s The settings, for the send interfaces
+ */
+void route_monitor_initialize(int debug_level, struct route_monitor *rm, const struct settings *s) {
+    struct sockaddr_nl addr;
+
+    rm->interfaces[0] = s->sif;
+    rm->interfaces[1] = s->sif_failover;
+    rm->active = 0;
+
+    if ((rm->sock = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE)) == -1) {
+        perror("socket");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create netlink socket (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+
+    if (bind(rm->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot subscribe to netlink route events (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "Watching link, address and route changes for send interface %s", s->sif);
+}
+
+/**
+ * Check whether packets to the connect address can leave through an interface: the interface
+ * is up and running and the kernel has a route to the connect address through it.
+ * @param[in] ifname The interface name
+ * @param[in] caddr The connect address
+ * @return 1 if the interface is usable, 0 otherwise.
+ */
+int route_interface_usable(const char *ifname, const struct sockaddr_in *caddr) {
+    struct ifreq ifr;
+    int sock;
+    int usable = 0;
+
+    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP)) == -1) {
+        return 0;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+    /* connect() on a UDP socket only does the route lookup, restricted to the bound interface */
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) == 0 && (ifr.ifr_flags & IFF_UP) && (ifr.ifr_flags & IFF_RUNNING) &&
+            setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname)) == 0 &&
+            connect(sock, (const struct sockaddr *)caddr, sizeof(*caddr)) == 0) {
+        usable = 1;
+    }
+
+    close(sock);
+
+    return usable;
+}
+
+/**
+ * Bind the send socket to the first usable send interface, the configured one before the failover.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] rm The route monitor
+ * @param[in,out] r The forwarding state, for the send socket and statistics
+ * @param[in] event When the event leading to the update was received
+ */
+void route_monitor_update(int debug_level, struct route_monitor *rm, struct redirector *r, const struct timespec *event) {
+    struct timespec switched;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (rm->interfaces[i] != NULL && route_interface_usable(rm->interfaces[i], &(r->caddr))) {
+            break;
+        }
+    }
+
+    if (i == 2) {
+        DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "No usable send interface, staying on %s", rm->interfaces[rm->active]);
+
+        return;
+    }
+    if (i == rm->active) {
+        return;
+    }
+
+    if (setsockopt(r->ssock, SOL_SOCKET, SO_BINDTODEVICE, rm->interfaces[i], strlen(rm->interfaces[i])) == -1) {
+        perror("setsockopt");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot move send socket to interface %s (%d)", rm->interfaces[i], errno);
+
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &switched);
+
+    r->st->count_send_interface_switch++;
+    r->st->time_send_interface_switch = (uint64_t)((switched.tv_sec - event->tv_sec) * 1000000000LL + (switched.tv_nsec - event->tv_nsec));
+
+    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Send interface switched from %s to %s in %.1lfus",
+            rm->interfaces[rm->active], rm->interfaces[i], (double)r->st->time_send_interface_switch / 1000);
+
+    rm->active = i;
+
+    /* The packets leave with another source address */
+    if (r->s->cakey != NULL) {
+        admission_source_update(debug_level, r, rm->interfaces[i]);
+    }
+}
+
+/**
+ * Read the pending netlink messages, count them and update the send interface if needed.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] rm The route monitor
+ * @param[in,out] r The forwarding state, for the send socket and statistics
+ */
+void route_monitor_receive(int debug_level, struct route_monitor *rm, struct redirector *r) {
+    char buffer[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+    struct timespec event;
+    int changed = 0;
+    int len;
+
+    clock_gettime(CLOCK_MONOTONIC, &event);
+
+    while ((len = recv(rm->sock, buffer, sizeof(buffer), 0)) > 0) {
+        struct nlmsghdr *nh;
+
+        for (nh = (struct nlmsghdr *)buffer; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            switch (nh->nlmsg_type) {
+                case RTM_NEWLINK:
+                case RTM_DELLINK:
+                    r->st->count_send_link_event++;
+                    changed = 1;
+
+                    break;
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                    r->st->count_send_address_event++;
+                    changed = 1;
+
+                    break;
+                case RTM_NEWROUTE:
+                case RTM_DELROUTE:
+                    r->st->count_send_route_event++;
+                    changed = 1;
+
+                    break;
+            }
+        }
+    }
+    if (len == -1 && errno == ENOBUFS) { /* Events were lost, check anyway */
+        changed = 1;
+    }
+
+    if (changed) {
+        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "Link, address or route change, checking send interface");
+
+        route_monitor_update(debug_level, rm, r, &event);
+    }
+}
+#endif
+
+/* Conntrack helper functions below */
+
+#ifdef __linux__
+/**
+ * Check whether connection tracking is loaded, in which case it processes every packet.
+ * @return 1 if conntrack is active, 0 otherwise.
+ */
+int conntrack_active(void) {
+    return access("/proc/sys/net/netfilter/nf_conntrack_count", R_OK) == 0;
+}
+
+/**
+ * Run nftables commands. nft is run from its usual absolute paths, with a fixed environment,
+ * instead of searching the inherited PATH.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] commands The commands, in nft -f syntax
+ * @return 0 on success, -1 otherwise.
+ */
+int conntrack_nft(int debug_level, const char *commands) {
+    static const char *paths[] = { "/usr/sbin/nft", "/sbin/nft", "/usr/bin/nft", "/bin/nft" };
+    static char *const environment[] = { "PATH=/usr/sbin:/usr/bin:/sbin:/bin", NULL };
+    const char *path = NULL;
+    size_t length = strlen(commands);
+    size_t written = 0;
+    int fds[2];
+    pid_t pid;
+    int status;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(paths) / sizeof(paths[0])) && path == NULL; i++) {
+        if (access(paths[i], X_OK) == 0) {
+            path = paths[i];
+        }
+    }
+    if (path == NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot find nft in /usr/sbin, /sbin, /usr/bin or /bin");
+
+        return -1;
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "%s -f -:\n%s", path, commands);
+
+    if (pipe(fds) == -1) {
+        perror("pipe");
+
+        return -1;
+    }
+
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+
+        return -1;
+    }
+
+    if (pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execle(path, "nft", "-f", "-", (char *)NULL, environment);
+        _exit(127);
+    }
+
+    close(fds[0]);
+    while (written < length) {
+        ssize_t retval = write(fds[1], commands + written, length - written);
+
+        if (retval == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += retval;
+    }
+    close(fds[1]);
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (written < length || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Install notrack rules for the listen port and the connect address tuple, in a table owned
+ * by this process and removed at exit.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] r The forwarding state, with the sockets bound
+ */
+void conntrack_bypass_install(int debug_level, const struct redirector *r) {
+    char commands[2048];
+    char ldaddr[INET_ADDRSTRLEN + 16] = "";
+    char lsaddr[INET_ADDRSTRLEN + 16] = "";
+    char caddr[INET_ADDRSTRLEN];
+    char table[sizeof(conntrack_table)];
+
+    if (!conntrack_active()) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Conntrack is not active, no notrack rules needed");
+
+        return;
+    }
+
+    snprintf(table, sizeof(table), "udp_redirect_%d", (int)getpid());
+    inet_ntop(AF_INET, &(r->caddr.sin_addr), caddr, sizeof(caddr));
+
+    if (r->lsock_name.sin_addr.s_addr != INADDR_ANY) {
+        char address[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &(r->lsock_name.sin_addr), address, sizeof(address));
+        snprintf(ldaddr, sizeof(ldaddr), "ip daddr %s ", address);
+        snprintf(lsaddr, sizeof(lsaddr), "ip saddr %s ", address);
+    }
+
+    /* Raw priority, so packets are marked before conntrack sees them. The table is created and flushed
+       first: a table left behind by a killed process with the same pid would otherwise be merged into. */
+    snprintf(commands, sizeof(commands),
+            "add table ip %s\n"
+            "flush table ip %s\n"
+            "table ip %s {\n"
+            "    chain prerouting {\n"
+            "        type filter hook prerouting priority raw; policy accept;\n"
+            "        %sudp dport %d notrack\n"
+            "        ip saddr %s udp sport %d udp dport %d notrack\n"
+            "    }\n"
+            "    chain output {\n"
+            "        type filter hook output priority raw; policy accept;\n"
+            "        %sudp sport %d notrack\n"
+            "        ip daddr %s udp dport %d udp sport %d notrack\n"
+            "    }\n"
+            "}\n",
+            table, table, table,
+            ldaddr, ntohs(r->lsock_name.sin_port),
+            caddr, ntohs(r->caddr.sin_port), ntohs(r->ssock_name.sin_port),
+            lsaddr, ntohs(r->lsock_name.sin_port),
+            caddr, ntohs(r->caddr.sin_port), ntohs(r->ssock_name.sin_port));
+
+    if (conntrack_nft(debug_level, commands) == -1) {
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot install the nftables notrack rules (is nft installed, running as root?)");
+
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Conntrack bypass: nftables table ip %s installed", table);
+
+    strcpy(conntrack_table, table);
+    atexit(conntrack_bypass_remove);
+}
+
+/**
+ * Remove the notrack rules, registered with atexit().
+ */
+void conntrack_bypass_remove(void) {
+    char commands[sizeof(conntrack_table) + 32];
+
+    if (conntrack_table[0] == '\0') {
+        return;
+    }
+
+    snprintf(commands, sizeof(commands), "delete table ip %s\n", conntrack_table);
+    if (conntrack_nft(DEBUG_LEVEL_ERROR, commands) == -1) {
+        fprintf(stderr, "Cannot remove nftables table ip %s\n", conntrack_table);
+    }
+
+    conntrack_table[0] = '\0';
+}
+
+/**
+ * SIGINT / SIGTERM handler, the main loop exits (and removes the rules) once set.
+ * @param[in] signal The signal received
+ */
+void conntrack_signal(int signal) {
+    terminate_signal = signal;
+}
+
+/**
+ * Read the conntrack table size and the drop counters, summed over all CPUs.
+ * @param[out] c The counters
+ * @return 0 on success, -1 if the counters are not available.
+ */
+int conntrack_statistics_read(struct conntrack_statistics *c) {
+    char header[1024];
+    char line[1024];
+    char *columns[64];
+    int count = 0;
+    char *token, *saveptr;
+    FILE *f;
+
+    memset(c, 0, sizeof(*c));
+
+    if (affinity_read("/proc/sys/net/netfilter/nf_conntrack_count", line, sizeof(line)) == 0) {
+        c->entries = strtoul(line, NULL, 10);
+    }
+    if (affinity_read("/proc/sys/net/netfilter/nf_conntrack_max", line, sizeof(line)) == 0) {
+        c->max = strtoul(line, NULL, 10);
+    }
+
+    if ((f = fopen("/proc/net/stat/nf_conntrack", "r")) == NULL) {
+        return -1;
+    }
+
+    /* The columns differ between kernel versions, find them by name */
+    if (fgets(header, sizeof(header), f) == NULL) {
+        fclose(f);
+
+        return -1;
+    }
+    for (token = strtok_r(header, " \t\n", &saveptr); token != NULL && count < 64; token = strtok_r(NULL, " \t\n", &saveptr)) {
+        columns[count++] = token;
+    }
+
+    /* One line per CPU */
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int i = 0;
+
+        for (token = strtok_r(line, " \t\n", &saveptr); token != NULL && i < count; token = strtok_r(NULL, " \t\n", &saveptr), i++) {
+            unsigned long value = strtoul(token, NULL, 16);
+
+            if (strcmp(columns[i], "drop") == 0) {
+                c->drop += value;
+            } else if (strcmp(columns[i], "early_drop") == 0) {
+                c->early_drop += value;
+            } else if (strcmp(columns[i], "insert_failed") == 0) {
+                c->insert_failed += value;
+            } else if (strcmp(columns[i], "invalid") == 0) {
+                c->invalid += value;
+            }
+        }
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+/**
+ * Display the conntrack table size and the drops since the redirector started.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] start The counters read at startup
+ */
+void conntrack_statistics_display(int debug_level, const struct conntrack_statistics *start) {
+    struct conntrack_statistics c;
+
+    if (conntrack_statistics_read(&c) == -1) {
+        return;
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "conntrack: entries %lu of %lu, drop %lu, early drop %lu, insert failed %lu, invalid %lu",
+            c.entries, c.max, c.drop - start->drop, c.early_drop - start->early_drop,
+            c.insert_failed - start->insert_failed, c.invalid - start->invalid);
+}
+#endif
+
+/* Affinity helper functions below */
+
+#ifdef __linux__
+/**
+ * Read a small sysfs or procfs file, without the trailing newline.
+ * @param[in] path The file path
+ * @param[out] buffer The file contents
+ * @param[in] size The buffer size
+ * @return 0 on success, -1 if the file cannot be read.
+ */
+int affinity_read(const char *path, char *buffer, size_t size) {
+    FILE *f;
+    size_t len;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+
+    len = fread(buffer, 1, size - 1, f);
+    fclose(f);
+
+    while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == ' ')) {
+        len--;
+    }
+    buffer[len] = '\0';
+
+    return (len > 0)?0:-1;
+}
+
+/**
+ * Add the CPUs of a kernel CPU list (e.g., "0-3,8") to a CPU set.
+ * @param[in] list The CPU list
+ * @param[in,out] set The CPU set
+ * @return The number of CPUs added.
+ */
+int affinity_parse_list(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    int count = 0;
+
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        long cpu;
+
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+            count++;
+        }
+
+        p = (*end == ',')?end + 1:end;
+    }
+
+    return count;
+}
+
+/**
+ * Add the CPUs handling an IRQ to a CPU set, preferring the CPUs the kernel actually delivers it to.
+ * @param[in] irq The IRQ number
+ * @param[in,out] set The CPU set
+ * @return The number of CPUs added.
+ */
+int affinity_irq(int irq, cpu_set_t *set) {
+    char path[PATH_MAX];
+    char buffer[1024];
+
+    snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+    if (affinity_read(path, buffer, sizeof(buffer)) == -1) {
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+        if (affinity_read(path, buffer, sizeof(buffer)) == -1) {
+            return 0;
+        }
+    }
+
+    return affinity_parse_list(buffer, set);
+}
+
+/**
+ * Find the CPUs handling an interface's queue interrupts and the CPUs of its NUMA node.
+ * Looks at the MSI interrupts of the device (or its parent, for virtio), then falls back
+ * to the /proc/interrupts entries named after the interface.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] ifname The interface name
+ * @param[in,out] irq_cpus The CPUs handling the interface interrupts
+ * @param[in,out] node_cpus The CPUs of the interface NUMA node
+ */
+void affinity_interface(int debug_level, const char *ifname, cpu_set_t *irq_cpus, cpu_set_t *node_cpus) {
+    static const char *device_paths[] = { "device", "device/.." };
+    char path[PATH_MAX];
+    char buffer[1024];
+    int irqs = 0;
+    int node = -1;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(device_paths) / sizeof(device_paths[0]); i++) {
+        DIR *dir;
+        struct dirent *entry;
+
+        snprintf(path, sizeof(path), "/sys/class/net/%s/%s/numa_node", ifname, device_paths[i]);
+        if (node == -1 && affinity_read(path, buffer, sizeof(buffer)) == 0) {
+            node = atoi(buffer);
+        }
+
+        snprintf(path, sizeof(path), "/sys/class/net/%s/%s/msi_irqs", ifname, device_paths[i]);
+        if (irqs > 0 || (dir = opendir(path)) == NULL) {
+            continue;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9' && affinity_irq(atoi(entry->d_name), irq_cpus) > 0) {
+                irqs++;
+            }
+        }
+        closedir(dir);
+    }
+
+    if (irqs == 0) {
+        FILE *f;
+        size_t ifname_len = strlen(ifname);
+
+        if ((f = fopen("/proc/interrupts", "r")) != NULL) {
+            char line[4096];
+
+            while (fgets(line, sizeof(line), f) != NULL) {
+                char *name = strstr(line, ifname);
+
+                /* Match "eth0", "eth0-TxRx-0" but not "eth01" */
+                if (name != NULL && name > line && name[-1] == ' ' && (name[ifname_len] == '-' || name[ifname_len] == '\n') &&
+                        affinity_irq(atoi(line), irq_cpus) > 0) {
+                    irqs++;
+                }
+            }
+            fclose(f);
+        }
+    }
+
+    if (node >= 0) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (affinity_read(path, buffer, sizeof(buffer)) == 0) {
+            affinity_parse_list(buffer, node_cpus);
+        }
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Interface %s: %d queue interrupts, NUMA node %d", ifname, irqs, node);
+}
+
+/**
+ * Choose CPUs for the forwarding threads: the main thread next to the interface interrupts,
+ * on the interface NUMA node, and the workers on the remaining CPUs of that node.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] s The settings, for the listen and send interfaces
+ * @param[out] a The chosen CPUs
+ */
+void affinity_plan(int debug_level, const struct settings *s, struct affinity *a) {
+    cpu_set_t allowed, irq_cpus, node_cpus, preferred;
+    int cpu;
+    int pass;
+
+    a->count = 0;
+
+    CPU_ZERO(&irq_cpus);
+    CPU_ZERO(&node_cpus);
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot get the allowed CPUs (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    if (s->lif != NULL) {
+        affinity_interface(debug_level, s->lif, &irq_cpus, &node_cpus);
+    }
+    if (s->sif != NULL && (s->lif == NULL || strcmp(s->lif, s->sif) != 0)) {
+        affinity_interface(debug_level, s->sif, &irq_cpus, &node_cpus);
+    }
+
+    CPU_AND(&irq_cpus, &irq_cpus, &allowed);
+    CPU_AND(&node_cpus, &node_cpus, &allowed);
+    if (CPU_COUNT(&node_cpus) == 0) { /* No NUMA information, any allowed CPU is local */
+        CPU_OR(&node_cpus, &node_cpus, &allowed);
+    }
+
+    /* Main thread: an interrupt CPU on the NUMA node, any interrupt CPU, any CPU of the node */
+    CPU_AND(&preferred, &irq_cpus, &node_cpus);
+    if (CPU_COUNT(&preferred) == 0) {
+        CPU_OR(&preferred, &irq_cpus, &node_cpus);
+        if (CPU_COUNT(&irq_cpus) > 0) {
+            CPU_AND(&preferred, &preferred, &irq_cpus);
+        }
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE && a->count == 0; cpu++) {
+        if (CPU_ISSET(cpu, &preferred)) {
+            a->cpus[a->count++] = cpu;
+        }
+    }
+    if (a->count == 0) {
+        return;
+    }
+
+    /* Workers: the other CPUs of the node, the ones not busy with interrupts first */
+    for (pass = 0; pass < 2; pass++) {
+        for (cpu = 0; cpu < CPU_SETSIZE && a->count < AFFINITY_MAX_CPUS; cpu++) {
+            if (cpu != a->cpus[0] && CPU_ISSET(cpu, &node_cpus) && (CPU_ISSET(cpu, &irq_cpus) == (pass == 1))) {
+                a->cpus[a->count++] = cpu;
+            }
+        }
+    }
+}
+
+/**
+ * Pin a thread to a CPU.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] thread The thread
+ * @param[in] cpu The CPU
+ */
+void affinity_apply(int debug_level, pthread_t thread, int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if ((errno = pthread_setaffinity_np(thread, sizeof(set), &set)) != 0) {
+        perror("pthread_setaffinity_np");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot pin thread to CPU %d (%d)", cpu, errno);
+
+        exit(EXIT_FAILURE);
+    }
+}
+#endif
+
+/* Admission helper functions below */
+
+/**
+ * Rotate left a 64 bit value.
+ */
+#define ROTL64(X, B) (uint64_t)(((X) << (B)) | ((X) >> (64 - (B))))
+
+/**
+ * One SipHash round.
+ */
+#define SIPROUND(V0, V1, V2, V3) \
+        do { \
+            V0 += V1; V1 = ROTL64(V1, 13); V1 ^= V0; V0 = ROTL64(V0, 32); \
+            V2 += V3; V3 = ROTL64(V3, 16); V3 ^= V2; \
+            V0 += V3; V3 = ROTL64(V3, 21); V3 ^= V0; \
+            V2 += V1; V1 = ROTL64(V1, 17); V1 ^= V2; V2 = ROTL64(V2, 32); \
+        } while (0)
+
+/**
+ * Compute SipHash-2-4 over a buffer.
+ * @param[in] key The 128 bit key
+ * @param[in] data The data to hash
+ * @param[in] len The data length
+ * @return The 64 bit hash.
+ */
+uint64_t siphash24(const uint64_t key[2], const unsigned char *data, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    uint64_t m;
+    uint64_t b = ((uint64_t)len) << 56;
+    const unsigned char *end = data + (len & ~(size_t)7);
+    int i;
+
+    for (; data != end; data += 8) {
+        m = 0;
+        for (i = 0; i < 8; i++) {
+            m |= ((uint64_t)data[i]) << (8 * i);
+        }
+
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    for (i = 0; i < (int)(len & 7); i++) {
+        b |= ((uint64_t)data[i]) << (8 * i);
+    }
+
+    v3 ^= b;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * Initialize admission tags.
+ * @param[out] a The admission structure to initialize.
+ * @param[in] key The ADMISSION_KEY_SIZE bytes pre-shared key
+ * @param[in] epoch_seconds The epoch length in seconds
+ */
+void admission_initialize(struct admission *a, const unsigned char *key, int epoch_seconds) {
+    int i;
+
+    a->key[0] = a->key[1] = 0;
+    for (i = 0; i < 8; i++) {
+        a->key[0] |= ((uint64_t)key[i]) << (8 * i);
+        a->key[1] |= ((uint64_t)key[i + 8]) << (8 * i);
+    }
+
+    a->epoch_seconds = epoch_seconds;
+    a->epoch = -1;
+}
+
+/**
+ * Derive the per epoch keys if the epoch changed. Keys for the previous and next epoch
+ * are kept to tolerate clock skew between peers.
+ * @param[in,out] a The admission structure
+ * @param[in] now The current time
+ */
+void admission_epoch_update(struct admission *a, time_t now) {
+    time_t epoch = now / a->epoch_seconds;
+    unsigned char input[9];
+    int i, j;
+
+    if (epoch == a->epoch) {
+        return;
+    }
+
+    for (i = 0; i < 3; i++) {
+        uint64_t e = (uint64_t)(epoch - 1 + i);
+
+        for (j = 0; j < 8; j++) {
+            input[j] = (e >> (8 * j)) & 0xff;
+        }
+
+        input[8] = 0;
+        a->epoch_key[i][0] = siphash24(a->key, input, sizeof(input));
+        input[8] = 1;
+        a->epoch_key[i][1] = siphash24(a->key, input, sizeof(input));
+    }
+
+    a->epoch = epoch;
+}
+
+/**
+ * Append an admission tag for the current epoch, over the packet and the source address and port
+ * the verifier receives it from. The buffer must have ADMISSION_TAG_SIZE bytes available after the data.
+ * @param[in,out] a The admission structure
+ * @param[in,out] data The packet
+ * @param[in] len The packet length
+ * @param[in] source The source address and port the packet reaches the verifier with
+ * @param[in] now The current time
+ * @return The packet length including the tag.
+ */
+size_t admission_tag_append(struct admission *a, unsigned char *data, size_t len, const struct sockaddr_in *source, time_t now) {
+    uint64_t tag;
+    int i;
+
+    admission_epoch_update(a, now);
+
+    /* The source goes where the tag will be, the MAC input is contiguous */
+    memcpy(data + len, &(source->sin_addr.s_addr), 4);
+    memcpy(data + len + 4, &(source->sin_port), 2);
+
+    tag = siphash24(a->epoch_key[1], data, len + ADMISSION_SOURCE_SIZE);
+    for (i = 0; i < ADMISSION_TAG_SIZE; i++) {
+        data[len + i] = (tag >> (8 * i)) & 0xff;
+    }
+
+    return len + ADMISSION_TAG_SIZE;
+}
+
+/**
+ * Verify the admission tag at the end of a packet against the current, previous and next epoch,
+ * bound to the source the packet was received from. The tag is overwritten.
+ * @param[in,out] a The admission structure
+ * @param[in,out] data The packet
+ * @param[in] len The packet length, including the tag
+ * @param[in] source The packet source address and port
+ * @param[in] now The current time
+ * @return The packet length without the tag, or -1 if the tag is missing or invalid.
+ */
+int admission_tag_verify(struct admission *a, unsigned char *data, size_t len, const struct sockaddr_in *source, time_t now) {
+    size_t payload_len;
+    uint64_t tag = 0;
+    int i;
+
+    if (len < ADMISSION_TAG_SIZE) {
+        return -1;
+    }
+    payload_len = len - ADMISSION_TAG_SIZE;
+
+    admission_epoch_update(a, now);
+
+    for (i = 0; i < ADMISSION_TAG_SIZE; i++) {
+        tag |= ((uint64_t)data[payload_len + i]) << (8 * i);
+    }
+
+    /* A tag replayed from another source does not match */
+    memcpy(data + payload_len, &(source->sin_addr.s_addr), 4);
+    memcpy(data + payload_len + 4, &(source->sin_port), 2);
+
+    /* Current epoch first, it is by far the most likely match */
+    if (siphash24(a->epoch_key[1], data, payload_len + ADMISSION_SOURCE_SIZE) == tag ||
+            siphash24(a->epoch_key[0], data, payload_len + ADMISSION_SOURCE_SIZE) == tag ||
+            siphash24(a->epoch_key[2], data, payload_len + ADMISSION_SOURCE_SIZE) == tag) {
+        return (int)payload_len;
+    }
+
+    return -1;
+}
+
+/**
+ * Find the source address and port packets to the connect address are sent with, which the admission
+ * tags are bound to: the send socket address or, if it is bound to any address, the address the kernel
+ * picks for the route to the connect address (through the send interface).
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] r The forwarding state
+ * @param[in] ifname The send interface, or NULL
+ */
+void admission_source_update(int debug_level, struct redirector *r, const char *ifname) {
+    struct sockaddr_in source = r->ssock_name;
+    char print_buffer[INET_ADDRSTRLEN];
+    int sock;
+
+    if (source.sin_addr.s_addr == htonl(INADDR_ANY) && (sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP)) != -1) {
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+
+        /* connect() on a UDP socket only does the route lookup */
+#ifdef __linux__
+        if (ifname != NULL && setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname)) == -1) {
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot bind admission source lookup to interface %s (%d)", ifname, errno);
+        }
+#else
+        (void)ifname;
+#endif
+        if (connect(sock, (const struct sockaddr *)&(r->caddr), sizeof(r->caddr)) == 0 &&
+                getsockname(sock, (struct sockaddr *)&local, &local_len) == 0) {
+            source.sin_addr = local.sin_addr;
+        }
+
+        close(sock);
+    }
+
+    __atomic_store_n(&(r->cadmission_source), ((uint64_t)source.sin_addr.s_addr << 16) | source.sin_port, __ATOMIC_RELAXED);
+
+    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect admission tags bound to source (%s, %d)",
+            inet_ntop(AF_INET, &(source.sin_addr), print_buffer, INET_ADDRSTRLEN), ntohs(source.sin_port));
+}
+
+/* Tunnel helper functions below */
+
+/**
+ * Read a 32 bit little endian value.
+ */
+#define U8TO32_LE(P) ((uint32_t)(P)[0] | ((uint32_t)(P)[1] << 8) | ((uint32_t)(P)[2] << 16) | ((uint32_t)(P)[3] << 24))
+
+/**
+ * Rotate left a 32 bit value.
+ */
+#define ROTL32(X, B) (uint32_t)(((X) << (B)) | ((X) >> (32 - (B))))
+
+/**
+ * One ChaCha20 quarter round.
+ */
+#define CHACHA20_QUARTERROUND(A, B, C, D) \
+        do { \
+            A += B; D ^= A; D = ROTL32(D, 16); \
+            C += D; B ^= C; B = ROTL32(B, 12); \
+            A += B; D ^= A; D = ROTL32(D, 8); \
+            C += D; B ^= C; B = ROTL32(B, 7); \
+        } while (0)
+
+/**
+ * Compute one ChaCha20 key stream block (RFC 8439).
+ * @param[in] key The 256 bit key
+ * @param[in] counter The block counter
+ * @param[in] nonce The 96 bit nonce
+ * @param[out] out The 64 byte key stream block
+ */
+void chacha20_block(const unsigned char *key, uint32_t counter, const unsigned char *nonce, unsigned char *out) {
+    uint32_t state[16];
+    uint32_t x[16];
+    int i;
+
+    state[0] = 0x61707865; state[1] = 0x3320646e; state[2] = 0x79622d32; state[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) {
+        state[4 + i] = U8TO32_LE(key + 4 * i);
+    }
+    state[12] = counter;
+    state[13] = U8TO32_LE(nonce);
+    state[14] = U8TO32_LE(nonce + 4);
+    state[15] = U8TO32_LE(nonce + 8);
+
+    memcpy(x, state, sizeof(x));
+
+    for (i = 0; i < 10; i++) {
+        CHACHA20_QUARTERROUND(x[0], x[4], x[8], x[12]);
+        CHACHA20_QUARTERROUND(x[1], x[5], x[9], x[13]);
+        CHACHA20_QUARTERROUND(x[2], x[6], x[10], x[14]);
+        CHACHA20_QUARTERROUND(x[3], x[7], x[11], x[15]);
+        CHACHA20_QUARTERROUND(x[0], x[5], x[10], x[15]);
+        CHACHA20_QUARTERROUND(x[1], x[6], x[11], x[12]);
+        CHACHA20_QUARTERROUND(x[2], x[7], x[8], x[13]);
+        CHACHA20_QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (i = 0; i < 16; i++) {
+        uint32_t v = x[i] + state[i];
+
+        out[4 * i] = v & 0xff;
+        out[4 * i + 1] = (v >> 8) & 0xff;
+        out[4 * i + 2] = (v >> 16) & 0xff;
+        out[4 * i + 3] = (v >> 24) & 0xff;
+    }
+}
+
+/**
+ * Encrypt or decrypt a buffer in place with ChaCha20, starting at block counter 1.
+ * @param[in] key The 256 bit key
+ * @param[in] nonce The 96 bit nonce
+ * @param[in,out] data The buffer
+ * @param[in] len The buffer length
+ */
+void chacha20_xor(const unsigned char *key, const unsigned char *nonce, unsigned char *data, size_t len) {
+    unsigned char block[64];
+    uint32_t counter = 1;
+    size_t i, j;
+
+    for (i = 0; i < len; i += 64) {
+        chacha20_block(key, counter++, nonce, block);
+
+        for (j = 0; j < 64 && i + j < len; j++) {
+            data[i + j] ^= block[j];
+        }
+    }
+}
+
+/**
+ * Poly1305 state, 26 bit limbs.
+ */
+struct poly1305 {
+    uint32_t r[5];              ///< The clamped multiplier
+    uint32_t h[5];              ///< The accumulator
+    uint32_t pad[4];            ///< The final addend
+};
+
+/**
+ * Initialize Poly1305 with a one time key.
+ * @param[out] p The Poly1305 state
+ * @param[in] key The 256 bit one time key
+ */
+void poly1305_initialize(struct poly1305 *p, const unsigned char *key) {
+    p->r[0] = (U8TO32_LE(key)) & 0x3ffffff;
+    p->r[1] = (U8TO32_LE(key + 3) >> 2) & 0x3ffff03;
+    p->r[2] = (U8TO32_LE(key + 6) >> 4) & 0x3ffc0ff;
+    p->r[3] = (U8TO32_LE(key + 9) >> 6) & 0x3f03fff;
+    p->r[4] = (U8TO32_LE(key + 12) >> 8) & 0x00fffff;
+
+    memset(p->h, 0, sizeof(p->h));
+
+    p->pad[0] = U8TO32_LE(key + 16);
+    p->pad[1] = U8TO32_LE(key + 20);
+    p->pad[2] = U8TO32_LE(key + 24);
+    p->pad[3] = U8TO32_LE(key + 28);
+}
+
+/**
+ * Process data with Poly1305. The final partial block is zero padded, as required by the AEAD construction.
+ * @param[in,out] p The Poly1305 state
+ * @param[in] data The data
+ * @param[in] len The data length
+ */
+void poly1305_update_padded(struct poly1305 *p, const unsigned char *data, size_t len) {
+    const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    unsigned char block[16];
+    size_t i;
+
+    for (i = 0; i < len; i += 16) {
+        const unsigned char *m = data + i;
+        uint64_t d0, d1, d2, d3, d4;
+        uint32_t c;
+
+        if (len - i < 16) {
+            memset(block, 0, sizeof(block));
+            memcpy(block, m, len - i);
+            m = block;
+        }
+
+        h0 += (U8TO32_LE(m)) & 0x3ffffff;
+        h1 += (U8TO32_LE(m + 3) >> 2) & 0x3ffffff;
+        h2 += (U8TO32_LE(m + 6) >> 4) & 0x3ffffff;
+        h3 += (U8TO32_LE(m + 9) >> 6) & 0x3ffffff;
+        h4 += (U8TO32_LE(m + 12) >> 8) | (1 << 24);
+
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+
+    p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+/**
+ * Finish Poly1305 and output the tag.
+ * @param[in,out] p The Poly1305 state
+ * @param[out] tag The 16 byte tag
+ */
+void poly1305_finish(struct poly1305 *p, unsigned char *tag) {
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    uint32_t g0, g1, g2, g3, g4;
+    uint32_t c, mask;
+    uint64_t f;
+    int i;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* Compute h - p and select it if h >= p, in constant time */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+
+    mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    f = (uint64_t)h0 + p->pad[0]; h0 = (uint32_t)f;
+    f = (uint64_t)h1 + p->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + p->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + p->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    for (i = 0; i < 4; i++) {
+        tag[i] = (h0 >> (8 * i)) & 0xff;
+        tag[4 + i] = (h1 >> (8 * i)) & 0xff;
+        tag[8 + i] = (h2 >> (8 * i)) & 0xff;
+        tag[12 + i] = (h3 >> (8 * i)) & 0xff;
+    }
+}
+
+/**
+ * Compute the ChaCha20-Poly1305 AEAD tag over additional data and ciphertext (RFC 8439).
+ * @param[in] key The 256 bit key
+ * @param[in] nonce The 96 bit nonce
+ * @param[in] aad The additional authenticated data
+ * @param[in] aad_len The additional authenticated data length
+ * @param[in] data The ciphertext
+ * @param[in] len The ciphertext length
+ * @param[out] tag The 16 byte tag
+ */
+void chacha20_poly1305_tag(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+        const unsigned char *data, size_t len, unsigned char *tag) {
+    unsigned char block[64];
+    unsigned char lengths[16];
+    struct poly1305 p;
+    int i;
+
+    chacha20_block(key, 0, nonce, block);
+    poly1305_initialize(&p, block);
+
+    for (i = 0; i < 8; i++) {
+        lengths[i] = ((uint64_t)aad_len >> (8 * i)) & 0xff;
+        lengths[8 + i] = ((uint64_t)len >> (8 * i)) & 0xff;
+    }
+
+    poly1305_update_padded(&p, aad, aad_len);
+    poly1305_update_padded(&p, data, len);
+    poly1305_update_padded(&p, lengths, sizeof(lengths));
+    poly1305_finish(&p, tag);
+}
+
+/**
+ * Initialize a tunnel.
+ * @param[out] t The tunnel structure to initialize
+ * @param[in] key The TUNNEL_KEY_SIZE bytes pre-shared key
+ * @param[in] send_direction The nonce prefix used for packets sent
+ * @param[in] receive_direction The nonce prefix expected on packets received
+ */
+void tunnel_initialize(struct tunnel *t, const unsigned char *key, uint32_t send_direction, uint32_t receive_direction) {
+    struct timespec ts;
+
+    memcpy(t->key, key, TUNNEL_KEY_SIZE);
+    t->send_direction = send_direction;
+    t->receive_direction = receive_direction;
+
+    /* Start from the wall clock so counters keep increasing across restarts with the same key,
+       as long as the wall clock does not step back across a restart */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->send_counter = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    /* Packets captured before a restart are refused, unless sent within the allowed clock skew */
+    t->replay_top = t->send_counter - TUNNEL_CLOCK_SKEW_NS;
+    memset(t->replay_bitmap, 0, sizeof(t->replay_bitmap));
+}
+
+/**
+ * Build the nonce for a packet: direction, then counter.
+ * @param[out] nonce The 96 bit nonce
+ * @param[in] direction The direction
+ * @param[in] counter The packet counter
+ */
+static void tunnel_nonce(unsigned char *nonce, uint32_t direction, uint64_t counter) {
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        nonce[i] = (direction >> (8 * (3 - i))) & 0xff;
+    }
+    for (i = 0; i < 8; i++) {
+        nonce[4 + i] = (counter >> (8 * (7 - i))) & 0xff;
+    }
+}
+
+/**
+ * Encrypt a packet in place. The packet gets a TUNNEL_HEADER_SIZE header (the counter) in front
+ * and a TUNNEL_TAG_SIZE tag at the end; both must fit in the buffer head and tail room.
+ * @param[in,out] t The tunnel
+ * @param[in] packet The packet
+ * @param[in,out] length The packet length, updated to include the header and tag
+ * @return The start of the encrypted packet.
+ */
+char *tunnel_seal(struct tunnel *t, char *packet, int *length) {
+    unsigned char *header = (unsigned char *)packet - TUNNEL_HEADER_SIZE;
+    unsigned char nonce[TUNNEL_NONCE_SIZE];
+    struct timespec ts;
+    uint64_t now;
+    uint64_t counter = __atomic_load_n(&(t->send_counter), __ATOMIC_RELAXED);
+    uint64_t next;
+    int i;
+
+    /* Counters advance by one per packet, and jump to the wall clock (every TUNNEL_CLOCK_SKEW_NS / 2 at most,
+       the only time reordered packets can fall out of the window) once they fall half the allowed skew
+       behind it, so a restarted receiver accepts them. Workers seal concurrently. */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    do {
+        next = (counter + TUNNEL_CLOCK_SKEW_NS / 2 < now)?now:counter;
+    } while (!__atomic_compare_exchange_n(&(t->send_counter), &counter, next + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    counter = next;
+
+    for (i = 0; i < TUNNEL_HEADER_SIZE; i++) {
+        header[i] = (counter >> (8 * (7 - i))) & 0xff;
+    }
+
+    tunnel_nonce(nonce, t->send_direction, counter);
+    chacha20_xor(t->key, nonce, (unsigned char *)packet, *length);
+    chacha20_poly1305_tag(t->key, nonce, NULL, 0, (unsigned char *)packet, *length, (unsigned char *)packet + *length);
+
+    *length += TUNNEL_HEADER_SIZE + TUNNEL_TAG_SIZE;
+
+    return (char *)header;
+}
+
+/**
+ * Check a packet counter against the replay window and record it.
+ * @param[in,out] t The tunnel
+ * @param[in] counter The packet counter, already authenticated
+ * @return 0 if the counter was not seen before, -1 if it is a replay or too old.
+ */
+int tunnel_replay_check(struct tunnel *t, uint64_t counter) {
+    uint64_t index = counter / 64;
+    uint64_t top_index = t->replay_top / 64;
+    int bit = counter % 64;
+
+    if (counter + TUNNEL_REPLAY_WINDOW <= t->replay_top) {
+        return -1;
+    }
+
+    if (counter > t->replay_top) {
+        uint64_t i;
+        uint64_t clear = index - top_index;
+
+        if (clear > TUNNEL_REPLAY_WORDS) {
+            clear = TUNNEL_REPLAY_WORDS;
+        }
+        for (i = 1; i <= clear; i++) {
+            t->replay_bitmap[(top_index + i) % TUNNEL_REPLAY_WORDS] = 0;
+        }
+
+        t->replay_top = counter;
+    }
+
+    if (t->replay_bitmap[index % TUNNEL_REPLAY_WORDS] & (1ULL << bit)) {
+        return -1;
+    }
+    t->replay_bitmap[index % TUNNEL_REPLAY_WORDS] |= (1ULL << bit);
+
+    return 0;
+}
+
+/**
+ * Authenticate and decrypt a packet in place. The caller checks the counter with
+ * tunnel_replay_check() before accepting the packet.
+ * @param[in] t The tunnel
+ * @param[in] packet The encrypted packet, starting with the header
+ * @param[in,out] length The packet length, updated to the plaintext length
+ * @param[out] counter The packet counter
+ * @return The start of the plaintext, or NULL if the packet is invalid.
+ */
+char *tunnel_open(struct tunnel *t, char *packet, int *length, uint64_t *counter) {
+    unsigned char *header = (unsigned char *)packet;
+    unsigned char *data = header + TUNNEL_HEADER_SIZE;
+    unsigned char nonce[TUNNEL_NONCE_SIZE];
+    unsigned char tag[TUNNEL_TAG_SIZE];
+    unsigned char difference = 0;
+    int data_length;
+    int i;
+
+    if (*length < TUNNEL_HEADER_SIZE + TUNNEL_TAG_SIZE) {
+        return NULL;
+    }
+    data_length = *length - TUNNEL_HEADER_SIZE - TUNNEL_TAG_SIZE;
+
+    *counter = 0;
+    for (i = 0; i < TUNNEL_HEADER_SIZE; i++) {
+        *counter = (*counter << 8) | header[i];
+    }
+
+    tunnel_nonce(nonce, t->receive_direction, *counter);
+    chacha20_poly1305_tag(t->key, nonce, NULL, 0, data, data_length, tag);
+
+    for (i = 0; i < TUNNEL_TAG_SIZE; i++) {
+        difference |= tag[i] ^ data[data_length + i];
+    }
+    if (difference != 0) {
+        return NULL;
+    }
+
+    chacha20_xor(t->key, nonce, data, data_length);
+    *length = data_length;
+
+    return (char *)data;
+}
+
+/* PROXY protocol helper functions below */
+
+/**
+ * Prepend a PROXY protocol v2 header for UDP over IPv4 to a packet. The packet must have
+ * PROXY_V2_HEADER_SIZE bytes of headroom.
+ * @param[in] packet The packet
+ * @param[in] source The original packet source (the client)
+ * @param[in] destination The original packet destination (the listener)
+ * @return The start of the packet, including the header.
+ */
+char *proxy_header_prepend(char *packet, const struct sockaddr_in *source, const struct sockaddr_in *destination) {
+    unsigned char *header = (unsigned char *)packet - PROXY_V2_HEADER_SIZE;
+
+    memcpy(header, PROXY_V2_SIGNATURE, PROXY_V2_SIGNATURE_SIZE);
+    header[12] = 0x21; /* Version 2, PROXY command */
+    header[13] = 0x12; /* AF_INET, DGRAM */
+    header[14] = 0;
+    header[15] = PROXY_V2_HEADER_SIZE - PROXY_V2_FIXED_SIZE;
+
+    /* Addresses and ports are already in network byte order */
+    memcpy(header + 16, &(source->sin_addr.s_addr), 4);
+    memcpy(header + 20, &(destination->sin_addr.s_addr), 4);
+    memcpy(header + 24, &(source->sin_port), 2);
+    memcpy(header + 26, &(destination->sin_port), 2);
+
+    return (char *)header;
+}
+
+/**
+ * Parse a PROXY protocol v2 header at the start of a packet.
+ * @param[in] packet The packet
+ * @param[in] length The packet length
+ * @param[out] source The source address from the header, or INADDR_ANY if the header carries none
+ * @return The header length, 0 if the packet has no header, or -1 if the header is invalid.
+ */
+int proxy_header_parse(const char *packet, int length, struct sockaddr_in *source) {
+    const unsigned char *header = (const unsigned char *)packet;
+    int header_length;
+
+    memset(source, 0, sizeof(*source));
+    source->sin_family = AF_INET;
+
+    if (length < PROXY_V2_FIXED_SIZE || memcmp(header, PROXY_V2_SIGNATURE, PROXY_V2_SIGNATURE_SIZE) != 0) {
+        return 0;
+    }
+
+    header_length = PROXY_V2_FIXED_SIZE + ((header[14] << 8) | header[15]);
+    if ((header[12] & 0xf0) != 0x20 || header_length > length) {
+        return -1;
+    }
+
+    /* LOCAL command, or not UDP over IPv4: strip the header and keep the default destination */
+    if ((header[12] & 0x0f) != 0x01 || header[13] != 0x12) {
+        return header_length;
+    }
+
+    if (header_length < PROXY_V2_HEADER_SIZE) {
+        return -1;
+    }
+
+    memcpy(&(source->sin_addr.s_addr), header + 16, 4);
+    memcpy(&(source->sin_port), header + 24, 2);
+
+    return header_length;
+}
+
+/* Packet program helper functions below */
+
+/**
+ * Decode and verify a packet program. Programs may only jump forward, which guarantees
+ * termination, and may only call known helpers. Memory accesses are checked at run time.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[out] p The program structure to initialize
+ * @param[in] code The bytecode, 8 byte little endian eBPF instructions
+ * @param[in] len The bytecode length
+ * @return 0 if the program is valid, -1 otherwise.
+ */
+int program_load(int debug_level, struct program *p, const unsigned char *code, size_t len) {
+    int count = len / PROGRAM_INSTRUCTION_SIZE;
+    int pc;
+
+    if (len == 0 || len % PROGRAM_INSTRUCTION_SIZE != 0 || count > PROGRAM_MAX_INSTRUCTIONS) {
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid program size: %zu bytes", len);
+
+        return -1;
+    }
+
+    if ((p->instructions = calloc(count, sizeof(struct program_instruction))) == NULL) {
+        perror("calloc");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot allocate program (%d)", errno);
+
+        exit(EXIT_FAILURE);
+    }
+    p->count = count;
+
+    for (pc = 0; pc < count; pc++) {
+        const unsigned char *c = code + pc * PROGRAM_INSTRUCTION_SIZE;
+
+        p->instructions[pc].opcode = c[0];
+        p->instructions[pc].dst = c[1] & 0x0f;
+        p->instructions[pc].src = (c[1] >> 4) & 0x0f;
+        p->instructions[pc].offset = (int16_t)(c[2] | (c[3] << 8));
+        p->instructions[pc].imm = (int32_t)((uint32_t)c[4] | ((uint32_t)c[5] << 8) | ((uint32_t)c[6] << 16) | ((uint32_t)c[7] << 24));
+    }
+
+    for (pc = 0; pc < count; pc++) {
+        const struct program_instruction *insn = &p->instructions[pc];
+        uint8_t class = insn->opcode & 0x07;
+        uint8_t op = insn->opcode & 0xf0;
+        int valid = 0;
+
+        if (insn->dst > 10 || insn->src > 10) {
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Program instruction %d: invalid register", pc);
+
+            return -1;
+        }
+
+        switch (class) {
+            case EBPF_CLASS_ALU:
+            case EBPF_CLASS_ALU64:
+                if (op == EBPF_OP_END) {
+                    valid = (class == EBPF_CLASS_ALU) && (insn->imm == 16 || insn->imm == 32 || insn->imm == 64);
+                } else if (op == EBPF_OP_NEG) {
+                    valid = !(insn->opcode & EBPF_SRC_X);
+                } else if (op <= EBPF_OP_ARSH) {
+                    valid = 1;
+
+                    if (!(insn->opcode & EBPF_SRC_X) && (op == EBPF_OP_DIV || op == EBPF_OP_MOD) && insn->imm == 0) {
+                        valid = 0;
+                    }
+                    if (!(insn->opcode & EBPF_SRC_X) && (op == EBPF_OP_LSH || op == EBPF_OP_RSH || op == EBPF_OP_ARSH) &&
+                            (insn->imm < 0 || insn->imm >= ((class == EBPF_CLASS_ALU64)?64:32))) {
+                        valid = 0;
+                    }
+                }
+                valid = valid && insn->dst != 10;
+
+                break;
+            case EBPF_CLASS_JMP:
+            case EBPF_CLASS_JMP32:
+                if (insn->opcode == EBPF_OPCODE_CALL) {
+                    valid = (class == EBPF_CLASS_JMP) && insn->imm >= 1 && insn->imm <= PROGRAM_HELPER_MAX;
+                } else if (insn->opcode == EBPF_OPCODE_EXIT) {
+                    valid = 1;
+                } else if (op == EBPF_OP_JA || (op >= EBPF_OP_JEQ && op <= EBPF_OP_JSGE) || (op >= EBPF_OP_JLT && op <= EBPF_OP_JSLE)) {
+                    int target = pc + 1 + insn->offset;
+
+                    /* Forward jumps only, and never into the second half of a 64 bit load */
+                    valid = insn->offset >= 0 && target < count &&
+                        !(op == EBPF_OP_JA && (class == EBPF_CLASS_JMP32 || (insn->opcode & EBPF_SRC_X))) &&
+                        !(target > 0 && p->instructions[target - 1].opcode == EBPF_OPCODE_LDDW);
+                }
+
+                break;
+            case EBPF_CLASS_LD:
+                valid = insn->opcode == EBPF_OPCODE_LDDW && insn->src == 0 && insn->dst != 10 &&
+                    pc + 1 < count && p->instructions[pc + 1].opcode == 0;
+                pc++; /* Skip the second half */
+
+                break;
+            case EBPF_CLASS_LDX:
+                valid = (insn->opcode & 0xe0) == EBPF_MODE_MEM && insn->dst != 10;
+
+                break;
+            case EBPF_CLASS_ST:
+            case EBPF_CLASS_STX:
+                valid = (insn->opcode & 0xe0) == EBPF_MODE_MEM;
+
+                break;
+        }
+
+        if (!valid) {
+            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Program instruction %d: invalid or unsupported opcode 0x%02x", pc, insn->opcode);
+
+            return -1;
+        }
+    }
+
+    /* The program must not fall off the end */
+    if (p->instructions[count - 1].opcode != EBPF_OPCODE_EXIT) {
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Program must end with exit");
+
+        return -1;
+    }
+
+    memset(p->counters, 0, sizeof(p->counters));
+
+    return 0;
+}
+
+/**
+ * Load and verify a packet program from a file containing raw eBPF bytecode.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[out] p The program structure to initialize
+ * @param[in] filename The bytecode file name
+ */
+void program_load_file(int debug_level, struct program *p, const char *filename) {
+    unsigned char code[PROGRAM_MAX_INSTRUCTIONS * PROGRAM_INSTRUCTION_SIZE + 1];
+    size_t len;
+    FILE *f;
+
+    if ((f = fopen(filename, "rb")) == NULL) {
+        perror("fopen");
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot open program %s (%d)", filename, errno);
+
+        exit(EXIT_FAILURE);
+    }
+
+    len = fread(code, 1, sizeof(code), f);
+    fclose(f);
+
+    if (program_load(debug_level, p, code, len) == -1) {
+        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid program %s", filename);
+
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "Loaded program %s: %d instructions", filename, p->count);
+}
+
+/**
+ * Check if a memory access falls within the packet or the program stack, and translate its program
+ * address (from PROGRAM_PACKET_BASE or PROGRAM_STACK_BASE) to the host address. Offsets are compared
+ * instead of end addresses, which could wrap around for addresses near UINT64_MAX.
+ * @param[in] ctx The program context
+ * @param[in] stack The program stack
+ * @param[in] addr The access address
+ * @param[in] size The access size
+ * @return The host address, or NULL if the access is not allowed.
+ */
+static inline unsigned char *program_memory_check(const struct program_context *ctx, uint64_t *stack, uint64_t addr, int size) {
+    uint64_t length = ctx->length;
+
+    if (addr >= PROGRAM_PACKET_BASE && addr - PROGRAM_PACKET_BASE <= length &&
+            (uint64_t)size <= length - (addr - PROGRAM_PACKET_BASE)) {
+        return ctx->data + (addr - PROGRAM_PACKET_BASE);
+    }
+    if (addr >= PROGRAM_STACK_BASE && addr - PROGRAM_STACK_BASE <= PROGRAM_STACK_SIZE &&
+            (uint64_t)size <= PROGRAM_STACK_SIZE - (addr - PROGRAM_STACK_BASE)) {
+        return (unsigned char *)stack + (addr - PROGRAM_STACK_BASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Swap the byte order of the lower bits of a value.
+ * @param[in] value The value
+ * @param[in] bits The number of bits to swap, 16, 32 or 64
+ * @return The value with the byte order swapped.
+ */
+static inline uint64_t program_byteswap(uint64_t value, int bits) {
+    uint64_t retval = 0;
+    int i;
+
+    for (i = 0; i < bits / 8; i++) {
+        retval = (retval << 8) | ((value >> (8 * i)) & 0xff);
+    }
+
+    return retval;
+}
+
+/**
+ * Call a packet program helper.
+ * @param[in,out] ctx The program context
+ * @param[in] helper The helper number
+ * @param[in] reg The program registers, arguments are in r1 to r5
+ * @return The helper return value.
+ */
+static uint64_t program_helper(struct program_context *ctx, int helper, const uint64_t *reg) {
+    switch (helper) {
+        case PROGRAM_HELPER_COUNTER_ADD:
+            if (reg[1] >= PROGRAM_COUNTERS) {
+                return 0;
+            }
+
+            return __atomic_add_fetch(&(ctx->program->counters[reg[1]]), reg[2], __ATOMIC_RELAXED);
+        case PROGRAM_HELPER_COUNTER_GET:
+            if (reg[1] >= PROGRAM_COUNTERS) {
+                return 0;
+            }
+
+            return __atomic_load_n(&(ctx->program->counters[reg[1]]), __ATOMIC_RELAXED);
+        case PROGRAM_HELPER_SET_LENGTH:
+            if (reg[1] > ctx->capacity) {
+                return (uint64_t)-1;
+            }
+            if (reg[1] > ctx->length) {
+                memset(ctx->data + ctx->length, 0, reg[1] - ctx->length);
+            }
+            ctx->length = reg[1];
+
+            return 0;
+        case PROGRAM_HELPER_SET_DESTINATION:
+            ctx->destination.sin_family = AF_INET;
+            ctx->destination.sin_addr.s_addr = (uint32_t)reg[1];
+            ctx->destination.sin_port = htons((uint16_t)reg[2]);
+            ctx->destination_set = 1;
+
+            return 0;
+        case PROGRAM_HELPER_SOURCE:
+            return ((uint64_t)ctx->source->sin_addr.s_addr << 16) | ntohs(ctx->source->sin_port);
+        case PROGRAM_HELPER_DESTINATION:
+            if (ctx->original_destination->sin_port == 0) {
+                return 0;
+            }
+
+            return ((uint64_t)ctx->original_destination->sin_addr.s_addr << 16) | ntohs(ctx->original_destination->sin_port);
+    }
+
+    return 0;
+}
+
+/**
+ * Run a packet program. The program is called with r1 pointing to the packet, r2 set to
+ * the packet length and r3 set to the direction. The packet and the zeroed stack are mapped
+ * at PROGRAM_PACKET_BASE and PROGRAM_STACK_BASE, so no host address or stale host data can
+ * end up in a forwarded packet.
+ * @param[in,out] ctx The program context
+ * @return The program return value (0 drops the packet), or 0 on a run time error.
+ */
+uint64_t program_run(struct program_context *ctx) {
+    static const int program_access_size[4] = { 4, 2, 1, 8 }; /* W, H, B, DW */
+    const struct program *p = ctx->program;
+    uint64_t reg[11];
+    uint64_t stack[PROGRAM_STACK_SIZE / sizeof(uint64_t)];
+    int pc = 0;
+
+    memset(reg, 0, sizeof(reg));
+    memset(stack, 0, sizeof(stack));
+    reg[1] = PROGRAM_PACKET_BASE;
+    reg[2] = ctx->length;
+    reg[3] = ctx->direction;
+    reg[10] = PROGRAM_STACK_BASE + PROGRAM_STACK_SIZE;
+
+    while (pc < p->count) {
+        const struct program_instruction *insn = &p->instructions[pc++];
+        uint8_t class = insn->opcode & 0x07;
+        uint8_t op = insn->opcode & 0xf0;
+        uint64_t src = (insn->opcode & EBPF_SRC_X)?reg[insn->src]:(uint64_t)(int64_t)insn->imm;
+        uint64_t *dst = &reg[insn->dst];
+        unsigned char *host;
+        uint64_t addr;
+        int size;
+        int jump;
+
+        switch (class) {
+            case EBPF_CLASS_ALU64:
+                switch (op) {
+                    case EBPF_OP_ADD:  *dst += src; break;
+                    case EBPF_OP_SUB:  *dst -= src; break;
+                    case EBPF_OP_MUL:  *dst *= src; break;
+                    case EBPF_OP_DIV:  *dst = src?(*dst / src):0; break;
+                    case EBPF_OP_OR:   *dst |= src; break;
+                    case EBPF_OP_AND:  *dst &= src; break;
+                    case EBPF_OP_LSH:  *dst <<= (src & 63); break;
+                    case EBPF_OP_RSH:  *dst >>= (src & 63); break;
+                    case EBPF_OP_NEG:  *dst = -*dst; break;
+                    case EBPF_OP_MOD:  *dst = src?(*dst % src):*dst; break;
+                    case EBPF_OP_XOR:  *dst ^= src; break;
+                    case EBPF_OP_MOV:  *dst = src; break;
+                    case EBPF_OP_ARSH: *dst = (uint64_t)((int64_t)*dst >> (src & 63)); break;
+                }
+
+                break;
+            case EBPF_CLASS_ALU: {
+                uint32_t d = (uint32_t)*dst;
+                uint32_t s = (uint32_t)src;
+
+                switch (op) {
+                    case EBPF_OP_ADD:  d += s; break;
+                    case EBPF_OP_SUB:  d -= s; break;
+                    case EBPF_OP_MUL:  d *= s; break;
+                    case EBPF_OP_DIV:  d = s?(d / s):0; break;
+                    case EBPF_OP_OR:   d |= s; break;
+                    case EBPF_OP_AND:  d &= s; break;
+                    case EBPF_OP_LSH:  d <<= (s & 31); break;
+                    case EBPF_OP_RSH:  d >>= (s & 31); break;
+                    case EBPF_OP_NEG:  d = -d; break;
+                    case EBPF_OP_MOD:  d = s?(d % s):d; break;
+                    case EBPF_OP_XOR:  d ^= s; break;
+                    case EBPF_OP_MOV:  d = s; break;
+                    case EBPF_OP_ARSH: d = (uint32_t)((int32_t)d >> (s & 31)); break;
+                    case EBPF_OP_END: {
+                        /* EBPF_SRC_X selects big endian, otherwise little endian */
+                        const uint16_t one = 1;
+                        int little_endian_host = *(const uint8_t *)&one;
+                        uint64_t value = *dst;
+
+                        if (insn->imm < 64) {
+                            value &= (1ULL << insn->imm) - 1;
+                        }
+                        if (little_endian_host == !!(insn->opcode & EBPF_SRC_X)) {
+                            value = program_byteswap(value, insn->imm);
+                        }
+                        *dst = value;
+
+                        continue;
+                    }
+                }
+                *dst = d;
+
+                break;
+            }
+            case EBPF_CLASS_JMP:
+            case EBPF_CLASS_JMP32:
+                if (insn->opcode == EBPF_OPCODE_EXIT) {
+                    return reg[0];
+                }
+                if (insn->opcode == EBPF_OPCODE_CALL) {
+                    reg[0] = program_helper(ctx, insn->imm, reg);
+
+                    break;
+                }
+
+                if (class == EBPF_CLASS_JMP) {
+                    uint64_t d = *dst;
+
+                    switch (op) {
+                        case EBPF_OP_JA:   jump = 1; break;
+                        case EBPF_OP_JEQ:  jump = d == src; break;
+                        case EBPF_OP_JGT:  jump = d > src; break;
+                        case EBPF_OP_JGE:  jump = d >= src; break;
+                        case EBPF_OP_JSET: jump = (d & src) != 0; break;
+                        case EBPF_OP_JNE:  jump = d != src; break;
+                        case EBPF_OP_JSGT: jump = (int64_t)d > (int64_t)src; break;
+                        case EBPF_OP_JSGE: jump = (int64_t)d >= (int64_t)src; break;
+                        case EBPF_OP_JLT:  jump = d < src; break;
+                        case EBPF_OP_JLE:  jump = d <= src; break;
+                        case EBPF_OP_JSLT: jump = (int64_t)d < (int64_t)src; break;
+                        case EBPF_OP_JSLE: jump = (int64_t)d <= (int64_t)src; break;
+                        default:          jump = 0; break;
+                    }
+                } else {
+                    uint32_t d = (uint32_t)*dst;
+                    uint32_t s = (uint32_t)src;
+
+                    switch (op) {
+                        case EBPF_OP_JEQ:  jump = d == s; break;
+                        case EBPF_OP_JGT:  jump = d > s; break;
+                        case EBPF_OP_JGE:  jump = d >= s; break;
+                        case EBPF_OP_JSET: jump = (d & s) != 0; break;
+                        case EBPF_OP_JNE:  jump = d != s; break;
+                        case EBPF_OP_JSGT: jump = (int32_t)d > (int32_t)s; break;
+                        case EBPF_OP_JSGE: jump = (int32_t)d >= (int32_t)s; break;
+                        case EBPF_OP_JLT:  jump = d < s; break;
+                        case EBPF_OP_JLE:  jump = d <= s; break;
+                        case EBPF_OP_JSLT: jump = (int32_t)d < (int32_t)s; break;
+                        case EBPF_OP_JSLE: jump = (int32_t)d <= (int32_t)s; break;
+                        default:          jump = 0; break;
+                    }
+                }
+                if (jump) {
+                    pc += insn->offset;
+                }
+
+                break;
+            case EBPF_CLASS_LD: /* 64 bit immediate load, verified at load time */
+                *dst = (uint32_t)insn->imm | ((uint64_t)(uint32_t)p->instructions[pc].imm << 32);
+                pc++;
+
+                break;
+            case EBPF_CLASS_LDX:
+            case EBPF_CLASS_ST:
+            case EBPF_CLASS_STX:
+                size = program_access_size[(insn->opcode >> 3) & 0x03];
+                addr = ((class == EBPF_CLASS_LDX)?reg[insn->src]:*dst) + insn->offset;
+
+                if ((host = program_memory_check(ctx, stack, addr, size)) == NULL) {
+                    ctx->error = 1;
+
+                    return 0;
+                }
+
+                if (class == EBPF_CLASS_LDX) {
+                    uint8_t v8; uint16_t v16; uint32_t v32; uint64_t v64;
+
+                    switch (size) {
+                        case 1: memcpy(&v8, host, 1); *dst = v8; break;
+                        case 2: memcpy(&v16, host, 2); *dst = v16; break;
+                        case 4: memcpy(&v32, host, 4); *dst = v32; break;
+                        default: memcpy(&v64, host, 8); *dst = v64; break;
+                    }
+                } else {
+                    uint64_t value = (class == EBPF_CLASS_STX)?reg[insn->src]:(uint64_t)(int64_t)insn->imm;
+                    uint8_t v8 = value; uint16_t v16 = value; uint32_t v32 = value;
+
+                    switch (size) {
+                        case 1: memcpy(host, &v8, 1); break;
+                        case 2: memcpy(host, &v16, 2); break;
+                        case 4: memcpy(host, &v32, 4); break;
+                        default: memcpy(host, &value, 8); break;
+                    }
+                }
+
+                break;
+        }
+    }
+
+    /* Not reached for verified programs */
+    ctx->error = 1;
+
+    return 0;
+}
+
+/**
+ * Run a packet program on a packet about to be forwarded.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in,out] p The program
+ * @param[in] direction The packet direction, see PACKET_DIRECTION
+ * @param[in,out] packet The packet, may be modified by the program
+ * @param[in] length The packet length
+ * @param[in] source The packet source
+ * @param[in] original_destination The address and port the packet was sent to, port 0 if unknown
+ * @param[out] destination The packet destination, if changed by the program
+ * @param[out] destination_set Set if the program changed the destination
+ * @return The new packet length, or -1 if the packet must be dropped.
+ */
+int program_packet(int debug_level, struct program *p, int direction, char *packet, int length,
+        const struct sockaddr_in *source, const struct sockaddr_in *original_destination, struct sockaddr_in *destination, int *destination_set) {
+    struct program_context ctx;
+
+    ctx.program = p;
+    ctx.data = (unsigned char *)packet;
+    ctx.length = length;
+    ctx.capacity = UDP_PAYLOAD_MAX;
+    ctx.direction = direction;
+    ctx.source = source;
+    ctx.original_destination = original_destination;
+    ctx.destination_set = 0;
+    ctx.error = 0;
+
+    if (program_run(&ctx) == 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "Program %s packet (%s)",
+                ctx.error?"aborted on":"dropped", (direction == PACKET_DIRECTION_LISTEN)?"LISTEN PORT":"SEND PORT");
+
+        return -1;
+    }
+
+    if (ctx.destination_set) {
+        *destination = ctx.destination;
+        *destination_set = 1;
+    }
+
+    return (int)ctx.length;
+}
+
+/* Query cache helper functions below */
+
+/**
+ * Parse the query cache rules and the challenge prefix.
+ * @param[out] q The query cache to initialize
+ * @param[in] s The settings
+ * @return 0 on success, -1 if a rule is invalid.
+ */
+int query_cache_initialize(struct query_cache *q, const struct settings *s) {
+    int i;
+
+    q->count = 0;
+    q->ttl_ms = s->query_cache_ttl;
+    q->challenge_length = 0;
+
+    q->challenges = NULL;
+
+    if (s->query_challenge != NULL &&
+            (q->challenge_length = hex_decode(s->query_challenge, q->challenge, sizeof(q->challenge))) <= 0) {
+        return -1;
+    }
+
+    if (q->challenge_length > 0 && s->query_cache_count > 0 &&
+            (q->challenges = calloc(QUERY_CHALLENGES, sizeof(struct query_challenge))) == NULL) {
+        perror("malloc");
+
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < s->query_cache_count; i++) {
+        struct query_rule *rule = &(q->rules[i]);
+        char query[2 * QUERY_PREFIX_MAX + 1];
+        const char *response = strchr(s->query_cache[i], ':');
+
+        if (response == NULL || response - s->query_cache[i] > 2 * QUERY_PREFIX_MAX) {
+            return -1;
+        }
+
+        memcpy(query, s->query_cache[i], response - s->query_cache[i]);
+        query[response - s->query_cache[i]] = '\0';
+
+        if ((rule->query_length = hex_decode(query, rule->query, sizeof(rule->query))) <= 0 ||
+                (rule->response_length = hex_decode(response + 1, rule->response, sizeof(rule->response))) <= 0) {
+            return -1;
+        }
+
+        if ((rule->cached = malloc(UDP_PAYLOAD_MAX)) == NULL) {
+            perror("malloc");
+
+            exit(EXIT_FAILURE);
+        }
+        rule->cached_length = 0;
+        rule->query_min = 0;
+        rule->pending = 0;
+        rule->pending_length = 0;
+
+        q->count++;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the rule a query (direction LISTEN) or a response (direction CONNECT) belongs to.
+ * Only reads the rule prefixes, safe to call from the workers.
+ * @param[in] q The query cache
+ * @param[in] direction The packet direction, see PACKET_DIRECTION
+ * @param[in] payload The packet
+ * @param[in] length The packet length
+ * @return The rule index, or -1 if no rule matches.
+ */
+int query_cache_match(const struct query_cache *q, int direction, const char *payload, int length) {
+    int i;
+
+    for (i = 0; i < q->count; i++) {
+        const unsigned char *prefix = (direction == PACKET_DIRECTION_LISTEN)?q->rules[i].query:q->rules[i].response;
+        int prefix_length = (direction == PACKET_DIRECTION_LISTEN)?q->rules[i].query_length:q->rules[i].response_length;
+
+        if (length >= prefix_length && memcmp(payload, prefix, prefix_length) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Answer a query from the cache, by replacing the packet payload with the cached response.
+ * A response is only served while fresh, and to queries at least as long as the one it
+ * answered, so queries without a challenge still reach the server and get one. With a
+ * challenge prefix, it is only served to queries ending with the challenge the upstream
+ * issued to their source, so a spoofed source cannot get it.
+ * @param[in,out] q The query cache
+ * @param[in,out] p The query, replaced by the cached response on a hit
+ * @param[in] now The current monotonic time
+ * @return 1 on a hit, 0 on a miss (the query is then expected to be forwarded).
+ */
+int query_cache_lookup(struct query_cache *q, struct packet *p, const struct timespec *now) {
+    struct query_rule *rule = &(q->rules[p->query_rule]);
+
+    if (rule->cached_length > 0 && p->length >= rule->query_min &&
+            TIMESPEC_DELTA_NS(rule->cached_time, *now) < (uint64_t)q->ttl_ms * 1000000ULL &&
+            (q->challenges == NULL || query_challenge_check(q, p, now))) {
+        p->payload = p->buffer + NETWORK_BUFFER_HEADROOM;
+        memcpy(p->payload, rule->cached, rule->cached_length);
+        p->length = rule->cached_length;
+        p->ecn = ECN_NOT_ECT;
+        p->time_kernel_set = 0;
+
+        return 1;
+    }
+
+    /* The next matching response answers this query */
+    rule->pending = 1;
+    rule->pending_length = p->length;
+
+    return 0;
+}
+
+/**
+ * Store a response to a forwarded query. Challenges are never stored.
+ * @param[in,out] q The query cache
+ * @param[in] p The response
+ * @param[in] now The current monotonic time
+ * @return 1 if the response was stored, 0 otherwise.
+ */
+int query_cache_store(struct query_cache *q, const struct packet *p, const struct timespec *now) {
+    struct query_rule *rule = &(q->rules[p->query_rule]);
+
+    if (!rule->pending) {
+        return 0;
+    }
+
+    memcpy(rule->cached, p->payload, p->length);
+    rule->cached_length = p->length;
+    rule->cached_time = *now;
+    rule->query_min = rule->pending_length;
+    rule->pending = 0;
+
+    return 1;
+}
+
+/**
+ * Check whether a response is a challenge.
+ * @param[in] q The query cache
+ * @param[in] p The response
+ * @return 1 if the response starts with the challenge prefix, 0 otherwise.
+ */
+int query_cache_challenge(const struct query_cache *q, const struct packet *p) {
+    return q->challenge_length > 0 && p->length >= q->challenge_length &&
+        memcmp(p->payload, q->challenge, q->challenge_length) == 0;
+}
+
+/**
+ * Find the challenge slot of a client.
+ * @param[in] q The query cache
+ * @param[in] client The client
+ * @return The slot, which may hold the challenge of another client.
+ */
+struct query_challenge *query_challenge_slot(const struct query_cache *q, const struct sockaddr_in *client) {
+    uint32_t hash = 2166136261U;
+    const unsigned char *data = (const unsigned char *)&(client->sin_addr.s_addr);
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        hash = (hash ^ data[i]) * 16777619U;
+    }
+    data = (const unsigned char *)&(client->sin_port);
+    for (i = 0; i < 2; i++) {
+        hash = (hash ^ data[i]) * 16777619U;
+    }
+
+    return &(q->challenges[hash & (QUERY_CHALLENGES - 1)]);
+}
+
+/**
+ * Remember the challenge the upstream issued to a client, replacing any other in its slot.
+ * Challenges longer than QUERY_PREFIX_MAX are not remembered, their clients are never served from the cache.
+ * @param[in,out] q The query cache
+ * @param[in] p The challenge response
+ * @param[in] client The client the challenge is sent to
+ * @param[in] now The current monotonic time
+ */
+void query_challenge_record(struct query_cache *q, const struct packet *p, const struct sockaddr_in *client, const struct timespec *now) {
+    struct query_challenge *c = query_challenge_slot(q, client);
+    int length = p->length - q->challenge_length;
+
+    if (length <= 0 || length > QUERY_PREFIX_MAX) {
+        return;
+    }
+
+    c->client = *client;
+    memcpy(c->value, p->payload + q->challenge_length, length);
+    c->length = length;
+    c->time = *now;
+}
+
+/**
+ * Check that a query ends with the challenge recently issued to its source.
+ * @param[in] q The query cache
+ * @param[in] p The query
+ * @param[in] now The current monotonic time
+ * @return 1 if it does, 0 otherwise.
+ */
+int query_challenge_check(const struct query_cache *q, const struct packet *p, const struct timespec *now) {
+    const struct query_challenge *c = query_challenge_slot(q, &(p->source));
+
+    return c->length > 0 && c->client.sin_addr.s_addr == p->source.sin_addr.s_addr && c->client.sin_port == p->source.sin_port &&
+        TIMESPEC_DELTA_NS(c->time, *now) < (uint64_t)QUERY_CHALLENGE_SECONDS * 1000000000ULL &&
+        p->length >= c->length && memcmp(p->payload + p->length - c->length, c->value, c->length) == 0;
+}
 
-                    exit(EXIT_FAILURE);
-                }
+/* Replay buffer helper functions below */
 
-                break;
-            case 'm': /* --send-address */
-                s.saddr = optarg;
+/**
+ * Initialize the replay buffer, streams are allocated as they are first seen.
+ * @param[out] rp The replay buffer
+ * @param[in] s The settings
+ */
+void replay_initialize(struct replay *rp, const struct settings *s) {
+    unsigned char key[16];
+    int fd;
+    int i;
+
+    memset(rp, 0, sizeof(*rp));
+    rp->count = 0;
+    rp->seconds = s->replay_seconds;
+    rp->slots = s->replay_slots;
+    rp->sequence_offset = s->replay_sequence_offset;
+    rp->stream_offset = s->replay_stream_offset;
+
+    if (rp->seconds == 0) {
+        return;
+    }
 
-                break;
-            case 'n': /* --send-port */
-                s.sport = atoi(optarg);
-                if (errno != EOK) {
-                    perror("atoi");
-                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid send port: %s (%d)", optarg, errno);
+    if ((fd = open("/dev/urandom", O_RDONLY)) == -1 || read(fd, key, sizeof(key)) != sizeof(key)) {
+        perror("urandom");
 
-                    exit(EXIT_FAILURE);
-                }
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    for (i = 0; i < 8; i++) {
+        rp->cookie_key[0] |= ((uint64_t)key[i]) << (8 * i);
+        rp->cookie_key[1] |= ((uint64_t)key[i + 8]) << (8 * i);
+    }
+}
+
+/**
+ * Compute the retransmit cookie of a requester address for an epoch.
+ * @param[in] rp The replay buffer
+ * @param[in] address The requester address
+ * @param[in] epoch The epoch, monotonic seconds divided by REPLAY_COOKIE_SECONDS
+ * @return The cookie.
+ */
+uint64_t replay_cookie(const struct replay *rp, const struct sockaddr_in *address, time_t epoch) {
+    unsigned char data[4 + 2 + 8];
+    uint64_t e = (uint64_t)epoch;
+    int i;
+
+    memcpy(data, &(address->sin_addr.s_addr), 4);
+    memcpy(data + 4, &(address->sin_port), 2);
+    for (i = 0; i < 8; i++) {
+        data[6 + i] = (e >> (8 * i)) & 0xff;
+    }
+
+    return siphash24(rp->cookie_key, data, sizeof(data));
+}
+
+/**
+ * Read a 32 bit big endian value.
+ * @param[in] data The value
+ * @return The value in host order.
+ */
+uint32_t replay_read32(const char *data) {
+    const unsigned char *d = (const unsigned char *)data;
+
+    return ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16) | ((uint32_t)d[2] << 8) | (uint32_t)d[3];
+}
+
+/**
+ * Read the stream and sequence number of a feed packet (direction CONNECT), or recognize a
+ * retransmit request (direction LISTEN). Only reads the settings, safe to call from the workers.
+ * @param[in] rp The replay buffer
+ * @param[in,out] p The packet, replay_set / replay_stream / replay_sequence or replay_request are set
+ */
+void replay_classify(const struct replay *rp, struct packet *p) {
+    if (p->direction == PACKET_DIRECTION_LISTEN) {
+        p->replay_request = (p->length >= REPLAY_REQUEST_SIZE && memcmp(p->payload, REPLAY_REQUEST_MAGIC, 4) == 0);
+
+        return;
+    }
+
+    if (p->length < rp->sequence_offset + 4 || (rp->stream_offset >= 0 && p->length < rp->stream_offset + 4)) {
+        return;
+    }
+
+    p->replay_sequence = replay_read32(p->payload + rp->sequence_offset);
+    p->replay_stream = (rp->stream_offset >= 0)?replay_read32(p->payload + rp->stream_offset):0;
+    p->replay_set = 1;
+}
+
+/**
+ * Find a stream, allocating its ring the first time it is seen.
+ * @param[in,out] rp The replay buffer
+ * @param[in] id The stream identifier
+ * @param[in] create Allocate the stream if it does not exist
+ * @return The stream, or NULL if not found or the stream table is full.
+ */
+struct replay_stream *replay_stream_find(struct replay *rp, uint32_t id, int create) {
+    struct replay_stream *stream;
+    int i;
+
+    for (i = 0; i < rp->count; i++) {
+        if (rp->streams[i].id == id) {
+            return &(rp->streams[i]);
+        }
+    }
+
+    if (!create || rp->count == REPLAY_STREAMS) {
+        return NULL;
+    }
+
+    stream = &(rp->streams[rp->count]);
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+
+    if ((stream->slots = calloc(rp->slots, sizeof(struct replay_slot))) == NULL ||
+            (stream->data = malloc((size_t)rp->slots * REPLAY_SLOT_SIZE)) == NULL) {
+        perror("malloc");
+
+        exit(EXIT_FAILURE);
+    }
+
+    rp->count++;
+
+    return stream;
+}
+
+/**
+ * Keep a feed packet, as sent, and count sequence gaps.
+ * @param[in,out] rp The replay buffer
+ * @param[in] p The packet, after the transforms
+ * @param[in] now The current monotonic time
+ */
+void replay_store(struct replay *rp, const struct packet *p, const struct timespec *now) {
+    struct replay_stream *stream;
+    struct replay_slot *slot;
+    int32_t delta;
+
+    if ((stream = replay_stream_find(rp, p->replay_stream, 1)) == NULL) {
+        return;
+    }
+
+    stream->count_packet++;
+
+    /* Sequence numbers wrap, compare them as a signed distance */
+    delta = (int32_t)(p->replay_sequence - stream->next_sequence);
+    if (!stream->started || delta == 0) {
+        stream->next_sequence = p->replay_sequence + 1;
+        stream->started = 1;
+    } else if (delta > 0) {
+        stream->count_gap++;
+        stream->count_gap_missing += delta;
+        stream->next_sequence = p->replay_sequence + 1;
+    } else {
+        stream->count_late++;
+    }
+
+    if (p->length > REPLAY_SLOT_SIZE) {
+        stream->count_oversize++;
+
+        return;
+    }
+
+    slot = &(stream->slots[p->replay_sequence % rp->slots]);
+    slot->sequence = p->replay_sequence;
+    slot->length = p->length;
+    slot->time = *now;
+    memcpy(stream->data + (size_t)(p->replay_sequence % rp->slots) * REPLAY_SLOT_SIZE, p->payload, p->length);
+}
+
+/**
+ * Answer a retransmit request: "URRQ", stream, first sequence (32 bit) and count (16 bit), big endian,
+ * then the cookie (64 bit) and optional padding. A request without a valid cookie is answered with
+ * "URCK" and the cookie of the requester address, shorter than the request, so a spoofed source
+ * never gets more than it sent. Buffered packets are sent again, from the listen socket, to the
+ * requester, up to REPLAY_AMPLIFICATION times the request size.
+ * @param[in,out] r The forwarding state
+ * @param[in] p The request
+ * @param[in] now The current monotonic time
+ * @return The number of packets sent again.
+ */
+int replay_serve(struct redirector *r, const struct packet *p, const struct timespec *now) {
+    struct replay *rp = &(r->replay);
+    struct replay_stream *stream;
+    uint32_t first = replay_read32(p->payload + 8);
+    int count = ((unsigned char)p->payload[12] << 8) | (unsigned char)p->payload[13];
+    time_t epoch = now->tv_sec / REPLAY_COOKIE_SECONDS;
+    uint64_t expected = replay_cookie(rp, &(p->source), epoch);
+    uint64_t received = 0;
+    long budget = (long)p->length * REPLAY_AMPLIFICATION;
+    int sent = 0;
+    int i;
+
+    if ((stream = replay_stream_find(rp, replay_read32(p->payload + 4), 0)) == NULL) {
+        return 0;
+    }
+
+    stream->count_request++;
+
+    if (p->length >= REPLAY_REQUEST_SIZE + REPLAY_COOKIE_SIZE) {
+        received = ((uint64_t)replay_read32(p->payload + REPLAY_REQUEST_SIZE) << 32) |
+                replay_read32(p->payload + REPLAY_REQUEST_SIZE + 4);
+    }
+
+    /* A cookie from the previous epoch is still accepted, in case the epoch changed in between */
+    if (p->length < REPLAY_REQUEST_SIZE + REPLAY_COOKIE_SIZE ||
+            (received != expected && received != replay_cookie(rp, &(p->source), epoch - 1))) {
+        unsigned char reply[4 + REPLAY_COOKIE_SIZE];
+
+        memcpy(reply, REPLAY_COOKIE_MAGIC, 4);
+        for (i = 0; i < REPLAY_COOKIE_SIZE; i++) {
+            reply[4 + i] = (expected >> (8 * (REPLAY_COOKIE_SIZE - 1 - i))) & 0xff;
+        }
+
+        if (sendto(r->lsock, reply, sizeof(reply), 0, (const struct sockaddr *)&(p->source), sizeof(p->source)) == -1 &&
+                !ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+            perror("sendto");
+            DEBUG(r->debug_level, DEBUG_LEVEL_INFO, "Cannot send packet to listen port (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
+
+        stream->count_challenge++;
+
+        return 0;
+    }
+
+    if (count > REPLAY_REQUEST_MAX) {
+        count = REPLAY_REQUEST_MAX;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint32_t sequence = first + i;
+        struct replay_slot *slot = &(stream->slots[sequence % rp->slots]);
+
+        if (slot->length == 0 || slot->sequence != sequence ||
+                TIMESPEC_DELTA_NS(slot->time, *now) >= (uint64_t)rp->seconds * 1000000000ULL) {
+            stream->count_unavailable++;
+
+            continue;
+        }
+
+        /* The requester asks again for the rest, or pads its request */
+        if (slot->length > budget) {
+            stream->count_limited += count - i;
+
+            break;
+        }
+        budget -= slot->length;
+
+        if (sendto(r->lsock, stream->data + (size_t)(sequence % rp->slots) * REPLAY_SLOT_SIZE, slot->length, 0,
+                    (const struct sockaddr *)&(p->source), sizeof(p->source)) == -1) {
+            if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("sendto");
+                DEBUG(r->debug_level, DEBUG_LEVEL_INFO, "Cannot send packet to listen port (%d)", errno);
+
+                exit(EXIT_FAILURE);
+            }
+
+            continue;
+        }
+
+        stream->count_resend++;
+        sent++;
+    }
+
+    return sent;
+}
+
+/**
+ * Display the per stream replay buffer counters.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] rp The replay buffer
+ */
+void replay_statistics_display(int debug_level, const struct replay *rp) {
+    int i;
+
+    for (i = 0; i < rp->count; i++) {
+        const struct replay_stream *stream = &(rp->streams[i]);
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "replay:stream:%u: packets %lu, gaps %lu (%lu missing), late %lu, oversize %lu, "
+                "requests %lu, challenged %lu, resent %lu, limited %lu, unavailable %lu",
+                stream->id, stream->count_packet, stream->count_gap, stream->count_gap_missing, stream->count_late,
+                stream->count_oversize, stream->count_request, stream->count_challenge, stream->count_resend,
+                stream->count_limited, stream->count_unavailable);
+    }
+}
+
+/* Hedging helper functions below */
+
+/**
+ * Initialize request hedging.
+ * @param[out] h The hedging state
+ * @param[in] s The settings
+ * @return 0 on success, -1 if the hedge address or the request identifier is invalid.
+ */
+int hedge_initialize(struct hedge *h, const struct settings *s) {
+    char end;
+
+    memset(h, 0, sizeof(*h));
+
+    h->address.sin_family = AF_INET;
+    if ((h->address.sin_addr.s_addr = inet_addr(s->hedge_address)) == INADDR_NONE) {
+        return -1;
+    }
+    h->address.sin_port = htons((s->hedge_port != 0)?s->hedge_port:s->cport);
+
+    if (sscanf(s->hedge_id, "%d:%d%c", &(h->id_offset), &(h->id_length), &end) != 2 ||
+            h->id_offset < 0 || h->id_offset > UDP_PAYLOAD_MAX || h->id_length <= 0 || h->id_length > HEDGE_ID_MAX) {
+        return -1;
+    }
+
+    h->percentile = s->hedge_percentile;
+    h->budget = s->hedge_budget;
+    h->delay_ns = HEDGE_DELAY_INITIAL_US * 1000ULL;
+
+    if ((h->requests = calloc(HEDGE_REQUESTS, sizeof(struct hedge_request))) == NULL ||
+            (h->data = malloc((size_t)HEDGE_REQUESTS * HEDGE_REQUEST_SIZE)) == NULL ||
+            (h->pending = calloc(HEDGE_REQUESTS, sizeof(struct hedge_pending))) == NULL) {
+        perror("malloc");
+
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+/**
+ * Read the request identifier of a request (direction LISTEN) or a reply (direction CONNECT),
+ * before the headers for the other side are added. Only reads the settings, safe to call from the workers.
+ * @param[in] h The hedging state
+ * @param[in,out] p The packet, hedge_set / hedge_id are set
+ */
+void hedge_classify(const struct hedge *h, struct packet *p) {
+    if (p->length < h->id_offset + h->id_length) {
+        return;
+    }
+
+    memcpy(p->hedge_id, p->payload + h->id_offset, h->id_length);
+    p->hedge_set = 1;
+}
+
+/**
+ * Find the slot of a request identifier, FNV-1a hashed.
+ * @param[in] h The hedging state
+ * @param[in] id The request identifier
+ * @return The slot.
+ */
+int hedge_slot(const struct hedge *h, const unsigned char *id) {
+    uint32_t hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < h->id_length; i++) {
+        hash = (hash ^ id[i]) * 16777619U;
+    }
+
+    return hash % HEDGE_REQUESTS;
+}
+
+/**
+ * Keep a request sent to the connect address, as sent, until its hedging deadline. A request
+ * with the same slot still waiting is forgotten. Every request earns a share of a hedge.
+ * @param[in,out] h The hedging state
+ * @param[in] p The request, after the transforms
+ * @param[in] now The current monotonic time
+ */
+void hedge_track(struct hedge *h, const struct packet *p, const struct timespec *now) {
+    struct hedge_request *request;
+    int slot;
+
+    if ((h->tokens += h->budget) > HEDGE_BURST * 100) {
+        h->tokens = HEDGE_BURST * 100;
+    }
+
+    if (p->length > HEDGE_REQUEST_SIZE) {
+        return;
+    }
+
+    slot = hedge_slot(h, p->hedge_id);
+    request = &(h->requests[slot]);
+
+    memcpy(request->id, p->hedge_id, h->id_length);
+    request->length = p->length;
+    request->sent = *now;
+    request->hedged = 0;
+    request->answered = 0;
+    request->sequence = ++h->sequence;
+    memcpy(h->data + (size_t)slot * HEDGE_REQUEST_SIZE, p->payload, p->length);
+
+    /* The ring holds as many entries as there are slots, the oldest entry is stale by now */
+    if (h->tail - h->head == HEDGE_REQUESTS) {
+        h->head++;
+    }
+    h->pending[h->tail % HEDGE_REQUESTS].slot = slot;
+    h->pending[h->tail % HEDGE_REQUESTS].sequence = request->sequence;
+    h->tail++;
+}
+
+/**
+ * Match a reply to its request. Replies from the connect address update the reply latencies,
+ * including the ones arriving after the hedge answered, so the delay follows the real tail.
+ * @param[in,out] h The hedging state
+ * @param[in,out] st The statistics
+ * @param[in] p The reply
+ * @param[in] now The current monotonic time
+ * @return 1 if the reply is delivered, 0 if the request was already answered.
+ */
+int hedge_reply(struct hedge *h, struct statistics *st, const struct packet *p, const struct timespec *now) {
+    struct hedge_request *request = &(h->requests[hedge_slot(h, p->hedge_id)]);
+    int from_hedge = (p->source.sin_addr.s_addr == h->address.sin_addr.s_addr && p->source.sin_port == h->address.sin_port);
+
+    /* Not a reply to a tracked request, forward it */
+    if (request->length == 0 || memcmp(request->id, p->hedge_id, h->id_length) != 0) {
+        return 1;
+    }
+
+    if (!from_hedge) {
+        hedge_latency(h, st, TIMESPEC_DELTA_NS(request->sent, *now));
+    }
+
+    if (request->answered) {
+        request->length = 0;
+        st->count_hedge_suppress++;
+
+        return 0;
+    }
+
+    /* Only hedged requests can be answered twice */
+    if (!request->hedged) {
+        request->length = 0;
+
+        return 1;
+    }
+
+    request->answered = 1;
+    if (from_hedge) {
+        st->count_hedge_won++;
+    }
+
+    return 1;
+}
+
+/**
+ * The histogram bucket of a latency: exact below 4us, then 4 buckets per power of 2.
+ * @param[in] us The latency in microseconds
+ * @return The bucket.
+ */
+int hedge_bucket(uint64_t us) {
+    int bits;
+    int bucket;
+
+    if (us < 4) {
+        return (int)us;
+    }
+
+    bits = 63 - __builtin_clzll(us);
+    bucket = bits * 4 + (int)((us >> (bits - 2)) & 3);
+
+    return (bucket < HEDGE_HISTOGRAM_BUCKETS)?bucket:HEDGE_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * The upper limit of a histogram bucket.
+ * @param[in] bucket The bucket
+ * @return The latency in microseconds.
+ */
+uint64_t hedge_bucket_limit(int bucket) {
+    if (bucket < 4) {
+        return bucket + 1;
+    }
+
+    return (uint64_t)(4 + bucket % 4 + 1) << (bucket / 4 - 2);
+}
+
+/**
+ * Record a reply latency, and update the hedging delay every HEDGE_SAMPLES_MIN latencies.
+ * @param[in,out] h The hedging state
+ * @param[in,out] st The statistics, the current delay is displayed
+ * @param[in] ns The reply latency in nanoseconds
+ */
+void hedge_latency(struct hedge *h, struct statistics *st, uint64_t ns) {
+    unsigned long target;
+    unsigned long count = 0;
+    int i;
+
+    h->histogram[hedge_bucket(ns / 1000)]++;
+    h->samples++;
+
+    /* Halve the weight of older latencies */
+    if (h->samples >= HEDGE_SAMPLES_DECAY) {
+        h->samples = 0;
+        for (i = 0; i < HEDGE_HISTOGRAM_BUCKETS; i++) {
+            h->histogram[i] /= 2;
+            h->samples += h->histogram[i];
+        }
+    }
+
+    if (++h->samples_update < HEDGE_SAMPLES_MIN) {
+        return;
+    }
+    h->samples_update = 0;
+
+    target = (h->samples * h->percentile + 99) / 100;
+    for (i = 0; i < HEDGE_HISTOGRAM_BUCKETS - 1; i++) {
+        if ((count += h->histogram[i]) >= target) {
+            break;
+        }
+    }
+
+    h->delay_ns = hedge_bucket_limit(i) * 1000;
+    if (h->delay_ns < HEDGE_DELAY_MIN_US * 1000ULL) {
+        h->delay_ns = HEDGE_DELAY_MIN_US * 1000ULL;
+    }
+    st->time_hedge_delay = h->delay_ns;
+}
+
+/**
+ * Send the requests unanswered past the hedging delay to the hedge address, within the budget.
+ * @param[in,out] r The forwarding state
+ * @return The milliseconds until the next deadline, or -1 if no request is waiting.
+ */
+int hedge_expire(struct redirector *r) {
+    struct hedge *h = &(r->hedge);
+    struct statistics *st = r->st;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (h->head != h->tail) {
+        struct hedge_pending *pending = &(h->pending[h->head % HEDGE_REQUESTS]);
+        struct hedge_request *request = &(h->requests[pending->slot]);
+        uint64_t elapsed;
+        int sendto_retval;
+
+        /* Answered, or the slot was taken by a later request */
+        if (request->sequence != pending->sequence || request->length == 0) {
+            h->head++;
+
+            continue;
+        }
+
+        if ((elapsed = TIMESPEC_DELTA_NS(request->sent, now)) < h->delay_ns) {
+            return (int)((h->delay_ns - elapsed + 999999) / 1000000);
+        }
+
+        h->head++;
+
+        if (h->tokens < 100) {
+            st->count_hedge_budget++;
+
+            continue;
+        }
+        h->tokens -= 100;
+
+        if ((sendto_retval = sendto(r->ssock, h->data + (size_t)pending->slot * HEDGE_REQUEST_SIZE, request->length, 0,
+                    (const struct sockaddr *)&(h->address), sizeof(h->address))) == -1) {
+            if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("sendto");
+                DEBUG(r->debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to hedge address (%d)", errno);
+
+                exit(EXIT_FAILURE);
+            }
+
+            continue;
+        }
+
+        request->hedged = 1;
+
+        st->count_hedge_sent++;
+        st->count_connect_packet_send++;
+        st->count_connect_byte_send += sendto_retval;
+    }
+
+    return -1;
+}
+
+/* Publish / subscribe helper functions below */
+
+/**
+ * Initialize the subscribers, without any.
+ * @param[out] ps The subscribers
+ * @param[in] s The settings
+ * @return 0 on success, -1 if the token is invalid.
+ */
+int pubsub_initialize(struct pubsub *ps, const struct settings *s) {
+    unsigned char key[16];
+    size_t size = 1;
+    int fd;
+    int i;
+
+    memset(ps, 0, sizeof(*ps));
+    ps->sock = -1;
+
+    if ((ps->token = s->subscribe_token) != NULL) {
+        ps->token_length = strlen(ps->token);
+        if (ps->token_length == 0 || ps->token_length > PUBSUB_TOKEN_MAX) {
+            return -1;
+        }
+        for (i = 0; i < (int)ps->token_length; i++) {
+            if (ps->token[i] <= ' ' || ps->token[i] > '~') {
+                return -1;
+            }
+        }
+    }
+
+    ps->timeout = s->subscribe_timeout;
+    ps->max = s->subscribe_max;
+
+    /* At most half full, so probes stay short */
+    while (size < (size_t)ps->max * 2) {
+        size <<= 1;
+    }
+    ps->mask = size - 1;
+
+    if ((ps->subscribers = calloc(ps->max, sizeof(struct pubsub_subscriber))) == NULL ||
+            (ps->table = malloc(size * sizeof(int))) == NULL) {
+        perror("malloc");
+
+        exit(EXIT_FAILURE);
+    }
+    memset(ps->table, 0xff, size * sizeof(int));
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) == -1 || read(fd, key, sizeof(key)) != sizeof(key)) {
+        perror("urandom");
+
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    for (i = 0; i < 8; i++) {
+        ps->cookie_key[0] |= ((uint64_t)key[i]) << (8 * i);
+        ps->cookie_key[1] |= ((uint64_t)key[i + 8]) << (8 * i);
+    }
+
+    return 0;
+}
+
+/**
+ * Hash a subscriber address.
+ * @param[in] address The subscriber address
+ * @return The FNV-1a hash of the address and port.
+ */
+unsigned int pubsub_hash(const struct sockaddr_in *address) {
+    uint32_t hash = 2166136261U;
 
-                break;
-            case 'o': /* --send-interface */
-                s.sif = optarg;
+    hash = (hash ^ address->sin_addr.s_addr) * 16777619U;
+    hash = (hash ^ address->sin_port) * 16777619U;
 
-                break;
-            case 'x': /* --listen-address-strict */
-                s.lstrict = 1;
+    return hash;
+}
 
-                break;
-            case 'y': /* --connect-address-strict */
-                s.cstrict = 1;
+/**
+ * Find the table slot of a subscriber, or the free slot it would take.
+ * @param[in] ps The subscribers
+ * @param[in] address The subscriber address
+ * @return The table slot.
+ */
+unsigned int pubsub_slot(const struct pubsub *ps, const struct sockaddr_in *address) {
+    unsigned int slot = pubsub_hash(address) & ps->mask;
 
-                break;
-            case 'k': /* --listen-sender-address */
-                s.lsaddr = optarg;
+    while (ps->table[slot] != -1) {
+        const struct sockaddr_in *other = &(ps->subscribers[ps->table[slot]].address);
 
-                break;
-            case 'l': /* --listen-sender-port */
-                s.lsport = atoi(optarg);
-                if (errno != EOK) {
-                    perror("atoi");
-                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid send port: %s (%d)", optarg, errno);
+        if (other->sin_addr.s_addr == address->sin_addr.s_addr && other->sin_port == address->sin_port) {
+            break;
+        }
 
-                    exit(EXIT_FAILURE);
-                }
+        slot = (slot + 1) & ps->mask;
+    }
 
-                break;
-            case 'r': /* --ignore-errors */
-                s.eignore = 1;
+    return slot;
+}
 
-                break;
-            case 's': /* --stop-errors */
-                s.eignore = 0;
+/**
+ * The cookie a new subscriber echoes, so packets are only replicated to addresses that asked for them.
+ * @param[in] ps The subscribers
+ * @param[in] address The subscriber address
+ * @param[in] epoch The cookie epoch, the time divided by the subscribe timeout
+ * @return The cookie.
+ */
+uint64_t pubsub_cookie(const struct pubsub *ps, const struct sockaddr_in *address, time_t epoch) {
+    unsigned char data[4 + 2 + 8];
+    uint64_t e = (uint64_t)epoch;
+    int i;
+
+    memcpy(data, &(address->sin_addr.s_addr), 4);
+    memcpy(data + 4, &(address->sin_port), 2);
+    for (i = 0; i < 8; i++) {
+        data[6 + i] = (e >> (8 * i)) & 0xff;
+    }
 
-                break;
-            case 'q': /* --stats */
-                s.stats = 1;
+    return siphash24(ps->cookie_key, data, sizeof(data));
+}
 
-                break;
-            case 'z': /* --version */
-                fprintf(stderr, "udp-redirect v%s\n", UDP_REDIRECT_VERSION);
-                exit(EXIT_SUCCESS);
+/**
+ * Check a subscription token, in constant time.
+ * @param[in] ps The subscribers
+ * @param[in] token The token received, or NULL
+ * @return 1 if no token is required or the token matches, 0 otherwise.
+ */
+int pubsub_token_check(const struct pubsub *ps, const char *token) {
+    unsigned char diff = 0;
+    size_t i;
 
-                break;
-            default:
-                usage(argv0, NULL);
-                break;
-        }
+    if (ps->token == NULL) {
+        return 1;
     }
-    argc -= optind;
-    argv += optind;
-
-    if (argc != 0) {
-        usage(argv0, "Unknown argument");
+    if (token == NULL || strlen(token) != ps->token_length) {
+        return 0;
     }
 
-    if (s.lport == 0) {
-        usage(argv0, "Listen port not specified");
+    for (i = 0; i < ps->token_length; i++) {
+        diff |= token[i] ^ ps->token[i];
     }
 
-    if (s.caddr == NULL && s.chost == NULL) {
-        usage(argv0, "Connect host or address not specified");
+    return diff == 0;
+}
+
+/**
+ * Add a subscriber, or extend its subscription.
+ * @param[in,out] ps The subscribers
+ * @param[in] address The subscriber address
+ * @param[in] now The current time
+ * @return 1 if the subscriber was added, 0 if it was already subscribed, -1 if there are too many subscribers.
+ */
+int pubsub_subscribe(struct pubsub *ps, const struct sockaddr_in *address, time_t now) {
+    unsigned int slot = pubsub_slot(ps, address);
+    struct pubsub_subscriber *subscriber;
+
+    if (ps->table[slot] != -1) {
+        ps->subscribers[ps->table[slot]].expires = now + ps->timeout;
+
+        return 0;
     }
 
-    if (s.cport == 0) {
-        usage(argv0, "Connect port not specified");
+    if (ps->count == ps->max) {
+        return -1;
     }
 
-    if ((s.lsaddr != NULL && s.lsport == 0) ||
-            (s.lsaddr == NULL && s.lsport != 0)) {
-        usage(argv0, "Options --listen-sender-port and --list-sender-address must either both be specified or none");
+    subscriber = &(ps->subscribers[ps->count]);
+    subscriber->address = *address;
+    subscriber->expires = now + ps->timeout;
+    subscriber->slot = slot;
+    ps->table[slot] = ps->count++;
+
+    return 1;
+}
+
+/**
+ * Remove a subscriber. The last subscriber takes its place in the array, and the table entries
+ * after its slot move back so that lookups do not stop early.
+ * @param[in,out] ps The subscribers
+ * @param[in] index The subscriber index
+ */
+void pubsub_remove(struct pubsub *ps, int index) {
+    unsigned int hole = ps->subscribers[index].slot;
+    unsigned int slot = hole;
+    int last = ps->count - 1;
+
+    ps->table[hole] = -1;
+
+    while (ps->table[slot = (slot + 1) & ps->mask] != -1) {
+        unsigned int home = pubsub_hash(&(ps->subscribers[ps->table[slot]].address)) & ps->mask;
+
+        /* Move the entry into the hole unless its home slot lies between the hole and its slot */
+        if (((slot - home) & ps->mask) >= ((slot - hole) & ps->mask)) {
+            ps->table[hole] = ps->table[slot];
+            ps->subscribers[ps->table[hole]].slot = hole;
+            ps->table[slot] = -1;
+            hole = slot;
+        }
     }
 
-    /* Set strict mode if using lsport and csport */
-    if (s.lsaddr != NULL && s.lsport != 0) {
-        s.lstrict = 1;
+    if (index != last) {
+        ps->subscribers[index] = ps->subscribers[last];
+        ps->table[ps->subscribers[index].slot] = index;
     }
+    ps->count--;
+}
 
-    /* Resolve connect host if available */
-    if (s.chost != NULL) {
-        s.caddr = resolve_host(debug_level, s.chost);
+/**
+ * Remove a subscriber by address.
+ * @param[in,out] ps The subscribers
+ * @param[in] address The subscriber address
+ * @return 1 if the subscriber was removed, 0 if it was not subscribed.
+ */
+int pubsub_unsubscribe(struct pubsub *ps, const struct sockaddr_in *address) {
+    unsigned int slot = pubsub_slot(ps, address);
+
+    if (ps->table[slot] == -1) {
+        return 0;
     }
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "---- INFO ----");
+    pubsub_remove(ps, ps->table[slot]);
 
-//    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Debug level: %d", debug_level);
+    return 1;
+}
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen address: %s", (s.laddr != NULL)?s.laddr:"ANY");
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen port: %d", s.lport);
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen interface: %s", (s.lif != NULL)?s.lif:"ANY");
+/**
+ * Remove the subscribers whose subscription ended, once per second.
+ * @param[in,out] ps The subscribers
+ * @param[out] st The statistics
+ * @param[in] now The current time
+ */
+void pubsub_expire(struct pubsub *ps, struct statistics *st, time_t now) {
+    int i;
 
-    if (s.chost != NULL) {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect host: %s", s.chost);
+    if (ps->sweep == now) {
+        return;
     }
+    ps->sweep = now;
 
-    if (s.caddr != NULL) {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect address: %s", s.caddr);
+    /* Backwards, so the subscriber moved into a removed one was already checked */
+    for (i = ps->count - 1; i >= 0; i--) {
+        if (ps->subscribers[i].expires <= now) {
+            pubsub_remove(ps, i);
+            st->count_pubsub_expire++;
+        }
     }
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect port: %d", s.cport);
+    st->count_pubsub_subscribers = ps->count;
+}
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send address: %s", (s.saddr != NULL)?s.saddr:"ANY");
-    if (s.sport != 0) {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send port: %d", s.sport);
-    } else {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send port: %s", "ANY");
+/**
+ * Handle the datagrams received on the control port, SUBSCRIBE or UNSUBSCRIBE followed by the
+ * token=<token> and cookie=<cookie> arguments. A new subscriber is first answered with its cookie,
+ * and added once it sends SUBSCRIBE again with it.
+ * @param[in,out] r The forwarding state
+ * @param[in] now The current time
+ */
+void pubsub_control(struct redirector *r, time_t now) {
+    struct pubsub *ps = &(r->pubsub);
+    struct statistics *st = r->st;
+    int budget;
+
+    /* Simplify inet_ntop usage in DEBUG() by reserving buffers to write output */
+    char print_buffer1[INET_ADDRSTRLEN];
+
+    for (budget = 0; budget < PUBSUB_CONTROL_BUDGET; budget++) {
+        char buffer[PUBSUB_CONTROL_SIZE + 1];
+        char reply[64];
+        struct sockaddr_in source;
+        socklen_t source_len = sizeof(source);
+        char *command, *argument, *token = NULL, *cookie = NULL, *save = NULL;
+        int recvfrom_retval;
+        int reply_length = 0;
+
+        if ((recvfrom_retval = recvfrom(ps->sock, buffer, PUBSUB_CONTROL_SIZE, 0, (struct sockaddr *)&source, &source_len)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("recvfrom");
+                DEBUG(r->debug_level, DEBUG_LEVEL_INFO, "Subscribe cannot receive packet (%d)", errno);
+
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+        }
+        buffer[recvfrom_retval] = '\0';
+
+        if ((command = strtok_r(buffer, " \t\r\n", &save)) == NULL) {
+            st->count_pubsub_deny++;
+
+            continue;
+        }
+        while ((argument = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (strncmp(argument, "token=", 6) == 0) {
+                token = argument + 6;
+            } else if (strncmp(argument, "cookie=", 7) == 0) {
+                cookie = argument + 7;
+            }
+        }
+
+        if (!pubsub_token_check(ps, token)) {
+            st->count_pubsub_deny++;
+
+            DEBUG(r->debug_level, DEBUG_LEVEL_DEBUG, "SUBSCRIBE PORT invalid token from (%s, %d)",
+                    inet_ntop(AF_INET, &(source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(source.sin_port));
+
+            continue;
+        }
+
+        if (strcmp(command, "SUBSCRIBE") == 0) {
+            time_t epoch = now / ps->timeout;
+            unsigned long long expected = pubsub_cookie(ps, &source, epoch);
+            unsigned long long received = 0;
+            char end;
+            int retval;
+
+            /* A cookie from the previous epoch is still accepted, in case the epoch changed in between */
+            if (ps->table[pubsub_slot(ps, &source)] == -1 &&
+                    (cookie == NULL || sscanf(cookie, "%16llx%c", &received, &end) != 1 ||
+                     (received != expected && received != pubsub_cookie(ps, &source, epoch - 1)))) {
+                reply_length = snprintf(reply, sizeof(reply), "COOKIE %016llx\n", expected);
+            } else if ((retval = pubsub_subscribe(ps, &source, now)) == -1) {
+                st->count_pubsub_full++;
+                reply_length = snprintf(reply, sizeof(reply), "FULL\n");
+            } else {
+                if (retval == 1) {
+                    st->count_pubsub_subscribe++;
+
+                    DEBUG(r->debug_level, DEBUG_LEVEL_DEBUG, "SUBSCRIBE PORT subscriber (%s, %d) added",
+                            inet_ntop(AF_INET, &(source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(source.sin_port));
+                }
+                reply_length = snprintf(reply, sizeof(reply), "OK %d\n", ps->timeout);
+            }
+        } else if (strcmp(command, "UNSUBSCRIBE") == 0) {
+            if (pubsub_unsubscribe(ps, &source)) {
+                st->count_pubsub_unsubscribe++;
+
+                DEBUG(r->debug_level, DEBUG_LEVEL_DEBUG, "SUBSCRIBE PORT subscriber (%s, %d) removed",
+                        inet_ntop(AF_INET, &(source.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(source.sin_port));
+            }
+            reply_length = snprintf(reply, sizeof(reply), "OK\n");
+        } else {
+            st->count_pubsub_deny++;
+
+            continue;
+        }
+
+        if (sendto(ps->sock, reply, reply_length, 0, (const struct sockaddr *)&source, sizeof(source)) == -1 &&
+                errno != EAGAIN && errno != EWOULDBLOCK && !ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+            perror("sendto");
+            DEBUG(r->debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to subscribe port (%d)", errno);
+
+            exit(EXIT_FAILURE);
+        }
     }
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send interface: %s", (s.sif != NULL)?s.sif:"ANY");
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen strict: %s", s.cstrict?"ENABLED":"DISABLED");
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Connect strict: %s", s.lstrict?"ENABLED":"DISABLED");
+    st->count_pubsub_subscribers = ps->count;
+}
 
-    if (s.lsaddr != NULL) {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen only accepts packets from address: %s", s.lsaddr);
+/**
+ * Send a packet from the connect address to every subscriber, from the control socket, in
+ * batches of PUBSUB_BATCH with sendmmsg() where available. Copies that do not fit the socket
+ * send buffer are dropped.
+ * @param[in,out] r The forwarding state
+ * @param[in] p The packet
+ */
+void pubsub_publish(struct redirector *r, const struct packet *p) {
+    struct pubsub *ps = &(r->pubsub);
+    struct statistics *st = r->st;
+    int sent = 0;
+    int i = 0;
+#ifdef __linux__
+    struct iovec iov;
+
+    iov.iov_base = p->payload;
+    iov.iov_len = p->length;
+#endif
+
+    st->count_pubsub_publish++;
+
+    while (i < ps->count) {
+        int retval;
+#ifdef __linux__
+        int batch = (ps->count - i < PUBSUB_BATCH)?(ps->count - i):PUBSUB_BATCH;
+        int j;
+
+        for (j = 0; j < batch; j++) {
+            struct msghdr *msg = &(ps->messages[j].msg_hdr);
+
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_name = &(ps->subscribers[i + j].address);
+            msg->msg_namelen = sizeof(struct sockaddr_in);
+            msg->msg_iov = &iov;
+            msg->msg_iovlen = 1;
+        }
+
+        retval = sendmmsg(ps->sock, ps->messages, batch, 0);
+#else
+        retval = (sendto(ps->sock, p->payload, p->length, 0,
+                    (const struct sockaddr *)&(ps->subscribers[i].address), sizeof(struct sockaddr_in)) == -1)?-1:1;
+#endif
+        if (retval == -1) {
+            /* The send buffer is full, drop the copies for the remaining subscribers */
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                st->count_pubsub_drop += ps->count - i;
+
+                break;
+            }
+
+            if (!ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("sendmmsg");
+                DEBUG(r->debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to subscribers (%d)", errno);
+
+                exit(EXIT_FAILURE);
+            }
+
+            /* Skip the subscriber the error is about */
+            st->count_pubsub_drop++;
+            i++;
+
+            continue;
+        }
+
+        sent += retval;
+        i += retval;
     }
-    if (s.lsport != 0) {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen only accepts packets from port: %d", s.lsport);
+
+    st->count_pubsub_send += sent;
+    st->count_listen_packet_send += sent;
+    st->count_listen_byte_send += (unsigned long)sent * p->length;
+
+    DEBUG(r->debug_level, DEBUG_LEVEL_DEBUG, "SEND (SUBSCRIBE PORT): %d bytes to %d of %d subscribers", p->length, sent, ps->count);
+}
+
+/* Rate limit helper functions below */
+
+/**
+ * Initialize the rate limiter, without any source counted.
+ * @param[out] rl The rate limiter
+ * @param[in] s The settings
+ * @return 0 on success, -1 if a peer or the key is invalid.
+ */
+int rate_limit_initialize(struct rate_limit *rl, const struct settings *s) {
+    int i;
+
+    memset(rl, 0, sizeof(*rl));
+    rl->limit = s->rate_limit;
+    rl->prefix = s->rate_limit_prefix;
+    rl->mask = htonl(0xffffffffU << (32 - rl->prefix));
+    rl->sock = -1;
+    rl->interval_ms = s->gossip_interval;
+
+    /* Start above the last sequence number sent before a restart, as long as the clock does not step back */
+    if (s->gossip_peer_count > 0) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        rl->sequence = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
     }
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Ignore errors: %s", s.eignore?"ENABLED":"DISABLED");
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Display stats: %s", s.stats?"ENABLED":"DISABLED");
+    for (i = 0; i < s->gossip_peer_count; i++) {
+        char address[INET_ADDRSTRLEN];
+        int port;
+        char end;
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "---- START ----");
+        if (sscanf(s->gossip_peers[i], "%15[0-9.]:%d%c", address, &port, &end) != 2 || port <= 0 || port > 65535 ||
+                inet_pton(AF_INET, address, &(rl->peers[i].sin_addr)) != 1) {
+            return -1;
+        }
+        rl->peers[i].sin_family = AF_INET;
+        rl->peers[i].sin_port = htons(port);
+    }
+    rl->peer_count = s->gossip_peer_count;
 
-    lsock = socket_setup(debug_level, "Listen", s.laddr, s.lport, s.lif, &lsock_name); /* Set up listening socket */
-    ssock = socket_setup(debug_level, "Send", s.saddr, s.sport, s.sif, &ssock_name); /* Set up send socket */
+    if (s->gossip_key != NULL) {
+        unsigned char key[ADMISSION_KEY_SIZE];
 
-    /* Set up connect address */
-    caddr.sin_family = AF_INET;
-    if ((caddr.sin_addr.s_addr = inet_addr(s.caddr)) == INADDR_NONE) {
-        perror("inet_addr");
-        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid connect address %s (%d)", s.caddr, errno);
+        if (hex_decode(s->gossip_key, key, sizeof(key)) != ADMISSION_KEY_SIZE) {
+            return -1;
+        }
+        for (i = 0; i < 8; i++) {
+            rl->key[0] |= ((uint64_t)key[i]) << (8 * i);
+            rl->key[1] |= ((uint64_t)key[i + 8]) << (8 * i);
+        }
+        rl->keyed = 1;
+    }
+
+    if ((rl->entries = calloc(RATE_LIMIT_ENTRIES, sizeof(struct rate_entry))) == NULL ||
+            (rl->dirty = malloc(RATE_LIMIT_ENTRIES * sizeof(int))) == NULL) {
+        perror("malloc");
 
         exit(EXIT_FAILURE);
     }
-    caddr.sin_port = htons(s.cport);
 
-    endpoint.sin_addr.s_addr = 0; /* No packet received, no endpoint */
+    return 0;
+}
 
-    previous_endpoint.sin_family = AF_INET;
-    if (s.lsaddr == NULL && s.lsport == 0) {
-        previous_endpoint.sin_addr.s_addr = 0; /* No packet received, no previous endpoint */
+/**
+ * Move the counts of an entry to a later second: the current second becomes the previous one if
+ * it is the one before, the counts are dropped otherwise.
+ * @param[in,out] e The entry
+ * @param[in] window The current second
+ */
+void rate_limit_roll(struct rate_entry *e, uint32_t window) {
+    if (e->window == window) {
+        return;
+    }
+
+    /* Packets of the previous second not gossiped yet are still sent with the next message */
+    if (e->window + 1 == window) {
+        e->local[1] = e->local[0];
+        e->remote[1] = e->remote[0];
+        e->reported[1] = e->reported[0];
     } else {
-        if ((previous_endpoint.sin_addr.s_addr = inet_addr(s.lsaddr)) == INADDR_NONE) {
-            perror("inet_addr");
-            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Invalid listen packet address %s (%d)", s.lsaddr, errno);
+        e->local[1] = e->remote[1] = e->reported[1] = 0;
+    }
+    e->local[0] = e->remote[0] = e->reported[0] = 0;
+    e->window = window;
+}
 
-            exit(EXIT_FAILURE);
+/**
+ * Find the entry of a source or prefix, taking a free or outdated slot if it has none.
+ * @param[in,out] rl The rate limiter
+ * @param[in] key The source address masked to the prefix
+ * @param[in] window The current second
+ * @return The entry, rolled to the current second, or NULL if the probed slots are all in use.
+ */
+struct rate_entry *rate_limit_find(struct rate_limit *rl, uint32_t key, uint32_t window) {
+    struct rate_entry *reuse = NULL;
+    uint32_t hash = (2166136261U ^ key) * 16777619U;
+    int i;
+
+    for (i = 0; i < RATE_LIMIT_PROBES; i++) {
+        struct rate_entry *e = &(rl->entries[(hash + i) & (RATE_LIMIT_ENTRIES - 1)]);
+
+        if (e->window != 0 && e->key == key) {
+            rate_limit_roll(e, window);
+
+            return e;
+        }
+
+        /* Free, or without counts in the sliding window: can be taken, but the key may still follow */
+        if (reuse == NULL && (e->window == 0 || e->window + 1 < window)) {
+            reuse = e;
+        }
+        if (e->window == 0) {
+            break;
         }
-        previous_endpoint.sin_port = htons(s.lsport);
     }
 
-    int endpoint_len = sizeof(endpoint);
+    if (reuse != NULL) {
+        reuse->key = key;
+        reuse->window = 0;
+        rate_limit_roll(reuse, window);
+    }
 
-    ERRNO_IGNORE_INIT(errno_ignore);
-    ERRNO_IGNORE_SET(errno_ignore, EINTR); /* Always ignore EINTR */
+    return reuse;
+}
 
-    if (s.eignore == 1) { /* List of harmless recvfrom / sendto errors. Possibly incorrect. */
-        ERRNO_IGNORE_SET(errno_ignore, EAGAIN);
-        ERRNO_IGNORE_SET(errno_ignore, EHOSTUNREACH);
-        ERRNO_IGNORE_SET(errno_ignore, ENETDOWN);
-        ERRNO_IGNORE_SET(errno_ignore, ENETUNREACH);
-        ERRNO_IGNORE_SET(errno_ignore, ENOBUFS);
-        ERRNO_IGNORE_SET(errno_ignore, EPIPE);
-        ERRNO_IGNORE_SET(errno_ignore, EADDRNOTAVAIL);
+/**
+ * Count a packet from a source unless the packets allowed by this node and the peers over the
+ * last second, the previous second weighted by the part of it still in the window, reached the limit.
+ * @param[in,out] r The forwarding state
+ * @param[in] source The packet source
+ * @return 1 if the packet is allowed, 0 if it must be dropped.
+ */
+int rate_limit_allow(struct redirector *r, const struct sockaddr_in *source) {
+    struct rate_limit *rl = &(r->rate);
+    struct rate_entry *e;
+    struct timespec now;
+    uint64_t previous;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if ((e = rate_limit_find(rl, source->sin_addr.s_addr & rl->mask, (uint32_t)now.tv_sec)) == NULL) {
+        r->st->count_rate_untracked++;
+
+        return 1;
     }
 
-    DEBUG(debug_level, DEBUG_LEVEL_VERBOSE, "entering infinite loop");
+    previous = (uint64_t)(e->local[1] + e->remote[1]) * (1000000000 - now.tv_nsec) / 1000000000;
+    if ((uint64_t)e->local[0] + e->remote[0] + previous >= rl->limit) {
+        return 0;
+    }
 
-    st.time_display_first = time(NULL);
+    e->local[0]++;
 
-    /* Main loop */
-    while (1) {
-        int poll_retval;
-        int recvfrom_retval;
-        int sendto_retval;
+    if (rl->peer_count > 0 && !e->dirty) {
+        e->dirty = 1;
+        rl->dirty[rl->dirty_count++] = e - rl->entries;
+    }
 
-        now = time(NULL);
+    return 1;
+}
 
-        ufds[0].fd = lsock; ufds[0].events = POLLIN | POLLPRI; ufds[0].revents = 0;
-        ufds[1].fd = ssock; ufds[1].events = POLLIN | POLLPRI; ufds[1].revents = 0;
+/**
+ * Order gossip candidates by decreasing new packets.
+ * @param[in] a The first candidate, new packets in the high 32 bits, entry index and second (0 for the
+ * current one, 1 for the previous one) as index * 2 + second in the low 32 bits
+ * @param[in] b The second candidate
+ * @return The qsort() comparison result.
+ */
+int rate_gossip_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
 
-        DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "waiting for readable sockets");
+    return (x < y) - (x > y);
+}
 
-        if (s.stats && (now - st.time_display_last) > STATISTICS_DELAY_SECONDS) {
-            statistics_display(debug_level, &st, now);
-            st.time_display_last = now;
-        }
+/**
+ * Send the packets allowed since the last message to the peers, per second, for the GOSSIP_ENTRIES
+ * sources or prefixes and seconds with the most; the others wait for the next message.
+ * @param[in,out] r The forwarding state
+ */
+void rate_gossip_send(struct redirector *r) {
+    struct rate_limit *rl = &(r->rate);
+    unsigned char message[GOSSIP_HEADER_SIZE + GOSSIP_ENTRIES * GOSSIP_ENTRY_SIZE + GOSSIP_TAG_SIZE];
+    uint64_t *candidates;
+    int count = 0;
+    int kept = 0;
+    int length;
+    int i;
 
-        if ((poll_retval = poll(ufds, 2, 1000)) == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
+    if (rl->dirty_count == 0) {
+        return;
+    }
 
-            perror("poll");
-            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Could not check readable sockets (%d)", errno);
+    if ((candidates = malloc(2 * rl->dirty_count * sizeof(uint64_t))) == NULL) {
+        perror("malloc");
 
-            exit(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < rl->dirty_count; i++) {
+        struct rate_entry *e = &(rl->entries[rl->dirty[i]]);
+        int second;
+
+        for (second = 0; second < 2; second++) {
+            if (e->local[second] != e->reported[second]) {
+                candidates[count++] = ((uint64_t)(e->local[second] - e->reported[second]) << 32) |
+                    ((uint32_t)rl->dirty[i] * 2 + second);
+            }
         }
-        if (poll_retval == 0) {
-            DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "poll timeout");
+        e->dirty = 0;
+    }
+    qsort(candidates, count, sizeof(uint64_t), rate_gossip_compare);
+
+    memcpy(message, GOSSIP_MAGIC, 4);
+    length = GOSSIP_HEADER_SIZE;
+    rl->dirty_count = 0;
+
+    for (i = 0; i < count; i++) {
+        int index = (candidates[i] & 0xffffffffU) / 2;
+        int second = candidates[i] & 1;
+        uint32_t delta = candidates[i] >> 32;
+        struct rate_entry *e = &(rl->entries[index]);
+        uint32_t value;
+
+        if (kept == GOSSIP_ENTRIES) {
+            if (!e->dirty) {
+                e->dirty = 1;
+                rl->dirty[rl->dirty_count++] = index;
+            }
+
             continue;
         }
 
-        /* New data on the LISTEN socket */
-        if (ufds[0].revents & POLLIN || ufds[0].revents & POLLPRI) {
-            if ((recvfrom_retval = recvfrom(lsock, network_buffer, sizeof(network_buffer), 0,
-                            (struct sockaddr *)&endpoint, (socklen_t *)&endpoint_len)) == -1) {
-                if (!ERRNO_IGNORE_CHECK(errno_ignore, errno)) {
-                    perror("recvfrom");
-                    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Listen cannot receive (%d)", errno);
+        memcpy(message + length, &(e->key), 4);
+        value = htonl(e->window - second);
+        memcpy(message + length + 4, &value, 4);
+        value = htonl(delta);
+        memcpy(message + length + 8, &value, 4);
+        length += GOSSIP_ENTRY_SIZE;
+        kept++;
 
-                    exit(EXIT_FAILURE);
-                }
-            }
-            if (recvfrom_retval > 0) {
-                st.count_listen_packet_receive++;
-                st.count_listen_byte_receive += recvfrom_retval;
-
-                DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "RECEIVE (%s, %d) -> (%s, %d) (LISTEN PORT): %d bytes",
-                        inet_ntop(AF_INET, &(endpoint.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(endpoint.sin_port),
-                        inet_ntop(AF_INET, &(lsock_name.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(lsock_name.sin_port),
-                        recvfrom_retval);
-
-                /** Accept the packet IF:
-                  * - There's no previous endpoint, OR
-                  * - There is a previous endpoint, but we are not in strict mode, OR
-                  * - The previous endpoint matches the current endpoint
-                */
-                if ((previous_endpoint.sin_addr.s_addr == 0 || !s.lstrict) ||
-                        (previous_endpoint.sin_addr.s_addr == endpoint.sin_addr.s_addr &&
-                         previous_endpoint.sin_port == endpoint.sin_port)) {
-
-                    if (previous_endpoint.sin_addr.s_addr == 0 || !s.lstrict) {
-                        if (previous_endpoint.sin_addr.s_addr != endpoint.sin_addr.s_addr ||
-                                previous_endpoint.sin_port != endpoint.sin_port) {
-                            DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "LISTEN remote endpoint set to (%s, %d)", inet_ntoa(endpoint.sin_addr), ntohs(endpoint.sin_port));
-                        }
+        e->reported[second] += delta;
+    }
+    free(candidates);
 
-                        previous_endpoint.sin_addr.s_addr = endpoint.sin_addr.s_addr;
-                        previous_endpoint.sin_port = endpoint.sin_port;
-                    }
+    if (kept == 0) {
+        return;
+    }
 
-                    if ((sendto_retval = sendto(ssock, network_buffer, recvfrom_retval, 0,
-                                    (struct sockaddr *)&caddr, sizeof(caddr))) == -1) {
-                        if (!ERRNO_IGNORE_CHECK(errno_ignore, errno)) {
-                            perror("sendto");
-                            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to send port (%d)", errno);
+    message[4] = (kept >> 8) & 0xff;
+    message[5] = kept & 0xff;
+    message[6] = rl->prefix;
+    message[7] = 0;
 
-                            exit(EXIT_FAILURE);
-                        }
-                    } else { // At least one byte was sent, record it
-                        st.count_connect_packet_send++;
-                        st.count_connect_byte_send += sendto_retval;
-                    }
+    rl->sequence++;
+    for (i = 0; i < 8; i++) {
+        message[8 + i] = (rl->sequence >> (56 - 8 * i)) & 0xff;
+    }
 
-                    DEBUG(debug_level, (sendto_retval == recvfrom_retval || s.eignore == 1)?DEBUG_LEVEL_DEBUG:DEBUG_LEVEL_ERROR,
-                            "SEND (%s, %d) -> (%s, %d) (SEND PORT): %d bytes (%s WRITE %d bytes)",
-                            inet_ntop(AF_INET, &(ssock_name.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(ssock_name.sin_port),
-                            inet_ntop(AF_INET, &(caddr.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(caddr.sin_port),
-                            sendto_retval,
-                            (sendto_retval == recvfrom_retval)?"FULL":"PARTIAL", recvfrom_retval);
-                } else {
-                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "LISTEN PORT invalid source (%s, %d), was expecting (%s, %d)",
-                            inet_ntop(AF_INET, &(endpoint.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(endpoint.sin_port),
-                            inet_ntop(AF_INET, &(previous_endpoint.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(previous_endpoint.sin_port));
-                }
-            }
+    if (rl->keyed) {
+        uint64_t tag = siphash24(rl->key, message, length);
+
+        for (i = 0; i < GOSSIP_TAG_SIZE; i++) {
+            message[length++] = (tag >> (8 * i)) & 0xff;
         }
+    }
 
-        /* New data on the SEND socket */
-        if (ufds[1].revents & POLLIN || ufds[1].revents & POLLPRI) {
-            if ((recvfrom_retval = recvfrom(ssock, network_buffer, sizeof(network_buffer), 0,
-                            (struct sockaddr *)&endpoint, (socklen_t *)&endpoint_len)) == -1) {
-                if (!ERRNO_IGNORE_CHECK(errno_ignore, errno)) {
-                    perror("recvfrom");
-                    DEBUG(debug_level, DEBUG_LEVEL_INFO, "Send cannot receive packet (%d)", errno);
+    for (i = 0; i < rl->peer_count; i++) {
+        if (sendto(rl->sock, message, length, 0, (const struct sockaddr *)&(rl->peers[i]), sizeof(rl->peers[i])) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && !ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("sendto");
+                DEBUG(r->debug_level, DEBUG_LEVEL_ERROR, "Cannot send packet to gossip peer (%d)", errno);
 
-                    exit(EXIT_FAILURE);
-                }
+                exit(EXIT_FAILURE);
             }
-            if (recvfrom_retval > 0) {
-                st.count_connect_packet_receive++;
-                st.count_connect_byte_receive += recvfrom_retval;
-
-                DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "RECEIVE (%s, %d) -> (%s, %d) (SEND PORT): %d bytes",
-                        inet_ntop(AF_INET, &(endpoint.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(endpoint.sin_port),
-                        inet_ntop(AF_INET, &(ssock_name.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(ssock_name.sin_port),
-                        recvfrom_retval);
-
-                /** Accept the packet IF:
-                  * - The listen socket has received a packet, so we know the endpoint, AND
-                  * - The packet was received from the connect endpoint, OR
-                  * - We are not in strict mode
-                  */
-                if (previous_endpoint.sin_addr.s_addr != 0 &&
-                        (!s.cstrict || (caddr.sin_addr.s_addr == endpoint.sin_addr.s_addr && caddr.sin_port == endpoint.sin_port))) {
-
-                    if ((sendto_retval = sendto(lsock, network_buffer, recvfrom_retval, 0,
-                                    (struct sockaddr *)&previous_endpoint, sizeof(previous_endpoint))) == -1) {
-                        if (!ERRNO_IGNORE_CHECK(errno_ignore, errno)) {
-                            perror("sendto");
-                            DEBUG(debug_level, DEBUG_LEVEL_INFO, "Cannot send packet to listen port (%d)", errno);
 
-                            exit(EXIT_FAILURE);
-                        }
-                    } else { // At least one byte was sent, record it
-                        st.count_listen_packet_send++;
-                        st.count_listen_byte_send += sendto_retval;
-                    }
-
-                    DEBUG(debug_level, (sendto_retval == recvfrom_retval || s.eignore == 1)?DEBUG_LEVEL_DEBUG:DEBUG_LEVEL_ERROR,
-                            "SEND (%s, %d) -> (%s, %d) (LISTEN PORT): %d bytes (%s WRITE %d bytes)",
-                            inet_ntop(AF_INET, &(lsock_name.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(lsock_name.sin_port),
-                            inet_ntop(AF_INET, &(previous_endpoint.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(previous_endpoint.sin_port),
-                            sendto_retval,
-                            (sendto_retval == recvfrom_retval)?"FULL":"PARTIAL", recvfrom_retval);
-                } else {
-                    DEBUG(debug_level, DEBUG_LEVEL_ERROR, "SEND PORT invalid source (%s, %d), was expecting (%s, %d)",
-                            inet_ntop(AF_INET, &(endpoint.sin_addr), print_buffer1, INET_ADDRSTRLEN), ntohs(endpoint.sin_port),
-                            inet_ntop(AF_INET, &(caddr.sin_addr), print_buffer2, INET_ADDRSTRLEN), ntohs(caddr.sin_port));
-                }
-            }
+            continue;
         }
-    }
 
-    /* Never reached. */
-    return 0;
+        r->st->count_gossip_send++;
+    }
 }
 
-/* Network helper functions below */
-
 /**
- * Creates a UDP socket on the specified address, port and interface, returning the socket and
- * the socket name (if either arguments were NULL or 0).
- *
- * @param[in] debug_level The debug level to be used for the DEBUG() macro
- * @param[in] desc The caller description, added to debug messages
- * @param[in] xaddr The IPV4 address for the socket to be created, or NULL for INADDR_ANY
- * @param[in] xport The IPV4 port for the socket to be created, or 0 for random (decided by bind())
- * @param[in] xif The OS interface name to bind to, or NULL for all interfaces.
- * @param[out] xsock_name The name of the socket created.
- * @return The socket file descriptor as integer.
- *
+ * Send a gossip message when due.
+ * @param[in,out] r The forwarding state
+ * @return The milliseconds until the next message.
  */
-int socket_setup(const int debug_level, const char *desc, const char *xaddr, const int xport, const char *xif, struct sockaddr_in *xsock_name) {
-    int xsock;
-    const int enable = 1;
-    struct sockaddr_in addr;
+int rate_gossip_timer(struct redirector *r) {
+    struct rate_limit *rl = &(r->rate);
+    struct timespec now;
+    int64_t left;
 
-    /* Set up listening socket */
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: create", desc);
-    if ((xsock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP)) == -1) {
-        perror("socket");
-        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot create DGRAM socket (%d)", errno);
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-        exit(EXIT_FAILURE);
-    }
+    if ((int64_t)TIMESPEC_DELTA_NS(rl->gossip_next, now) >= 0) {
+        rate_gossip_send(r);
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
+        rl->gossip_next = now;
+        rl->gossip_next.tv_nsec += (long)rl->interval_ms * 1000000;
+        rl->gossip_next.tv_sec += rl->gossip_next.tv_nsec / 1000000000;
+        rl->gossip_next.tv_nsec %= 1000000000;
+    }
 
-    /* Address specified or any */
-    if (xaddr != NULL) {
-        if ((addr.sin_addr.s_addr = inet_addr(xaddr)) == INADDR_NONE) {
-            perror("inet_addr");
-            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "%s address invalid %s (%d)", desc, xaddr, errno);
+    left = (int64_t)TIMESPEC_DELTA_NS(now, rl->gossip_next);
 
-            exit(EXIT_FAILURE);
-        }
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to address %s", desc, xaddr);
-    } else {
-        addr.sin_addr.s_addr = INADDR_ANY;
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to address %s", desc, "ANY");
-    }
+    return (int)((left + 999999) / 1000000);
+}
 
-    /* Port specified or any */
-    if (xport != 0) {
-        addr.sin_port = htons(xport);
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to port %d", desc, xport);
-    } else {
-        addr.sin_port = 0;
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to port %s", desc, "ANY");
-    }
+/**
+ * Add the counts gossiped by the peers. Messages from other addresses, with another prefix length,
+ * without a valid tag or not newer than the last one accepted from the peer (replayed, or reordered)
+ * are dropped; counts for seconds outside the sliding window are ignored.
+ * @param[in,out] r The forwarding state
+ */
+void rate_gossip_receive(struct redirector *r) {
+    struct rate_limit *rl = &(r->rate);
+    struct statistics *st = r->st;
+    int budget;
+
+    for (budget = 0; budget < PUBSUB_CONTROL_BUDGET; budget++) {
+        unsigned char message[GOSSIP_HEADER_SIZE + GOSSIP_ENTRIES * GOSSIP_ENTRY_SIZE + GOSSIP_TAG_SIZE + 1];
+        struct sockaddr_in source;
+        socklen_t source_len = sizeof(source);
+        struct timespec now;
+        uint64_t sequence = 0;
+        int recvfrom_retval;
+        int count, peer, i;
 
-    if (xif != NULL) {
-#ifdef __MACH__
-        unsigned int xif_idx;
+        if ((recvfrom_retval = recvfrom(rl->sock, message, sizeof(message), 0, (struct sockaddr *)&source, &source_len)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !ERRNO_IGNORE_CHECK(r->errno_ignore, errno)) {
+                perror("recvfrom");
+                DEBUG(r->debug_level, DEBUG_LEVEL_INFO, "Gossip cannot receive packet (%d)", errno);
 
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to interface %s", desc, xif);
+                exit(EXIT_FAILURE);
+            }
 
-        if ((xif_idx = if_nametoindex(xif)) == 0) {
-            perror("if_nametoindex");
-            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot get the interface ID (%d)", errno);
+            return;
+        }
 
-            exit(EXIT_FAILURE);
+        for (peer = 0; peer < rl->peer_count; peer++) {
+            if (rl->peers[peer].sin_addr.s_addr == source.sin_addr.s_addr && rl->peers[peer].sin_port == source.sin_port) {
+                break;
+            }
         }
 
-        if (setsockopt(xsock, IPPROTO_IP, IP_BOUND_IF, &xif_idx, sizeof(xif_idx)) == -1) {
-            perror("setsockopt");
-            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket interface (%d)", errno);
+        count = (recvfrom_retval >= GOSSIP_HEADER_SIZE)?((message[4] << 8) | message[5]):-1;
+        if (peer == rl->peer_count || count <= 0 || count > GOSSIP_ENTRIES || memcmp(message, GOSSIP_MAGIC, 4) != 0 ||
+                message[6] != rl->prefix ||
+                recvfrom_retval != GOSSIP_HEADER_SIZE + count * GOSSIP_ENTRY_SIZE + (rl->keyed?GOSSIP_TAG_SIZE:0)) {
+            st->count_gossip_invalid++;
 
-            exit(EXIT_FAILURE);
+            continue;
         }
-#elif __unix__
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to interface %s", desc, xif);
 
-        if (setsockopt(xsock, SOL_SOCKET, SO_BINDTODEVICE, xif, strlen(xif)) == -1) {
-            perror("setsockopt");
-            DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket interface (%d)", errno);
+        if (rl->keyed) {
+            uint64_t tag = siphash24(rl->key, message, recvfrom_retval - GOSSIP_TAG_SIZE);
+            unsigned char diff = 0;
 
-            exit(EXIT_FAILURE);
-        }
-#endif
-    } else {
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind to interface %s", desc, "ANY");
-    }
+            for (i = 0; i < GOSSIP_TAG_SIZE; i++) {
+                diff |= message[recvfrom_retval - GOSSIP_TAG_SIZE + i] ^ ((tag >> (8 * i)) & 0xff);
+            }
+            if (diff != 0) {
+                st->count_gossip_invalid++;
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: reuse local address", desc);
+                continue;
+            }
+        }
 
-    if (setsockopt(xsock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        perror("setsockopt");
-        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket SO_REUSEADDR (%d)", errno);
+        /* The sequence number is covered by the tag, a captured message cannot be added twice */
+        for (i = 0; i < 8; i++) {
+            sequence = (sequence << 8) | message[8 + i];
+        }
+        if (sequence <= rl->peer_sequence[peer]) {
+            st->count_gossip_invalid++;
 
-        exit(EXIT_FAILURE);
-    }
+            continue;
+        }
+        rl->peer_sequence[peer] = sequence;
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: set nonblocking", desc);
-    if (fcntl(xsock, F_SETFL, O_NONBLOCK) == -1) {
-        perror("fcntl");
-        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot set socket O_NONBLOCK (%d)", errno);
+        st->count_gossip_receive++;
 
-        exit(EXIT_FAILURE);
-    }
+        clock_gettime(CLOCK_REALTIME, &now);
 
-    DEBUG(debug_level, DEBUG_LEVEL_INFO, "%s socket: bind", desc);
-    if (bind(xsock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        perror("bind");
-        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot bind socket (%d)", errno);
+        for (i = 0; i < count; i++) {
+            const unsigned char *entry = message + GOSSIP_HEADER_SIZE + i * GOSSIP_ENTRY_SIZE;
+            uint32_t key, window, delta;
+            struct rate_entry *e;
 
-        exit(EXIT_FAILURE);
-    }
+            memcpy(&key, entry, 4);
+            memcpy(&window, entry + 4, 4);
+            memcpy(&delta, entry + 8, 4);
+            window = ntohl(window);
+            delta = ntohl(delta);
 
-    socklen_t xsock_name_len = sizeof(*xsock_name);
-    if (getsockname(xsock, (struct sockaddr *)xsock_name, &xsock_name_len) == -1) {
-        perror("getsockname");
-        DEBUG(debug_level, DEBUG_LEVEL_ERROR, "Cannot get socket name (%d)", errno);
+            if ((window != (uint32_t)now.tv_sec && window + 1 != (uint32_t)now.tv_sec) ||
+                    (e = rate_limit_find(rl, key & rl->mask, (uint32_t)now.tv_sec)) == NULL) {
+                continue;
+            }
 
-        exit(EXIT_FAILURE);
+            e->remote[(window == (uint32_t)now.tv_sec)?0:1] += delta;
+        }
     }
-
-    return xsock;
 }
 
+/* Parsing helper functions below */
+
 /**
- * Resolve a host to an IP address.
- * @param[in] debug_level The debug level to be used for the DEBUG() macro
- * @param[in] host The host to resolve
- * @return A newly allocated buffer containing the IP.
+ * Decode a hexadecimal string.
+ * @param[in] hex The hexadecimal string
+ * @param[out] out The decoded bytes
+ * @param[in] out_len The size of the output buffer
+ * @return The number of decoded bytes, or -1 if the string is invalid or too long.
  */
-char *resolve_host(int debug_level, const char *host) {
-    struct hostent *host_info;
-    struct in_addr *address;
-    char *retval;
-
-    if ((host_info = gethostbyname(host)) == NULL) {
-        perror("gethostbyname");
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Could not resolve host %s (%d)", host, errno);
+int hex_decode(const char *hex, unsigned char *out, size_t out_len) {
+    size_t hex_len = strlen(hex);
+    size_t i;
 
-        exit(EXIT_FAILURE);
+    if (hex_len % 2 != 0 || hex_len / 2 > out_len) {
+        return -1;
     }
 
-    address = (struct in_addr *)(host_info->h_addr);
-    if ((retval = strdup(inet_ntoa(*address))) == NULL) {
-        perror("strdup");
-        DEBUG(debug_level, DEBUG_LEVEL_INFO, "Could not duplicate string (%d)", errno);
+    for (i = 0; i < hex_len / 2; i++) {
+        unsigned int value;
 
-        exit(EXIT_FAILURE);
+        if (sscanf(hex + 2 * i, "%2x", &value) != 1 ||
+                strchr("0123456789abcdefABCDEF", hex[2 * i]) == NULL ||
+                strchr("0123456789abcdefABCDEF", hex[2 * i + 1]) == NULL) {
+            return -1;
+        }
+        out[i] = (unsigned char)value;
     }
 
-    DEBUG(debug_level, DEBUG_LEVEL_DEBUG, "Resolved %s to %s", host, strdup(inet_ntoa(*address)));
-
-    return retval;
+    return (int)(hex_len / 2);
 }
 
 /* Settings helper functions below */
@@ -814,6 +9159,9 @@ void settings_initialize(struct settings *s) {
     s->saddr = NULL;
     s->sport = 0;
     s->sif = NULL;
+    s->sif_failover = NULL;
+
+    s->cproxy = 0;
 
     s->lstrict = 0;
     s->cstrict = 0;
@@ -821,6 +9169,71 @@ void settings_initialize(struct settings *s) {
     s->lsaddr = NULL;
     s->lsport = 0;
 
+    s->lakey = NULL;
+    s->cakey = NULL;
+    s->aepoch = ADMISSION_EPOCH_SECONDS;
+
+    s->ltkey = NULL;
+    s->ctkey = NULL;
+
+    s->program = NULL;
+
+    s->query_cache_count = 0;
+    s->query_cache_ttl = QUERY_CACHE_TTL_MS;
+    s->query_challenge = NULL;
+
+    s->replay_seconds = 0;
+    s->replay_slots = REPLAY_SLOTS;
+    s->replay_sequence_offset = 0;
+    s->replay_stream_offset = -1;
+
+    s->budget_packets = 1;
+    s->budget_cpu = 0;
+    s->budget_buffer = 0;
+    s->cpu_accounting = 0;
+
+    s->hedge_address = NULL;
+    s->hedge_port = 0;
+    s->hedge_percentile = HEDGE_PERCENTILE;
+    s->hedge_budget = HEDGE_BUDGET;
+    s->hedge_id = HEDGE_ID;
+
+    s->sk_lookup_count = 0;
+
+    s->rate_limit = 0;
+    s->rate_limit_prefix = 32;
+    s->gossip_port = 0;
+    s->gossip_peer_count = 0;
+    s->gossip_interval = GOSSIP_INTERVAL_MS;
+    s->gossip_key = NULL;
+
+    s->subscribe_port = 0;
+    s->subscribe_token = NULL;
+    s->subscribe_timeout = PUBSUB_TIMEOUT;
+    s->subscribe_max = PUBSUB_MAX;
+
+    s->egress_queue = EGRESS_QUEUE_NONE;
+    s->egress_limit = EGRESS_LIMIT;
+    s->codel_target = CODEL_TARGET_US;
+    s->codel_interval = CODEL_INTERVAL_US;
+
+    s->ecn = 0;
+    s->ecn_threshold = 0;
+
+    s->io_backend = IO_BACKEND_POLL;
+    s->busy_poll = 0;
+    s->calibrate = 0;
+    s->calibrate_cache = CALIBRATE_CACHE;
+
+    s->workers = 0;
+
+    s->affinity = 0;
+
+    s->conntrack_bypass = 0;
+
+    s->reuseport = 0;
+    s->standby = 0;
+
     s->eignore = 1;
     s->stats = 0;
 }
@@ -840,8 +9253,25 @@ void usage(const char *argv0, const char *message) {
     fprintf(stderr, "          [--listen-address <address>] --listen-port <port> [--listen-interface <interface>]\n");
     fprintf(stderr, "          [--connect-address <address> | --connect-host <hostname> --connect-port <port>\n");
     fprintf(stderr, "          [--send-address <address>] [--send-port <port>] [--send-interface <interface>]\n");
+    fprintf(stderr, "          [--send-interface-failover <interface>]\n");
+    fprintf(stderr, "          [--connect-proxy-protocol]\n");
     fprintf(stderr, "          [--list-address-strict] [--connect-address-strict]\n");
     fprintf(stderr, "          [--lsten-sender-addr <address>] [--listen-sender-port <port>]\n");
+    fprintf(stderr, "          [--listen-admission-key <key>] [--connect-admission-key <key>] [--admission-epoch <seconds>]\n");
+    fprintf(stderr, "          [--listen-tunnel-key <key>] [--connect-tunnel-key <key>]\n");
+    fprintf(stderr, "          [--packet-program <file>]\n");
+    fprintf(stderr, "          [--query-cache <query>:<response> ...] [--query-cache-ttl <milliseconds>] [--query-challenge <prefix>]\n");
+    fprintf(stderr, "          [--replay-buffer <seconds>] [--replay-slots <count>] [--replay-sequence-offset <bytes>] [--replay-stream-offset <bytes>]\n");
+    fprintf(stderr, "          [--hedge-address <address>] [--hedge-port <port>] [--hedge-percentile <percentile>] [--hedge-budget <percent>] [--hedge-id <offset>:<length>]\n");
+    fprintf(stderr, "          [--budget-packets <count>] [--budget-cpu <percent>] [--budget-buffer <bytes>] [--cpu-accounting]\n");
+    fprintf(stderr, "          [--rate-limit <packets>] [--rate-limit-prefix <bits>] [--gossip-port <port>] [--gossip-peer <address>:<port>] [--gossip-interval <milliseconds>] [--gossip-key <key>]\n");
+    fprintf(stderr, "          [--subscribe-port <port>] [--subscribe-token <token>] [--subscribe-timeout <seconds>] [--subscribe-max <subscribers>]\n");
+    fprintf(stderr, "          [--egress-queue <codel|fq-codel>] [--egress-queue-limit <packets>] [--codel-target <microseconds>] [--codel-interval <microseconds>]\n");
+    fprintf(stderr, "          [--ecn] [--ecn-ce-threshold <microseconds>]\n");
+    fprintf(stderr, "          [--io-backend <poll|epoll>] [--busy-poll <microseconds>] [--calibrate] [--calibrate-cache <file>]\n");
+    fprintf(stderr, "          [--workers <count>] [--auto-affinity]\n");
+    fprintf(stderr, "          [--conntrack-bypass]\n");
+    fprintf(stderr, "          [--reuseport] [--hot-standby <pid>] [--sk-lookup <address>[/<prefix>]:<port>[-<port>]]\n");
     fprintf(stderr, "          [--ignore-errors] [--stop-errors]\n");
     fprintf(stderr, "          [--stats] [--verbose] [--debug] [--version]\n");
     fprintf(stderr, "\n");
@@ -859,15 +9289,86 @@ void usage(const char *argv0, const char *message) {
     fprintf(stderr, "--connect-host <hostname>               Connect host, overwrites --connect-address if both are specified (required)\n");
     fprintf(stderr, "--connect-port <port>                   Connect port (required)\n");
     fprintf(stderr, "--connect-address-strict                Only receive packets from --connect-address / --connect-port (optional)\n");
+    fprintf(stderr, "--connect-proxy-protocol                Prepend a PROXY v2 header to packets sent to the connect address, route replies by header (optional)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "--send-address <ipv4 address>           Send packets from address (optional)\n");
     fprintf(stderr, "--send-port <port>                      Send packets from port (optional)\n");
     fprintf(stderr, "--send-interface <interface>            Send packets from interface (optional)\n");
+    fprintf(stderr, "--send-interface-failover <interface>   Send packets from this interface while --send-interface is down or has no route (optional)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "--listen-sender-address <ipv4 address>  Listen endpoint only accepts packets from this source address (optional)\n");
     fprintf(stderr, "--listen-sender-port <port>             Listen endpoint only accepts packets from this source port (optional)\n");
     fprintf(stderr, "                                        (must be set together, --listen-address-strict is implied)\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "--listen-admission-key <key>            Drop listener packets without a valid admission tag, strip the tag otherwise (optional)\n");
+    fprintf(stderr, "--connect-admission-key <key>           Append an admission tag to packets sent to the connect address, bound to the source address\n");
+    fprintf(stderr, "                                        and port, no NAT between the peers (optional)\n");
+    fprintf(stderr, "                                        (key is 32 hexadecimal characters)\n");
+    fprintf(stderr, "--admission-epoch <seconds>             Admission key rotation epoch, defaults to %d seconds (optional)\n", ADMISSION_EPOCH_SECONDS);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--listen-tunnel-key <key>               Decrypt packets received by the listener, encrypt packets sent to it (optional)\n");
+    fprintf(stderr, "--connect-tunnel-key <key>              Encrypt packets sent to the connect address, decrypt packets received from it (optional)\n");
+    fprintf(stderr, "                                        (ChaCha20-Poly1305, key is 64 hexadecimal characters)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--packet-program <file>                 Run the eBPF bytecode in file on every forwarded packet (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--query-cache <query>:<response>        Answer queries starting with the query prefix from the last upstream response starting\n");
+    fprintf(stderr, "                                        with the response prefix, prefixes in hexadecimal, up to 8 rules (optional)\n");
+    fprintf(stderr, "--query-cache-ttl <milliseconds>        How long cached responses are served, defaults to 1000 (optional)\n");
+    fprintf(stderr, "--query-challenge <prefix>              Upstream responses starting with prefix (hexadecimal) are challenges, never cached (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--replay-buffer <seconds>               Keep packets from the connect address for retransmit requests from the listener endpoint (optional)\n");
+    fprintf(stderr, "--replay-slots <count>                  Packets kept per stream, defaults to 4096 (optional)\n");
+    fprintf(stderr, "--replay-sequence-offset <bytes>        Offset of the 32 bit big endian sequence number in the payload, defaults to 0 (optional)\n");
+    fprintf(stderr, "--replay-stream-offset <bytes>          Offset of the 32 bit big endian stream identifier in the payload, one stream if not set (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--hedge-address <ipv4 address>          Also send requests not answered within the hedging delay here, deliver the first reply (optional)\n");
+    fprintf(stderr, "--hedge-port <port>                     Hedge port, defaults to --connect-port (optional)\n");
+    fprintf(stderr, "--hedge-percentile <percentile>         The hedging delay is this percentile of recent reply latencies, defaults to %d (optional)\n", HEDGE_PERCENTILE);
+    fprintf(stderr, "--hedge-budget <percent>                Hedge at most this share of requests, defaults to %d (optional)\n", HEDGE_BUDGET);
+    fprintf(stderr, "--hedge-id <offset>:<length>            Request identifier in requests and replies, defaults to %s (the DNS ID) (optional)\n", HEDGE_ID);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--budget-packets <count>                Packets received per socket per loop iteration, alternating sockets, defaults to 1 (optional)\n");
+    fprintf(stderr, "--budget-cpu <percent>                  CPU share of each direction, in percent of one CPU, implies --cpu-accounting (optional)\n");
+    fprintf(stderr, "--budget-buffer <bytes>                 Bytes buffered per direction in the socket and the worker queue (optional)\n");
+    fprintf(stderr, "--cpu-accounting                        Measure the CPU time used by each direction, displayed with --stats (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--rate-limit <packets>                  Packets per second each source may send to the listener, across the gossip peers (optional)\n");
+    fprintf(stderr, "--rate-limit-prefix <bits>              Count sources by prefix of this length, defaults to 32 (optional)\n");
+    fprintf(stderr, "--gossip-port <port>                    Exchange rate limit counts with the peers on this port (optional)\n");
+    fprintf(stderr, "--gossip-peer <address>:<port>          A peer to gossip rate limit counts to and accept them from, repeatable (optional)\n");
+    fprintf(stderr, "--gossip-interval <milliseconds>        Milliseconds between gossip messages, defaults to %d (optional)\n", GOSSIP_INTERVAL_MS);
+    fprintf(stderr, "--gossip-key <key>                      Authenticate gossip messages, 32 hexadecimal characters (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--subscribe-port <port>                 Replicate packets from the connect address to the subscribers of this control port (optional)\n");
+    fprintf(stderr, "--subscribe-token <token>               Token subscribers must send, token=<token> (optional)\n");
+    fprintf(stderr, "--subscribe-timeout <seconds>           Subscribers expire without a keepalive, defaults to %d (optional)\n", PUBSUB_TIMEOUT);
+    fprintf(stderr, "--subscribe-max <subscribers>           Subscribers at most, defaults to %d (optional)\n", PUBSUB_MAX);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--egress-queue <codel|fq-codel>         Queue packets while the socket send buffer is full, dropping with CoDel (optional)\n");
+    fprintf(stderr, "--egress-queue-limit <packets>          Packets held per egress queue, defaults to %d (optional)\n", EGRESS_LIMIT);
+    fprintf(stderr, "--codel-target <microseconds>           CoDel target sojourn time, defaults to %d (optional)\n", CODEL_TARGET_US);
+    fprintf(stderr, "--codel-interval <microseconds>         CoDel interval, defaults to %d (optional)\n", CODEL_INTERVAL_US);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--ecn                                   Forward the TOS (DSCP and ECN codepoint) of received packets (optional)\n");
+    fprintf(stderr, "--ecn-ce-threshold <microseconds>       Mark CE on ECN capable packets held longer than this, implies --ecn (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--io-backend <poll|epoll>               Wait for readable sockets with poll or epoll, defaults to poll (optional)\n");
+    fprintf(stderr, "--busy-poll <microseconds>              Busy poll the sockets for incoming packets, Linux only (optional)\n");
+    fprintf(stderr, "--calibrate                             Pick the I/O backend, --budget-packets and --busy-poll with a loopback self-test (optional)\n");
+    fprintf(stderr, "--calibrate-cache <file>                Calibration cache, keyed by kernel and CPU model, defaults to %s (optional)\n", CALIBRATE_CACHE);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--workers <count>                       Decrypt, encrypt and run packet programs on worker threads, packets are still sent in order\n");
+    fprintf(stderr, "                                        per flow (direction, source address and port) (optional)\n");
+    fprintf(stderr, "--auto-affinity                         Pin threads to CPUs next to the listen / send interface queue interrupts (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--conntrack-bypass                      Install nftables notrack rules for the listen port and connect address, removed at exit (optional)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "--reuseport                             Bind with SO_REUSEPORT, the first process bound receives all packets (optional)\n");
+    fprintf(stderr, "--hot-standby <pid>                     Join the port of process pid and take over when it exits, implies --reuseport (optional)\n");
+    fprintf(stderr, "--sk-lookup <address>[/<prefix>]:<port>[-<port>]\n");
+    fprintf(stderr, "                                        Steer packets to these addresses and ports to the listen socket with BPF sk_lookup, repeatable (optional)\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "--ignore-errors                         Ignore most receive or send errors (unreachable, etc.) instead of exiting (optional) (default)\n");
     fprintf(stderr, "--stop-errors                           Exit on most receive or send errors (unreachable, etc.) (optional)\n");
     fprintf(stderr, "\n");
@@ -922,6 +9423,79 @@ void statistics_initialize(struct statistics *st) {
     st->count_connect_packet_send = 0;
     st->count_connect_byte_send = 0;
 
+    st->count_listen_admission_drop = 0;
+
+    st->count_listen_tunnel_drop = 0;
+    st->count_connect_tunnel_drop = 0;
+
+    st->count_listen_program_drop = 0;
+    st->count_connect_program_drop = 0;
+
+    st->count_query_hit = 0;
+    st->count_query_miss = 0;
+    st->count_query_store = 0;
+    st->count_query_challenge = 0;
+
+    st->count_hedge_request = 0;
+    st->count_hedge_sent = 0;
+    st->count_hedge_won = 0;
+    st->count_hedge_budget = 0;
+    st->count_hedge_suppress = 0;
+    st->time_hedge_delay = HEDGE_DELAY_INITIAL_US * 1000ULL;
+
+    st->count_listen_rate_drop = 0;
+    st->count_rate_untracked = 0;
+    st->count_gossip_send = 0;
+    st->count_gossip_receive = 0;
+    st->count_gossip_invalid = 0;
+
+    st->count_pubsub_subscribe = 0;
+    st->count_pubsub_unsubscribe = 0;
+    st->count_pubsub_expire = 0;
+    st->count_pubsub_deny = 0;
+    st->count_pubsub_full = 0;
+    st->count_pubsub_publish = 0;
+    st->count_pubsub_send = 0;
+    st->count_pubsub_drop = 0;
+    st->count_pubsub_subscribers = 0;
+
+    st->count_listen_egress_queue = 0;
+    st->count_listen_egress_drop = 0;
+    st->count_listen_egress_mark = 0;
+    st->count_listen_egress_overflow = 0;
+    st->count_connect_egress_queue = 0;
+    st->count_connect_egress_drop = 0;
+    st->count_connect_egress_mark = 0;
+    st->count_connect_egress_overflow = 0;
+
+    st->time_listen_cpu = 0;
+    st->time_connect_cpu = 0;
+    st->count_listen_budget_defer = 0;
+    st->count_connect_budget_defer = 0;
+
+    st->count_listen_ecn_ect0 = 0;
+    st->count_listen_ecn_ect1 = 0;
+    st->count_listen_ecn_ce = 0;
+    st->count_listen_ecn_ce_mark = 0;
+    st->count_connect_ecn_ect0 = 0;
+    st->count_connect_ecn_ect1 = 0;
+    st->count_connect_ecn_ce = 0;
+    st->count_connect_ecn_ce_mark = 0;
+
+    st->count_send_link_event = 0;
+    st->count_send_address_event = 0;
+    st->count_send_route_event = 0;
+    st->count_send_interface_switch = 0;
+    st->time_send_interface_switch = 0;
+
+    st->count_worker_packet = 0;
+    st->count_worker_depth_sum = 0;
+    st->count_worker_depth_samples = 0;
+    st->count_worker_depth_max = 0;
+    st->time_worker_queue = 0;
+    st->time_worker_process = 0;
+    st->time_worker_reorder = 0;
+
     st->count_listen_packet_receive_total = 0;
     st->count_listen_byte_receive_total = 0;
 
@@ -933,6 +9507,68 @@ void statistics_initialize(struct statistics *st) {
 
     st->count_connect_packet_send_total = 0;
     st->count_connect_byte_send_total = 0;
+
+    st->count_listen_admission_drop_total = 0;
+
+    st->count_listen_tunnel_drop_total = 0;
+    st->count_connect_tunnel_drop_total = 0;
+
+    st->count_listen_program_drop_total = 0;
+    st->count_connect_program_drop_total = 0;
+
+    st->count_query_hit_total = 0;
+    st->count_query_miss_total = 0;
+    st->count_query_store_total = 0;
+    st->count_query_challenge_total = 0;
+
+    st->count_hedge_request_total = 0;
+    st->count_hedge_sent_total = 0;
+    st->count_hedge_won_total = 0;
+    st->count_hedge_budget_total = 0;
+    st->count_hedge_suppress_total = 0;
+
+    st->count_listen_rate_drop_total = 0;
+    st->count_rate_untracked_total = 0;
+    st->count_gossip_send_total = 0;
+    st->count_gossip_receive_total = 0;
+    st->count_gossip_invalid_total = 0;
+
+    st->count_pubsub_subscribe_total = 0;
+    st->count_pubsub_unsubscribe_total = 0;
+    st->count_pubsub_expire_total = 0;
+    st->count_pubsub_deny_total = 0;
+    st->count_pubsub_full_total = 0;
+    st->count_pubsub_publish_total = 0;
+    st->count_pubsub_send_total = 0;
+    st->count_pubsub_drop_total = 0;
+
+    st->count_listen_egress_queue_total = 0;
+    st->count_listen_egress_drop_total = 0;
+    st->count_listen_egress_mark_total = 0;
+    st->count_listen_egress_overflow_total = 0;
+    st->count_connect_egress_queue_total = 0;
+    st->count_connect_egress_drop_total = 0;
+    st->count_connect_egress_mark_total = 0;
+    st->count_connect_egress_overflow_total = 0;
+
+    st->time_listen_cpu_total = 0;
+    st->time_connect_cpu_total = 0;
+    st->count_listen_budget_defer_total = 0;
+    st->count_connect_budget_defer_total = 0;
+
+    st->count_listen_ecn_ect0_total = 0;
+    st->count_listen_ecn_ect1_total = 0;
+    st->count_listen_ecn_ce_total = 0;
+    st->count_listen_ecn_ce_mark_total = 0;
+    st->count_connect_ecn_ect0_total = 0;
+    st->count_connect_ecn_ect1_total = 0;
+    st->count_connect_ecn_ce_total = 0;
+    st->count_connect_ecn_ce_mark_total = 0;
+
+    st->count_send_link_event_total = 0;
+    st->count_send_address_event_total = 0;
+    st->count_send_route_event_total = 0;
+    st->count_send_interface_switch_total = 0;
 }
 
 /**
@@ -972,13 +9608,29 @@ char int_to_human_char(double value) {
     return human_readable_sizes[count];
 }
 
+/**
+ * Display the packet program counters that are not zero.
+ * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] p The packet program
+ */
+void program_statistics_display(int debug_level, const struct program *p) {
+    int i;
+
+    for (i = 0; i < PROGRAM_COUNTERS; i++) {
+        if (__atomic_load_n(&(p->counters[i]), __ATOMIC_RELAXED) != 0) {
+            DEBUG(debug_level, DEBUG_LEVEL_INFO, "program:counter:%d: %llu", i, (unsigned long long)__atomic_load_n(&(p->counters[i]), __ATOMIC_RELAXED));
+        }
+    }
+}
+
 /**
  * Display the stored statistics
  * @param[in] debug_level The debug level to be used for the DEBUG() macro
+ * @param[in] s The settings, used to only display statistics for enabled features
  * @param[in] st The statistics structure
  * @param[in] now The current time
  */
-void statistics_display(int debug_level, struct statistics *st, time_t now) {
+void statistics_display(int debug_level, const struct settings *s, struct statistics *st, time_t now) {
     int time_delta = now - st->time_display_last;
     int time_delta_total = now - st->time_display_first;
 
@@ -997,6 +9649,68 @@ void statistics_display(int debug_level, struct statistics *st, time_t now) {
     st->count_connect_packet_send_total += st->count_connect_packet_send;
     st->count_connect_byte_send_total += st->count_connect_byte_send;
 
+    st->count_listen_admission_drop_total += st->count_listen_admission_drop;
+
+    st->count_listen_tunnel_drop_total += st->count_listen_tunnel_drop;
+    st->count_connect_tunnel_drop_total += st->count_connect_tunnel_drop;
+
+    st->count_listen_program_drop_total += st->count_listen_program_drop;
+    st->count_connect_program_drop_total += st->count_connect_program_drop;
+
+    st->count_query_hit_total += st->count_query_hit;
+    st->count_query_miss_total += st->count_query_miss;
+    st->count_query_store_total += st->count_query_store;
+    st->count_query_challenge_total += st->count_query_challenge;
+
+    st->count_hedge_request_total += st->count_hedge_request;
+    st->count_hedge_sent_total += st->count_hedge_sent;
+    st->count_hedge_won_total += st->count_hedge_won;
+    st->count_hedge_budget_total += st->count_hedge_budget;
+    st->count_hedge_suppress_total += st->count_hedge_suppress;
+
+    st->count_listen_rate_drop_total += st->count_listen_rate_drop;
+    st->count_rate_untracked_total += st->count_rate_untracked;
+    st->count_gossip_send_total += st->count_gossip_send;
+    st->count_gossip_receive_total += st->count_gossip_receive;
+    st->count_gossip_invalid_total += st->count_gossip_invalid;
+
+    st->count_pubsub_subscribe_total += st->count_pubsub_subscribe;
+    st->count_pubsub_unsubscribe_total += st->count_pubsub_unsubscribe;
+    st->count_pubsub_expire_total += st->count_pubsub_expire;
+    st->count_pubsub_deny_total += st->count_pubsub_deny;
+    st->count_pubsub_full_total += st->count_pubsub_full;
+    st->count_pubsub_publish_total += st->count_pubsub_publish;
+    st->count_pubsub_send_total += st->count_pubsub_send;
+    st->count_pubsub_drop_total += st->count_pubsub_drop;
+
+    st->count_listen_egress_queue_total += st->count_listen_egress_queue;
+    st->count_listen_egress_drop_total += st->count_listen_egress_drop;
+    st->count_listen_egress_mark_total += st->count_listen_egress_mark;
+    st->count_listen_egress_overflow_total += st->count_listen_egress_overflow;
+    st->count_connect_egress_queue_total += st->count_connect_egress_queue;
+    st->count_connect_egress_drop_total += st->count_connect_egress_drop;
+    st->count_connect_egress_mark_total += st->count_connect_egress_mark;
+    st->count_connect_egress_overflow_total += st->count_connect_egress_overflow;
+
+    st->time_listen_cpu_total += st->time_listen_cpu;
+    st->time_connect_cpu_total += st->time_connect_cpu;
+    st->count_listen_budget_defer_total += st->count_listen_budget_defer;
+    st->count_connect_budget_defer_total += st->count_connect_budget_defer;
+
+    st->count_listen_ecn_ect0_total += st->count_listen_ecn_ect0;
+    st->count_listen_ecn_ect1_total += st->count_listen_ecn_ect1;
+    st->count_listen_ecn_ce_total += st->count_listen_ecn_ce;
+    st->count_listen_ecn_ce_mark_total += st->count_listen_ecn_ce_mark;
+    st->count_connect_ecn_ect0_total += st->count_connect_ecn_ect0;
+    st->count_connect_ecn_ect1_total += st->count_connect_ecn_ect1;
+    st->count_connect_ecn_ce_total += st->count_connect_ecn_ce;
+    st->count_connect_ecn_ce_mark_total += st->count_connect_ecn_ce_mark;
+
+    st->count_send_link_event_total += st->count_send_link_event;
+    st->count_send_address_event_total += st->count_send_address_event;
+    st->count_send_route_event_total += st->count_send_route_event;
+    st->count_send_interface_switch_total += st->count_send_interface_switch;
+
     DEBUG(debug_level, DEBUG_LEVEL_INFO, "---- STATS %ds ----", STATISTICS_DELAY_SECONDS);
 
     DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:receive:packets: " HRF " (" HRF "/s), listen:receive:bytes: " HRF " (" HRF "/s)",
@@ -1019,6 +9733,91 @@ void statistics_display(int debug_level, struct statistics *st, time_t now) {
             HUMAN_READABLE((double)st->count_connect_packet_send / time_delta),
             HUMAN_READABLE((double)st->count_connect_byte_send),
             HUMAN_READABLE((double)st->count_connect_byte_send / time_delta));
+    if (s->lakey != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:admission:drops: " HRF " (" HRF "/s)",
+                HUMAN_READABLE((double)st->count_listen_admission_drop),
+                HUMAN_READABLE((double)st->count_listen_admission_drop / time_delta));
+    }
+    if (s->ltkey != NULL || s->ctkey != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:tunnel:drops: " HRF " (" HRF "/s), connect:tunnel:drops: " HRF " (" HRF "/s)",
+                HUMAN_READABLE((double)st->count_listen_tunnel_drop),
+                HUMAN_READABLE((double)st->count_listen_tunnel_drop / time_delta),
+                HUMAN_READABLE((double)st->count_connect_tunnel_drop),
+                HUMAN_READABLE((double)st->count_connect_tunnel_drop / time_delta));
+    }
+    if (s->program != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:program:drops: " HRF " (" HRF "/s), connect:program:drops: " HRF " (" HRF "/s)",
+                HUMAN_READABLE((double)st->count_listen_program_drop),
+                HUMAN_READABLE((double)st->count_listen_program_drop / time_delta),
+                HUMAN_READABLE((double)st->count_connect_program_drop),
+                HUMAN_READABLE((double)st->count_connect_program_drop / time_delta));
+    }
+    if (s->cpu_accounting) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:cpu: %.1lfms (%.2lf%%, %.0lfns/packet), connect:cpu: %.1lfms (%.2lf%%, %.0lfns/packet)",
+                (double)st->time_listen_cpu / 1000000, (double)st->time_listen_cpu / time_delta / 10000000,
+                (double)st->time_listen_cpu / ((st->count_listen_packet_receive > 0)?st->count_listen_packet_receive:1),
+                (double)st->time_connect_cpu / 1000000, (double)st->time_connect_cpu / time_delta / 10000000,
+                (double)st->time_connect_cpu / ((st->count_connect_packet_receive > 0)?st->count_connect_packet_receive:1));
+    }
+    if (s->budget_cpu > 0 || s->budget_buffer > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:budget:deferred: %lu, connect:budget:deferred: %lu",
+                st->count_listen_budget_defer, st->count_connect_budget_defer);
+    }
+    if (s->query_cache_count > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "query:cache: hit %lu, miss %lu (%.1lf%% hit rate, %lu upstream queries saved), stored %lu, challenges %lu",
+                st->count_query_hit, st->count_query_miss,
+                100.0 * st->count_query_hit / ((st->count_query_hit + st->count_query_miss > 0)?(st->count_query_hit + st->count_query_miss):1),
+                st->count_query_hit, st->count_query_store, st->count_query_challenge);
+    }
+    if (s->rate_limit > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:ratelimit: dropped %lu, untracked %lu",
+                st->count_listen_rate_drop, st->count_rate_untracked);
+    }
+    if (s->gossip_port != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "ratelimit:gossip: sent %lu, received %lu, invalid %lu",
+                st->count_gossip_send, st->count_gossip_receive, st->count_gossip_invalid);
+    }
+    if (s->subscribe_port != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "pubsub: subscribers %lu, subscribed %lu, unsubscribed %lu, expired %lu, denied %lu, full %lu",
+                st->count_pubsub_subscribers, st->count_pubsub_subscribe, st->count_pubsub_unsubscribe, st->count_pubsub_expire,
+                st->count_pubsub_deny, st->count_pubsub_full);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "pubsub:send: packets %lu, copies %lu, dropped %lu",
+                st->count_pubsub_publish, st->count_pubsub_send, st->count_pubsub_drop);
+    }
+    if (s->egress_queue != EGRESS_QUEUE_NONE) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:egress: queued %lu, codel drops %lu, codel marks %lu, overflow %lu",
+                st->count_listen_egress_queue, st->count_listen_egress_drop, st->count_listen_egress_mark, st->count_listen_egress_overflow);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "connect:egress: queued %lu, codel drops %lu, codel marks %lu, overflow %lu",
+                st->count_connect_egress_queue, st->count_connect_egress_drop, st->count_connect_egress_mark, st->count_connect_egress_overflow);
+    }
+    if (s->hedge_address != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "hedge: requests %lu, hedged %lu (%.1lf%%), won %lu, over budget %lu, suppressed %lu, delay %.1lfus",
+                st->count_hedge_request, st->count_hedge_sent,
+                100.0 * st->count_hedge_sent / ((st->count_hedge_request > 0)?st->count_hedge_request:1),
+                st->count_hedge_won, st->count_hedge_budget, st->count_hedge_suppress, (double)st->time_hedge_delay / 1000);
+    }
+    if (s->ecn) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:ecn: ect0 %lu, ect1 %lu, ce %lu, ce marked %lu",
+                st->count_listen_ecn_ect0, st->count_listen_ecn_ect1, st->count_listen_ecn_ce, st->count_listen_ecn_ce_mark);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "connect:ecn: ect0 %lu, ect1 %lu, ce %lu, ce marked %lu",
+                st->count_connect_ecn_ect0, st->count_connect_ecn_ect1, st->count_connect_ecn_ce, st->count_connect_ecn_ce_mark);
+    }
+    if (s->sif != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "send:events: link %lu, address %lu, route %lu, send:interface:switches: %lu (last %.1lfus)",
+                st->count_send_link_event, st->count_send_address_event, st->count_send_route_event,
+                st->count_send_interface_switch, (double)st->time_send_interface_switch / 1000);
+    }
+    if (s->workers > 0) {
+        double packets = (st->count_worker_packet > 0)?st->count_worker_packet:1;
+
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "workers:queue:depth: %.1lf average, %lu max",
+                (double)st->count_worker_depth_sum / ((st->count_worker_depth_samples > 0)?st->count_worker_depth_samples:1),
+                st->count_worker_depth_max);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "workers:latency: queue %.1lfus, process %.1lfus, reorder %.1lfus average",
+                (double)st->time_worker_queue / packets / 1000,
+                (double)st->time_worker_process / packets / 1000,
+                (double)st->time_worker_reorder / packets / 1000);
+    }
 
     DEBUG(debug_level, DEBUG_LEVEL_INFO, "---- STATS TOTAL ----");
 
@@ -1042,9 +9841,113 @@ void statistics_display(int debug_level, struct statistics *st, time_t now) {
             HUMAN_READABLE((double)st->count_connect_packet_send_total / time_delta_total),
             HUMAN_READABLE((double)st->count_connect_byte_send_total),
             HUMAN_READABLE((double)st->count_connect_byte_send_total / time_delta_total));
+    if (s->lakey != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:admission:drops: " HRF " (" HRF "/s)",
+                HUMAN_READABLE((double)st->count_listen_admission_drop_total),
+                HUMAN_READABLE((double)st->count_listen_admission_drop_total / time_delta_total));
+    }
+    if (s->ltkey != NULL || s->ctkey != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:tunnel:drops: " HRF " (" HRF "/s), connect:tunnel:drops: " HRF " (" HRF "/s)",
+                HUMAN_READABLE((double)st->count_listen_tunnel_drop_total),
+                HUMAN_READABLE((double)st->count_listen_tunnel_drop_total / time_delta_total),
+                HUMAN_READABLE((double)st->count_connect_tunnel_drop_total),
+                HUMAN_READABLE((double)st->count_connect_tunnel_drop_total / time_delta_total));
+    }
+    if (s->program != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:program:drops: " HRF " (" HRF "/s), connect:program:drops: " HRF " (" HRF "/s)",
+                HUMAN_READABLE((double)st->count_listen_program_drop_total),
+                HUMAN_READABLE((double)st->count_listen_program_drop_total / time_delta_total),
+                HUMAN_READABLE((double)st->count_connect_program_drop_total),
+                HUMAN_READABLE((double)st->count_connect_program_drop_total / time_delta_total));
+    }
+    if (s->cpu_accounting) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:cpu: %.1lfms (%.2lf%%, %.0lfns/packet), connect:cpu: %.1lfms (%.2lf%%, %.0lfns/packet)",
+                (double)st->time_listen_cpu_total / 1000000, (double)st->time_listen_cpu_total / time_delta_total / 10000000,
+                (double)st->time_listen_cpu_total / ((st->count_listen_packet_receive_total > 0)?st->count_listen_packet_receive_total:1),
+                (double)st->time_connect_cpu_total / 1000000, (double)st->time_connect_cpu_total / time_delta_total / 10000000,
+                (double)st->time_connect_cpu_total / ((st->count_connect_packet_receive_total > 0)?st->count_connect_packet_receive_total:1));
+    }
+    if (s->budget_cpu > 0 || s->budget_buffer > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:budget:deferred: %lu, connect:budget:deferred: %lu",
+                st->count_listen_budget_defer_total, st->count_connect_budget_defer_total);
+    }
+    if (s->query_cache_count > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "query:cache: hit %lu, miss %lu (%.1lf%% hit rate, %lu upstream queries saved), stored %lu, challenges %lu",
+                st->count_query_hit_total, st->count_query_miss_total,
+                100.0 * st->count_query_hit_total / ((st->count_query_hit_total + st->count_query_miss_total > 0)?(st->count_query_hit_total + st->count_query_miss_total):1),
+                st->count_query_hit_total, st->count_query_store_total, st->count_query_challenge_total);
+    }
+    if (s->rate_limit > 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:ratelimit: dropped %lu, untracked %lu",
+                st->count_listen_rate_drop_total, st->count_rate_untracked_total);
+    }
+    if (s->gossip_port != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "ratelimit:gossip: sent %lu, received %lu, invalid %lu",
+                st->count_gossip_send_total, st->count_gossip_receive_total, st->count_gossip_invalid_total);
+    }
+    if (s->subscribe_port != 0) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "pubsub: subscribers %lu, subscribed %lu, unsubscribed %lu, expired %lu, denied %lu, full %lu",
+                st->count_pubsub_subscribers, st->count_pubsub_subscribe_total, st->count_pubsub_unsubscribe_total, st->count_pubsub_expire_total,
+                st->count_pubsub_deny_total, st->count_pubsub_full_total);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "pubsub:send: packets %lu, copies %lu, dropped %lu",
+                st->count_pubsub_publish_total, st->count_pubsub_send_total, st->count_pubsub_drop_total);
+    }
+    if (s->egress_queue != EGRESS_QUEUE_NONE) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:egress: queued %lu, codel drops %lu, codel marks %lu, overflow %lu",
+                st->count_listen_egress_queue_total, st->count_listen_egress_drop_total, st->count_listen_egress_mark_total, st->count_listen_egress_overflow_total);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "connect:egress: queued %lu, codel drops %lu, codel marks %lu, overflow %lu",
+                st->count_connect_egress_queue_total, st->count_connect_egress_drop_total, st->count_connect_egress_mark_total, st->count_connect_egress_overflow_total);
+    }
+    if (s->hedge_address != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "hedge: requests %lu, hedged %lu (%.1lf%%), won %lu, over budget %lu, suppressed %lu, delay %.1lfus",
+                st->count_hedge_request_total, st->count_hedge_sent_total,
+                100.0 * st->count_hedge_sent_total / ((st->count_hedge_request_total > 0)?st->count_hedge_request_total:1),
+                st->count_hedge_won_total, st->count_hedge_budget_total, st->count_hedge_suppress_total, (double)st->time_hedge_delay / 1000);
+    }
+    if (s->ecn) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "listen:ecn: ect0 %lu, ect1 %lu, ce %lu, ce marked %lu",
+                st->count_listen_ecn_ect0_total, st->count_listen_ecn_ect1_total, st->count_listen_ecn_ce_total, st->count_listen_ecn_ce_mark_total);
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "connect:ecn: ect0 %lu, ect1 %lu, ce %lu, ce marked %lu",
+                st->count_connect_ecn_ect0_total, st->count_connect_ecn_ect1_total, st->count_connect_ecn_ce_total, st->count_connect_ecn_ce_mark_total);
+    }
+    if (s->sif != NULL) {
+        DEBUG(debug_level, DEBUG_LEVEL_INFO, "send:events: link %lu, address %lu, route %lu, send:interface:switches: %lu",
+                st->count_send_link_event_total, st->count_send_address_event_total, st->count_send_route_event_total,
+                st->count_send_interface_switch_total);
+    }
 
     st->count_listen_packet_receive = st->count_listen_byte_receive = \
         st->count_listen_packet_send = st->count_listen_byte_send = \
         st->count_connect_packet_receive = st->count_connect_byte_receive = \
         st->count_connect_packet_send = st->count_connect_byte_send = 0;
+
+    st->count_listen_admission_drop = 0;
+
+    st->count_listen_tunnel_drop = st->count_connect_tunnel_drop = 0;
+
+    st->count_listen_program_drop = st->count_connect_program_drop = 0;
+
+    st->count_query_hit = st->count_query_miss = st->count_query_store = st->count_query_challenge = 0;
+
+    st->count_hedge_request = st->count_hedge_sent = st->count_hedge_won = st->count_hedge_budget = st->count_hedge_suppress = 0;
+
+    st->count_listen_rate_drop = st->count_rate_untracked = 0;
+    st->count_gossip_send = st->count_gossip_receive = st->count_gossip_invalid = 0;
+
+    st->count_pubsub_subscribe = st->count_pubsub_unsubscribe = st->count_pubsub_expire = st->count_pubsub_deny = st->count_pubsub_full = 0;
+    st->count_pubsub_publish = st->count_pubsub_send = st->count_pubsub_drop = 0;
+
+    st->count_listen_egress_queue = st->count_listen_egress_drop = st->count_listen_egress_mark = st->count_listen_egress_overflow = 0;
+    st->count_connect_egress_queue = st->count_connect_egress_drop = st->count_connect_egress_mark = st->count_connect_egress_overflow = 0;
+
+    st->time_listen_cpu = st->time_connect_cpu = 0;
+    st->count_listen_budget_defer = st->count_connect_budget_defer = 0;
+
+    st->count_listen_ecn_ect0 = st->count_listen_ecn_ect1 = st->count_listen_ecn_ce = st->count_listen_ecn_ce_mark = 0;
+    st->count_connect_ecn_ect0 = st->count_connect_ecn_ect1 = st->count_connect_ecn_ce = st->count_connect_ecn_ce_mark = 0;
+
+    st->count_send_link_event = st->count_send_address_event = st->count_send_route_event = st->count_send_interface_switch = 0;
+
+    st->count_worker_packet = st->count_worker_depth_sum = st->count_worker_depth_samples = st->count_worker_depth_max = 0;
+    st->time_worker_queue = st->time_worker_process = st->time_worker_reorder = 0;
 }